@@ -0,0 +1,1083 @@
+/* bench.c: SimpleFS benchmark driver */
+
+#include "sfs/crc32c.h"
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/logging.h"
+#include "sfs/lz.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Constants */
+
+#define BENCH_FILE_SIZE     (1<<20)             /* Size of read/write benchmark file */
+#define BENCH_COPY_BUFFER   (4*BUFSIZ)          /* Same buffer size as sfssh copyin/copyout */
+#define BENCH_SEED          (0x5f5)             /* Fixed seed for random offsets */
+#define BENCH_SMALL_FILES   (512)               /* Number of files in small-file benchmark */
+#define BENCH_SMALL_SIZE    (100)               /* Size of each small file */
+#define BENCH_CODEC_ROUNDS  (256)               /* Clusters (de)compressed per codec run */
+#define BENCH_DEDUP_COPIES  (8)                 /* Near-identical files in dedup benchmark */
+#define BENCH_ASYNC_READS   (8192)              /* Reads per async benchmark run */
+#define BENCH_ASYNC_DEPTH   (32)                /* Largest number of async reads in flight */
+
+/* Structures */
+
+typedef struct Result Result;
+struct Result {
+    size_t      operations;                     /* Number of operations performed */
+    size_t      bytes;                          /* Number of bytes transferred */
+    size_t      errors;                         /* Number of failed or short operations */
+    size_t      reads;                          /* Disk block reads during benchmark */
+    size_t      writes;                         /* Disk block writes during benchmark */
+    double      seconds;                        /* Elapsed wall clock time */
+};
+
+/* Globals */
+
+static FILE        *Output    = NULL;           /* Machine-readable results stream */
+static const char  *ImageDir  = "data";         /* Directory for generated images */
+static size_t       Repeat    = 3;              /* Repetitions for short benchmarks */
+
+static const size_t ImageSizes[]  = {256, 1024, 4096};
+static const size_t LargeSizes[]  = {4096, 65536, 262144};
+static const size_t FileCounts[]  = {0, 64, 512, 2048};
+static const size_t ChunkSizes[]  = {512, 4096, 16384, 65536};
+static const size_t AsyncDepths[] = {0, 1, 8, BENCH_ASYNC_DEPTH};
+
+/* Utility Prototypes */
+
+double  timestamp();
+void    result_begin(Result *result, Disk *disk);
+void    result_end(Result *result, Disk *disk);
+void    result_report(const char *name, const char *parameter, size_t value, Result *result);
+Disk *  image_open(size_t blocks, const char *tag);
+void    image_remove(size_t blocks, const char *tag);
+bool    image_prepare(FileSystem *fs, Disk *disk);
+
+/* Benchmark Prototypes */
+
+void    bench_format();
+void    bench_mount();
+void    bench_churn();
+void    bench_io();
+void    bench_copy();
+void    bench_small();
+void    bench_compress();
+void    bench_checksums();
+void    bench_dedup();
+void    bench_clone();
+void    bench_discard();
+void    bench_async();
+void    bench_vectors();
+void    text_fill(char *data, size_t length);
+size_t  image_allocated(Disk *disk);
+
+/* Main Execution */
+
+void usage(const char *program, int status) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -d DIR     Directory for generated images (default: data)\n");
+    fprintf(stderr, "    -r COUNT   Repetitions for short benchmarks (default: 3)\n");
+    fprintf(stderr, "    -h         Show this help message\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "d:r:h")) != -1) {
+        switch (c) {
+            case 'd': ImageDir = optarg; break;
+            case 'r': Repeat   = max(1, atoi(optarg)); break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+
+    /* Keep results on the original stdout and send the library's chatter
+     * (disk_close statistics, copy messages) to /dev/null so the output
+     * stays machine-readable. */
+    int results_fd = dup(STDOUT_FILENO);
+    int null_fd    = open("/dev/null", O_WRONLY);
+    if (results_fd < 0 || null_fd < 0 || !(Output = fdopen(results_fd, "w"))) {
+        error("Unable to set up output: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    fprintf(Output, "benchmark,parameter,value,operations,bytes,errors,reads,writes,seconds,ops_per_sec,mib_per_sec\n");
+
+    bench_format();
+    bench_mount();
+    bench_churn();
+    bench_io();
+    bench_copy();
+    bench_small();
+    bench_compress();
+    bench_checksums();
+    bench_dedup();
+    bench_clone();
+    bench_discard();
+    bench_async();
+    bench_vectors();
+
+    fclose(Output);
+    return EXIT_SUCCESS;
+}
+
+/* Benchmark Functions */
+
+/**
+ * Measure fs_format time for each image size in ImageSizes (default format)
+ * and LargeSizes (revision 2).
+ **/
+void    bench_format() {
+    size_t small = sizeof(ImageSizes)/sizeof(ImageSizes[0]);
+    size_t large = sizeof(LargeSizes)/sizeof(LargeSizes[0]);
+
+    for (size_t i = 0; i < small + large; i++) {
+        size_t blocks = i < small ? ImageSizes[i] : LargeSizes[i - small];
+        FormatOptions options = {.revision = i < small ? 0 : FS_REVISION_2};
+        Result result = {0};
+
+        for (size_t r = 0; r < Repeat; r++) {
+            Disk *disk = image_open(blocks, "format");
+            if (!disk) {
+                result.errors++;
+                continue;
+            }
+
+            FileSystem fs = {0};
+            Result run = {0};
+            result_begin(&run, disk);
+            if (!fs_format_ex(&fs, disk, &options)) {
+                run.errors++;
+            }
+            result_end(&run, disk);
+
+            result.operations++;
+            result.bytes   += blocks * BLOCK_SIZE;
+            result.errors  += run.errors;
+            result.reads   += run.reads;
+            result.writes  += run.writes;
+            result.seconds += run.seconds;
+            disk_close(disk);
+        }
+
+        result_report(i < small ? "format" : "format_r2", "blocks", blocks, &result);
+        image_remove(blocks, "format");
+    }
+}
+
+/**
+ * Measure fs_mount and fs_check time as the number of valid inodes (each
+ * with one data block) grows.
+ **/
+void    bench_mount() {
+    size_t blocks = ImageSizes[sizeof(ImageSizes)/sizeof(ImageSizes[0]) - 1];
+    char   payload[BLOCK_SIZE];
+    memset(payload, 'm', sizeof(payload));
+
+    for (size_t i = 0; i < sizeof(FileCounts)/sizeof(FileCounts[0]); i++) {
+        size_t files  = FileCounts[i];
+        Result result = {0};
+        Disk  *disk   = image_open(blocks, "mount");
+        if (!disk) {
+            continue;
+        }
+
+        FileSystem fs = {0};
+        if (!image_prepare(&fs, disk)) {
+            result.errors++;
+        } else {
+            for (size_t f = 0; f < files; f++) {
+                ssize_t inode_number = fs_create(&fs);
+                if (inode_number < 0 ||
+                    fs_write(&fs, inode_number, payload, sizeof(payload), 0) != sizeof(payload)) {
+                    result.errors++;
+                }
+            }
+            fs_unmount(&fs);
+        }
+
+        for (size_t r = 0; r < Repeat; r++) {
+            Result run = {0};
+            result_begin(&run, disk);
+            if (!fs_mount(&fs, disk)) {
+                run.errors++;
+            }
+            result_end(&run, disk);
+            fs_unmount(&fs);
+
+            result.operations++;
+            result.errors  += run.errors;
+            result.reads   += run.reads;
+            result.writes  += run.writes;
+            result.seconds += run.seconds;
+        }
+
+        result_report("mount", "files", files, &result);
+
+        Result checked = {0};
+        CheckOptions options = {0};
+        CheckReport  report;
+        if (fs_mount(&fs, disk)) {
+            for (size_t r = 0; r < Repeat; r++) {
+                Result run = {0};
+                result_begin(&run, disk);
+                if (!fs_check(&fs, &options, &report)) {
+                    run.errors++;
+                }
+                result_end(&run, disk);
+
+                checked.operations++;
+                checked.errors  += run.errors;
+                checked.reads   += run.reads;
+                checked.writes  += run.writes;
+                checked.seconds += run.seconds;
+            }
+            fs_unmount(&fs);
+        } else {
+            checked.errors++;
+        }
+        result_report("check", "files", files, &checked);
+
+        disk_close(disk);
+        image_remove(blocks, "mount");
+    }
+}
+
+/**
+ * Measure create/write/remove churn: each operation creates an inode,
+ * writes a small payload to it, and removes it again.
+ **/
+void    bench_churn() {
+    size_t blocks = ImageSizes[sizeof(ImageSizes)/sizeof(ImageSizes[0]) - 1];
+    size_t cycles = 1024;
+    char   payload[BLOCK_SIZE/4];
+    memset(payload, 'c', sizeof(payload));
+
+    Disk *disk = image_open(blocks, "churn");
+    if (!disk) {
+        return;
+    }
+
+    FileSystem fs = {0};
+    Result result = {0};
+    if (!image_prepare(&fs, disk)) {
+        result.errors++;
+    } else {
+        result_begin(&result, disk);
+        for (size_t c = 0; c < cycles; c++) {
+            ssize_t inode_number = fs_create(&fs);
+            if (inode_number < 0) {
+                result.errors++;
+                continue;
+            }
+            if (fs_write(&fs, inode_number, payload, sizeof(payload), 0) != sizeof(payload)) {
+                result.errors++;
+            }
+            if (!fs_remove(&fs, inode_number)) {
+                result.errors++;
+            }
+            result.operations++;
+            result.bytes += sizeof(payload);
+        }
+        result_end(&result, disk);
+        fs_unmount(&fs);
+    }
+
+    result_report("churn", "cycles", cycles, &result);
+    disk_close(disk);
+    image_remove(blocks, "churn");
+}
+
+/**
+ * Measure sequential and random fs_write/fs_read throughput on a single
+ * BENCH_FILE_SIZE file for each chunk size in ChunkSizes.
+ **/
+void    bench_io() {
+    size_t blocks = ImageSizes[sizeof(ImageSizes)/sizeof(ImageSizes[0]) - 1];
+
+    for (size_t i = 0; i < sizeof(ChunkSizes)/sizeof(ChunkSizes[0]); i++) {
+        size_t chunk  = ChunkSizes[i];
+        size_t chunks = BENCH_FILE_SIZE / chunk;
+        char  *buffer = malloc(chunk);
+        Disk  *disk   = image_open(blocks, "io");
+        if (!buffer || !disk) {
+            free(buffer);
+            if (disk) disk_close(disk);
+            continue;
+        }
+        memset(buffer, 'i', chunk);
+
+        FileSystem fs = {0};
+        ssize_t inode_number = -1;
+        if (image_prepare(&fs, disk)) {
+            inode_number = fs_create(&fs);
+        }
+
+        Result seq_write = {0}, seq_read = {0}, rnd_write = {0}, rnd_read = {0};
+        if (inode_number < 0) {
+            seq_write.errors = seq_read.errors = rnd_write.errors = rnd_read.errors = 1;
+        } else {
+            result_begin(&seq_write, disk);
+            for (size_t c = 0; c < chunks; c++) {
+                ssize_t n = fs_write(&fs, inode_number, buffer, chunk, c * chunk);
+                if (n != (ssize_t)chunk) seq_write.errors++;
+                seq_write.bytes += max(n, 0);
+                seq_write.operations++;
+            }
+            result_end(&seq_write, disk);
+
+            result_begin(&seq_read, disk);
+            for (size_t c = 0; c < chunks; c++) {
+                ssize_t n = fs_read(&fs, inode_number, buffer, chunk, c * chunk);
+                if (n != (ssize_t)chunk) seq_read.errors++;
+                seq_read.bytes += max(n, 0);
+                seq_read.operations++;
+            }
+            result_end(&seq_read, disk);
+
+            srand(BENCH_SEED);
+            result_begin(&rnd_write, disk);
+            for (size_t c = 0; c < chunks; c++) {
+                size_t  offset = (rand() % chunks) * chunk;
+                ssize_t n = fs_write(&fs, inode_number, buffer, chunk, offset);
+                if (n != (ssize_t)chunk) rnd_write.errors++;
+                rnd_write.bytes += max(n, 0);
+                rnd_write.operations++;
+            }
+            result_end(&rnd_write, disk);
+
+            srand(BENCH_SEED);
+            result_begin(&rnd_read, disk);
+            for (size_t c = 0; c < chunks; c++) {
+                size_t  offset = (rand() % chunks) * chunk;
+                ssize_t n = fs_read(&fs, inode_number, buffer, chunk, offset);
+                if (n != (ssize_t)chunk) rnd_read.errors++;
+                rnd_read.bytes += max(n, 0);
+                rnd_read.operations++;
+            }
+            result_end(&rnd_read, disk);
+        }
+
+        result_report("seq_write",  "chunk", chunk, &seq_write);
+        result_report("seq_read",   "chunk", chunk, &seq_read);
+        result_report("rand_write", "chunk", chunk, &rnd_write);
+        result_report("rand_read",  "chunk", chunk, &rnd_read);
+
+        fs_unmount(&fs);
+        disk_close(disk);
+        image_remove(blocks, "io");
+        free(buffer);
+    }
+}
+
+/**
+ * Measure copyin/copyout throughput between a host file and the file
+ * system, using the same loop and buffer size as sfssh.
+ **/
+void    bench_copy() {
+    size_t blocks = ImageSizes[sizeof(ImageSizes)/sizeof(ImageSizes[0]) - 1];
+    char   path[BUFSIZ];
+    char   buffer[BENCH_COPY_BUFFER];
+
+    /* Generate host source file */
+    snprintf(path, sizeof(path), "%s/bench.copy.src", ImageDir);
+    FILE *source = fopen(path, "w+");
+    if (!source) {
+        error("Unable to open %s: %s", path, strerror(errno));
+        return;
+    }
+    srand(BENCH_SEED);
+    for (size_t written = 0; written < BENCH_FILE_SIZE; written += sizeof(buffer)) {
+        for (size_t b = 0; b < sizeof(buffer); b++) {
+            buffer[b] = 'a' + rand() % 26;
+        }
+        fwrite(buffer, 1, sizeof(buffer), source);
+    }
+
+    Disk *disk = image_open(blocks, "copy");
+    FileSystem fs = {0};
+    ssize_t inode_number = -1;
+    if (disk && image_prepare(&fs, disk)) {
+        inode_number = fs_create(&fs);
+    }
+
+    Result copyin = {0}, copyout = {0};
+    if (inode_number < 0) {
+        copyin.errors = copyout.errors = 1;
+    } else {
+        rewind(source);
+        result_begin(&copyin, disk);
+        size_t offset = 0;
+        while (true) {
+            ssize_t result = fread(buffer, 1, sizeof(buffer), source);
+            if (result <= 0) {
+                break;
+            }
+            ssize_t actual = fs_write(&fs, inode_number, buffer, result, offset);
+            copyin.operations++;
+            if (actual != result) {
+                copyin.errors++;
+                break;
+            }
+            offset += actual;
+        }
+        fflush(source);
+        copyin.bytes = offset;
+        result_end(&copyin, disk);
+
+        snprintf(path, sizeof(path), "%s/bench.copy.dst", ImageDir);
+        FILE *target = fopen(path, "w");
+        if (!target) {
+            copyout.errors++;
+        } else {
+            result_begin(&copyout, disk);
+            offset = 0;
+            while (true) {
+                ssize_t result = fs_read(&fs, inode_number, buffer, sizeof(buffer), offset);
+                if (result <= 0) {
+                    break;
+                }
+                fwrite(buffer, 1, result, target);
+                copyout.operations++;
+                offset += result;
+            }
+            fflush(target);
+            copyout.bytes = offset;
+            if (offset != copyin.bytes) {
+                copyout.errors++;
+            }
+            result_end(&copyout, disk);
+            fclose(target);
+            unlink(path);
+        }
+    }
+
+    result_report("copyin",  "bytes", BENCH_FILE_SIZE, &copyin);
+    result_report("copyout", "bytes", BENCH_FILE_SIZE, &copyout);
+
+    fs_unmount(&fs);
+    if (disk) {
+        disk_close(disk);
+    }
+    image_remove(blocks, "copy");
+    fclose(source);
+    snprintf(path, sizeof(path), "%s/bench.copy.src", ImageDir);
+    unlink(path);
+}
+
+/**
+ * Measure writing and reading back many small files on revision 2, with
+ * and without inline data.
+ **/
+void    bench_small() {
+    size_t blocks = ImageSizes[sizeof(ImageSizes)/sizeof(ImageSizes[0]) - 1];
+    char   payload[BENCH_SMALL_SIZE];
+    char   buffer[BENCH_SMALL_SIZE];
+    memset(payload, 's', sizeof(payload));
+
+    for (size_t inline_data = 0; inline_data <= 1; inline_data++) {
+        FormatOptions options = {.revision = FS_REVISION_2, .features = inline_data ? FS_FEATURE_INLINE_DATA : 0};
+        Result writes = {0}, reads = {0};
+        FileSystem fs = {0};
+        Disk *disk = image_open(blocks, "small");
+        if (!disk || !fs_format_ex(&fs, disk, &options) || !fs_mount(&fs, disk)) {
+            writes.errors = reads.errors = 1;
+        } else {
+            result_begin(&writes, disk);
+            for (size_t f = 0; f < BENCH_SMALL_FILES; f++) {
+                ssize_t inode_number = fs_create(&fs);
+                if (inode_number < 0 ||
+                    fs_write(&fs, inode_number, payload, sizeof(payload), 0) != sizeof(payload)) {
+                    writes.errors++;
+                }
+                writes.operations++;
+                writes.bytes += sizeof(payload);
+            }
+            result_end(&writes, disk);
+
+            result_begin(&reads, disk);
+            for (size_t f = 0; f < BENCH_SMALL_FILES; f++) {
+                if (fs_read(&fs, f, buffer, sizeof(buffer), 0) != sizeof(buffer)) {
+                    reads.errors++;
+                }
+                reads.operations++;
+                reads.bytes += sizeof(buffer);
+            }
+            result_end(&reads, disk);
+            fs_unmount(&fs);
+        }
+
+        result_report("small_write", "inline", inline_data, &writes);
+        result_report("small_read",  "inline", inline_data, &reads);
+        if (disk) {
+            disk_close(disk);
+        }
+        image_remove(blocks, "small");
+    }
+}
+
+/**
+ * Measure the compression codec alone on one cluster of log-like text, then
+ * writing and reading back a file of it with and without compression.
+ * Decompression must stay well above disk throughput to pay off.
+ **/
+void    bench_compress() {
+    static char data[BENCH_FILE_SIZE];
+    static char buffer[BENCH_FILE_SIZE];
+    size_t      cluster = CLUSTER_BLOCKS * BLOCK_SIZE;
+    size_t      packed  = 0;
+    text_fill(data, sizeof(data));
+
+    Result compress = {0}, decompress = {0};
+    compress.seconds = timestamp();
+    for (size_t r = 0; r < Repeat * BENCH_CODEC_ROUNDS; r++) {
+        packed = lz_compress(data + (r % 16) * cluster, cluster, buffer, cluster);
+        if (!packed) {
+            compress.errors++;
+        }
+        compress.operations++;
+        compress.bytes += cluster;
+    }
+    compress.seconds = timestamp() - compress.seconds;
+
+    packed = lz_compress(data, cluster, buffer, cluster);
+    decompress.seconds = timestamp();
+    for (size_t r = 0; r < Repeat * BENCH_CODEC_ROUNDS; r++) {
+        if (lz_decompress(buffer, packed, buffer + cluster, cluster) != (ssize_t)cluster) {
+            decompress.errors++;
+        }
+        decompress.operations++;
+        decompress.bytes += cluster;
+    }
+    decompress.seconds = timestamp() - decompress.seconds;
+
+    result_report("lz_compress",   "packed", packed, &compress);
+    result_report("lz_decompress", "packed", packed, &decompress);
+
+    size_t blocks = LargeSizes[0];
+    for (size_t compressed = 0; compressed <= 1; compressed++) {
+        FormatOptions options = {.revision = FS_REVISION_2, .features = compressed ? FS_FEATURE_COMPRESSION : 0};
+        Result writes = {0}, reads = {0};
+        FileSystem fs = {0};
+        Disk *disk = image_open(blocks, "compress");
+        if (!disk || !fs_format_ex(&fs, disk, &options) || !fs_mount(&fs, disk) || fs_create(&fs) != 0) {
+            writes.errors = reads.errors = 1;
+        } else {
+            result_begin(&writes, disk);
+            for (size_t offset = 0; offset < sizeof(data); offset += BENCH_COPY_BUFFER) {
+                if (fs_write(&fs, 0, data + offset, BENCH_COPY_BUFFER, offset) != BENCH_COPY_BUFFER) {
+                    writes.errors++;
+                }
+                writes.operations++;
+                writes.bytes += BENCH_COPY_BUFFER;
+            }
+            result_end(&writes, disk);
+
+            result_begin(&reads, disk);
+            for (size_t offset = 0; offset < sizeof(data); offset += BENCH_COPY_BUFFER) {
+                if (fs_read(&fs, 0, buffer + offset, BENCH_COPY_BUFFER, offset) != BENCH_COPY_BUFFER) {
+                    reads.errors++;
+                }
+                reads.operations++;
+                reads.bytes += BENCH_COPY_BUFFER;
+            }
+            result_end(&reads, disk);
+            if (memcmp(data, buffer, sizeof(data))) {
+                reads.errors++;
+            }
+            fs_unmount(&fs);
+        }
+
+        result_report("compressed_write", "compress", compressed, &writes);
+        result_report("compressed_read",  "compress", compressed, &reads);
+        if (disk) {
+            disk_close(disk);
+        }
+        image_remove(blocks, "compress");
+    }
+}
+
+/**
+ * Measure CRC32C throughput on its own, then writing and reading back a
+ * file with and without checksums.  Verification should barely show up in
+ * the read rate.
+ **/
+void    bench_checksums() {
+    static char data[BENCH_FILE_SIZE];
+    static char buffer[BENCH_FILE_SIZE];
+    text_fill(data, sizeof(data));
+
+    Result   crc = {0};
+    uint32_t sum = 0;
+    crc.seconds = timestamp();
+    for (size_t r = 0; r < Repeat * BENCH_CODEC_ROUNDS; r++) {
+        sum = crc32c(sum, data + (r % 256) * BLOCK_SIZE, BLOCK_SIZE);
+        crc.operations++;
+        crc.bytes += BLOCK_SIZE;
+    }
+    crc.seconds = timestamp() - crc.seconds;
+    result_report("crc32c", "block", BLOCK_SIZE, &crc);
+
+    size_t blocks = LargeSizes[0];
+    for (size_t checksums = 0; checksums <= 1; checksums++) {
+        FormatOptions options = {.revision = FS_REVISION_2, .features = checksums ? FS_FEATURE_CHECKSUMS : 0};
+        Result writes = {0}, reads = {0};
+        FileSystem fs = {0};
+        Disk *disk = image_open(blocks, "checksums");
+        if (!disk || !fs_format_ex(&fs, disk, &options) || !fs_mount(&fs, disk) || fs_create(&fs) != 0) {
+            writes.errors = reads.errors = 1;
+        } else {
+            result_begin(&writes, disk);
+            for (size_t offset = 0; offset < sizeof(data); offset += BENCH_COPY_BUFFER) {
+                if (fs_write(&fs, 0, data + offset, BENCH_COPY_BUFFER, offset) != BENCH_COPY_BUFFER) {
+                    writes.errors++;
+                }
+                writes.operations++;
+                writes.bytes += BENCH_COPY_BUFFER;
+            }
+            result_end(&writes, disk);
+
+            result_begin(&reads, disk);
+            for (size_t r = 0; r < Repeat; r++) {
+                for (size_t offset = 0; offset < sizeof(data); offset += BENCH_COPY_BUFFER) {
+                    if (fs_read(&fs, 0, buffer + offset, BENCH_COPY_BUFFER, offset) != BENCH_COPY_BUFFER) {
+                        reads.errors++;
+                    }
+                    reads.operations++;
+                    reads.bytes += BENCH_COPY_BUFFER;
+                }
+            }
+            result_end(&reads, disk);
+            fs_unmount(&fs);
+        }
+
+        result_report("checksum_write", "checksums", checksums, &writes);
+        result_report("checksum_read",  "checksums", checksums, &reads);
+        if (disk) {
+            disk_close(disk);
+        }
+        image_remove(blocks, "checksums");
+    }
+}
+
+/**
+ * Measure writing BENCH_DEDUP_COPIES near-identical files (the same text
+ * with one block changed per copy) with and without dedup.  The dedup_index
+ * row reports blocks saved as operations and the memory taken by reference
+ * counts and the content index as bytes.
+ **/
+void    bench_dedup() {
+    static char data[BENCH_FILE_SIZE];
+    text_fill(data, sizeof(data));
+
+    size_t blocks = LargeSizes[1];
+    for (size_t dedup = 0; dedup <= 1; dedup++) {
+        FormatOptions options = {.revision = FS_REVISION_2, .features = dedup ? FS_FEATURE_DEDUP : 0};
+        Result writes = {0}, index = {0};
+        FileSystem fs = {0};
+        Disk *disk = image_open(blocks, "dedup");
+        if (!disk || !fs_format_ex(&fs, disk, &options) || !fs_mount(&fs, disk)) {
+            writes.errors = index.errors = 1;
+        } else {
+            result_begin(&writes, disk);
+            for (size_t copy = 0; copy < BENCH_DEDUP_COPIES; copy++) {
+                ssize_t inode_number = fs_create(&fs);
+                data[copy * BLOCK_SIZE] ^= 1;
+                for (size_t offset = 0; offset < sizeof(data); offset += BENCH_COPY_BUFFER) {
+                    if (inode_number < 0 ||
+                        fs_write(&fs, inode_number, data + offset, BENCH_COPY_BUFFER, offset) != BENCH_COPY_BUFFER) {
+                        writes.errors++;
+                    }
+                    writes.operations++;
+                    writes.bytes += BENCH_COPY_BUFFER;
+                }
+                data[copy * BLOCK_SIZE] ^= 1;
+            }
+            result_end(&writes, disk);
+
+            DedupReport report = {0};
+            index.seconds = timestamp();
+            if (dedup && !fs_dedup_report(&fs, &report)) {
+                index.errors++;
+            }
+            index.seconds = timestamp() - index.seconds;
+            index.operations = report.saved;
+            index.bytes      = report.memory;
+            fs_unmount(&fs);
+        }
+
+        result_report("dedup_write", "dedup", dedup, &writes);
+        result_report("dedup_index", "dedup", dedup, &index);
+        if (disk) {
+            disk_close(disk);
+        }
+        image_remove(blocks, "dedup");
+    }
+}
+
+/**
+ * Measure duplicating a BENCH_FILE_SIZE file by copying its data (clone 0)
+ * and by fs_clone (clone 1) on a reflink image.  The clone_diverge row then
+ * overwrites every eighth block of the duplicate, which for a clone copies
+ * shared pointer and data blocks on first write.
+ **/
+void    bench_clone() {
+    static char data[BENCH_FILE_SIZE];
+    static char buffer[BENCH_COPY_BUFFER];
+    text_fill(data, sizeof(data));
+
+    size_t blocks = LargeSizes[1];
+    for (size_t clone = 0; clone <= 1; clone++) {
+        FormatOptions options = {.revision = FS_REVISION_2, .features = FS_FEATURE_REFLINK};
+        Result copies = {0}, diverge = {0};
+        FileSystem fs = {0};
+        Disk *disk = image_open(blocks, "clone");
+        if (!disk || !fs_format_ex(&fs, disk, &options) || !fs_mount(&fs, disk) ||
+            fs_create(&fs) != 0 || fs_write(&fs, 0, data, sizeof(data), 0) != sizeof(data)) {
+            copies.errors = diverge.errors = 1;
+        } else {
+            ssize_t inode_number = -1;
+            result_begin(&copies, disk);
+            if (clone) {
+                inode_number = fs_clone(&fs, 0);
+            } else if ((inode_number = fs_create(&fs)) >= 0) {
+                for (size_t offset = 0; offset < sizeof(data); offset += sizeof(buffer)) {
+                    if (fs_read(&fs, 0, buffer, sizeof(buffer), offset) != sizeof(buffer) ||
+                        fs_write(&fs, inode_number, buffer, sizeof(buffer), offset) != sizeof(buffer)) {
+                        copies.errors++;
+                    }
+                }
+            }
+            result_end(&copies, disk);
+            copies.operations = 1;
+            copies.bytes      = sizeof(data);
+            copies.errors    += inode_number < 0;
+
+            result_begin(&diverge, disk);
+            for (size_t offset = 0; inode_number >= 0 && offset < sizeof(data); offset += 8 * BLOCK_SIZE) {
+                if (fs_write(&fs, inode_number, data, BLOCK_SIZE, offset) != BLOCK_SIZE) {
+                    diverge.errors++;
+                }
+                diverge.operations++;
+                diverge.bytes += BLOCK_SIZE;
+            }
+            result_end(&diverge, disk);
+            fs_unmount(&fs);
+        }
+
+        result_report("clone_copy",    "clone", clone, &copies);
+        result_report("clone_diverge", "clone", clone, &diverge);
+        if (disk) {
+            disk_close(disk);
+        }
+        image_remove(blocks, "clone");
+    }
+}
+
+/**
+ * Measure removing BENCH_DEDUP_COPIES files of BENCH_FILE_SIZE (every other
+ * file first, so freed runs are not adjacent) under each discard mode, and
+ * fs_trim after removal without discard.  Operations are blocks discarded
+ * and bytes are host storage released by the image.
+ **/
+void    bench_discard() {
+    static char data[BENCH_FILE_SIZE];
+    text_fill(data, sizeof(data));
+
+    size_t blocks = LargeSizes[1];
+    for (uint32_t mode = DISCARD_NONE; mode <= DISCARD_BATCH; mode++) {
+        Result removes = {0}, trims = {0};
+        FileSystem fs = {0};
+        Disk *disk = image_open(blocks, "discard");
+        if (!disk || !fs_format(&fs, disk) || !fs_mount(&fs, disk) || !fs_set_discard(&fs, mode)) {
+            removes.errors = trims.errors = 1;
+        } else {
+            for (size_t copy = 0; copy < BENCH_DEDUP_COPIES; copy++) {
+                if (fs_create(&fs) != (ssize_t)copy || fs_write(&fs, copy, data, sizeof(data), 0) != sizeof(data)) {
+                    removes.errors++;
+                }
+            }
+
+            size_t allocated = image_allocated(disk);
+            size_t discards  = disk->discards;
+            result_begin(&removes, disk);
+            for (size_t pass = 0; pass < 2; pass++) {
+                for (size_t copy = pass; copy < BENCH_DEDUP_COPIES; copy += 2) {
+                    removes.errors += !fs_remove(&fs, copy);
+                }
+            }
+            fs_set_discard(&fs, DISCARD_NONE);
+            result_end(&removes, disk);
+            removes.operations = disk->discards - discards;
+            removes.bytes      = allocated - min(allocated, image_allocated(disk));
+
+            allocated = image_allocated(disk);
+            discards  = disk->discards;
+            result_begin(&trims, disk);
+            trims.errors += fs_trim(&fs) < 0;
+            result_end(&trims, disk);
+            trims.operations = disk->discards - discards;
+            trims.bytes      = allocated - min(allocated, image_allocated(disk));
+            fs_unmount(&fs);
+        }
+
+        result_report("discard_remove", "mode", mode, &removes);
+        result_report("discard_trim",   "mode", mode, &trims);
+        if (disk) {
+            disk_close(disk);
+        }
+        image_remove(blocks, "discard");
+    }
+}
+
+/**
+ * Measure BENCH_ASYNC_READS random 4096-byte reads spread over
+ * BENCH_DEDUP_COPIES files, issued with fs_read (depth 0) and through
+ * fs_submit_read with up to each of AsyncDepths requests in flight.
+ **/
+void    bench_async() {
+    static char data[BENCH_FILE_SIZE];
+    static char buffers[BENCH_ASYNC_DEPTH][4096];
+    text_fill(data, sizeof(data));
+
+    size_t blocks = LargeSizes[1];
+    FileSystem fs = {0};
+    Disk *disk = image_open(blocks, "async");
+    bool  ready = disk && fs_format(&fs, disk) && fs_mount(&fs, disk);
+    for (size_t copy = 0; ready && copy < BENCH_DEDUP_COPIES; copy++) {
+        ready = fs_create(&fs) == (ssize_t)copy && fs_write(&fs, copy, data, sizeof(data), 0) == sizeof(data);
+    }
+
+    for (size_t d = 0; d < sizeof(AsyncDepths) / sizeof(AsyncDepths[0]); d++) {
+        size_t depth  = AsyncDepths[d];
+        Result result = {0};
+        if (!ready) {
+            result.errors = 1;
+            result_report("async_read", "depth", depth, &result);
+            continue;
+        }
+
+        srand(BENCH_SEED);
+        result_begin(&result, disk);
+        if (!depth) {
+            for (size_t r = 0; r < BENCH_ASYNC_READS; r++) {
+                size_t inode_number = rand() % BENCH_DEDUP_COPIES;
+                size_t offset       = (rand() % (sizeof(data) / 4096)) * 4096;
+                result.errors += fs_read(&fs, inode_number, buffers[0], 4096, offset) != 4096;
+            }
+        } else {
+            Completion completions[BENCH_ASYNC_DEPTH];
+            size_t     sent = 0, done = 0, free_slots = depth;
+            size_t     slots[BENCH_ASYNC_DEPTH];
+            for (size_t s = 0; s < depth; s++) {
+                slots[s] = s;
+            }
+            while (done < BENCH_ASYNC_READS) {
+                while (sent < BENCH_ASYNC_READS && free_slots) {
+                    size_t slot         = slots[--free_slots];
+                    size_t inode_number = rand() % BENCH_DEDUP_COPIES;
+                    size_t offset       = (rand() % (sizeof(data) / 4096)) * 4096;
+                    if (!fs_submit_read(&fs, inode_number, buffers[slot], 4096, offset, slot)) {
+                        slots[free_slots++] = slot;
+                        result.errors++;
+                        done++;
+                    }
+                    sent++;
+                }
+                size_t count = fs_wait(&fs, completions, depth, 1);
+                for (size_t c = 0; c < count; c++) {
+                    result.errors += completions[c].result != 4096;
+                    slots[free_slots++] = completions[c].tag;
+                }
+                done += count;
+                if (!count && sent == BENCH_ASYNC_READS) {
+                    break;
+                }
+            }
+        }
+        result_end(&result, disk);
+        result.operations = BENCH_ASYNC_READS;
+        result.bytes      = BENCH_ASYNC_READS * 4096;
+        result_report("async_read", "depth", depth, &result);
+    }
+
+    if (ready) {
+        fs_unmount(&fs);
+    }
+    if (disk) {
+        disk_close(disk);
+    }
+    image_remove(blocks, "async");
+}
+
+/**
+ * Measure fs_writev and fs_readv of a BENCH_FILE_SIZE file split into
+ * segments of each of ChunkSizes bytes (one call for the whole file).
+ **/
+void    bench_vectors() {
+    static char         data[BENCH_FILE_SIZE];
+    static char         copy[BENCH_FILE_SIZE];
+    static struct iovec writes[BENCH_FILE_SIZE / 512];
+    static struct iovec reads[BENCH_FILE_SIZE / 512];
+    text_fill(data, sizeof(data));
+
+    size_t blocks = ImageSizes[sizeof(ImageSizes)/sizeof(ImageSizes[0]) - 1];
+    for (size_t i = 0; i < sizeof(ChunkSizes)/sizeof(ChunkSizes[0]); i++) {
+        size_t segment  = ChunkSizes[i];
+        size_t segments = BENCH_FILE_SIZE / segment;
+        for (size_t s = 0; s < segments; s++) {
+            writes[s] = (struct iovec){data + s * segment, segment};
+            reads[s]  = (struct iovec){copy + s * segment, segment};
+        }
+
+        Result vec_write = {0}, vec_read = {0};
+        FileSystem fs = {0};
+        Disk *disk = image_open(blocks, "vectors");
+        if (!disk || !image_prepare(&fs, disk)) {
+            vec_write.errors = vec_read.errors = 1;
+        } else if (fs_create(&fs) != 0) {
+            vec_write.errors = vec_read.errors = 1;
+            fs_unmount(&fs);
+        } else {
+            result_begin(&vec_write, disk);
+            vec_write.errors += fs_writev(&fs, 0, writes, segments, 0) != BENCH_FILE_SIZE;
+            result_end(&vec_write, disk);
+
+            result_begin(&vec_read, disk);
+            vec_read.errors += fs_readv(&fs, 0, reads, segments, 0) != BENCH_FILE_SIZE;
+            result_end(&vec_read, disk);
+            vec_read.errors += memcmp(copy, data, BENCH_FILE_SIZE) != 0;
+            fs_unmount(&fs);
+        }
+
+        vec_write.operations = vec_read.operations = 1;
+        vec_write.bytes      = vec_read.bytes      = BENCH_FILE_SIZE;
+        result_report("writev", "segment", segment, &vec_write);
+        result_report("readv",  "segment", segment, &vec_read);
+        if (disk) {
+            disk_close(disk);
+        }
+        image_remove(blocks, "vectors");
+    }
+}
+
+/* Utility Functions */
+
+/**
+ * Return current monotonic time in seconds.
+ **/
+double  timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Record starting time and disk counters for a benchmark run.
+ **/
+void    result_begin(Result *result, Disk *disk) {
+    result->reads   = disk->reads;
+    result->writes  = disk->writes;
+    result->seconds = timestamp();
+}
+
+/**
+ * Convert starting time and disk counters into deltas for a benchmark run.
+ **/
+void    result_end(Result *result, Disk *disk) {
+    result->seconds = timestamp() - result->seconds;
+    result->reads   = disk->reads  - result->reads;
+    result->writes  = disk->writes - result->writes;
+}
+
+/**
+ * Emit one CSV row for a benchmark result.
+ **/
+void    result_report(const char *name, const char *parameter, size_t value, Result *result) {
+    double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+    fprintf(Output, "%s,%s,%zu,%zu,%zu,%zu,%zu,%zu,%.6f,%.1f,%.2f\n",
+        name, parameter, value,
+        result->operations, result->bytes, result->errors,
+        result->reads, result->writes, result->seconds,
+        result->operations / seconds,
+        result->bytes / seconds / (1<<20));
+    fflush(Output);
+}
+
+/**
+ * Fill data with reproducible log-like text (timestamps, levels, counters).
+ **/
+void    text_fill(char *data, size_t length) {
+    static const char *Levels[] = {"INFO", "DEBUG", "WARN"};
+    uint64_t seed = BENCH_SEED;
+    size_t   used = 0;
+    char     line[128];
+
+    for (size_t n = 0; used < length; n++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        int size = snprintf(line, sizeof(line), "2026-01-01 00:%02zu:%02zu %s request %zu served in %lu ms\n",
+            n / 60 % 60, n % 60, Levels[(seed >> 33) % 3], n, (unsigned long)(seed >> 40) % 500);
+        size_t chunk = min((size_t)size, length - used);
+        memcpy(data + used, line, chunk);
+        used += chunk;
+    }
+}
+
+/**
+ * Return bytes of host storage allocated to the disk image.
+ **/
+size_t  image_allocated(Disk *disk) {
+    struct stat st;
+    fsync(disk->fd);
+    return fstat(disk->fd, &st) == 0 ? (size_t)st.st_blocks * 512 : 0;
+}
+
+/**
+ * Create a fresh, zero-filled image of the given size under ImageDir.
+ **/
+Disk *  image_open(size_t blocks, const char *tag) {
+    char path[BUFSIZ];
+    snprintf(path, sizeof(path), "%s/bench.%s.%zu", ImageDir, tag, blocks);
+    unlink(path);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, blocks * BLOCK_SIZE) < 0) {
+        error("Unable to create %s: %s", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    return disk_open(path, blocks);
+}
+
+/**
+ * Remove image generated by image_open.
+ **/
+void    image_remove(size_t blocks, const char *tag) {
+    char path[BUFSIZ];
+    snprintf(path, sizeof(path), "%s/bench.%s.%zu", ImageDir, tag, blocks);
+    unlink(path);
+}
+
+/**
+ * Format and mount a fresh image.
+ **/
+bool    image_prepare(FileSystem *fs, Disk *disk) {
+    return fs_format(fs, disk) && fs_mount(fs, disk);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+# Test: same seed produces identical images
+
+for i in 1 2; do
+    ./bin/sfs-populate -s 7 -d lognormal:8192:1.2 -f 60 -F 50 -c 25 -r 2 $SCRATCH/image.$i 1024 > $SCRATCH/summary.$i 2> /dev/null
+done
+echo -n "Testing   populate reproducibility in $SCRATCH/image.1 ... "
+if cmp -s $SCRATCH/image.1 $SCRATCH/image.2 && cmp -s $SCRATCH/summary.1 $SCRATCH/summary.2; then
+    echo "Success"
+else
+    echo "Failure"
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: populated image mounts and live files are readable
+
+files=$(awk '/files live/ { print $1 }' $SCRATCH/summary.1)
+valid=$(printf "mount\ndebug\n" | ./bin/sfssh $SCRATCH/image.1 1024 2> /dev/null | grep -c '^Inode')
+echo -n "Testing   populate contents in $SCRATCH/image.1 ... "
+if [ "$files" -gt 0 ] && [ "$files" = "$valid" ]; then
+    echo "Success"
+else
+    echo "Failure"
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
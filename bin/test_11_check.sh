@@ -0,0 +1,79 @@
+#!/bin/bash
+
+image-5-input() {
+    cat <<EOF
+check
+mount
+check
+check json
+EOF
+}
+
+image-5-output() {
+    cat <<EOF
+check failed!
+disk mounted.
+check: 1 inodes 1 blocks 0 out_of_range 0 duplicates 0 size_mismatches 0 unreadable 0 leaked 0 unmarked 0 repaired
+{"inodes": 1, "blocks": 1, "out_of_range": 0, "duplicates": 0, "size_mismatches": 0, "unreadable": 0, "leaked": 0, "unmarked": 0, "repaired": 0}
+4 disk block reads
+0 disk block writes
+EOF
+}
+
+image-20-input() {
+    cat <<EOF
+mount
+check
+check json
+EOF
+}
+
+image-20-output() {
+    cat <<EOF
+disk mounted.
+check: 2 inodes 11 blocks 0 out_of_range 0 duplicates 0 size_mismatches 0 unreadable 0 leaked 0 unmarked 0 repaired
+{"inodes": 2, "blocks": 11, "out_of_range": 0, "duplicates": 0, "size_mismatches": 0, "unreadable": 0, "leaked": 0, "unmarked": 0, "repaired": 0}
+10 disk block reads
+0 disk block writes
+EOF
+}
+
+image-200-input() {
+    cat <<EOF
+mount
+check
+check json
+EOF
+}
+
+image-200-output() {
+    cat <<EOF
+disk mounted.
+check: 3 inodes 129 blocks 0 out_of_range 0 duplicates 0 size_mismatches 0 unreadable 0 leaked 0 unmarked 0 repaired
+{"inodes": 3, "blocks": 129, "out_of_range": 0, "duplicates": 0, "size_mismatches": 0, "unreadable": 0, "leaked": 0, "unmarked": 0, "repaired": 0}
+67 disk block reads
+0 disk block writes
+EOF
+}
+
+test-check() {
+    BLOCKS=$1
+
+    echo -n "Testing   check on data/image.$BLOCKS ... "
+    if diff -u <(image-$BLOCKS-input | ./bin/sfssh data/image.$BLOCKS $BLOCKS 2> /dev/null) <(image-$BLOCKS-output) > test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat test.log
+	EXIT=$(($EXIT + 1))
+    fi
+    rm -f test.log
+}
+
+EXIT=0
+
+test-check 5
+test-check 20
+test-check 200
+
+exit $EXIT
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+SOCKET=$SCRATCH/sfsd.sock
+trap "kill \$DAEMON 2> /dev/null; rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+printf "format\n" | ./bin/sfssh $SCRATCH/image 4096 > /dev/null 2>&1
+./bin/sfsd -t 4 $SOCKET $SCRATCH/image 4096 > $SCRATCH/daemon.log 2>&1 &
+DAEMON=$!
+for i in $(seq 50); do
+    [ -S $SOCKET ] && break
+    sleep 0.1
+done
+
+# Test: concurrent pipelined clients get correct results
+
+./bin/sfs-load -c 4 -n 500 -p 8 -s 4096 $SOCKET > $SCRATCH/load.1 2> /dev/null
+./bin/sfs-load -c 2 -n 50 -p 32 -s 65536 -w 25 $SOCKET > $SCRATCH/load.2 2> /dev/null
+echo -n "Testing   sfsd pipelined load on $SOCKET ... "
+if [ "$(awk '/requests$/ { print $1 }' $SCRATCH/load.1)" = 2000 ] && grep -q '^0 errors' $SCRATCH/load.1 &&
+   [ "$(awk '/requests$/ { print $1 }' $SCRATCH/load.2)" = 100 ]  && grep -q '^0 errors' $SCRATCH/load.2; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/load.1 $SCRATCH/load.2
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: daemon shuts down cleanly and leaves a consistent image
+
+kill -TERM $DAEMON
+wait $DAEMON
+STATUS=$?
+echo -n "Testing   sfsd shutdown on $SCRATCH/image ... "
+if [ $STATUS = 0 ] && [ ! -e $SOCKET ] &&
+   printf "mount\ncheck\n" | ./bin/sfssh $SCRATCH/image 4096 2> /dev/null | grep -q '^check: 0 inodes 0 blocks 0 out_of_range 0 duplicates 0 size_mismatches 0 unreadable 0 leaked 0 unmarked'; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/daemon.log
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
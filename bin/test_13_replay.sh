@@ -0,0 +1,48 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+SOCKET=$SCRATCH/sfsd.sock
+trap "kill \$DAEMON 2> /dev/null; rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+printf "format\n" | ./bin/sfssh $SCRATCH/image 4096 > /dev/null 2>&1
+cp $SCRATCH/image $SCRATCH/image.replay
+./bin/sfsd -t 4 -T $SCRATCH/trace $SOCKET $SCRATCH/image 4096 > $SCRATCH/daemon.log 2>&1 &
+DAEMON=$!
+for i in $(seq 50); do
+    [ -S $SOCKET ] && break
+    sleep 0.1
+done
+
+./bin/sfs-load -c 4 -n 200 -p 4 -s 4096 $SOCKET > /dev/null 2>&1
+kill -TERM $DAEMON
+wait $DAEMON
+
+# Test: replaying a captured trace reproduces its results and disk I/O
+
+./bin/sfs-replay $SCRATCH/trace $SCRATCH/image.replay 4096 > $SCRATCH/replay 2> /dev/null
+echo -n "Testing   sfs-replay on $SCRATCH/trace ... "
+if grep -q '^812 operations replayed' $SCRATCH/replay && grep -q '^0 mismatches' $SCRATCH/replay &&
+   grep -Eq '^([0-9]+) disk reads traced, \1 replayed' $SCRATCH/replay &&
+   grep -Eq '^([0-9]+) disk writes traced, \1 replayed' $SCRATCH/replay; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/daemon.log $SCRATCH/replay
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: replaying onto an image that cannot be opened fails cleanly
+
+./bin/sfs-replay $SCRATCH/trace $SCRATCH/missing/image 4096 > /dev/null 2>&1
+STATUS=$?
+echo -n "Testing   sfs-replay on $SCRATCH/missing/image ... "
+if [ $STATUS -eq 1 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
@@ -0,0 +1,40 @@
+/* client.h: SimpleFS daemon client */
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "sfs/protocol.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Client Structure */
+
+typedef struct Client Client;
+struct Client {
+    int         fd;                             /* Connected Unix socket */
+    uint32_t    tag;                            /* Tag of the next request */
+};
+
+/* Client Functions */
+
+Client *client_open(const char *path);
+void    client_close(Client *client);
+
+ssize_t client_create(Client *client);
+bool    client_remove(Client *client, size_t inode_number);
+ssize_t client_stat(Client *client, size_t inode_number);
+ssize_t client_read(Client *client, size_t inode_number, char *data, size_t length, size_t offset);
+ssize_t client_write(Client *client, size_t inode_number, const char *data, size_t length, size_t offset);
+ssize_t client_clone(Client *client, size_t inode_number);
+
+/* Pipelining Functions */
+
+ssize_t client_send(Client *client, uint16_t op, size_t inode_number, const char *data, size_t length, size_t offset);
+bool    client_receive(Client *client, Response *response, char *data, size_t capacity);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,15 @@
+/* crc32c.h: SimpleFS block checksums */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Checksum Functions */
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -4,31 +4,108 @@
 #define DISK_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 /* Disk Constants */
 
-#define BLOCK_SIZE      (1<<12)
+#define BLOCK_SIZE      (1<<12)         /* Default block size */
+#define MIN_BLOCK_SIZE  (1<<10)         /* Smallest block size (disk_set_block_size) */
+#define MAX_BLOCK_SIZE  (1<<16)         /* Largest block size (disk_set_block_size) */
 #define DISK_FAILURE    (-1)
 
-/* Disk Structure */
+#define DISK_DIRECT     (1<<0)          /* Bypass the host page cache (O_DIRECT) */
+#define DISK_ALIGNMENT  (1<<12)         /* Buffer alignment for direct I/O */
+#define DISK_ARENA_BUFFERS (64)         /* Block buffers kept in a disk's arena */
 
+#define DISK_MODEL_NONE (0)             /* Host file speed, nothing simulated */
+#define DISK_MODEL_HDD  (1)             /* Seek and rotation by block distance */
+#define DISK_MODEL_SSD  (2)             /* Per-op latency over a few channels */
+#define DISK_MODEL_NVME (3)             /* Low per-op latency over many channels */
+#define DISK_MAX_CHANNELS (64)          /* Upper bound on DiskModel channels */
+
+#define DISK_MAX_MEMBERS (16)           /* Upper bound on images one disk is striped or mirrored over */
+#define DISK_STRIPE_PREFIX "stripe:"    /* disk_open_ex path spec: stripe:UNIT:PATH,PATH,... */
+#define DISK_MIRROR_PREFIX "mirror:"    /* disk_open_ex path spec: mirror:PATH,PATH,... */
+#define DISK_REGION_SIZE (1<<20)        /* Bytes of a mirror covered by one dirty bit */
+
+#define DISK_QUEUE_DEPTH    (128)       /* Default writes the scheduler holds */
+#define DISK_MAX_MERGE      (64)        /* Upper bound on blocks per merged transfer */
+#define DISK_READ_EXPIRE_NS (500000)    /* Default read deadline */
+#define DISK_WRITE_EXPIRE_NS (5000000)  /* Default time a write may be held */
+#define DISK_WRITES_STARVED (2)         /* Default read batches run ahead of due writes */
+
+/* Disk Structures */
+
+typedef struct DiskArena DiskArena;
+typedef struct DiskDevice DiskDevice;
+typedef struct DiskMember DiskMember;
+typedef struct DiskMirror DiskMirror;
+typedef struct DiskModel DiskModel;
+typedef struct DiskQueue DiskQueue;
+typedef struct DiskScheduler DiskScheduler;
 typedef struct Disk Disk;
 
+struct DiskModel {
+    int         type;           /* DISK_MODEL_*				*/
+    uint32_t    channels;       /* Operations serviced at once (SSD, NVMe)	*/
+    uint32_t    track_blocks;   /* Blocks per track (HDD)		*/
+    uint64_t    seek_min_ns;    /* Track to track seek (HDD)		*/
+    uint64_t    seek_max_ns;    /* Full stroke seek (HDD)		*/
+    uint64_t    rotation_ns;    /* One revolution (HDD)			*/
+    uint64_t    read_ns;        /* Block read latency (SSD, NVMe)	*/
+    uint64_t    write_ns;       /* Block write latency (SSD, NVMe)	*/
+    bool        inject;         /* Delay callers (not just account time)	*/
+};
+
+struct DiskScheduler {
+    uint32_t    depth;          /* Writes held before they must go out (0 for default)	*/
+    uint32_t    max_merge;      /* Blocks per transfer (0 for DISK_MAX_MERGE)	*/
+    uint32_t    writes_starved; /* Read batches run ahead of due writes (0 for default)	*/
+    uint64_t    read_expire_ns; /* Read deadline (0 for default)		*/
+    uint64_t    write_expire_ns;/* Longest a write is held (0 for default)	*/
+};
+
 struct Disk {
-    int	    fd;	        /* File descriptor of disk image	*/
+    int	    fd;	        /* File descriptor of (first) disk image	*/
     size_t  blocks;     /* Number of blocks in disk image	*/
+    size_t  block_size; /* Bytes per block			*/
     size_t  reads;      /* Number of reads to disk image	*/
     size_t  writes;     /* Number of writes to disk image	*/
+    size_t  discards;   /* Number of blocks discarded		*/
+    int     flags;      /* DISK_* flags in effect		*/
+    DiskArena *arena;   /* Pool of aligned block buffers	*/
+    DiskDevice *device; /* Simulated device (NULL for none)	*/
+    size_t  device_ns;  /* Simulated device busy time (ns)	*/
+    DiskQueue *queue;   /* Request scheduler (NULL for none)	*/
+    DiskMember *members;/* Images blocks are striped or mirrored over	*/
+    size_t  nmembers;   /* Number of member images		*/
+    size_t  stripe_size;/* Bytes per stripe unit		*/
+    DiskMirror *mirror; /* Mirror state (NULL unless mirrored)	*/
 }; 
 
 /* Disk Functions */
 
 Disk *	disk_open(const char *path, size_t blocks);
+Disk *	disk_open_ex(const char *path, size_t blocks, int flags);
+Disk *	disk_open_striped(const char **paths, size_t npaths, size_t stripe_size, size_t blocks, int flags);
+Disk *	disk_open_mirrored(const char **paths, size_t npaths, size_t blocks, int flags);
 void	disk_close(Disk *disk);
 
 ssize_t	disk_read(Disk *disk, size_t block, char *data);
 ssize_t	disk_write(Disk *disk, size_t block, char *data);
+ssize_t	disk_discard(Disk *disk, size_t block, size_t count);
+bool	disk_grow(Disk *disk, size_t blocks);
+bool	disk_set_block_size(Disk *disk, size_t block_size);
+bool	disk_set_model(Disk *disk, const DiskModel *model);
+bool	disk_model_preset(const char *name, DiskModel *model);
+bool	disk_set_scheduler(Disk *disk, const DiskScheduler *scheduler);
+bool	disk_flush(Disk *disk);
+bool	disk_detach(Disk *disk, size_t member);
+ssize_t	disk_resync(Disk *disk, size_t member, const char *path);
+
+char *	disk_buffer_get(Disk *disk);
+void	disk_buffer_put(Disk *disk, char *buffer);
 
 #endif
 
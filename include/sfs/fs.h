@@ -5,17 +5,67 @@
 
 #include "sfs/disk.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 /* File System Constants */
 
-#define MAGIC_NUMBER        (0xf0f03410)
+#define MAGIC_NUMBER        (0xf0f03410)        /* Revision 1: 32-bit block addressing */
 #define INODES_PER_BLOCK    (128)               /* TODO: Number of inodes per block */
 #define POINTERS_PER_INODE  (5)                 /* TODO: Number of direct pointers per inode */
 #define POINTERS_PER_BLOCK  (1024)              /* TODO: Number of pointers per block */
 
+#define MAGIC_NUMBER_64         (0xf0f03464)    /* Revision 2: 64-bit block addressing */
+#define INODES_PER_BLOCK_64     (32)            /* Number of 64-bit inodes per block (default sizes) */
+#define POINTERS_PER_BLOCK_64   (512)           /* Number of 64-bit pointers per block (default size) */
+#define INDIRECT_LEVELS_64      (3)             /* Single, double, and triple indirect */
+
+#define FS_REVISION_1           (1)
+#define FS_REVISION_2           (2)
+#define DEFAULT_INODE_RATIO     (16384)         /* Bytes of disk per inode (revision 2) */
+#define INODE_SIZE_64           (128)           /* Default (and minimum) revision 2 inode size */
+#define MAX_INODE_SIZE          (1024)          /* Largest revision 2 inode size */
+
+#define FS_FEATURE_INLINE_DATA  (1 << 0)        /* Small files are stored inside the inode */
+#define FS_FEATURE_COMPRESSION  (1 << 1)        /* New files are compressed in clusters */
+#define FS_FEATURE_CHECKSUMS    (1 << 2)        /* Blocks are protected by CRC32C checksums */
+#define FS_FEATURE_DEDUP        (1 << 3)        /* Identical data blocks are stored once */
+#define FS_FEATURE_REFLINK      (1 << 4)        /* Inodes can be cloned and snapshotted */
+#define FS_FEATURES_SUPPORTED   (FS_FEATURE_INLINE_DATA | FS_FEATURE_COMPRESSION | FS_FEATURE_CHECKSUMS | FS_FEATURE_DEDUP | FS_FEATURE_REFLINK)
+#define FS_FEATURES_SHARED      (FS_FEATURE_DEDUP | FS_FEATURE_REFLINK)
+
+#define INODE_INLINE            (1 << 0)        /* Inode flag: data is stored inline */
+#define INODE_COMPRESSED        (1 << 1)        /* Inode flag: data is compressed in clusters */
+#define INODE_READONLY          (1 << 2)        /* Inode flag: snapshot copy (no writes or removal) */
+#define INODE_SNAPSHOT          (1 << 3)        /* Inode flag: snapshot catalog (copy of each inode) */
+
+#define CLUSTER_BLOCKS          (4)             /* File blocks compressed together */
+#define POINTER_COMPRESSED      (1ULL << 63)    /* Pointer belongs to a compressed cluster */
+#define POINTER_UNWRITTEN       (1ULL << 62)    /* Reserved block not yet written (reads as zeroes) */
+#define POINTER_LENGTH_SHIFT    (48)            /* Compressed cluster length (bytes) above block */
+#define POINTER_BLOCK_MASK      ((1ULL << POINTER_LENGTH_SHIFT) - 1)
+
+#define FALLOCATE_UNWRITTEN     (1 << 0)        /* fs_fallocate: mark blocks unwritten instead of zeroing */
+
+#define CHECKSUMS_PER_BLOCK     (BLOCK_SIZE / sizeof(uint32_t))     /* At the default block size */
+#define MAX_COMPRESSED_BLOCK_SIZE (BLOCK_SIZE)  /* Largest block size that allows compression */
+
+#define DEDUP_MIN_SLOTS         (64)            /* Initial size of the content index */
+
+#define DISCARD_NONE            (0)             /* Freed blocks keep their contents */
+#define DISCARD_SYNC            (1)             /* Freed blocks are discarded as they are released */
+#define DISCARD_BATCH           (2)             /* Freed blocks are queued and discarded in runs */
+#define DISCARD_QUEUE_EXTENTS   (64)            /* Queued runs before a batch is flushed */
+
+#define ASYNC_WORKERS           (4)             /* Default async I/O worker threads */
+#define ASYNC_MAX_WORKERS       (64)            /* Upper bound on async I/O worker threads */
+
+#define DEFRAG_BATCH_BLOCKS     (64)            /* Blocks moved per pass under the I/O lock */
+
 /* File System Structures */
 
 typedef struct SuperBlock SuperBlock;
@@ -26,6 +76,21 @@ struct SuperBlock {
     uint32_t    inodes;                         /* Number of inodes in file system */
 };
 
+typedef struct SuperBlock64 SuperBlock64;
+struct SuperBlock64 {
+    uint32_t    magic_number;                   /* File system magic number */
+    uint32_t    revision;                       /* On-disk format revision */
+    uint64_t    blocks;                         /* Number of blocks in file system */
+    uint64_t    inode_blocks;                   /* Number of blocks reserved for inodes */
+    uint64_t    inodes;                         /* Number of inodes in file system */
+    uint64_t    inode_ratio;                    /* Bytes of disk per inode at format */
+    uint32_t    inode_size;                     /* Bytes per inode (0 means INODE_SIZE_64) */
+    uint32_t    features;                       /* FS_FEATURE_* flags */
+    uint64_t    checksum_blocks;                /* Blocks of CRC32C checksums after inode table */
+    uint32_t    block_size;                     /* Bytes per block (0 means BLOCK_SIZE) */
+    uint32_t    reserved;                       /* Must be zero */
+};
+
 typedef struct Inode      Inode;
 struct Inode {
     uint32_t    valid;                          /* Whether or not inode is valid */
@@ -34,35 +99,207 @@ struct Inode {
     uint32_t    indirect;                       /* Indirect pointers */
 };
 
+typedef struct Inode64    Inode64;
+struct Inode64 {
+    uint32_t    valid;                          /* Whether or not inode is valid */
+    uint32_t    flags;                          /* Inode flags */
+    uint64_t    size;                           /* Size of file */
+    uint64_t    direct[POINTERS_PER_INODE];     /* Direct pointers */
+    uint64_t    indirect;                       /* Single indirect pointer */
+    uint64_t    double_indirect;                /* Double indirect pointer */
+    uint64_t    triple_indirect;                /* Triple indirect pointer */
+    uint64_t    reserved[6];                    /* Reserved (pads inode to 128 bytes) */
+};                                              /* Inline inodes keep data from direct onward */
+
+/* A Block holds BLOCK_SIZE bytes; larger blocks are only ever reached
+ * through block_size buffers borrowed from the disk (disk_buffer_get). */
 typedef union  Block      Block;
 union Block {
     SuperBlock  super;                          /* View block as superblock */
+    SuperBlock64 super64;                       /* View block as 64-bit superblock */
     Inode       inodes[INODES_PER_BLOCK];       /* View block as inode */
+    Inode64     inodes64[INODES_PER_BLOCK_64];  /* View block as 64-bit inodes */
     uint32_t    pointers[POINTERS_PER_BLOCK];   /* View block as pointers */
+    uint64_t    pointers64[POINTERS_PER_BLOCK_64]; /* View block as 64-bit pointers */
     char        data[BLOCK_SIZE];               /* View block as data */
 };
 
+typedef struct FormatOptions FormatOptions;
+struct FormatOptions {
+    uint32_t    revision;                       /* On-disk revision (0 picks by disk size) */
+    uint64_t    inode_ratio;                    /* Bytes of disk per inode (revision 2) */
+    uint32_t    inode_size;                     /* Bytes per inode (revision 2, 0 for default) */
+    uint32_t    features;                       /* FS_FEATURE_* flags (implies revision 2) */
+    uint64_t    max_blocks;                     /* Size to reserve inodes and checksums for (fs_grow) */
+    uint32_t    block_size;                     /* Bytes per block (revision 2, 0 for BLOCK_SIZE) */
+    uint64_t    inodes;                         /* Number of inodes (revision 2, 0 uses inode_ratio) */
+};
+
+typedef struct CheckOptions CheckOptions;
+struct CheckOptions {
+    bool        repair;                         /* Fix problems that are found */
+    bool        json;                           /* Report as JSON lines instead of text */
+    FILE       *stream;                         /* Report stream (NULL for no report) */
+};
+
+typedef struct CheckReport CheckReport;
+struct CheckReport {
+    uint64_t    inodes;                         /* Valid inodes checked */
+    uint64_t    blocks;                         /* Blocks referenced by valid inodes */
+    uint64_t    out_of_range;                   /* Pointers outside the data region */
+    uint64_t    duplicates;                     /* References to an already referenced block */
+    uint64_t    size_mismatches;                /* Data blocks mapped past end of file */
+    uint64_t    unreadable;                     /* Inode or pointer blocks that could not be read */
+    uint64_t    leaked;                         /* Blocks in use but not referenced */
+    uint64_t    unmarked;                       /* Blocks referenced but marked free */
+    uint64_t    repaired;                       /* Problems fixed */
+};
+
+typedef struct ScrubReport ScrubReport;
+struct ScrubReport {
+    uint64_t    blocks;                         /* Blocks in use that were verified */
+    uint64_t    corrupted;                      /* Blocks whose checksum does not match */
+    uint64_t    unreadable;                     /* Blocks that could not be read */
+};
+
+typedef struct DedupReport DedupReport;
+struct DedupReport {
+    uint64_t    indexed;                        /* Data blocks in the content index */
+    uint64_t    shared;                         /* Blocks referenced more than once */
+    uint64_t    saved;                          /* Blocks saved by sharing */
+    uint64_t    memory;                         /* Bytes of reference counts and index */
+};
+
+typedef struct DedupIndex DedupIndex;
+struct DedupIndex {
+    uint64_t    *slots;                         /* Open addressing table of blocks (0 if empty) */
+    uint64_t     capacity;                      /* Number of slots (power of two) */
+    uint64_t     count;                         /* Number of indexed blocks */
+    uint32_t    *hashes;                        /* Content hash of every indexed block */
+    uint64_t    *indexed;                       /* Bitmap of indexed blocks */
+};
+
+typedef struct DefragOptions DefragOptions;
+struct DefragOptions {
+    uint64_t    rate;                           /* Blocks moved per second (0 for no limit) */
+    FILE       *stream;                         /* Per-file report stream (NULL for no report) */
+};
+
+typedef struct DefragReport DefragReport;
+struct DefragReport {
+    uint64_t    files;                          /* Valid inodes with data blocks */
+    uint64_t    fragmented;                     /* Files in more than one run */
+    uint64_t    relocated;                      /* Fragmented files moved into one run */
+    uint64_t    skipped;                        /* Fragmented files left in place */
+    uint64_t    blocks;                         /* Data blocks moved */
+    uint64_t    runs_before;                    /* Runs of every file before */
+    uint64_t    runs_after;                     /* Runs of every file after */
+};
+
+typedef struct DiscardExtent DiscardExtent;
+struct DiscardExtent {
+    uint64_t    start;                          /* First freed block */
+    uint64_t    count;                          /* Number of consecutive freed blocks */
+};
+
+typedef struct DiscardQueue DiscardQueue;
+struct DiscardQueue {
+    uint32_t    mode;                           /* DISCARD_SYNC or DISCARD_BATCH */
+    uint64_t    count;                          /* Number of queued extents */
+    DiscardExtent extents[DISCARD_QUEUE_EXTENTS]; /* Freed runs not yet discarded */
+};
+
+typedef struct Completion Completion;
+struct Completion {
+    uint64_t    tag;                            /* Caller's tag from fs_submit_* */
+    ssize_t     result;                         /* fs_read or fs_write result */
+};
+
+typedef struct AsyncRequest AsyncRequest;
+struct AsyncRequest {
+    bool        write;                          /* fs_write (else fs_read) */
+    size_t      inode_number;                   /* Inode to transfer */
+    char       *data;                           /* Caller-owned buffer */
+    size_t      length;                         /* Bytes to transfer */
+    size_t      offset;                         /* Byte offset in file */
+    Completion  completion;                     /* Tag and result */
+    AsyncRequest *next;                         /* Pending or completed list link */
+};
+
+typedef struct AsyncQueue AsyncQueue;
+struct AsyncQueue {
+    pthread_mutex_t lock;                       /* Protects lists and counters */
+    pthread_cond_t  submitted;                  /* Signalled when requests are pending */
+    pthread_cond_t  completed;                  /* Signalled when requests complete */
+    pthread_rwlock_t io_lock;                   /* Reads share fs, writes own it */
+    AsyncRequest *pending;                      /* Requests waiting for a worker (FIFO) */
+    AsyncRequest *pending_tail;
+    AsyncRequest *done;                         /* Completions not yet reaped (FIFO) */
+    AsyncRequest *done_tail;
+    size_t      ready;                          /* Requests on the done list */
+    size_t      inflight;                       /* Submitted but not yet reaped */
+    size_t      workers;                        /* Number of worker threads */
+    bool        stopping;                       /* Workers exit once set */
+    pthread_t   threads[ASYNC_MAX_WORKERS];     /* Worker threads */
+};
+
 typedef struct FileSystem FileSystem;
 struct FileSystem {
     Disk        *disk;                          /* Disk file system is mounted on */
-    bool        *free_blocks;                   /* Free block bitmap */
-    SuperBlock   meta_data;                     /* File system meta data */
+    uint64_t    *free_blocks;                   /* Free block bitmap (bit set if free) */
+    uint32_t    *checksums;                     /* CRC32C of every block (NULL if disabled) */
+    uint64_t    *dirty_checksums;               /* Checksum blocks not yet written back (bitmap) */
+    uint32_t    *refcounts;                     /* References to every block (NULL unless shared) */
+    DedupIndex  *dedup;                         /* Content index (NULL if disabled) */
+    DiscardQueue *discard;                      /* Discard of freed blocks (NULL if disabled) */
+    AsyncQueue  *async;                         /* Async I/O workers (NULL until first submit) */
+    size_t       free_hint;                     /* Lowest bitmap word that may have a free block */
+    SuperBlock64 meta_data;                     /* File system meta data (any revision) */
 };
 
 /* File System Functions */
 
 void    fs_debug(Disk *disk);
 bool    fs_format(FileSystem *fs, Disk *disk);
+bool    fs_format_ex(FileSystem *fs, Disk *disk, const FormatOptions *options);
+bool    fs_check(FileSystem *fs, const CheckOptions *options, CheckReport *report);
+bool    fs_scrub(FileSystem *fs, const CheckOptions *options, ScrubReport *report);
+bool    fs_dedup_report(FileSystem *fs, DedupReport *report);
+bool    fs_defrag(FileSystem *fs, const DefragOptions *options, DefragReport *report);
 
 bool    fs_mount(FileSystem *fs, Disk *disk);
 void    fs_unmount(FileSystem *fs);
+bool    fs_set_discard(FileSystem *fs, uint32_t mode);
+ssize_t fs_trim(FileSystem *fs);
+bool    fs_grow(FileSystem *fs, uint64_t blocks);
 
 ssize_t fs_create(FileSystem *fs);
 bool    fs_remove(FileSystem *fs, size_t inode_number);
 ssize_t fs_stat(FileSystem *fs, size_t inode_number);
+bool    fs_load_inode(FileSystem *fs, size_t inode_number, Inode64 *node);
+ssize_t fs_fragmentation(FileSystem *fs, size_t inode_number);
 
 ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
 ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
+ssize_t fs_readv(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset);
+ssize_t fs_writev(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset);
+bool    fs_truncate(FileSystem *fs, size_t inode_number, size_t size);
+bool    fs_fallocate(FileSystem *fs, size_t inode_number, size_t offset, size_t length, uint32_t flags);
+
+ssize_t fs_seek_data(FileSystem *fs, size_t inode_number, size_t offset);
+ssize_t fs_seek_hole(FileSystem *fs, size_t inode_number, size_t offset);
+ssize_t fs_seek_inode(FileSystem *fs, Inode64 *node, size_t offset, bool data);
+
+bool    fs_async_start(FileSystem *fs, size_t workers);
+bool    fs_submit_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset, uint64_t tag);
+bool    fs_submit_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset, uint64_t tag);
+size_t  fs_poll(FileSystem *fs, Completion *completions, size_t capacity);
+size_t  fs_wait(FileSystem *fs, Completion *completions, size_t capacity, size_t minimum);
+
+ssize_t fs_clone(FileSystem *fs, size_t inode_number);
+ssize_t fs_snapshot(FileSystem *fs);
+ssize_t fs_snapshot_inode(FileSystem *fs, size_t snapshot, size_t inode_number);
+bool    fs_snapshot_delete(FileSystem *fs, size_t snapshot);
 
 #endif
 
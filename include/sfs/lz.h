@@ -0,0 +1,21 @@
+/* lz.h: SimpleFS block compression codec */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdlib.h>
+
+/* Codec Constants */
+
+#define LZ_MIN_MATCH    (4)                     /* Shortest match worth encoding */
+#define LZ_MAX_OFFSET   (65535)                 /* Farthest match (16-bit offset) */
+#define LZ_HASH_BITS    (12)                    /* Match finder table size (log2) */
+
+/* Codec Functions */
+
+size_t  lz_compress(const char *source, size_t length, char *output, size_t capacity);
+ssize_t lz_decompress(const char *source, size_t length, char *output, size_t capacity);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,56 @@
+/* protocol.h: SimpleFS daemon wire protocol */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+/* Protocol Constants */
+
+#define PROTOCOL_MAGIC          (0x53465344)    /* "SFSD" */
+#define PROTOCOL_MAX_LENGTH     (1 << 20)       /* Largest read or write payload */
+#define PROTOCOL_WINDOW         (16 * PROTOCOL_MAX_LENGTH) /* Unread response bytes per connection */
+
+#define OP_CREATE               (1)             /* fs_create() */
+#define OP_REMOVE               (2)             /* fs_remove(inode) */
+#define OP_STAT                 (3)             /* fs_stat(inode) */
+#define OP_READ                 (4)             /* fs_read(inode, length, offset) */
+#define OP_WRITE                (5)             /* fs_write(inode, payload, offset) */
+#define OP_CLONE                (6)             /* fs_clone(inode) */
+
+/* Protocol Structures
+ *
+ * Every message is a fixed header followed by length payload bytes (write
+ * data in requests, read data in responses), in host byte order since both
+ * ends run on the same machine.  Requests on one connection are executed in
+ * order and answered in order; tag is echoed so pipelined clients can match
+ * responses to requests.  The server stops reading a connection while
+ * PROTOCOL_WINDOW bytes of its responses are unread, so a client that sends
+ * without reading must keep the responses it has in flight (header plus read
+ * length each) below that.
+ */
+
+typedef struct Request Request;
+struct Request {
+    uint32_t    magic;                          /* PROTOCOL_MAGIC */
+    uint16_t    op;                             /* OP_* operation */
+    uint16_t    reserved;                       /* Must be zero */
+    uint32_t    tag;                            /* Chosen by client, echoed in response */
+    uint32_t    length;                         /* Bytes to read, or write payload that follows */
+    uint64_t    inode;                          /* Inode number (unused by OP_CREATE) */
+    uint64_t    offset;                         /* Byte offset (OP_READ and OP_WRITE) */
+};
+
+typedef struct Response Response;
+struct Response {
+    uint32_t    magic;                          /* PROTOCOL_MAGIC */
+    uint16_t    op;                             /* Operation of the request */
+    uint16_t    reserved;                       /* Zero */
+    uint32_t    tag;                            /* Tag of the request */
+    uint32_t    length;                         /* Read payload that follows */
+    int64_t     result;                         /* fs.c return value (bool as 0 or 1) */
+};
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,83 @@
+/* trace.h: SimpleFS binary I/O tracing */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Trace Constants */
+
+#define TRACE_MAGIC             (0x53465452)    /* "SFTR" */
+#define TRACE_VERSION           (1)
+#define TRACE_RING_RECORDS      (1 << 16)       /* Records buffered between flushes (power of two) */
+#define TRACE_FLUSH_MS          (10)            /* Interval at which the ring is written out */
+
+#define TRACE_DISK_READ         (1)             /* disk_read(block) */
+#define TRACE_DISK_WRITE        (2)             /* disk_write(block) */
+#define TRACE_DISK_DISCARD      (3)             /* disk_discard(block, count) */
+#define TRACE_FS_CREATE         (16)            /* fs_create() */
+#define TRACE_FS_REMOVE         (17)            /* fs_remove(inode) */
+#define TRACE_FS_STAT           (18)            /* fs_stat(inode) */
+#define TRACE_FS_READ           (19)            /* fs_readv(inode, length, offset) */
+#define TRACE_FS_WRITE          (20)            /* fs_writev(inode, length, offset) */
+#define TRACE_FS_TRUNCATE       (21)            /* fs_truncate(inode, length) */
+#define TRACE_FS_FALLOCATE      (22)            /* fs_fallocate(inode, length, offset, flags) */
+#define TRACE_FS_CLONE          (23)            /* fs_clone(inode) */
+#define TRACE_OPS               (24)            /* Upper bound on TRACE_* values */
+
+/* Trace Structures
+ *
+ * A trace file is a TraceHeader followed by fixed size TraceRecords in the
+ * order they were flushed, which is the order operations finished.  File
+ * system records are only written for the outermost operation of a thread
+ * (the writes fs_truncate issues are part of its record); disk records are
+ * written for every block transferred, including those of fs operations.
+ */
+
+typedef struct TraceHeader TraceHeader;
+struct TraceHeader {
+    uint32_t    magic;                          /* TRACE_MAGIC */
+    uint32_t    version;                        /* TRACE_VERSION */
+    uint32_t    record_size;                    /* sizeof(TraceRecord) */
+    uint32_t    reserved;                       /* Zero */
+    uint64_t    records;                        /* Records that follow */
+    uint64_t    dropped;                        /* Records lost because the ring was full */
+};
+
+typedef struct TraceRecord TraceRecord;
+struct TraceRecord {
+    uint64_t    timestamp;                      /* Nanoseconds from trace start to operation start */
+    uint32_t    duration;                       /* Nanoseconds the operation took (saturated) */
+    uint16_t    op;                             /* TRACE_* operation */
+    uint16_t    flags;                          /* Operation flags (fs_fallocate) */
+    uint64_t    inode;                          /* Inode number (block number for disk records) */
+    uint64_t    length;                         /* Bytes (blocks for discards) */
+    uint64_t    offset;                         /* Byte offset */
+    int64_t     result;                         /* Return value (bool as 0 or 1) */
+};
+
+/* Trace Globals */
+
+extern bool     TraceEnabled;                   /* Whether a trace is being captured */
+
+/* Trace Macros */
+
+#define trace_begin()   \
+    (__atomic_load_n(&TraceEnabled, __ATOMIC_RELAXED) ? trace_clock() : 0)
+
+/* Trace Functions */
+
+bool        trace_start(const char *path);
+ssize_t     trace_stop();
+uint64_t    trace_clock();
+void        trace_end(uint16_t op, uint64_t started, uint64_t inode, uint64_t length, uint64_t offset, int64_t result);
+uint64_t    trace_op_begin();
+void        trace_op_end(uint16_t op, uint64_t started, uint16_t flags, uint64_t inode, uint64_t length, uint64_t offset, int64_t result);
+const char *trace_op_name(uint16_t op);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
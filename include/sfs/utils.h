@@ -11,6 +11,20 @@
 #define max(a, b)   \
     (((a) > (b)) ? (a) : (b))
 
+/* Bitmap Macros (array of uint64_t words) */
+
+#define BITMAP_WORDS(n)         \
+    (((n) + 63) / 64)
+
+#define bitmap_test(map, i)     \
+    (((map)[(i) / 64] >> ((i) % 64)) & 1)
+
+#define bitmap_set(map, i)      \
+    ((map)[(i) / 64] |= (1ULL << ((i) % 64)))
+
+#define bitmap_clear(map, i)    \
+    ((map)[(i) / 64] &= ~(1ULL << ((i) % 64)))
+
 #endif
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
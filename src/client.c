@@ -0,0 +1,234 @@
+/* client.c: SimpleFS daemon client */
+
+#include "sfs/client.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Internal Prototypes */
+
+bool    client_write_all(int fd, struct iovec *iov, int count);
+bool    client_read_all(int fd, char *data, size_t length);
+int64_t client_call(Client *client, uint16_t op, size_t inode_number, const char *data, size_t length, size_t offset, char *output);
+
+/* External Functions */
+
+/**
+ * Connect to the sfsd daemon listening on the Unix socket at path.
+ *
+ * @param       path        Path of the daemon's socket.
+ * @return      Pointer to newly allocated Client structure (NULL on failure).
+ **/
+Client *client_open(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)){
+        return NULL;
+    }
+    strcpy(address.sun_path, path);
+
+    Client *client = calloc(1, sizeof(Client));
+    if (!client){
+        return NULL;
+    }
+    client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->fd < 0 || connect(client->fd, (struct sockaddr *)&address, sizeof(address)) < 0){
+        if (client->fd >= 0){
+            close(client->fd);
+        }
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+/**
+ * Close connection and release Client structure.
+ *
+ * @param       client      Pointer to Client structure.
+ **/
+void    client_close(Client *client) {
+    if (client){
+        close(client->fd);
+        free(client);
+    }
+}
+
+/**
+ * Create a new Inode on the daemon's file system (see fs_create).
+ *
+ * @return      Inode number of the new Inode (-1 on failure).
+ **/
+ssize_t client_create(Client *client) {
+    return client_call(client, OP_CREATE, 0, NULL, 0, 0, NULL);
+}
+
+/**
+ * Remove an Inode (see fs_remove).
+ *
+ * @return      Whether or not the Inode was removed.
+ **/
+bool    client_remove(Client *client, size_t inode_number) {
+    return client_call(client, OP_REMOVE, inode_number, NULL, 0, 0, NULL) == 1;
+}
+
+/**
+ * Return size of an Inode (see fs_stat).
+ *
+ * @return      Size of the Inode in bytes (-1 on failure).
+ **/
+ssize_t client_stat(Client *client, size_t inode_number) {
+    return client_call(client, OP_STAT, inode_number, NULL, 0, 0, NULL);
+}
+
+/**
+ * Read up to length bytes at offset from an Inode into data (see fs_read).
+ * Requests larger than PROTOCOL_MAX_LENGTH fail.
+ *
+ * @return      Number of bytes read (-1 on failure).
+ **/
+ssize_t client_read(Client *client, size_t inode_number, char *data, size_t length, size_t offset) {
+    return client_call(client, OP_READ, inode_number, NULL, length, offset, data);
+}
+
+/**
+ * Write length bytes from data at offset to an Inode (see fs_write).
+ * Requests larger than PROTOCOL_MAX_LENGTH fail.
+ *
+ * @return      Number of bytes written (-1 on failure).
+ **/
+ssize_t client_write(Client *client, size_t inode_number, const char *data, size_t length, size_t offset) {
+    return client_call(client, OP_WRITE, inode_number, data, length, offset, NULL);
+}
+
+/**
+ * Clone an Inode (see fs_clone).
+ *
+ * @return      Inode number of the clone (-1 on failure).
+ **/
+ssize_t client_clone(Client *client, size_t inode_number) {
+    return client_call(client, OP_CLONE, inode_number, NULL, 0, 0, NULL);
+}
+
+/**
+ * Send one request without waiting for its response, so that several can
+ * be in flight on the connection (their responses arrive in order).  For
+ * OP_WRITE, data holds length payload bytes; for OP_READ, length is the
+ * number of bytes to read.
+ *
+ * @param       client          Pointer to Client structure.
+ * @param       op              OP_* operation.
+ * @param       inode_number    Inode number.
+ * @param       data            Write payload (NULL for other operations).
+ * @param       length          Payload or read length.
+ * @param       offset          Byte offset.
+ * @return      Tag of the request (-1 on failure).
+ **/
+ssize_t client_send(Client *client, uint16_t op, size_t inode_number, const char *data, size_t length, size_t offset) {
+    if (!client || length > PROTOCOL_MAX_LENGTH){
+        return -1;
+    }
+
+    Request request = {
+        .magic  = PROTOCOL_MAGIC,
+        .op     = op,
+        .tag    = client->tag++,
+        .length = length,
+        .inode  = inode_number,
+        .offset = offset,
+    };
+    struct iovec iov[2] = {
+        {&request, sizeof(request)},
+        {(void *)data, op == OP_WRITE ? length : 0},
+    };
+    if (!client_write_all(client->fd, iov, iov[1].iov_len ? 2 : 1)){
+        return -1;
+    }
+    return request.tag;
+}
+
+/**
+ * Receive the next response, copying its payload into data.
+ *
+ * @param       client          Pointer to Client structure.
+ * @param       response        Response header.
+ * @param       data            Buffer for read payload (may be NULL if none is expected).
+ * @param       capacity        Size of data buffer.
+ * @return      Whether or not a well-formed response was received.
+ **/
+bool    client_receive(Client *client, Response *response, char *data, size_t capacity) {
+    if (!client || !client_read_all(client->fd, (char *)response, sizeof(Response))){
+        return false;
+    }
+    if (response->magic != PROTOCOL_MAGIC || response->length > capacity){
+        return false;
+    }
+    return client_read_all(client->fd, data, response->length);
+}
+
+/* Internal Functions */
+
+/**
+ * Write every byte described by iov to fd, retrying short writes (without
+ * raising SIGPIPE if the daemon has gone away).
+ **/
+bool    client_write_all(int fd, struct iovec *iov, int count) {
+    while (count){
+        struct msghdr message = {.msg_iov = iov, .msg_iovlen = count};
+        ssize_t written = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (written < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        while (count && (size_t)written >= iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count){
+            iov->iov_base  = (char *)iov->iov_base + written;
+            iov->iov_len  -= written;
+        }
+    }
+    return true;
+}
+
+/**
+ * Read exactly length bytes from fd into data.
+ **/
+bool    client_read_all(int fd, char *data, size_t length) {
+    while (length){
+        ssize_t nread = read(fd, data, length);
+        if (nread < 0 && errno == EINTR){
+            continue;
+        }
+        if (nread <= 0){
+            return false;
+        }
+        data   += nread;
+        length -= nread;
+    }
+    return true;
+}
+
+/**
+ * Send one request and wait for its response.
+ *
+ * @return      Result of the operation (-1 on failure).
+ **/
+int64_t client_call(Client *client, uint16_t op, size_t inode_number, const char *data, size_t length, size_t offset, char *output) {
+    Response response;
+    ssize_t  tag = client_send(client, op, inode_number, data, length, offset);
+    if (tag < 0 || !client_receive(client, &response, output, output ? length : 0) || response.tag != tag){
+        return -1;
+    }
+    return response.result;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
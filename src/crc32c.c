@@ -0,0 +1,143 @@
+/* crc32c.c: SimpleFS block checksums */
+
+#include "sfs/crc32c.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/* Internal Constants */
+
+#define CRC32C_POLYNOMIAL   (0x82f63b78)        /* Castagnoli polynomial (reflected) */
+#define CRC32C_STRIPE       (1360)              /* Bytes per interleaved stream (3 per 4 KiB block) */
+
+/* Internal Globals */
+
+static uint32_t         Table[256];             /* Byte-at-a-time lookup table */
+static uint32_t         Shift[4][256];          /* Advance crc over CRC32C_STRIPE zero bytes */
+static bool             Hardware = false;       /* Whether the SSE4.2 crc32 instruction is available */
+static pthread_once_t   Once     = PTHREAD_ONCE_INIT;
+
+/* Internal Prototypes */
+
+void    crc32c_init();
+uint32_t crc32c_table(uint32_t crc, const unsigned char *data, size_t length);
+uint32_t crc32c_shift(uint32_t crc);
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char *data, size_t length);
+
+/* External Functions */
+
+/**
+ * Compute CRC32C (Castagnoli) of data, continuing from crc (0 to start).
+ * Uses the SSE4.2 crc32 instruction when the CPU has it and a lookup table
+ * otherwise; both give the same result.
+ *
+ * @param       crc         Checksum of the preceding data (0 if none).
+ * @param       data        Data to checksum.
+ * @param       length      Number of bytes in data.
+ * @return      Updated checksum.
+ **/
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&Once, crc32c_init);
+    if (Hardware){
+        return ~crc32c_hardware(~crc, data, length);
+    }
+    return ~crc32c_table(~crc, data, length);
+}
+
+/* Internal Functions */
+
+/**
+ * Build the lookup table and probe for the crc32 instruction.
+ **/
+void    crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++){
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++){
+            crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & -(crc & 1));
+        }
+        Table[i] = crc;
+    }
+
+    // Feeding zero bytes is linear in crc, so one table per crc byte suffices
+    static const unsigned char Zeroes[CRC32C_STRIPE];
+    for (uint32_t k = 0; k < 4; k++){
+        for (uint32_t i = 0; i < 256; i++){
+            Shift[k][i] = crc32c_table(i << (8 * k), Zeroes, sizeof(Zeroes));
+        }
+    }
+#if defined(__x86_64__)
+    Hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/**
+ * Return raw crc advanced over CRC32C_STRIPE zero bytes.  Because CRC
+ * updates are linear, crc(a || b) = shift(crc(a)) ^ crc(0, b) when b is
+ * CRC32C_STRIPE bytes, which lets independent streams be combined.
+ **/
+uint32_t crc32c_shift(uint32_t crc) {
+    return Shift[0][crc & 0xff] ^ Shift[1][(crc >> 8) & 0xff] ^
+           Shift[2][(crc >> 16) & 0xff] ^ Shift[3][crc >> 24];
+}
+
+/**
+ * Update raw (uninverted) crc with data one byte at a time.
+ **/
+uint32_t crc32c_table(uint32_t crc, const unsigned char *data, size_t length) {
+    while (length--){
+        crc = (crc >> 8) ^ Table[(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * Update raw (uninverted) crc with data eight bytes at a time using the
+ * SSE4.2 crc32 instruction.  The instruction has a latency of several
+ * cycles but can start every cycle, so large inputs are split into three
+ * interleaved streams that are combined with crc32c_shift.
+ **/
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char *data, size_t length) {
+    while (length >= 3 * CRC32C_STRIPE){
+        uint64_t a = crc, b = 0, c = 0;
+        for (size_t i = 0; i < CRC32C_STRIPE; i += sizeof(uint64_t)){
+            uint64_t x, y, z;
+            memcpy(&x, data + i, sizeof(x));
+            memcpy(&y, data + i + CRC32C_STRIPE, sizeof(y));
+            memcpy(&z, data + i + 2 * CRC32C_STRIPE, sizeof(z));
+            a = _mm_crc32_u64(a, x);
+            b = _mm_crc32_u64(b, y);
+            c = _mm_crc32_u64(c, z);
+        }
+        crc     = crc32c_shift(crc32c_shift(a) ^ b) ^ c;
+        data   += 3 * CRC32C_STRIPE;
+        length -= 3 * CRC32C_STRIPE;
+    }
+
+    uint64_t wide = crc;
+    while (length >= sizeof(uint64_t)){
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        wide    = _mm_crc32_u64(wide, word);
+        data   += sizeof(word);
+        length -= sizeof(word);
+    }
+    crc = wide;
+    while (length--){
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#else
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char *data, size_t length) {
+    return crc32c_table(crc, data, length);
+}
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,18 +1,168 @@
 /* disk.c: SimpleFS disk emulator */
 
+#define _GNU_SOURCE                             /* fallocate, O_DIRECT */
+
 #include "sfs/disk.h"
 #include "sfs/logging.h"
+#include "sfs/trace.h"
+#include "sfs/utils.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/* Internal Constants */
+
+#define DEVICE_READ     (0)
+#define DEVICE_WRITE    (1)
+#define DEVICE_DISCARD  (2)
+#define QUEUE_PENDING   (-2)                    /* Result of a read not yet dispatched */
+
+#define MEMBER_IDLE     (0)
+#define MEMBER_POSTED   (1)                     /* Transfer waiting for the member's thread */
+#define MEMBER_DONE     (2)                     /* Transfer finished, result not yet collected */
+#define MEMBER_STOP     (3)                     /* Thread should exit */
+
+/* Internal Structures */
+
+struct DiskArena {
+    pthread_mutex_t lock;                       /* Protects the fields below */
+    char       *memory;                         /* DISK_ARENA_BUFFERS buffers (allocated on first use) */
+    size_t      buffer_size;                    /* Bytes per buffer */
+    size_t      free[DISK_ARENA_BUFFERS];       /* Indices of buffers not lent out */
+    size_t      nfree;                          /* Number of entries in free */
+    size_t      lent;                           /* Buffers lent out (including ones from malloc) */
+};
+
+struct DiskDevice {
+    pthread_mutex_t lock;                       /* Protects the fields below */
+    DiskModel   model;                          /* Device parameters */
+    uint64_t    opened;                         /* Host time the model was set (ns) */
+    uint64_t    head;                           /* Block after the last one transferred (HDD) */
+    uint64_t    busy[DISK_MAX_CHANNELS];        /* Simulated time each channel is busy until (ns) */
+};
+
+struct DiskMember {
+    Disk           *disk;                       /* Disk the image belongs to */
+    int             fd;                         /* File descriptor of member image */
+    pthread_t       thread;                     /* Issues this member's part of split transfers */
+    pthread_mutex_t lock;                       /* Protects the fields below */
+    pthread_cond_t  changed;                    /* Signalled when state changes */
+    int             state;                      /* MEMBER_* */
+    const struct iovec *iov;                    /* Posted transfer */
+    int             iovcnt;
+    off_t           offset;
+    bool            write;
+    ssize_t         result;
+    bool            online;                     /* Whether the image is in sync (mirrors) */
+    uint64_t       *dirty;                      /* Regions written while offline (mirrors) */
+    size_t          inflight;                   /* Reads being served (mirrors) */
+    size_t          position;                   /* Block after the last one read (mirrors) */
+};
+
+struct DiskMirror {
+    pthread_rwlock_t lock;                      /* Held for reading by transfers, for writing to change members */
+    size_t          online;                     /* Members in sync */
+    size_t          regions;                    /* DISK_REGION_SIZE regions per member */
+};
+
+typedef struct DiskRequest DiskRequest;
+struct DiskRequest {
+    size_t      block;                          /* Block to transfer */
+    char       *data;                           /* Caller's buffer (reads) or queue buffer (writes) */
+    uint64_t    deadline;                       /* disk_clock() by which it should be dispatched */
+    ssize_t    *result;                         /* Where a read's result goes (NULL for writes) */
+};
+
+struct DiskQueue {
+    pthread_mutex_t lock;                       /* Protects the fields below */
+    pthread_cond_t  wake;                       /* Signalled when the dispatcher has work */
+    pthread_cond_t  done;                       /* Signalled when requests complete */
+    pthread_t   thread;                         /* Dispatcher */
+    DiskScheduler options;                      /* Limits and deadlines (defaults filled in) */
+    DiskRequest *reads;                         /* Waiting reads, sorted by block */
+    size_t      nreads;
+    size_t      read_capacity;
+    DiskRequest *writes;                        /* Held writes, sorted by block (options.depth at most) */
+    size_t      nwrites;
+    char       *memory;                         /* options.depth aligned block buffers for writes */
+    char      **free;                           /* Buffers not holding a write */
+    size_t      nfree;
+    size_t      position;                       /* Block after the last transfer (elevator head) */
+    size_t      starved;                        /* Read batches dispatched while writes were due */
+    size_t      flushers;                       /* Threads waiting in disk_flush */
+    bool        busy;                           /* Whether a transfer is in progress */
+    bool        failed;                         /* Whether a held write failed since the last flush */
+    bool        stopping;                       /* Whether the dispatcher should drain and exit */
+};
+
+/* Internal Globals */
+
+static const struct {
+    const char *name;
+    DiskModel   model;
+} DiskPresets[] = {
+    {"none", {.type = DISK_MODEL_NONE}},
+    {"hdd",  {.type = DISK_MODEL_HDD, .channels = 1, .track_blocks = 256,   /* 7200 rpm */
+              .seek_min_ns = 500000, .seek_max_ns = 15000000, .rotation_ns = 8333333, .inject = true}},
+    {"ssd",  {.type = DISK_MODEL_SSD, .channels = 8, .read_ns = 80000, .write_ns = 50000, .inject = true}},
+    {"nvme", {.type = DISK_MODEL_NVME, .channels = 32, .read_ns = 20000, .write_ns = 15000, .inject = true}},
+};
 
 /* Internal Prototyes */
 
 bool    disk_sanity_check(Disk *disk, size_t blocknum, const char *data);
+ssize_t disk_transfer(Disk *disk, size_t block, char *data, bool write);
+bool    disk_set_buffered(Disk *disk);
+void    disk_simulate(Disk *disk, size_t block, int op);
+void    disk_map(const Disk *disk, size_t block, size_t *member, off_t *offset);
+size_t  disk_member_size(const Disk *disk, size_t blocks);
+ssize_t disk_transfer_vector(Disk *disk, size_t block, const struct iovec *iov, size_t count, bool write);
+ssize_t disk_member_transfer(Disk *disk, DiskMember *member, const struct iovec *iov, int iovcnt, off_t offset, bool write);
+void *  disk_member_thread(void *arg);
+void    disk_release(Disk *disk, size_t opened);
+Disk *  disk_open_members(const char **paths, size_t npaths, size_t stripe_size, size_t blocks, int flags, bool mirrored);
+size_t  disk_parse_paths(char *list, const char **paths);
+void    disk_member_post(DiskMember *member, const struct iovec *iov, int iovcnt, off_t offset, bool write);
+ssize_t disk_member_wait(DiskMember *member);
+ssize_t disk_mirror_transfer(Disk *disk, size_t block, const struct iovec *iov, size_t count, bool write);
+ssize_t disk_mirror_read(Disk *disk, const struct iovec *iov, int iovcnt, off_t offset, size_t size);
+ssize_t disk_mirror_pick(Disk *disk, size_t block);
+bool    disk_mirror_fail(Disk *disk, size_t member);
+void    disk_mirror_dirty(Disk *disk, off_t offset, size_t size);
+bool    disk_mirror_copy(Disk *disk, DiskMember *target, size_t region, char *buffer);
+ssize_t disk_queue_read(Disk *disk, size_t block, char *data);
+ssize_t disk_queue_write(Disk *disk, size_t block, const char *data);
+void    disk_queue_hold(Disk *disk, size_t block, size_t count);
+size_t  disk_queue_search(const DiskRequest *requests, size_t count, size_t block);
+size_t  disk_queue_oldest(const DiskRequest *requests, size_t count);
+void *  disk_dispatcher(void *arg);
+void    disk_dispatch(Disk *disk, DiskRequest *batch, size_t count, bool write);
+uint64_t disk_clock();
+uint64_t disk_isqrt(uint64_t n);
 
 /* External Functions */
 
+/**
+ * Open disk with default flags (see disk_open_ex).
+ *
+ * @param       path        Path to disk image to create.
+ * @param       blocks      Number of blocks to allocate for disk image.
+ *
+ * @return      Pointer to newly allocated and configured Disk structure (NULL
+ *              on failure).
+ **/
+Disk *	disk_open(const char *path, size_t blocks) {
+    return disk_open_ex(path, blocks, 0);
+}
+
 /**
  *
  * Opens disk at specified path with the specified number of blocks by doing
@@ -22,39 +172,192 @@ bool    disk_sanity_check(Disk *disk, size_t blocknum, const char *data);
  *
  *  2. Open file descriptor to specified path.
  *
- *  3. Truncate file to desired file size (blocks * BLOCK_SIZE).
+ *  3. Truncate file to desired file size (blocks * BLOCK_SIZE).  Images
+ *  are only ever extended, and the extension is sparse, so opening a large
+ *  image does not write any data.
  *
- * @param       path        Path to disk image to create.
+ * With DISK_DIRECT, the image is opened with O_DIRECT so block I/O bypasses
+ * the host page cache.  Buffers that are not DISK_ALIGNMENT aligned are
+ * bounced through the disk's arena (see disk_buffer_get), and if the host
+ * file system rejects O_DIRECT, at open or on the first transfer, the disk
+ * falls back to buffered I/O and clears DISK_DIRECT from its flags.
+ *
+ * A path of the form stripe:UNIT:PATH,PATH,... opens a disk striped over
+ * the listed images with UNIT bytes per stripe unit (see disk_open_striped),
+ * and mirror:PATH,PATH,... one mirrored over them (see disk_open_mirrored),
+ * so anything that takes an image path can use either.
+ *
+ * @param       path        Path to disk image to create (or stripe spec).
  * @param       blocks      Number of blocks to allocate for disk image.
+ * @param       flags       DISK_* flags.
  *
  * @return      Pointer to newly allocated and configured Disk structure (NULL
  *              on failure).
  **/
-Disk *	disk_open(const char *path, size_t blocks) {
-    //disk_open complete and correct (I think)
-    Disk * new_disk = malloc(sizeof(Disk));
-    int fd = open(path, O_RDWR | O_CREAT, 0644);
-    //printf("\n\nFile descriptor: %i\n\n", fd);
-    if(fd<0){
-        //printf("THIS IS THE BAD FILE POLICE REROOREROO");
-        if (!truncate(path, blocks*BLOCK_SIZE)){
-            free(new_disk);
-            return NULL;
+Disk *	disk_open_ex(const char *path, size_t blocks, int flags) {
+    const char *paths[DISK_MAX_MEMBERS];
+    char       *spec;
+    Disk       *disk;
+
+    if (strncmp(path, DISK_STRIPE_PREFIX, strlen(DISK_STRIPE_PREFIX)) == 0){
+        // stripe:UNIT:PATH,PATH,...
+        char   *end;
+        size_t  stripe_size = strtoull(path + strlen(DISK_STRIPE_PREFIX), &end, 10);
+        size_t  npaths      = (spec = *end == ':' ? strdup(end + 1) : NULL) ? disk_parse_paths(spec, paths) : 0;
+        disk = npaths ? disk_open_striped(paths, npaths, stripe_size, blocks, flags) : NULL;
+    } else if (strncmp(path, DISK_MIRROR_PREFIX, strlen(DISK_MIRROR_PREFIX)) == 0){
+        // mirror:PATH,PATH,...
+        size_t  npaths = (spec = strdup(path + strlen(DISK_MIRROR_PREFIX))) ? disk_parse_paths(spec, paths) : 0;
+        disk = npaths ? disk_open_mirrored(paths, npaths, blocks, flags) : NULL;
+    } else {
+        return disk_open_members(&path, 1, BLOCK_SIZE, blocks, flags, false);
+    }
+    free(spec);
+    return disk;
+}
+
+/**
+ * Open a disk striped (RAID-0) over several images: logical blocks are laid
+ * out in stripe units of stripe_size bytes dealt round-robin to the images,
+ * so block N lives in image (N / unit) % npaths, where unit is the number of
+ * blocks per stripe unit.  Each image holds an equal share of the stripe
+ * units (the last ones may be partly unused), and is created and extended
+ * like a single image (see disk_open_ex).
+ *
+ * Single block transfers go to the image that holds the block, so
+ * concurrent callers spread over the images.  Multi-block transfers (merged
+ * by a scheduler, see disk_set_scheduler) are split into one transfer per
+ * image, issued in parallel by a thread per image.
+ *
+ * @param       paths       Paths to member images (in stripe order).
+ * @param       npaths      Number of member images (1 to DISK_MAX_MEMBERS).
+ * @param       stripe_size Bytes per stripe unit (a multiple of BLOCK_SIZE).
+ * @param       blocks      Number of BLOCK_SIZE blocks in the striped disk.
+ * @param       flags       DISK_* flags.
+ *
+ * @return      Pointer to newly allocated and configured Disk structure (NULL
+ *              on failure).
+ **/
+Disk *	disk_open_striped(const char **paths, size_t npaths, size_t stripe_size, size_t blocks, int flags) {
+    if (!stripe_size || stripe_size % BLOCK_SIZE){
+        return NULL;
+    }
+    return disk_open_members(paths, npaths, stripe_size, blocks, flags, false);
+}
+
+/**
+ * Open a disk mirrored (RAID-1) over several images, each of which holds a
+ * full copy of the disk; images are assumed to be in sync when opened.
+ *
+ * Writes go to every member in parallel, one to each member's thread (the
+ * caller issues the first itself), and only fail if no member took them.  A
+ * member that fails a transfer is taken offline, as is one removed with
+ * disk_detach, and the DISK_REGION_SIZE regions written while it is offline
+ * are recorded in its dirty bitmap, so disk_resync only copies those.
+ *
+ * Reads go to the online member with the fewest reads in flight, and among
+ * those to the one whose last read ended nearest the block.  Multi-block
+ * reads (merged by a scheduler) are split evenly over the online members, so
+ * read throughput grows with the number of mirrors.
+ *
+ * @param       paths       Paths to member images.
+ * @param       npaths      Number of member images (2 to DISK_MAX_MEMBERS).
+ * @param       blocks      Number of BLOCK_SIZE blocks in the mirrored disk.
+ * @param       flags       DISK_* flags.
+ *
+ * @return      Pointer to newly allocated and configured Disk structure (NULL
+ *              on failure).
+ **/
+Disk *	disk_open_mirrored(const char **paths, size_t npaths, size_t blocks, int flags) {
+    if (npaths < 2){
+        return NULL;
+    }
+    return disk_open_members(paths, npaths, BLOCK_SIZE, blocks, flags, true);
+}
+
+/**
+ * Body of disk_open_striped and disk_open_mirrored (a single image is a
+ * stripe of one).
+ **/
+Disk *  disk_open_members(const char **paths, size_t npaths, size_t stripe_size, size_t blocks, int flags, bool mirrored) {
+    // Reject sizes whose byte offsets do not fit in off_t
+    if (blocks > (size_t)INT64_MAX / BLOCK_SIZE - stripe_size / BLOCK_SIZE * npaths || (flags & ~DISK_DIRECT) ||
+        !npaths || npaths > DISK_MAX_MEMBERS){
+        return NULL;
+    }
+
+    Disk * new_disk = calloc(1, sizeof(Disk));
+    if (!new_disk){
+        return NULL;
+    }
+    new_disk->arena   = calloc(1, sizeof(DiskArena));
+    new_disk->members = calloc(npaths, sizeof(DiskMember));
+    new_disk->mirror  = mirrored ? calloc(1, sizeof(DiskMirror)) : NULL;
+    if (!new_disk->arena || !new_disk->members || (mirrored && !new_disk->mirror)){
+        free(new_disk->arena);
+        free(new_disk->members);
+        free(new_disk->mirror);
+        free(new_disk);
+        return NULL;
+    }
+    new_disk->blocks      = blocks;
+    new_disk->block_size  = BLOCK_SIZE;
+    new_disk->nmembers    = npaths;
+    new_disk->stripe_size = stripe_size;
+    new_disk->flags       = flags;
+    pthread_mutex_init(&new_disk->arena->lock, NULL);
+
+    size_t member_size = disk_member_size(new_disk, blocks);
+    if (mirrored){
+        // Prefer writers so disk_resync can finish under a steady load
+        pthread_rwlockattr_t attributes;
+        pthread_rwlockattr_init(&attributes);
+        pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&new_disk->mirror->lock, &attributes);
+        pthread_rwlockattr_destroy(&attributes);
+        new_disk->mirror->online  = npaths;
+        new_disk->mirror->regions = (member_size + DISK_REGION_SIZE - 1) / DISK_REGION_SIZE;
+    }
+    for (size_t m = 0; m < npaths; m++){
+        DiskMember *member = &new_disk->members[m];
+        int fd = (flags & DISK_DIRECT) ? open(paths[m], O_RDWR | O_CREAT | O_DIRECT, 0644) : -1;
+        if (fd < 0){
+            new_disk->flags &= ~DISK_DIRECT;
+            fd = open(paths[m], O_RDWR | O_CREAT, 0644);
         }
-        fd = open(path, O_RDONLY);
         if(fd<0){
-            free(new_disk);
+            disk_release(new_disk, m);
+            return NULL;
+        }
+        member->disk   = new_disk;
+        member->fd     = fd;
+        member->online = true;
+        pthread_mutex_init(&member->lock, NULL);
+        pthread_cond_init(&member->changed, NULL);
+        if (mirrored && !(member->dirty = calloc(BITMAP_WORDS(new_disk->mirror->regions) + 1, sizeof(uint64_t)))){
+            disk_release(new_disk, m + 1);
+            return NULL;
+        }
+
+        // Extend (sparsely) but never shrink the image
+        struct stat st;
+        if (fstat(fd, &st) < 0 ||
+            (st.st_size < (off_t)member_size && ftruncate(fd, member_size) < 0)){
+            disk_release(new_disk, m + 1);
+            return NULL;
+        }
+
+        if (npaths > 1 && pthread_create(&member->thread, NULL, disk_member_thread, member) != 0){
+            disk_release(new_disk, m + 1);
             return NULL;
         }
     }
-    if(blocks>BLOCK_SIZE){
-        free(new_disk);
-        return NULL;
+
+    // A member that refused O_DIRECT turns it off for all of them
+    if ((flags & DISK_DIRECT) && !(new_disk->flags & DISK_DIRECT)){
+        disk_set_buffered(new_disk);
     }
-    new_disk->fd = fd;
-    new_disk->reads = 0;
-    new_disk->writes = 0;
-    new_disk->blocks = blocks;
+    new_disk->fd = new_disk->members[0].fd;
     return new_disk;
 }
 
@@ -71,10 +374,14 @@ Disk *	disk_open(const char *path, size_t blocks) {
  */
 void	disk_close(Disk *disk) {
     //complete and correct (I think)
-    close(disk->fd);
+    disk_set_scheduler(disk, NULL);
     printf("%zu disk block reads\n" , disk->reads);
     printf("%zu disk block writes\n", disk->writes);
-    free(disk);
+    if (disk->device){
+        printf("%zu us simulated device time\n", disk->device_ns / 1000);
+    }
+    disk_set_model(disk, NULL);
+    disk_release(disk, disk->nmembers);
 }
 
 /**
@@ -83,33 +390,32 @@ void	disk_close(Disk *disk) {
  *
  *  1. Perform sanity check.
  *
- *  2. Seek to specified block.
+ *  2. Read from block to data buffer (must be block_size bytes).
  *
- *  3. Read from block to data buffer (must be BLOCK_SIZE).
+ * Reads use pread and an atomic counter so that several threads may share
+ * one Disk (see fs_mount).
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
  * @param       data        Data buffer.
  *
  * @return      Number of bytes read.
- *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ *              (block_size on success, DISK_FAILURE on failure).
  **/
 ssize_t disk_read(Disk *disk, size_t block, char *data) {
-    // incorrect
+    uint64_t started = trace_begin();
+    ssize_t  result  = DISK_FAILURE;
     if (disk_sanity_check(disk, block, data)){
-        if(lseek(disk->fd,block*BLOCK_SIZE,SEEK_SET)<0){
-            //printf("\n\nLSEEK FAIL\n\n");
-            return DISK_FAILURE; //correct
-        }
-        if (read(disk->fd, data, BLOCK_SIZE) == BLOCK_SIZE){
-            disk->reads++;
-            return BLOCK_SIZE;
+        if (disk->queue){
+            result = disk_queue_read(disk, block, data);
+        } else if (disk_transfer(disk, block, data, false) == (ssize_t)disk->block_size){
+            __atomic_fetch_add(&disk->reads, 1, __ATOMIC_RELAXED);
+            disk_simulate(disk, block, DEVICE_READ);
+            result = disk->block_size;
         }
-        //printf("\n\nLSEEK/READ FAIL\n\n");
-        return DISK_FAILURE;
     }
-    //printf("\n\nSANITY CHECK FAILED\n\n");
-    return DISK_FAILURE;
+    trace_end(TRACE_DISK_READ, started, block, disk ? disk->block_size : 0, 0, result);
+    return result;
 }
 
 /**
@@ -118,39 +424,1448 @@ ssize_t disk_read(Disk *disk, size_t block, char *data) {
  *
  *  1. Perform sanity check.
  *
- *  2. Seek to specified block.
+ *  2. Write data buffer (must be block_size bytes) to disk block.
  *
- *  3. Write data buffer (must be BLOCK_SIZE) to disk block.
+ * Like disk_read, this is safe to call from several threads at once.
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
  * @param       data        Data buffer.
  *
  * @return      Number of bytes written.
- *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ *              (block_size on success, DISK_FAILURE on failure).
  **/
 ssize_t disk_write(Disk *disk, size_t block, char *data) {
-    //incorrect
+    uint64_t started = trace_begin();
+    ssize_t  result  = DISK_FAILURE;
     if (disk_sanity_check(disk, block, data)){
-        if(lseek(disk->fd,block*BLOCK_SIZE,SEEK_SET)<0){
-            //printf("\n\nLSEEK FAIL\n\n");
-            return DISK_FAILURE; //correct
+        if (disk->queue){
+            result = disk_queue_write(disk, block, data);
+        } else if (disk_transfer(disk, block, data, true) == (ssize_t)disk->block_size){
+            __atomic_fetch_add(&disk->writes, 1, __ATOMIC_RELAXED);
+            disk_simulate(disk, block, DEVICE_WRITE);
+            result = disk->block_size;
+        }
+    }
+    trace_end(TRACE_DISK_WRITE, started, block, disk ? disk->block_size : 0, 0, result);
+    return result;
+}
+
+/**
+ * Discard count blocks starting at the specified block by punching a hole
+ * in the disk image, which releases the host storage behind them.  The
+ * image keeps its size and discarded blocks read back as zeros.
+ *
+ * Discards are not counted as writes, and like disk_write this is safe to
+ * call from several threads at once.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block to discard.
+ * @param       count       Number of blocks to discard.
+ *
+ * @return      Number of blocks discarded.
+ *              (count on success, DISK_FAILURE on failure or if the host
+ *              file system cannot punch holes).
+ **/
+ssize_t disk_discard(Disk *disk, size_t block, size_t count) {
+    uint64_t started = trace_begin();
+    ssize_t  result  = DISK_FAILURE;
+    if (!disk || !count || block >= disk->blocks || count > disk->blocks - block){
+        trace_end(TRACE_DISK_DISCARD, started, block, count, 0, result);
+        return result;
+    }
+
+    // The blocks of a range that fall on one member are contiguous in it
+    off_t first[DISK_MAX_MEMBERS], last[DISK_MAX_MEMBERS];
+    bool  striped = disk->nmembers > 1 && !disk->mirror;
+    for (size_t m = 0; m < disk->nmembers; m++){
+        first[m] = striped ? -1 : (off_t)block * disk->block_size;
+        last[m]  = (off_t)(block + count) * disk->block_size;
+    }
+    size_t unit = striped ? disk->stripe_size / disk->block_size : 0;
+    for (size_t b = block; striped && b < block + count; b += unit - b % unit){
+        size_t member;
+        off_t  offset;
+        disk_map(disk, b, &member, &offset);
+        if (first[member] < 0){
+            first[member] = offset;
+        }
+        last[member] = offset + (off_t)(min(unit - b % unit, block + count - b) * disk->block_size);
+    }
+
+    if (disk->queue){
+        disk_queue_hold(disk, block, count);
+    }
+    if (disk->mirror){
+        pthread_rwlock_rdlock(&disk->mirror->lock);
+    }
+    bool punched = true;
+    for (size_t m = 0; m < disk->nmembers; m++){
+        if (first[m] >= 0 && __atomic_load_n(&disk->members[m].online, __ATOMIC_RELAXED) &&
+            fallocate(disk->members[m].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      first[m], last[m] - first[m]) < 0){
+            punched = false;
+        }
+    }
+    if (disk->mirror){
+        if (punched){
+            disk_mirror_dirty(disk, first[0], last[0] - first[0]);
+        }
+        pthread_rwlock_unlock(&disk->mirror->lock);
+    }
+    if (punched){
+        __atomic_fetch_add(&disk->discards, count, __ATOMIC_RELAXED);
+        disk_simulate(disk, block, DEVICE_DISCARD);
+        result = count;
+    }
+    if (disk->queue){
+        pthread_mutex_unlock(&disk->queue->lock);
+    }
+    trace_end(TRACE_DISK_DISCARD, started, block, count, 0, result);
+    return result;
+}
+
+/**
+ * Grow disk image to the specified number of blocks.  Like disk_open, the
+ * image is extended sparsely, so this writes no data; disks never shrink.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      New number of blocks (>= current).
+ *
+ * @return      Whether or not the disk now has that many blocks.
+ **/
+bool	disk_grow(Disk *disk, size_t blocks) {
+    if (!disk || blocks < disk->blocks ||
+        blocks > (size_t)INT64_MAX / disk->block_size - disk->stripe_size / disk->block_size * disk->nmembers){
+        return false;
+    }
+
+    size_t member_size = disk_member_size(disk, blocks);
+    bool   grown       = true;
+    if (disk->mirror){
+        pthread_rwlock_wrlock(&disk->mirror->lock);
+    }
+    for (size_t m = 0; m < disk->nmembers && grown; m++){
+        struct stat st;
+        int         fd = disk->members[m].fd;
+        if (fstat(fd, &st) < 0 ||
+            (st.st_size < (off_t)member_size && ftruncate(fd, member_size) < 0)){
+            grown = false;
+        }
+    }
+
+    // New regions start out in sync (zeros everywhere)
+    size_t regions = (member_size + DISK_REGION_SIZE - 1) / DISK_REGION_SIZE;
+    if (grown && disk->mirror && regions > disk->mirror->regions){
+        size_t words = BITMAP_WORDS(regions) + 1, old = BITMAP_WORDS(disk->mirror->regions) + 1;
+        for (size_t m = 0; m < disk->nmembers && grown; m++){
+            uint64_t *dirty = realloc(disk->members[m].dirty, words * sizeof(uint64_t));
+            if (dirty){
+                memset(dirty + old, 0, (words - old) * sizeof(uint64_t));
+                disk->members[m].dirty = dirty;
+            }
+            grown = dirty != NULL;
+        }
+        if (grown){
+            disk->mirror->regions = regions;
+        }
+    }
+    if (grown){
+        disk->blocks = blocks;
+    }
+    if (disk->mirror){
+        pthread_rwlock_unlock(&disk->mirror->lock);
+    }
+    return grown;
+}
+
+/**
+ * Change the size of the disk's blocks (disks open with BLOCK_SIZE blocks).
+ * The image keeps its size in bytes, so the number of blocks is rescaled,
+ * rounding down if the image is not a multiple of the new size.  This is
+ * not safe to call while other threads use the disk, and fails while any
+ * arena buffers are lent out, or while a scheduler is attached, since
+ * their buffers have the old size.  Striped disks keep their stripe unit,
+ * so blocks cannot grow past it.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block_size  Bytes per block (a power of two from
+ *                          MIN_BLOCK_SIZE to MAX_BLOCK_SIZE).
+ *
+ * @return      Whether or not the disk now uses blocks of that size.
+ **/
+bool	disk_set_block_size(Disk *disk, size_t block_size) {
+    if (!disk || block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1))){
+        return false;
+    }
+    if (block_size == disk->block_size){
+        return true;
+    }
+    if (disk->arena->lent || disk->queue || (disk->nmembers > 1 && !disk->mirror && disk->stripe_size % block_size)){
+        return false;
+    }
+
+    // Arena buffers are allocated again, at the new size, when next needed
+    free(disk->arena->memory);
+    disk->arena->memory = NULL;
+    disk->arena->nfree  = 0;
+    disk->blocks     = disk->blocks * disk->block_size / block_size;
+    disk->block_size = block_size;
+    return true;
+}
+
+/**
+ * Simulate a storage device behind the disk image.  Every block read and
+ * write (and every discard) is charged the time the modelled device would
+ * take, given the blocks it served before, and the total is kept in
+ * device_ns:
+ *
+ *  - DISK_MODEL_HDD serves one request at a time.  Moving to another track
+ *    costs a seek that grows with the square root of the track distance,
+ *    then the head waits for the block to rotate under it; the block right
+ *    after the previous one streams at transfer speed.
+ *
+ *  - DISK_MODEL_SSD and DISK_MODEL_NVME charge a fixed read or write
+ *    latency on one of several channels (chosen by block number), which
+ *    serve requests in parallel.
+ *
+ * With inject set, callers also sleep until their request would complete,
+ * so requests from several threads queue for channels as they would on the
+ * device.  Otherwise requests are charged back to back, which makes the
+ * accounted time deterministic.  Like disk_set_block_size, this is not safe
+ * to call while other threads use the disk.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       model       Device parameters (NULL or DISK_MODEL_NONE to
+ *                          stop simulating).
+ *
+ * @return      Whether or not the model is in effect.
+ **/
+bool	disk_set_model(Disk *disk, const DiskModel *model) {
+    if (!disk){
+        return false;
+    }
+    if (!model || model->type == DISK_MODEL_NONE){
+        if (disk->device){
+            pthread_mutex_destroy(&disk->device->lock);
+            free(disk->device);
+            disk->device = NULL;
         }
-        //definitely wrong. help
-        if (write(disk->fd, data, BLOCK_SIZE) == BLOCK_SIZE){
-            disk->writes++;
-            return BLOCK_SIZE;
+        return true;
+    }
+
+    bool hdd = model->type == DISK_MODEL_HDD;
+    if ((model->type != DISK_MODEL_HDD && model->type != DISK_MODEL_SSD && model->type != DISK_MODEL_NVME) ||
+        (hdd && (!model->track_blocks || !model->rotation_ns || model->seek_min_ns > model->seek_max_ns)) ||
+        (!hdd && (!model->channels || model->channels > DISK_MAX_CHANNELS))){
+        return false;
+    }
+
+    DiskDevice *device = disk->device ? disk->device : calloc(1, sizeof(DiskDevice));
+    if (!device){
+        return false;
+    }
+    if (!disk->device){
+        pthread_mutex_init(&device->lock, NULL);
+    }
+    device->model = *model;
+    device->model.channels = hdd ? 1 : model->channels;
+    device->opened = disk_clock();
+    device->head   = 0;
+    memset(device->busy, 0, sizeof(device->busy));
+    disk->device    = device;
+    disk->device_ns = 0;
+    return true;
+}
+
+/**
+ * Fill in the parameters of a named device model: "none", "hdd" (7200 rpm),
+ * "ssd" (SATA flash) or "nvme".  Presets inject delays.
+ *
+ * @param       name        Preset name.
+ * @param       model       DiskModel structure to fill in.
+ *
+ * @return      Whether or not the preset exists.
+ **/
+bool	disk_model_preset(const char *name, DiskModel *model) {
+    for (size_t i = 0; i < sizeof(DiskPresets) / sizeof(DiskPresets[0]); i++){
+        if (strcmp(name, DiskPresets[i].name) == 0){
+            *model = DiskPresets[i].model;
+            return true;
         }
-        //printf("\n\nLSEEK/READ FAIL\n\n");
+    }
+    return false;
+}
+
+/**
+ * Attach a request scheduler to the disk (or, with NULL, flush and detach
+ * it).  Requests then pass through a queue served by a dispatcher thread:
+ *
+ *  - Writes are copied into the queue and complete at once (write-back).
+ *  A write to a block already queued replaces the queued data, and reads of
+ *  a queued block are answered from it.  Held writes go out once depth of
+ *  them are queued, once the oldest is write_expire_ns old, or on
+ *  disk_flush, so a failed write is reported by the next disk_flush.
+ *
+ *  - Reads wait in the queue, so reads from several threads can be sorted
+ *  and merged too.
+ *
+ *  - The dispatcher serves the queue in ascending block order from the
+ *  last block it transferred (wrapping around), merging up to max_merge
+ *  adjacent blocks into one preadv or pwritev.  Reads are preferred, but a
+ *  request past its deadline is served first, and due writes get a turn
+ *  after writes_starved read batches.
+ *
+ * Once a scheduler is attached, reads and writes count transfers (so
+ * merging shows as fewer of them, and reads answered from the queue do not
+ * count), and block sizes cannot change.  Like disk_set_block_size, this is
+ * not safe to call while other threads use the disk.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       scheduler   Scheduler limits (zero fields take defaults), or
+ *                          NULL to stop scheduling.
+ *
+ * @return      Whether or not the scheduler is in effect (for NULL, whether
+ *              every held write reached the image).
+ **/
+bool	disk_set_scheduler(Disk *disk, const DiskScheduler *scheduler) {
+    if (!disk){
+        return false;
+    }
+
+    bool flushed = true;
+    if (disk->queue){
+        DiskQueue *queue = disk->queue;
+        pthread_mutex_lock(&queue->lock);
+        queue->stopping = true;
+        pthread_cond_signal(&queue->wake);
+        pthread_mutex_unlock(&queue->lock);
+        pthread_join(queue->thread, NULL);
+
+        flushed = !queue->failed;
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->wake);
+        pthread_cond_destroy(&queue->done);
+        free(queue->reads);
+        free(queue->writes);
+        free(queue->free);
+        free(queue->memory);
+        free(queue);
+        disk->queue = NULL;
+    }
+    if (!scheduler){
+        return flushed;
+    }
+
+    DiskScheduler options = *scheduler;
+    options.depth           = options.depth           ? options.depth           : DISK_QUEUE_DEPTH;
+    options.max_merge       = options.max_merge       ? options.max_merge       : DISK_MAX_MERGE;
+    options.writes_starved  = options.writes_starved  ? options.writes_starved  : DISK_WRITES_STARVED;
+    options.read_expire_ns  = options.read_expire_ns  ? options.read_expire_ns  : DISK_READ_EXPIRE_NS;
+    options.write_expire_ns = options.write_expire_ns ? options.write_expire_ns : DISK_WRITE_EXPIRE_NS;
+    if (options.max_merge > DISK_MAX_MERGE){
+        return false;
+    }
+
+    DiskQueue *queue = calloc(1, sizeof(DiskQueue));
+    void      *memory;
+    if (!queue){
+        return false;
+    }
+    queue->options = options;
+    queue->writes  = calloc(options.depth, sizeof(DiskRequest));
+    queue->free    = calloc(options.depth, sizeof(char *));
+    queue->memory  = posix_memalign(&memory, DISK_ALIGNMENT, (size_t)options.depth * disk->block_size) == 0 ? memory : NULL;
+    if (!queue->writes || !queue->free || !queue->memory){
+        free(queue->writes);
+        free(queue->free);
+        free(queue->memory);
+        free(queue);
+        return false;
+    }
+    for (size_t i = 0; i < options.depth; i++){
+        queue->free[queue->nfree++] = queue->memory + i * disk->block_size;
+    }
+
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->wake, &attributes);
+    pthread_cond_init(&queue->done, NULL);
+    pthread_condattr_destroy(&attributes);
+
+    disk->queue = queue;
+    if (pthread_create(&queue->thread, NULL, disk_dispatcher, disk) != 0){
+        disk->queue = NULL;
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->wake);
+        pthread_cond_destroy(&queue->done);
+        free(queue->writes);
+        free(queue->free);
+        free(queue->memory);
+        free(queue);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Wait until every write the scheduler holds has reached the image (see
+ * disk_set_scheduler).  Without a scheduler writes are never held.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not every write held since the last flush was
+ *              written successfully.
+ **/
+bool	disk_flush(Disk *disk) {
+    DiskQueue *queue = disk ? disk->queue : NULL;
+    if (!queue){
+        return disk != NULL;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->flushers++;
+    pthread_cond_signal(&queue->wake);
+    while (queue->nwrites || queue->busy){
+        pthread_cond_wait(&queue->done, &queue->lock);
+    }
+    queue->flushers--;
+    bool result = !queue->failed;
+    queue->failed = false;
+    pthread_mutex_unlock(&queue->lock);
+    return result;
+}
+
+/**
+ * Take a member of a mirrored disk offline (as if it failed): it gets no
+ * more transfers, and the regions written from now on are marked dirty in
+ * its bitmap until disk_resync brings it back.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       member      Index of member image.
+ *
+ * @return      Whether or not the member is now offline (false if the disk
+ *              is not mirrored, or the member is offline or the last one
+ *              online).
+ **/
+bool	disk_detach(Disk *disk, size_t member) {
+    if (!disk || !disk->mirror || member >= disk->nmembers){
+        return false;
+    }
+    pthread_rwlock_wrlock(&disk->mirror->lock);
+    bool detached = disk->members[member].online && disk->mirror->online > 1;
+    if (detached){
+        disk->members[member].online = false;
+        disk->mirror->online--;
+    }
+    pthread_rwlock_unlock(&disk->mirror->lock);
+    return detached;
+}
+
+/**
+ * Bring an offline member of a mirrored disk back in sync by copying the
+ * regions in its dirty bitmap from the online members, then put it back
+ * online.  Regions are copied while the disk stays in use; writes that
+ * land on a region after it was copied mark it dirty again, and the last
+ * of them are copied with transfers held off.
+ *
+ * With a path, the member's image is replaced by the one there first.  An
+ * image smaller than the disk (say, a new one) is taken to be blank and
+ * copied in full; a larger one is taken to be the member's old image (say,
+ * the same device reattached) and only gets the dirty regions.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       member      Index of member image.
+ * @param       path        Path to replacement image (NULL to keep the
+ *                          member's image).
+ *
+ * @return      Number of DISK_REGION_SIZE regions copied (DISK_FAILURE on
+ *              failure, in which case the member stays offline).
+ **/
+ssize_t	disk_resync(Disk *disk, size_t member, const char *path) {
+    if (!disk || !disk->mirror || member >= disk->nmembers){
+        return DISK_FAILURE;
+    }
+    DiskMirror *mirror = disk->mirror;
+    DiskMember *target = &disk->members[member];
+    char       *buffer = NULL;
+    if (__atomic_load_n(&target->online, __ATOMIC_RELAXED) ||
+        posix_memalign((void **)&buffer, DISK_ALIGNMENT, DISK_REGION_SIZE) != 0){
         return DISK_FAILURE;
     }
-    //printf("\n\nSANITY CHECK FAILED\n\n");
 
-    return DISK_FAILURE;
+    if (path){
+        bool direct = __atomic_load_n(&disk->flags, __ATOMIC_RELAXED) & DISK_DIRECT;
+        int  fd     = direct ? open(path, O_RDWR | O_CREAT | O_DIRECT, 0644) : -1;
+        if (fd < 0){
+            fd = open(path, O_RDWR | O_CREAT, 0644);
+        }
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0){
+            if (fd >= 0){
+                close(fd);
+            }
+            free(buffer);
+            return DISK_FAILURE;
+        }
+
+        pthread_rwlock_wrlock(&mirror->lock);
+        size_t member_size = disk_member_size(disk, disk->blocks);
+        if (st.st_size < (off_t)member_size && ftruncate(fd, member_size) < 0){
+            pthread_rwlock_unlock(&mirror->lock);
+            close(fd);
+            free(buffer);
+            return DISK_FAILURE;
+        }
+        if (st.st_size < (off_t)member_size){
+            for (size_t r = 0; r < mirror->regions; r++){
+                bitmap_set(target->dirty, r);
+            }
+        }
+        close(target->fd);
+        target->fd = fd;
+        if (member == 0){
+            disk->fd = fd;
+        }
+        if (direct && !(fcntl(fd, F_GETFL) & O_DIRECT)){
+            disk_set_buffered(disk);
+        }
+        pthread_rwlock_unlock(&mirror->lock);
+    }
+
+    // Copy dirty regions while transfers continue...
+    ssize_t copied = 0;
+    for (size_t r = 0; ; r++){
+        pthread_rwlock_rdlock(&mirror->lock);
+        if (r >= mirror->regions){
+            pthread_rwlock_unlock(&mirror->lock);
+            break;
+        }
+        bool dirty = bitmap_test(target->dirty, r);
+        if (dirty && !disk_mirror_copy(disk, target, r, buffer)){
+            pthread_rwlock_unlock(&mirror->lock);
+            free(buffer);
+            return DISK_FAILURE;
+        }
+        copied += dirty;
+        pthread_rwlock_unlock(&mirror->lock);
+    }
 
+    // ...then catch up on regions written meanwhile with them held off
+    pthread_rwlock_wrlock(&mirror->lock);
+    for (size_t r = 0; r < mirror->regions; r++){
+        if (bitmap_test(target->dirty, r)){
+            if (!disk_mirror_copy(disk, target, r, buffer)){
+                pthread_rwlock_unlock(&mirror->lock);
+                free(buffer);
+                return DISK_FAILURE;
+            }
+            copied++;
+        }
+    }
+    target->online = true;
+    mirror->online++;
+    pthread_rwlock_unlock(&mirror->lock);
+    free(buffer);
+    return copied;
 }
 
-/* Internal Functions */
+/**
+ * Borrow a DISK_ALIGNMENT aligned buffer of one block from the disk's arena
+ * of DISK_ARENA_BUFFERS buffers, which is allocated on first use so memory
+ * use stays fixed however many I/Os are in flight.  When every arena buffer
+ * is lent out, a buffer is allocated on its own instead.  Buffers can be
+ * passed to disk_read and disk_write without copies in direct mode.  This is
+ * safe to call from several threads at once.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Buffer of block_size bytes (NULL on failure); return it with
+ *              disk_buffer_put.
+ **/
+char *	disk_buffer_get(Disk *disk) {
+    DiskArena *arena  = disk->arena;
+    char      *buffer = NULL;
+
+    pthread_mutex_lock(&arena->lock);
+    if (!arena->memory && !arena->lent){
+        void *memory;
+        if (posix_memalign(&memory, DISK_ALIGNMENT, DISK_ARENA_BUFFERS * disk->block_size) == 0){
+            arena->memory      = memory;
+            arena->buffer_size = disk->block_size;
+            arena->nfree       = DISK_ARENA_BUFFERS;
+            for (size_t i = 0; i < DISK_ARENA_BUFFERS; i++){
+                arena->free[i] = DISK_ARENA_BUFFERS - 1 - i;
+            }
+        }
+    }
+    if (arena->nfree){
+        buffer = arena->memory + arena->free[--arena->nfree] * arena->buffer_size;
+    } else {
+        void *memory;
+        buffer = posix_memalign(&memory, DISK_ALIGNMENT, disk->block_size) == 0 ? memory : NULL;
+    }
+    arena->lent += buffer != NULL;
+    pthread_mutex_unlock(&arena->lock);
+    return buffer;
+}
+
+/**
+ * Return a buffer borrowed with disk_buffer_get.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       buffer      Buffer to return (NULL is ignored).
+ **/
+void	disk_buffer_put(Disk *disk, char *buffer) {
+    DiskArena *arena = disk->arena;
+    if (!buffer){
+        return;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    if (arena->memory && buffer >= arena->memory && buffer < arena->memory + DISK_ARENA_BUFFERS * arena->buffer_size){
+        arena->free[arena->nfree++] = (buffer - arena->memory) / arena->buffer_size;
+    } else {
+        free(buffer);
+    }
+    arena->lent--;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/* Internal Functions */
+
+/**
+ * Read or write one block with pread or pwrite.  In direct mode, unaligned
+ * buffers are bounced through an arena buffer, and a transfer the host
+ * rejects (EINVAL) switches the disk to buffered I/O and is retried.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ * @param       write       Whether to write (rather than read) the block.
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on error).
+ **/
+ssize_t disk_transfer(Disk *disk, size_t block, char *data, bool write) {
+    size_t  size   = disk->block_size;
+    size_t  member;
+    off_t   offset;
+    disk_map(disk, block, &member, &offset);
+    int     fd     = disk->members[member].fd;
+    bool    direct = __atomic_load_n(&disk->flags, __ATOMIC_RELAXED) & DISK_DIRECT;
+    char   *buffer = data;
+    if (direct && (uintptr_t)data % DISK_ALIGNMENT){
+        if (!(buffer = disk_buffer_get(disk))){
+            return DISK_FAILURE;
+        }
+        if (write){
+            memcpy(buffer, data, size);
+        }
+    }
+
+    ssize_t result;
+    if (disk->mirror){
+        result = disk_mirror_transfer(disk, block, &(struct iovec){buffer, size}, 1, write);
+    } else {
+        result = write ? pwrite(fd, buffer, size, offset) : pread(fd, buffer, size, offset);
+        if (result < 0 && errno == EINVAL && direct && disk_set_buffered(disk)){
+            result = write ? pwrite(fd, buffer, size, offset) : pread(fd, buffer, size, offset);
+        }
+    }
+
+    if (buffer != data){
+        if (!write && result == (ssize_t)size){
+            memcpy(data, buffer, size);
+        }
+        disk_buffer_put(disk, buffer);
+    }
+    return result == (ssize_t)size ? result : DISK_FAILURE;
+}
+
+/**
+ * Split a comma separated list of member image paths in place.
+ *
+ * @return      Number of paths (0 if there are none or too many).
+ **/
+size_t  disk_parse_paths(char *list, const char **paths) {
+    size_t npaths = 0;
+    char  *state  = NULL;
+    for (char *path = strtok_r(list, ",", &state); path; path = strtok_r(NULL, ",", &state)){
+        if (npaths == DISK_MAX_MEMBERS){
+            return 0;
+        }
+        paths[npaths++] = path;
+    }
+    return npaths;
+}
+
+/**
+ * Find the member image and byte offset in it that hold a block (mirrors
+ * hold every block at the same offset, which is returned for member 0).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Logical block number.
+ * @param       member      Set to index of member image.
+ * @param       offset      Set to byte offset in member image.
+ **/
+void    disk_map(const Disk *disk, size_t block, size_t *member, off_t *offset) {
+    if (disk->nmembers == 1 || disk->mirror){
+        *member = 0;
+        *offset = (off_t)block * disk->block_size;
+        return;
+    }
+    size_t unit   = disk->stripe_size / disk->block_size;
+    size_t stripe = block / unit;
+    *member = stripe % disk->nmembers;
+    *offset = (off_t)((stripe / disk->nmembers) * unit + block % unit) * disk->block_size;
+}
+
+/**
+ * Return bytes each member image needs to hold blocks logical blocks.
+ **/
+size_t  disk_member_size(const Disk *disk, size_t blocks) {
+    if (disk->nmembers == 1 || disk->mirror){
+        return blocks * disk->block_size;
+    }
+    size_t unit    = disk->stripe_size / disk->block_size;
+    size_t stripes = (blocks + unit - 1) / unit;
+    return (stripes + disk->nmembers - 1) / disk->nmembers * disk->stripe_size;
+}
+
+/**
+ * Transfer adjacent blocks with one preadv or pwritev per member image they
+ * fall on: a member's share goes to its thread, except the first one,
+ * which the caller issues itself while the others run.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block.
+ * @param       iov         One buffer of block_size bytes per block.
+ * @param       count       Number of blocks (DISK_MAX_MERGE at most).
+ * @param       write       Whether to write (rather than read) the blocks.
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on error).
+ **/
+ssize_t disk_transfer_vector(Disk *disk, size_t block, const struct iovec *iov, size_t count, bool write) {
+    if (disk->mirror){
+        return disk_mirror_transfer(disk, block, iov, count, write);
+    }
+
+    struct iovec parts[DISK_MAX_MEMBERS][DISK_MAX_MERGE];
+    int          nparts[DISK_MAX_MEMBERS] = {0};
+    off_t        offsets[DISK_MAX_MEMBERS];
+    size_t       order[DISK_MAX_MEMBERS], involved = 0;
+    for (size_t i = 0; i < count; i++){
+        size_t member;
+        off_t  offset;
+        disk_map(disk, block + i, &member, &offset);
+        if (!nparts[member]){
+            offsets[member]   = offset;
+            order[involved++] = member;
+        }
+        parts[member][nparts[member]++] = iov[i];
+    }
+
+    for (size_t i = 1; i < involved; i++){
+        disk_member_post(&disk->members[order[i]], parts[order[i]], nparts[order[i]], offsets[order[i]], write);
+    }
+
+    ssize_t total  = disk_member_transfer(disk, &disk->members[order[0]], parts[order[0]], nparts[order[0]], offsets[order[0]], write);
+    bool    failed = total < 0;
+    for (size_t i = 1; i < involved; i++){
+        ssize_t result = disk_member_wait(&disk->members[order[i]]);
+        failed = failed || result < 0;
+        total += result;
+    }
+    return !failed && total == (ssize_t)(count * disk->block_size) ? total : DISK_FAILURE;
+}
+
+/**
+ * Issue one preadv or pwritev on a member image, switching the disk to
+ * buffered I/O and retrying if the host rejects a direct transfer.
+ **/
+ssize_t disk_member_transfer(Disk *disk, DiskMember *member, const struct iovec *iov, int iovcnt, off_t offset, bool write) {
+    bool    direct = __atomic_load_n(&disk->flags, __ATOMIC_RELAXED) & DISK_DIRECT;
+    ssize_t result = write ? pwritev(member->fd, iov, iovcnt, offset) : preadv(member->fd, iov, iovcnt, offset);
+    if (result < 0 && errno == EINVAL && direct && disk_set_buffered(disk)){
+        result = write ? pwritev(member->fd, iov, iovcnt, offset) : preadv(member->fd, iov, iovcnt, offset);
+    }
+    return result;
+}
+
+/**
+ * Hand a transfer to a member's thread, once it has finished the previous
+ * one (another caller may be using it); collect it with disk_member_wait.
+ **/
+void    disk_member_post(DiskMember *member, const struct iovec *iov, int iovcnt, off_t offset, bool write) {
+    pthread_mutex_lock(&member->lock);
+    while (member->state != MEMBER_IDLE){
+        pthread_cond_wait(&member->changed, &member->lock);
+    }
+    member->iov    = iov;
+    member->iovcnt = iovcnt;
+    member->offset = offset;
+    member->write  = write;
+    member->state  = MEMBER_POSTED;
+    pthread_cond_broadcast(&member->changed);
+    pthread_mutex_unlock(&member->lock);
+}
+
+/**
+ * Wait for the transfer posted to a member's thread and return its result.
+ **/
+ssize_t disk_member_wait(DiskMember *member) {
+    pthread_mutex_lock(&member->lock);
+    while (member->state != MEMBER_DONE){
+        pthread_cond_wait(&member->changed, &member->lock);
+    }
+    ssize_t result = member->result;
+    member->state  = MEMBER_IDLE;
+    pthread_cond_broadcast(&member->changed);
+    pthread_mutex_unlock(&member->lock);
+    return result;
+}
+
+/**
+ * Transfer adjacent blocks of a mirrored disk: write them to every online
+ * member in parallel, or read them from the online members (see
+ * disk_open_mirrored).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block.
+ * @param       iov         One buffer of block_size bytes per block.
+ * @param       count       Number of blocks (DISK_MAX_MERGE at most).
+ * @param       write       Whether to write (rather than read) the blocks.
+ *
+ * @return      Number of bytes transferred (DISK_FAILURE on error).
+ **/
+ssize_t disk_mirror_transfer(Disk *disk, size_t block, const struct iovec *iov, size_t count, bool write) {
+    DiskMirror *mirror = disk->mirror;
+    size_t      size   = count * disk->block_size;
+    off_t       offset = (off_t)block * disk->block_size;
+    ssize_t     result = DISK_FAILURE;
+
+    pthread_rwlock_rdlock(&mirror->lock);
+    size_t online[DISK_MAX_MEMBERS], nonline = 0;
+    for (size_t m = 0; m < disk->nmembers; m++){
+        if (__atomic_load_n(&disk->members[m].online, __ATOMIC_RELAXED)){
+            online[nonline++] = m;
+        }
+    }
+
+    if (write){
+        for (size_t i = 1; i < nonline; i++){
+            disk_member_post(&disk->members[online[i]], iov, count, offset, true);
+        }
+        ssize_t results[DISK_MAX_MEMBERS];
+        results[0] = disk_member_transfer(disk, &disk->members[online[0]], iov, count, offset, true);
+        for (size_t i = 1; i < nonline; i++){
+            results[i] = disk_member_wait(&disk->members[online[i]]);
+        }
+
+        // Members that missed a write others took drop out of sync
+        for (size_t i = 0; i < nonline; i++){
+            if (results[i] == (ssize_t)size){
+                result = size;
+            }
+        }
+        for (size_t i = 0; i < nonline && result >= 0; i++){
+            if (results[i] != (ssize_t)size){
+                disk_mirror_fail(disk, online[i]);
+            }
+        }
+        if (result >= 0){
+            disk_mirror_dirty(disk, offset, size);
+        }
+    } else if (count < 2 || nonline < 2){
+        result = disk_mirror_read(disk, iov, count, offset, size);
+    } else {
+        // Split the blocks evenly over the online members
+        size_t  parts = min(count, nonline), chunk = (count + parts - 1) / parts;
+        ssize_t results[DISK_MAX_MEMBERS];
+        for (size_t i = 1; i * chunk < count; i++){
+            DiskMember *member = &disk->members[online[i]];
+            __atomic_fetch_add(&member->inflight, 1, __ATOMIC_RELAXED);
+            disk_member_post(member, iov + i * chunk, min(chunk, count - i * chunk), offset + i * chunk * disk->block_size, false);
+        }
+        results[0] = disk_member_transfer(disk, &disk->members[online[0]], iov, chunk, offset, false);
+        for (size_t i = 1; i * chunk < count; i++){
+            DiskMember *member = &disk->members[online[i]];
+            results[i] = disk_member_wait(member);
+            __atomic_fetch_sub(&member->inflight, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&member->position, block + min(count, (i + 1) * chunk), __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&disk->members[online[0]].position, block + chunk, __ATOMIC_RELAXED);
+
+        // Read parts that failed again from the members left
+        result = size;
+        for (size_t i = 0; i * chunk < count && result >= 0; i++){
+            size_t blocks = min(chunk, count - i * chunk);
+            if (results[i] != (ssize_t)(blocks * disk->block_size)){
+                disk_mirror_fail(disk, online[i]);
+                if (disk_mirror_read(disk, iov + i * chunk, blocks, offset + i * chunk * disk->block_size,
+                                     blocks * disk->block_size) < 0){
+                    result = DISK_FAILURE;
+                }
+            }
+        }
+    }
+    pthread_rwlock_unlock(&mirror->lock);
+    return result;
+}
+
+/**
+ * Read from one online member of a mirrored disk (see disk_mirror_pick),
+ * trying the others in turn if it fails.  The caller holds the mirror lock
+ * for reading.
+ *
+ * @return      Number of bytes read (DISK_FAILURE if no member could).
+ **/
+ssize_t disk_mirror_read(Disk *disk, const struct iovec *iov, int iovcnt, off_t offset, size_t size) {
+    size_t  block  = offset / disk->block_size;
+    ssize_t picked;
+    while ((picked = disk_mirror_pick(disk, block)) >= 0){
+        DiskMember *member = &disk->members[picked];
+        __atomic_fetch_add(&member->inflight, 1, __ATOMIC_RELAXED);
+        ssize_t result = disk_member_transfer(disk, member, iov, iovcnt, offset, false);
+        __atomic_fetch_sub(&member->inflight, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&member->position, block + size / disk->block_size, __ATOMIC_RELAXED);
+        if (result == (ssize_t)size){
+            return result;
+        }
+        if (!disk_mirror_fail(disk, picked)){
+            break;
+        }
+    }
+    return DISK_FAILURE;
+}
+
+/**
+ * Choose the online member of a mirrored disk to read a block from: the one
+ * with the fewest reads in flight, and of those the one whose last read
+ * ended nearest the block.
+ *
+ * @return      Index of member (-1 if none is online).
+ **/
+ssize_t disk_mirror_pick(Disk *disk, size_t block) {
+    ssize_t best = -1;
+    size_t  best_load = 0, best_distance = 0;
+    for (size_t m = 0; m < disk->nmembers; m++){
+        DiskMember *member = &disk->members[m];
+        if (!__atomic_load_n(&member->online, __ATOMIC_RELAXED)){
+            continue;
+        }
+        size_t load     = __atomic_load_n(&member->inflight, __ATOMIC_RELAXED);
+        size_t position = __atomic_load_n(&member->position, __ATOMIC_RELAXED);
+        size_t distance = position > block ? position - block : block - position;
+        if (best < 0 || load < best_load || (load == best_load && distance < best_distance)){
+            best          = m;
+            best_load     = load;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+/**
+ * Take a member of a mirrored disk that failed a transfer offline, unless
+ * it is the last one online.  The caller holds the mirror lock for reading.
+ *
+ * @return      Whether or not the member was taken offline.
+ **/
+bool    disk_mirror_fail(Disk *disk, size_t member) {
+    DiskMirror *mirror = disk->mirror;
+    size_t      online = __atomic_load_n(&mirror->online, __ATOMIC_RELAXED);
+    do {
+        if (online < 2){
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&mirror->online, &online, online - 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (!__atomic_exchange_n(&disk->members[member].online, false, __ATOMIC_RELAXED)){
+        __atomic_fetch_add(&mirror->online, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    error("Mirror member %zu failed, taken offline", member);
+    return true;
+}
+
+/**
+ * Mark the regions a write covered dirty in the bitmaps of the members
+ * that are offline.  This runs after the write reached the online members,
+ * so a region disk_resync copied before it is copied again.
+ **/
+void    disk_mirror_dirty(Disk *disk, off_t offset, size_t size) {
+    size_t first = offset / DISK_REGION_SIZE;
+    size_t last  = (offset + size - 1) / DISK_REGION_SIZE;
+    for (size_t m = 0; m < disk->nmembers; m++){
+        DiskMember *member = &disk->members[m];
+        if (__atomic_load_n(&member->online, __ATOMIC_RELAXED)){
+            continue;
+        }
+        for (size_t r = first; r <= last; r++){
+            __atomic_fetch_or(&member->dirty[r / 64], 1ULL << (r % 64), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Copy one region of a mirrored disk from the online members to an offline
+ * one, clearing its dirty bit first so writes that race the copy set it
+ * again.  The caller holds the mirror lock.
+ *
+ * @return      Whether or not the region was copied.
+ **/
+bool    disk_mirror_copy(Disk *disk, DiskMember *target, size_t region, char *buffer) {
+    off_t  offset = (off_t)region * DISK_REGION_SIZE;
+    size_t size   = min((size_t)DISK_REGION_SIZE, disk_member_size(disk, disk->blocks) - offset);
+    __atomic_fetch_and(&target->dirty[region / 64], ~(1ULL << (region % 64)), __ATOMIC_RELAXED);
+
+    struct iovec iov = {buffer, size};
+    if (disk_mirror_read(disk, &iov, 1, offset, size) != (ssize_t)size ||
+        disk_member_transfer(disk, target, &iov, 1, offset, true) != (ssize_t)size){
+        __atomic_fetch_or(&target->dirty[region / 64], 1ULL << (region % 64), __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Member thread: issue transfers posted by disk_member_post until told to
+ * stop.
+ **/
+void *  disk_member_thread(void *arg) {
+    DiskMember *member = arg;
+    pthread_mutex_lock(&member->lock);
+    while (member->state != MEMBER_STOP){
+        if (member->state != MEMBER_POSTED){
+            pthread_cond_wait(&member->changed, &member->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&member->lock);
+        ssize_t result = disk_member_transfer(member->disk, member, member->iov, member->iovcnt, member->offset, member->write);
+        pthread_mutex_lock(&member->lock);
+        member->result = result;
+        member->state  = MEMBER_DONE;
+        pthread_cond_broadcast(&member->changed);
+    }
+    pthread_mutex_unlock(&member->lock);
+    return NULL;
+}
+
+/**
+ * Close the first opened member images of a disk, stop their threads, and
+ * release the disk's memory.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       opened      Number of members whose image was opened (their
+ *                          thread exists once the image was sized).
+ **/
+void    disk_release(Disk *disk, size_t opened) {
+    for (size_t m = 0; m < opened; m++){
+        DiskMember *member = &disk->members[m];
+        if (disk->nmembers > 1 && member->thread){
+            pthread_mutex_lock(&member->lock);
+            member->state = MEMBER_STOP;
+            pthread_cond_broadcast(&member->changed);
+            pthread_mutex_unlock(&member->lock);
+            pthread_join(member->thread, NULL);
+        }
+        pthread_mutex_destroy(&member->lock);
+        pthread_cond_destroy(&member->changed);
+        free(member->dirty);
+        close(member->fd);
+    }
+    if (disk->mirror){
+        pthread_rwlock_destroy(&disk->mirror->lock);
+        free(disk->mirror);
+    }
+    pthread_mutex_destroy(&disk->arena->lock);
+    free(disk->arena->memory);
+    free(disk->arena);
+    free(disk->members);
+    free(disk);
+}
+
+/**
+ * Turn O_DIRECT off for a disk whose host file system rejected a direct
+ * transfer (for example, blocks smaller than its sectors), on every member.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not the disk now uses buffered I/O.
+ **/
+bool    disk_set_buffered(Disk *disk) {
+    for (size_t m = 0; m < disk->nmembers; m++){
+        int fd    = disk->members[m].fd;
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || ((flags & O_DIRECT) && fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0)){
+            return false;
+        }
+    }
+    __atomic_and_fetch(&disk->flags, ~DISK_DIRECT, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Charge one operation to the disk's simulated device (see disk_set_model)
+ * and, if the model injects delays, sleep until it would complete.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block the operation starts at.
+ * @param       op          DEVICE_READ, DEVICE_WRITE or DEVICE_DISCARD.
+ **/
+void    disk_simulate(Disk *disk, size_t block, int op) {
+    DiskDevice *device = disk->device;
+    if (!device){
+        return;
+    }
+
+    DiskModel *model   = &device->model;
+    uint64_t   arrival = model->inject ? disk_clock() - device->opened : 0;
+
+    pthread_mutex_lock(&device->lock);
+    uint64_t *busy  = &device->busy[model->type == DISK_MODEL_HDD ? 0 : block % model->channels];
+    uint64_t  start = arrival > *busy ? arrival : *busy;
+    uint64_t  end   = start;
+    if (model->type == DISK_MODEL_HDD){
+        // Discards only update the drive's mapping, so they take no time
+        uint64_t transfer = model->rotation_ns / model->track_blocks;
+        if (op != DEVICE_DISCARD && block != device->head){
+            uint64_t tracks   = disk->blocks / model->track_blocks + 1;
+            uint64_t from     = device->head / model->track_blocks;
+            uint64_t to       = block / model->track_blocks;
+            uint64_t distance = from > to ? from - to : to - from;
+            if (distance){
+                end += model->seek_min_ns +
+                       (model->seek_max_ns - model->seek_min_ns) * disk_isqrt((distance << 20) / tracks) / (1 << 10);
+            }
+            uint64_t angle  = end % model->rotation_ns;
+            uint64_t target = block % model->track_blocks * transfer;
+            end += (target + model->rotation_ns - angle) % model->rotation_ns;
+        }
+        if (op != DEVICE_DISCARD){
+            end += transfer;
+            device->head = block + 1;
+        }
+    } else {
+        end += op == DEVICE_READ ? model->read_ns : model->write_ns;
+    }
+    *busy = end;
+    disk->device_ns += end - start;
+    pthread_mutex_unlock(&device->lock);
+
+    if (model->inject && end > arrival){
+        uint64_t deadline = device->opened + end;
+        struct timespec ts = {.tv_sec = deadline / 1000000000ULL, .tv_nsec = deadline % 1000000000ULL};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+}
+
+/**
+ * Read a block through the scheduler: answer it from a held write of the
+ * block, or queue it and wait for the dispatcher.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to read.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes read (DISK_FAILURE on failure).
+ **/
+ssize_t disk_queue_read(Disk *disk, size_t block, char *data) {
+    DiskQueue *queue  = disk->queue;
+    ssize_t    result = QUEUE_PENDING;
+
+    pthread_mutex_lock(&queue->lock);
+    size_t held = disk_queue_search(queue->writes, queue->nwrites, block);
+    if (held < queue->nwrites && queue->writes[held].block == block){
+        memcpy(data, queue->writes[held].data, disk->block_size);
+        pthread_mutex_unlock(&queue->lock);
+        return disk->block_size;
+    }
+
+    if (queue->nreads == queue->read_capacity){
+        size_t       capacity = queue->read_capacity ? 2 * queue->read_capacity : 16;
+        DiskRequest *reads    = realloc(queue->reads, capacity * sizeof(DiskRequest));
+        if (!reads){
+            pthread_mutex_unlock(&queue->lock);
+            return DISK_FAILURE;
+        }
+        queue->reads         = reads;
+        queue->read_capacity = capacity;
+    }
+    size_t index = disk_queue_search(queue->reads, queue->nreads, block);
+    memmove(&queue->reads[index + 1], &queue->reads[index], (queue->nreads - index) * sizeof(DiskRequest));
+    queue->reads[index] = (DiskRequest){block, data, disk_clock() + queue->options.read_expire_ns, &result};
+    queue->nreads++;
+    pthread_cond_signal(&queue->wake);
+
+    while (result == QUEUE_PENDING){
+        pthread_cond_wait(&queue->done, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return result;
+}
+
+/**
+ * Write a block through the scheduler: copy it into the queue (replacing a
+ * held write of the block), waiting for room if depth writes are held.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to write.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes written (block_size).
+ **/
+ssize_t disk_queue_write(Disk *disk, size_t block, const char *data) {
+    DiskQueue *queue = disk->queue;
+
+    pthread_mutex_lock(&queue->lock);
+    size_t index;
+    while (true){
+        index = disk_queue_search(queue->writes, queue->nwrites, block);
+        if (index < queue->nwrites && queue->writes[index].block == block){
+            memcpy(queue->writes[index].data, data, disk->block_size);
+            pthread_mutex_unlock(&queue->lock);
+            return disk->block_size;
+        }
+        if (queue->nfree){
+            break;
+        }
+        pthread_cond_signal(&queue->wake);
+        pthread_cond_wait(&queue->done, &queue->lock);
+    }
+
+    char *buffer = queue->free[--queue->nfree];
+    memcpy(buffer, data, disk->block_size);
+    memmove(&queue->writes[index + 1], &queue->writes[index], (queue->nwrites - index) * sizeof(DiskRequest));
+    queue->writes[index] = (DiskRequest){block, buffer, disk_clock() + queue->options.write_expire_ns, NULL};
+    queue->nwrites++;
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+    return disk->block_size;
+}
+
+/**
+ * Prepare to discard blocks with a scheduler attached: drop held writes of
+ * the blocks (they were issued before the discard, so it supersedes them)
+ * and wait for the transfer in progress.  Returns with the queue locked, so
+ * nothing is dispatched until the caller unlocks it.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block to be discarded.
+ * @param       count       Number of blocks to be discarded.
+ **/
+void    disk_queue_hold(Disk *disk, size_t block, size_t count) {
+    DiskQueue *queue = disk->queue;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->busy){
+        pthread_cond_wait(&queue->done, &queue->lock);
+    }
+
+    size_t first = disk_queue_search(queue->writes, queue->nwrites, block);
+    size_t last  = first;
+    while (last < queue->nwrites && queue->writes[last].block - block < count){
+        queue->free[queue->nfree++] = queue->writes[last++].data;
+    }
+    memmove(&queue->writes[first], &queue->writes[last], (queue->nwrites - last) * sizeof(DiskRequest));
+    queue->nwrites -= last - first;
+    if (last > first){
+        pthread_cond_broadcast(&queue->done);
+    }
+}
+
+/**
+ * Return index of the first request for block or a later one.
+ **/
+size_t  disk_queue_search(const DiskRequest *requests, size_t count, size_t block) {
+    size_t low = 0, high = count;
+    while (low < high){
+        size_t middle = low + (high - low) / 2;
+        if (requests[middle].block < block){
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Return index of the request with the earliest deadline (count must not
+ * be zero).
+ **/
+size_t  disk_queue_oldest(const DiskRequest *requests, size_t count) {
+    size_t oldest = 0;
+    for (size_t i = 1; i < count; i++){
+        if (requests[i].deadline < requests[oldest].deadline){
+            oldest = i;
+        }
+    }
+    return oldest;
+}
+
+/**
+ * Dispatcher thread: pick the next batch by the deadline policy (see
+ * disk_set_scheduler), take it off the queue, and transfer it.  Held writes
+ * wait (with a timeout for the oldest one's deadline) until they are due;
+ * on stop, everything queued is dispatched before the thread exits.
+ **/
+void *  disk_dispatcher(void *arg) {
+    Disk          *disk    = arg;
+    DiskQueue     *queue   = disk->queue;
+    DiskScheduler *options = &queue->options;
+    DiskRequest    batch[DISK_MAX_MERGE];
+
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->stopping || queue->nreads || queue->nwrites){
+        uint64_t now          = disk_clock();
+        size_t   oldest_read  = queue->nreads  ? disk_queue_oldest(queue->reads, queue->nreads)   : 0;
+        size_t   oldest_write = queue->nwrites ? disk_queue_oldest(queue->writes, queue->nwrites) : 0;
+        bool     write_late   = queue->nwrites && queue->writes[oldest_write].deadline <= now;
+        bool     writes_due   = queue->nwrites &&
+                                (write_late || !queue->nfree || queue->flushers || queue->stopping);
+
+        DiskRequest *requests;
+        size_t       count, start;
+        bool         write;
+        if (queue->nreads && queue->reads[oldest_read].deadline <= now){
+            write = false;
+            start = oldest_read;
+        } else if (writes_due && (!queue->nreads || queue->starved >= options->writes_starved)){
+            write = true;
+            start = write_late ? oldest_write : disk_queue_search(queue->writes, queue->nwrites, queue->position);
+        } else if (queue->nreads){
+            write = false;
+            start = disk_queue_search(queue->reads, queue->nreads, queue->position);
+        } else if (queue->nwrites){
+            struct timespec deadline = {
+                .tv_sec  = queue->writes[oldest_write].deadline / 1000000000ULL,
+                .tv_nsec = queue->writes[oldest_write].deadline % 1000000000ULL,
+            };
+            pthread_cond_timedwait(&queue->wake, &queue->lock, &deadline);
+            continue;
+        } else {
+            pthread_cond_wait(&queue->wake, &queue->lock);
+            continue;
+        }
+
+        if (write){
+            requests = queue->writes;
+            count    = queue->nwrites;
+            queue->starved = 0;
+        } else {
+            requests = queue->reads;
+            count    = queue->nreads;
+            queue->starved += writes_due;
+        }
+        if (start == count){
+            start = 0;
+        }
+
+        // Merge the run of adjacent blocks from start; direct reads can only
+        // be merged into buffers the host accepts as they are
+        bool   direct = __atomic_load_n(&disk->flags, __ATOMIC_RELAXED) & DISK_DIRECT;
+        size_t length = 1;
+        while (length < options->max_merge && start + length < count &&
+               requests[start + length].block == requests[start].block + length &&
+               (write || !direct || ((uintptr_t)requests[start].data % DISK_ALIGNMENT == 0 &&
+                                     (uintptr_t)requests[start + length].data % DISK_ALIGNMENT == 0))){
+            length++;
+        }
+        memcpy(batch, &requests[start], length * sizeof(DiskRequest));
+        memmove(&requests[start], &requests[start + length], (count - start - length) * sizeof(DiskRequest));
+        if (write){
+            queue->nwrites -= length;
+        } else {
+            queue->nreads  -= length;
+        }
+        queue->position = batch[length - 1].block + 1;
+        queue->busy     = true;
+        pthread_mutex_unlock(&queue->lock);
+
+        disk_dispatch(disk, batch, length, write);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->busy = false;
+        pthread_cond_broadcast(&queue->done);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+/**
+ * Transfer a batch of requests for adjacent blocks as one preadv or
+ * pwritev, then complete them: record reads' results, release writes'
+ * buffers, and count the transfer.  Called by the dispatcher without the
+ * queue lock; completion takes it.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       batch       Requests, in block order.
+ * @param       count       Number of requests.
+ * @param       write       Whether the requests are writes.
+ **/
+void    disk_dispatch(Disk *disk, DiskRequest *batch, size_t count, bool write) {
+    DiskQueue *queue = disk->queue;
+    size_t     size  = disk->block_size;
+    ssize_t    result;
+
+    if (count == 1){
+        result = disk_transfer(disk, batch[0].block, batch[0].data, write);
+    } else {
+        struct iovec iov[DISK_MAX_MERGE];
+        for (size_t i = 0; i < count; i++){
+            iov[i] = (struct iovec){batch[i].data, size};
+        }
+        result = disk_transfer_vector(disk, batch[0].block, iov, count, write);
+    }
+
+    bool success = result == (ssize_t)(count * size);
+    if (success){
+        __atomic_fetch_add(write ? &disk->writes : &disk->reads, 1, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < count; i++){
+            disk_simulate(disk, batch[i].block, write ? DEVICE_WRITE : DEVICE_READ);
+        }
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    for (size_t i = 0; i < count; i++){
+        if (write){
+            queue->free[queue->nfree++] = batch[i].data;
+        } else {
+            *batch[i].result = success ? (ssize_t)size : DISK_FAILURE;
+        }
+    }
+    queue->failed = queue->failed || (write && !success);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Return current monotonic time in nanoseconds.
+ **/
+uint64_t disk_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Return floor of the square root of n.
+ **/
+uint64_t disk_isqrt(uint64_t n) {
+    uint64_t root = 0;
+    for (uint64_t bit = (uint64_t)1 << 62; bit; bit >>= 2){
+        if (n >= root + bit){
+            n    -= root + bit;
+            root  = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+    return root;
+}
 
 /**
  * Perform sanity check before read or write operation by doing the following:
@@ -1,14 +1,171 @@
 /* fs.c: SimpleFS file system */
 
+#include "sfs/crc32c.h"
 #include "sfs/fs.h"
 #include "sfs/logging.h"
+#include "sfs/lz.h"
+#include "sfs/trace.h"
 #include "sfs/utils.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
 #include <unistd.h>
 
+/* Internal Constants */
+
+#define MAX_INDIRECT_LEVELS     (3)
+#define MOUNT_MAX_THREADS       (16)            /* Upper bound on inode table scan workers */
+#define MOUNT_CHUNK_BLOCKS      (8)             /* Inode blocks claimed per scan work item */
+
+/* Internal Macros */
+
+#define fs_revision1(meta)              ((meta)->revision < FS_REVISION_2)
+#define fs_block_size(meta)            ((size_t)(meta)->block_size)
+#define fs_block_index(meta, offset)    (fs_block_size(meta) == BLOCK_SIZE ? (offset) / BLOCK_SIZE : (offset) >> __builtin_ctzl(fs_block_size(meta)))
+#define fs_block_offset(meta, offset)   ((offset) & (fs_block_size(meta) - 1))
+#define fs_block_count(meta, bytes)     fs_block_index(meta, (bytes) + fs_block_size(meta) - 1)
+#define fs_checksums_per_block(meta)    (fs_block_size(meta) / sizeof(uint32_t))
+#define fs_inodes_per_block(meta)       (fs_revision1(meta) ? INODES_PER_BLOCK   : fs_block_size(meta) / (meta)->inode_size)
+#define fs_pointers_per_block(meta)     (fs_revision1(meta) ? POINTERS_PER_BLOCK : fs_block_size(meta) / sizeof(uint64_t))
+#define fs_indirect_levels(meta)        (fs_revision1(meta) ? 1 : INDIRECT_LEVELS_64)
+#define fs_inline_capacity(meta)        (((meta)->features & FS_FEATURE_INLINE_DATA) ? (meta)->inode_size - offsetof(Inode64, direct) : 0)
+#define fs_inode_inline(node)           ((node)->flags & INODE_INLINE)
+#define fs_inode_compressed(node)       ((node)->flags & INODE_COMPRESSED)
+#define fs_data_start(meta)             ((meta)->inode_blocks + (meta)->checksum_blocks + 1)
+#define fs_inode_table_blocks(meta)     ((meta)->inodes / fs_inodes_per_block(meta))
+#define fs_checksummed(meta, block)     ((block) > 0 && ((block) <= (meta)->inode_blocks || (block) >= fs_data_start(meta)))
+#define fs_pointer_block(pointer)       ((uint64_t)((pointer) & POINTER_BLOCK_MASK))
+#define fs_pointer_length(pointer)      ((uint64_t)(((pointer) & ~POINTER_COMPRESSED) >> POINTER_LENGTH_SHIFT))
+#define fs_block_shared(fs, block)      ((fs)->refcounts && (fs)->refcounts[block] > 1)
+#define fs_block_get(fs)                ((Block *)disk_buffer_get((fs)->disk))
+#define fs_block_put(fs, block)         disk_buffer_put((fs)->disk, (char *)(block))
+
+/* Internal Structures */
+
+typedef struct MapPath MapPath;
+struct MapPath {
+    size_t      depth;                          /* Number of pointer blocks on path */
+    size_t      slot;                           /* Pointer index in leaf (or direct if depth is 0) */
+    uint64_t    numbers[MAX_INDIRECT_LEVELS];   /* Disk block of each pointer block */
+    bool        dirty[MAX_INDIRECT_LEVELS];     /* Whether pointer block was modified */
+    Block      *blocks[MAX_INDIRECT_LEVELS];    /* Pointer block contents (leaf last, see fs_release_path) */
+};
+
+typedef struct IoVector IoVector;
+struct IoVector {
+    const struct iovec *iov;                    /* Current segment */
+    size_t      count;                          /* Segments left (including current) */
+    size_t      skip;                           /* Bytes of current segment already used */
+};
+
+typedef struct CheckContext CheckContext;
+struct CheckContext {
+    const CheckOptions *options;                /* Caller's check options */
+    uint64_t   *seen;                           /* Bitmap of referenced blocks (atomic) */
+    pthread_mutex_t lock;                       /* Serializes report stream */
+};
+
+typedef struct ScanWorker ScanWorker;
+struct ScanWorker {
+    FileSystem  view;                           /* Private view of fs (mount: partial bitmap) */
+    uint64_t   *next;                           /* Next unclaimed block (shared) */
+    uint64_t    last;                           /* Last block to claim */
+    void      (*scan)(ScanWorker *, uint64_t);  /* Called for each claimed inode block */
+    CheckContext *check;                        /* Shared fs_check state */
+    uint64_t   *indexed;                        /* Data blocks to index after mount (shared) */
+    CheckReport report;                         /* Per-worker fs_check counts */
+    ScrubReport scrub;                          /* Per-worker fs_scrub counts */
+    pthread_t   thread;                         /* Worker thread */
+    bool        started;                        /* Whether thread was created */
+};
+
+/* Internal Prototypes */
+
+bool    fs_read_super(Disk *disk, SuperBlock64 *meta);
+ssize_t fs_read_block(FileSystem *fs, uint64_t block, char *data);
+ssize_t fs_write_block(FileSystem *fs, uint64_t block, char *data);
+bool    fs_flush_checksums(FileSystem *fs);
+void    fs_get_inode(const SuperBlock64 *meta, Block *block, size_t index, Inode64 *node);
+void    fs_put_inode(const SuperBlock64 *meta, Block *block, size_t index, const Inode64 *node);
+char *  fs_inline_data(const SuperBlock64 *meta, Block *block, size_t index);
+uint64_t fs_get_pointer(const SuperBlock64 *meta, Block *block, size_t index);
+void    fs_set_pointer(const SuperBlock64 *meta, Block *block, size_t index, uint64_t pointer);
+uint64_t *fs_indirect_root(Inode64 *node, size_t level);
+ssize_t fs_read_inode_block(FileSystem *fs, size_t inode_number, Block *block);
+ssize_t fs_allocate_inode(FileSystem *fs);
+ssize_t fs_readv_inode(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset);
+ssize_t fs_writev_inode(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset);
+bool    fs_truncate_inode(FileSystem *fs, size_t inode_number, size_t size);
+bool    fs_fallocate_inode(FileSystem *fs, size_t inode_number, size_t offset, size_t length, uint32_t flags);
+bool    fs_save_inode(FileSystem *fs, size_t inode_number, Inode64 *node);
+bool    fs_release_inode(FileSystem *fs, size_t inode_number, Inode64 *node);
+ssize_t fs_clone_inode(FileSystem *fs, size_t inode_number, uint32_t flags);
+void    fs_share_block(FileSystem *fs, uint64_t block);
+ssize_t fs_copy_pointers(FileSystem *fs, Block *block, uint64_t number);
+int     fs_map_slot(FileSystem *fs, Inode64 *node, size_t index, bool allocate, MapPath *path, bool *allocated);
+uint64_t fs_get_slot(FileSystem *fs, Inode64 *node, MapPath *path, size_t offset);
+void    fs_set_slot(FileSystem *fs, Inode64 *node, MapPath *path, size_t offset, uint64_t pointer);
+ssize_t fs_map_block(FileSystem *fs, Inode64 *node, size_t index, bool allocate, MapPath *path, bool *allocated);
+bool    fs_commit_path(FileSystem *fs, MapPath *path);
+void    fs_release_path(FileSystem *fs, MapPath *path);
+uint64_t fs_leaf_end(const SuperBlock64 *meta, uint64_t index);
+void    fs_cluster_range(uint64_t index, uint64_t *first, size_t *count);
+char *  fs_cluster_buffer(FileSystem *fs, size_t blocks);
+bool    fs_cluster_load(FileSystem *fs, Inode64 *node, MapPath *path, size_t count, char *data, size_t offset, size_t length);
+bool    fs_cluster_store(FileSystem *fs, Inode64 *node, MapPath *path, size_t count, const char *data, size_t length, bool *dirty);
+ssize_t fs_read_clusters(FileSystem *fs, Inode64 *node, char *data, size_t length, size_t offset);
+ssize_t fs_write_clusters(FileSystem *fs, size_t inode_number, Inode64 *node, const char *data, size_t length, size_t offset);
+ssize_t fs_write_dedup(FileSystem *fs, size_t inode_number, Inode64 *node, const char *data, size_t length, size_t offset);
+bool    fs_dedup_store(FileSystem *fs, Inode64 *node, MapPath *path, const char *data, bool *dirty);
+uint64_t fs_dedup_lookup(FileSystem *fs, uint32_t hash, const char *data);
+bool    fs_dedup_insert(FileSystem *fs, uint64_t block, uint32_t hash);
+void    fs_dedup_remove(FileSystem *fs, uint64_t block);
+bool    fs_dedup_resize(DedupIndex *index, uint64_t capacity);
+void    fs_dedup_free(DedupIndex *index);
+bool    fs_inline_convert(FileSystem *fs, size_t inode_number, Inode64 *node, const char *inline_data);
+ssize_t fs_iov_length(const struct iovec *iov, int iovcnt);
+char *  fs_iov_direct(IoVector *vector, size_t length);
+void    fs_iov_copy(IoVector *vector, char *data, size_t length, bool gather);
+ssize_t fs_seek_block(FileSystem *fs, Inode64 *node, uint64_t index, bool data, uint64_t nblocks);
+ssize_t fs_seek_tree(FileSystem *fs, uint64_t block, size_t level, uint64_t first, uint64_t index, bool data, uint64_t nblocks);
+ssize_t fs_defrag_runs(FileSystem *fs, Inode64 *node, uint64_t *blocks, bool *movable);
+bool    fs_defrag_inode(FileSystem *fs, size_t inode_number, const DefragOptions *options, DefragReport *report, const struct timespec *started);
+void    fs_defrag_throttle(const DefragOptions *options, const struct timespec *started, uint64_t moved);
+ssize_t fs_allocate_block(FileSystem *fs);
+ssize_t fs_claim_run(FileSystem *fs, uint64_t count, uint64_t *length);
+bool    fs_zero_blocks(FileSystem *fs, uint64_t start, uint64_t count, bool unwritten);
+void    fs_release_block(FileSystem *fs, uint64_t block);
+bool    fs_release_tree(FileSystem *fs, uint64_t block, size_t level);
+bool    fs_truncate_tree(FileSystem *fs, uint64_t *pointer, size_t level, uint64_t first, uint64_t keep);
+void    fs_discard_block(FileSystem *fs, uint64_t block);
+void    fs_discard_flush(FileSystem *fs);
+uint64_t fs_discard_range(FileSystem *fs, uint64_t start, uint64_t end);
+int     fs_discard_compare(const void *a, const void *b);
+bool    fs_async_submit(FileSystem *fs, bool write, size_t inode_number, char *data, size_t length, size_t offset, uint64_t tag);
+void *  fs_async_worker(void *arg);
+void    fs_async_stop(FileSystem *fs);
+void    fs_async_exclude(FileSystem *fs, bool exclude);
+void    fs_mark_used(FileSystem *fs, uint64_t block);
+size_t  fs_scan_threads(uint64_t blocks);
+void *  fs_scan_worker(void *arg);
+void    fs_scan_run(ScanWorker *workers, size_t count);
+void    fs_mount_scan_block(ScanWorker *worker, uint64_t block);
+void    fs_mount_reference(ScanWorker *worker, uint64_t block, size_t level, bool index);
+void    fs_mount_scan(FileSystem *fs);
+void    fs_check_scan_block(ScanWorker *worker, uint64_t block);
+bool    fs_check_pointer(ScanWorker *worker, uint64_t inode_number, uint64_t *pointer, uint64_t index, size_t level, uint64_t nblocks);
+bool    fs_check_tree(ScanWorker *worker, uint64_t inode_number, uint64_t block, size_t level, uint64_t first, uint64_t nblocks);
+void    fs_check_problem(ScanWorker *worker, uint64_t *counter, const char *problem, int64_t inode_number, uint64_t block, bool repaired);
+void    fs_check_summary(const CheckOptions *options, const CheckReport *report);
+void    fs_scrub_scan_block(ScanWorker *worker, uint64_t block);
+void    fs_scrub_summary(const CheckOptions *options, const ScrubReport *report);
+void    fs_debug_tree(const SuperBlock64 *meta, Disk *disk, uint64_t block, size_t level);
+
 /* External Functions */
 
 /**
@@ -18,64 +175,131 @@
  *
  *  2. Read Inode Table and report information about each Inode.
  *
+ * Output is streamed directly to stdout so that memory use does not depend
+ * on the size of the file system.
+ *
  * @param       disk        Pointer to Disk structure.
  **/
 void    fs_debug(Disk *disk) {
-    Block block;
+    Block *block = (Block *)disk_buffer_get(disk);
     // Read SuperBlock
-    if (disk_read(disk, 0, block.data) == DISK_FAILURE) {
+    if (!block || disk_read(disk, 0, block->data) == DISK_FAILURE) {
+        disk_buffer_put(disk, (char *)block);
         return;
     }
+    SuperBlock   super   = block->super;
+    SuperBlock64 super64 = block->super64;
+    disk_buffer_put(disk, (char *)block);
 
     // Print SuperBlock Information
+    SuperBlock64 meta;
     printf("SuperBlock:\n");
-    if (block.super.magic_number == MAGIC_NUMBER)
+    if (super.magic_number == MAGIC_NUMBER_64) {
+        meta = super64;
+        if (meta.inode_size < INODE_SIZE_64 || meta.inode_size > MAX_INODE_SIZE || (meta.inode_size & (meta.inode_size - 1))){
+            meta.inode_size = INODE_SIZE_64;
+        }
+        meta.block_size = meta.block_size ? meta.block_size : BLOCK_SIZE;
+        if (!disk_set_block_size(disk, meta.block_size)){
+            meta.block_size = disk->block_size;
+        }
         printf("    magic number is valid\n");
-    else
-        printf("    magic number is not valid\n");
-    printf("    %u blocks\n"         , block.super.blocks);
-    printf("    %u inode blocks\n"   , block.super.inode_blocks);
-    printf("    %u inodes\n"         , block.super.inodes);
-    
+        printf("    revision %u\n"          , meta.revision);
+        printf("    %u byte blocks\n"       , meta.block_size);
+        printf("    %u byte inodes\n"       , meta.inode_size);
+        if (meta.features & FS_FEATURE_INLINE_DATA)
+            printf("    inline data enabled\n");
+        if (meta.features & FS_FEATURE_COMPRESSION)
+            printf("    compression enabled\n");
+        if (meta.features & FS_FEATURE_CHECKSUMS)
+            printf("    checksums enabled\n");
+        if (meta.features & FS_FEATURE_DEDUP)
+            printf("    dedup enabled\n");
+        if (meta.features & FS_FEATURE_REFLINK)
+            printf("    reflink enabled\n");
+        printf("    %lu blocks\n"           , meta.blocks);
+        printf("    %lu inode blocks\n"     , meta.inode_blocks);
+        if (meta.features & FS_FEATURE_CHECKSUMS)
+            printf("    %lu checksum blocks\n", meta.checksum_blocks);
+        printf("    %lu inodes\n"           , meta.inodes);
+    } else {
+        if (super.magic_number == MAGIC_NUMBER)
+            printf("    magic number is valid\n");
+        else
+            printf("    magic number is not valid\n");
+        printf("    %u blocks\n"         , super.blocks);
+        printf("    %u inode blocks\n"   , super.inode_blocks);
+        printf("    %u inodes\n"         , super.inodes);
+        meta = (SuperBlock64){
+            .magic_number = super.magic_number,
+            .revision     = FS_REVISION_1,
+            .blocks       = super.blocks,
+            .inode_blocks = super.inode_blocks,
+            .inodes       = super.inodes,
+            .inode_size   = sizeof(Inode),
+            .block_size   = BLOCK_SIZE,
+        };
+    }
+
     // Print Inode Information
-    for (uint32_t k = 1; k <= block.super.inode_blocks; k++){
-        Block block2;
+    size_t inodes_per_block = fs_inodes_per_block(&meta);
+    Block *inode_block      = (Block *)disk_buffer_get(disk);
+    for (uint64_t k = 1; inode_block && k <= meta.inode_blocks; k++){
         // Check if the inode block successfully reads
-        if (disk_read(disk, k, block2.data) == BLOCK_SIZE){
-            // Read Inodes
-            for (uint32_t i = 0; i < INODES_PER_BLOCK; i++){
-                // Check if inode is valid
-                if (block2.inodes[i].valid==1){
-                    // Print General Inode Information
-                    printf("Inode %u:\n", i);
-                    printf("    size: %u bytes\n", block2.inodes[i].size);
-                    char buffer[BUFSIZ] = {0};
-                    // Print direct blocks
-                    for (uint32_t j = 0; j < POINTERS_PER_INODE; j++){
-                        if (block2.inodes[i].direct[j] > 0)
-                            sprintf(buffer, "%s %u", buffer, block2.inodes[i].direct[j]);
-                    }
-                    printf("    direct blocks:%s\n", buffer);
-                    // Check and print indirect block
-                    if (block2.inodes[i].indirect){
-                        Block block3;
-                        printf("    indirect block: %u\n", block2.inodes[i].indirect);
-                    // Use indirect block number to disk read to get the indirect block, which is an array of pointers so you can iterate through it
-                        char indirectbuf[BUFSIZ] = {0};
-                        // Read indirect block and print pointers
-                        if(disk_read(disk, block2.inodes[i].indirect, block3.data) == BLOCK_SIZE){
-                            for (uint32_t j = 0; j < POINTERS_PER_BLOCK; j++){
-                                if (block3.pointers[j]>0){
-                                    sprintf(indirectbuf, "%s %u", indirectbuf, block3.pointers[j]);
-                                }
-                            }
-                        }
-                        printf("    indirect data blocks:%s\n", indirectbuf);
-                    }
+        if (disk_read(disk, k, inode_block->data) == DISK_FAILURE){
+            continue;
+        }
+        for (size_t i = 0; i < inodes_per_block; i++){
+            Inode64 node;
+            fs_get_inode(&meta, inode_block, i, &node);
+            if (!node.valid){
+                continue;
+            }
+
+            // Print General Inode Information
+            printf("Inode %lu:\n", (k - 1) * inodes_per_block + i);
+            printf("    size: %lu bytes\n", node.size);
+            if (fs_inode_inline(&node))
+                printf("    inline data\n");
+            if (fs_inode_compressed(&node))
+                printf("    compressed\n");
+            if (node.flags & INODE_READONLY)
+                printf("    read-only\n");
+            if (node.flags & INODE_SNAPSHOT)
+                printf("    snapshot\n");
+            printf("    direct blocks:");
+            for (size_t j = 0; j < POINTERS_PER_INODE; j++){
+                if (fs_pointer_block(node.direct[j]))
+                    printf(" %lu", fs_pointer_block(node.direct[j]));
+            }
+            printf("\n");
+
+            // Print indirect trees
+            static const char *Names[] = {"indirect", "double indirect", "triple indirect"};
+            for (size_t level = 1; level <= fs_indirect_levels(&meta); level++){
+                uint64_t root = *fs_indirect_root(&node, level);
+                if (!root){
+                    continue;
                 }
+                printf("    %s block: %lu\n", Names[level - 1], root);
+                printf("    %s data blocks:", Names[level - 1]);
+                fs_debug_tree(&meta, disk, root, level);
+                printf("\n");
             }
         }
     }
+    disk_buffer_put(disk, (char *)inode_block);
+}
+
+/**
+ * Format Disk using default options (see fs_format_ex).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       disk    Pointer to Disk structure.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool    fs_format(FileSystem *fs, Disk *disk) {
+    return fs_format_ex(fs, disk, NULL);
 }
 
 /**
@@ -86,61 +310,133 @@ void    fs_debug(Disk *disk) {
  *
  *  2. Clear all remaining blocks.
  *
+ * Revision 1 reserves 10% of the blocks for inodes and clears every block.
+ * Revision 2 sizes the inode table from the inode ratio (bytes of disk per
+ * inode) and only clears the inode table, since data blocks are never read
+ * before they are allocated and written.  Without options, revision 1 is used
+ * whenever the disk fits in 32-bit block numbers.
+ *
+ * With max_blocks, revision 2 sizes the inode table and checksum region for
+ * a disk of that many blocks, but only puts the inodes for the current size
+ * in use, so that fs_grow can later add inodes and checksums in place.
+ *
+ * Revision 2 may also pick its geometry: block_size (a power of two from
+ * MIN_BLOCK_SIZE to MAX_BLOCK_SIZE) and an explicit number of inodes, which
+ * is rounded up to whole inode blocks and overrides inode_ratio.  The disk
+ * is switched to the chosen block size (see disk_set_block_size), so its
+ * number of blocks is counted in those blocks.  Compression needs blocks of
+ * at most MAX_COMPRESSED_BLOCK_SIZE, since cluster lengths are kept in the
+ * spare bits of block pointers.
+ *
  * Note: Do not format a mounted Disk!
  *
  * @param       fs      Pointer to FileSystem structure.
  * @param       disk    Pointer to Disk structure.
+ * @param       options Format options (NULL for defaults).
  * @return      Whether or not all disk operations were successful.
  **/
-bool    fs_format(FileSystem *fs, Disk *disk) {
-    //printf("\n\n%d\n\n",disk->blocks);
-    //printf("\n\n%d\n\n",fs->meta_data.blocks);
-    if (fs->disk){
+bool    fs_format_ex(FileSystem *fs, Disk *disk, const FormatOptions *options) {
+    uint32_t block_size  = (options && options->block_size)  ? options->block_size  : BLOCK_SIZE;
+    if (fs->disk || !disk || !disk_set_block_size(disk, block_size) || disk->blocks < 2){
         return false;
     }
-    Block block;
-    block.super.magic_number = MAGIC_NUMBER;
-    block.super.blocks = disk->blocks;
-    if (disk->blocks%10 == 0){
-        block.super.inode_blocks = disk->blocks/10;
-    }
-    else{
-        block.super.inode_blocks = (int)disk->blocks/10 + 1;
+
+    uint32_t revision    = options ? options->revision : 0;
+    uint64_t inode_ratio = (options && options->inode_ratio) ? options->inode_ratio : DEFAULT_INODE_RATIO;
+    uint32_t inode_size  = (options && options->inode_size)  ? options->inode_size  : INODE_SIZE_64;
+    uint32_t features    = options ? options->features : 0;
+    uint64_t reserve     = options ? max(options->max_blocks, disk->blocks) : disk->blocks;
+    uint64_t inodes      = options ? options->inodes : 0;
+    if (!revision){
+        bool legacy = disk->blocks <= UINT32_MAX && !features && inode_size == INODE_SIZE_64 && reserve == disk->blocks &&
+                      block_size == BLOCK_SIZE && !inodes;
+        revision = legacy ? FS_REVISION_1 : FS_REVISION_2;
     }
-    block.super.inodes = block.super.inode_blocks*INODES_PER_BLOCK;
 
-    if(disk_write(disk, 0, block.data)==DISK_FAILURE){
+    Block *block = (Block *)disk_buffer_get(disk);
+    if (!block){
         return false;
     }
-    
-    for(uint32_t a = 1; a <= block.super.inode_blocks; a++){
-        Block block2;
-        //clear the inode blocks
-        for (uint32_t d = 0; d < INODES_PER_BLOCK; d++){
-            block2.inodes[d].valid = 0;
-            block2.inodes[d].size = 0;
-            for (uint32_t e = 0; e < POINTERS_PER_INODE; e++){
-                block2.inodes[d].direct[e] = 0;
-            }
-            block2.inodes[d].indirect = 0;
+    memset(block->data, 0, block_size);
+    bool result = false;
+
+    if (revision == FS_REVISION_1){
+        if (disk->blocks > UINT32_MAX || features || reserve > disk->blocks || block_size != BLOCK_SIZE || inodes){
+            disk_buffer_put(disk, block->data);
+            return false;
+        }
+        block->super.magic_number = MAGIC_NUMBER;
+        block->super.blocks       = disk->blocks;
+        block->super.inode_blocks = (disk->blocks + 9) / 10;
+        block->super.inodes       = block->super.inode_blocks * INODES_PER_BLOCK;
+    } else if (revision == FS_REVISION_2){
+        if (inode_ratio < 128 || inode_size < INODE_SIZE_64 || inode_size > MAX_INODE_SIZE ||
+            (inode_size & (inode_size - 1)) || (features & ~FS_FEATURES_SUPPORTED) ||
+            ((features & FS_FEATURE_COMPRESSION) && (disk->blocks > POINTER_BLOCK_MASK || block_size > MAX_COMPRESSED_BLOCK_SIZE)) ||
+            reserve > (uint64_t)INT64_MAX / block_size || inodes / (block_size / inode_size) >= disk->blocks){
+            disk_buffer_put(disk, block->data);
+            return false;
+        }
+        uint64_t inodes_per_block = block_size / inode_size;
+        uint64_t checksums_per_block = block_size / sizeof(uint32_t);
+        if (inodes){
+            inode_ratio = max((disk->blocks * block_size) / inodes, 1);
         }
-        if(disk_write(disk, a, block2.data)==DISK_FAILURE){
+        inodes                = max(inodes, max((disk->blocks * block_size) / inode_ratio, 1));
+        uint64_t reserved     = max((reserve * block_size) / inode_ratio, inodes);
+        uint64_t inode_blocks = (reserved + inodes_per_block - 1) / inodes_per_block;
+        uint64_t checksum_blocks = (features & FS_FEATURE_CHECKSUMS) ? (reserve + checksums_per_block - 1) / checksums_per_block : 0;
+        if (inode_blocks + checksum_blocks + 1 >= disk->blocks){
+            disk_buffer_put(disk, block->data);
             return false;
         }
+        block->super64.magic_number = MAGIC_NUMBER_64;
+        block->super64.revision     = FS_REVISION_2;
+        block->super64.blocks       = disk->blocks;
+        block->super64.inode_blocks = inode_blocks;
+        block->super64.inodes       = (inodes + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+        block->super64.inode_ratio  = inode_ratio;
+        block->super64.inode_size   = inode_size;
+        block->super64.features     = features;
+        block->super64.checksum_blocks = checksum_blocks;
+        block->super64.block_size   = block_size;
+    } else {
+        disk_buffer_put(disk, block->data);
+        return false;
+    }
+
+    if(disk_write(disk, 0, block->data)==DISK_FAILURE){
+        disk_buffer_put(disk, block->data);
+        return false;
+    }
+
+    // Clear the inode table (and, for revision 1, the data blocks)
+    uint64_t inode_blocks    = block->super64.inode_blocks;
+    uint64_t checksum_blocks = revision == FS_REVISION_1 ? 0 : block->super64.checksum_blocks;
+    uint64_t clear           = revision == FS_REVISION_1 ? disk->blocks : inode_blocks + 1;
+    memset(block->data, 0, block_size);
+    result = true;
+    for (uint64_t b = 1; result && b < clear; b++){
+        if(disk_write(disk, b, block->data)==DISK_FAILURE){
+            result = false;
+        }
     }
 
-    for (uint32_t b = block.super.inode_blocks+1; b < block.super.blocks; b++){
-        Block block3;
-        //clear the data blocks
-        for (uint32_t c = 0; c < BLOCK_SIZE; c++){
-            block3.data[c] = 0;
+    // Record checksums of the cleared inode table (data blocks get theirs when written)
+    uint32_t  zero    = crc32c(0, block->data, block_size);
+    uint32_t *entries = (uint32_t *)block->data;        /* block_size / 4 of them */
+    for (uint64_t c = 0; result && c < checksum_blocks; c++){
+        for (uint64_t i = 0; i < block_size / sizeof(uint32_t); i++){
+            uint64_t b = c * (block_size / sizeof(uint32_t)) + i;
+            entries[i] = (b > 0 && b <= inode_blocks) ? zero : 0;
         }
-        if(disk_write(disk, b, block3.data)==DISK_FAILURE){
-            return false;
+        if(disk_write(disk, inode_blocks + 1 + c, block->data)==DISK_FAILURE){
+            result = false;
         }
     }
 
-    return true;
+    disk_buffer_put(disk, block->data);
+    return result;
 }
 
 /**
@@ -148,12 +444,18 @@ bool    fs_format(FileSystem *fs, Disk *disk) {
  *
  *  1. Read and check SuperBlock (verify attributes).
  *
- *  2. Verify and record FileSystem disk attribute. 
+ *  2. Verify and record FileSystem disk attribute.
  *
  *  3. Copy SuperBlock to FileSystem meta data attribute
  *
  *  4. Initialize FileSystem free blocks bitmap.
  *
+ * The inode table is scanned by a pool of worker threads (see
+ * fs_mount_scan), so inode and indirect block reads for different
+ * parts of the table are in flight at the same time.  When blocks may be
+ * shared (dedup or reflink), the scan also counts the references to every
+ * block and rebuilds the content index, which are only kept in memory.
+ *
  * Note: Do not mount a Disk that has already been mounted!
  *
  * @param       fs      Pointer to FileSystem structure.
@@ -161,68 +463,87 @@ bool    fs_format(FileSystem *fs, Disk *disk) {
  * @return      Whether or not the mount operation was successful.
  **/
 bool    fs_mount(FileSystem *fs, Disk *disk) {
+    if(fs->disk || !disk){
+        return false;
+    }
 
-    //printf("\nMOUNT ENTER\n");
-    if(fs->disk){
+    // Read and verify SuperBlock, then address the disk in its blocks
+    SuperBlock64 meta;
+    if (!fs_read_super(disk, &meta) || !disk_set_block_size(disk, meta.block_size)){
         return false;
     }
 
-    // Read SuperBlock
-    Block block;
-    if(disk_read(disk, 0, block.data)==DISK_FAILURE){
-        //printf("\n\nHELLO FAILURE\n\n");
-        disk->reads++;
+    // Build free block bitmap: everything past the inode table starts free
+    size_t    words  = BITMAP_WORDS(meta.blocks);
+    uint64_t *bitmap = malloc(words * sizeof(uint64_t));
+    if (!bitmap){
         return false;
     }
+    memset(bitmap, 0xff, words * sizeof(uint64_t));
+    if (meta.blocks % 64){
+        bitmap[words - 1] = (1ULL << (meta.blocks % 64)) - 1;
+    }
+    for (uint64_t b = 0; b < fs_data_start(&meta); b++){
+        bitmap_clear(bitmap, b);
+    }
 
-    fs->disk = disk;
-    // Copy Superblock to meta_data
-    fs->meta_data = block.super;
-
-    bool *bitmap = calloc(block.super.blocks, sizeof(bool));
-    for (int a = 0; a < block.super.blocks; a++){
-        bitmap[a] = true;
-    }
-    bitmap[0]=false;
-    //printf("\n\nSET UP BITMAP\n\n");
-    for (uint32_t i = 1; i <= block.super.inode_blocks; i++){
-        Block block2;
-        //printf("\n\nINODE BLOCK %i\n\n", i);
-        if(disk_read(disk, i, block2.data)==BLOCK_SIZE){
-            for (uint32_t j = 0; j < INODES_PER_BLOCK; j++){
-                //printf("\n\nValid: %i\n\n", block2.inodes[j].valid);
-                if (block2.inodes[j].valid==1){
-                    //printf("\n\nVALID INODE %u\n\n", j);
-                    for (uint32_t k = 0; k < POINTERS_PER_INODE; k++){
-                        if(block2.inodes[j].direct[k]>0){
-                            //printf("\n\nDIRECT %u\n\n",block2.inodes[j].direct[k]);
-                            bitmap[block2.inodes[j].direct[k]]=false;
-                        }
-                    }
-                    //printf("\n\nBut does it make it here?\n\n");
-                    if (block2.inodes[j].indirect){
-                        Block block3;
-                        bitmap[block2.inodes[j].indirect]=false;
-                        if(disk_read(disk,block2.inodes[j].indirect,block3.data)==BLOCK_SIZE){
-                            for (uint32_t m = 0; m < POINTERS_PER_BLOCK; m++){
-                                if(block3.pointers[m]>0){
-                                    bitmap[block3.pointers[m]]=false;
-                                }
-                            }
-                        }
-                    }
-                }
+    // Load block checksums so that every read below is verified
+    uint32_t *checksums = NULL;
+    uint64_t *dirty     = NULL;
+    if (meta.checksum_blocks){
+        checksums = malloc(meta.checksum_blocks * meta.block_size);
+        dirty     = calloc(BITMAP_WORDS(meta.checksum_blocks), sizeof(uint64_t));
+        for (uint64_t c = 0; checksums && c < meta.checksum_blocks; c++){
+            if (disk_read(disk, meta.inode_blocks + 1 + c, (char *)checksums + c * meta.block_size) == DISK_FAILURE){
+                free(checksums);
+                checksums = NULL;
+            }
+        }
+        if (!checksums || !dirty){
+            free(checksums);
+            free(dirty);
+            free(bitmap);
+            return false;
+        }
+    }
+
+    // Reference counts and the content index are rebuilt by the scan below
+    uint32_t   *refcounts = NULL;
+    DedupIndex *dedup     = NULL;
+    if (meta.features & FS_FEATURES_SHARED){
+        refcounts = calloc(meta.blocks, sizeof(uint32_t));
+        if (meta.features & FS_FEATURE_DEDUP){
+            dedup = calloc(1, sizeof(DedupIndex));
+            if (dedup){
+                dedup->hashes   = calloc(meta.blocks, sizeof(uint32_t));
+                dedup->indexed  = calloc(BITMAP_WORDS(meta.blocks), sizeof(uint64_t));
+                dedup->slots    = calloc(DEDUP_MIN_SLOTS, sizeof(uint64_t));
+                dedup->capacity = DEDUP_MIN_SLOTS;
             }
-            bitmap[i]=false;
+        }
+        if (!refcounts || ((meta.features & FS_FEATURE_DEDUP) && (!dedup || !dedup->hashes || !dedup->indexed || !dedup->slots))){
+            fs_dedup_free(dedup);
+            free(refcounts);
+            free(dirty);
+            free(checksums);
+            free(bitmap);
+            return false;
         }
     }
-    fs->free_blocks = bitmap;
-    /*printf("\n\n%i\n\n",fs->free_blocks[0]);
-    printf("\n\n%i\n\n",fs->free_blocks[1]);
-    printf("\n\n%i\n\n",fs->free_blocks[2]);
-    printf("\n\n%i\n\n",fs->free_blocks[3]);
-    printf("\n\n%i\n\n",fs->free_blocks[4]);*/
-    //printf("\nEND OF MOUNT\n");
+
+    fs->disk            = disk;
+    fs->meta_data       = meta;
+    fs->free_blocks     = bitmap;
+    fs->free_hint       = 0;
+    fs->checksums       = checksums;
+    fs->dirty_checksums = dirty;
+    fs->refcounts       = refcounts;
+    fs->dedup           = dedup;
+    fs->discard         = NULL;
+    fs->async           = NULL;
+
+    // Mark blocks referenced by valid inodes as in use
+    fs_mount_scan(fs);
     return true;
 }
 
@@ -236,450 +557,4264 @@ bool    fs_mount(FileSystem *fs, Disk *disk) {
  * @param       fs      Pointer to FileSystem structure.
  **/
 void    fs_unmount(FileSystem *fs) {
+    fs_async_stop(fs);
+    fs_set_discard(fs, DISCARD_NONE);
+    if (fs->disk){
+        fs_flush_checksums(fs);
+        disk_flush(fs->disk);
+    }
     fs->disk = NULL;
     free(fs->free_blocks);
     fs->free_blocks=NULL;
+    free(fs->checksums);
+    fs->checksums=NULL;
+    free(fs->dirty_checksums);
+    fs->dirty_checksums=NULL;
+    free(fs->refcounts);
+    fs->refcounts=NULL;
+    fs_dedup_free(fs->dedup);
+    fs->dedup=NULL;
 }
 
 /**
- * Allocate an Inode in the FileSystem Inode table by doing the following:
+ * Set how blocks freed on the mounted FileSystem are discarded (punched out
+ * of the disk image so the host can reclaim them):
  *
- *  1. Search Inode table for free inode.
+ *  - DISCARD_NONE: freed blocks keep their contents (the default).
  *
- *  2. Reserve free inode in Inode table.
+ *  - DISCARD_SYNC: each block is discarded as soon as it is freed.
  *
- * Note: Be sure to record updates to Inode table to Disk.
+ *  - DISCARD_BATCH: freed blocks are queued as runs (adjacent frees extend
+ *  the last run) and discarded once the queue fills, on fs_trim, or on
+ *  unmount.  A queued block that is allocated again before then is skipped.
  *
- * @param       fs      Pointer to FileSystem structure.
- * @return      Inode number of allocated Inode.
+ * Leaving batch mode flushes the queue.  The mode only lasts until unmount.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       mode            DISCARD_* mode.
+ * @return      Whether or not the mode was set.
  **/
-ssize_t fs_create(FileSystem *fs) {
+bool    fs_set_discard(FileSystem *fs, uint32_t mode) {
+    if (!fs->disk || mode > DISCARD_BATCH){
+        return false;
+    }
 
-    // Problem: This should work, but all of the inodes are valid?
-    
-    //printf("\nYO YO\n");
-    for (uint32_t i = 1; i <= fs->meta_data.inode_blocks; i++){
-        Block block;
-        //printf("\ni: %i\n",i);
-        if (disk_read(fs->disk,i,block.data)==BLOCK_SIZE){
-            for (uint32_t j = 0; j < INODES_PER_BLOCK; j++){
-                //printf("\nj: %i\n",j);
-                //printf("\nVALID: %i\n",block.inodes[i].valid);
-                if (block.inodes[j].valid==0){
-                    //printf("\nHello I'm Valid\n");
-                    block.inodes[j].valid=1;
-                    block.inodes[j].size=0;
-                    
-                    if(disk_write(fs->disk,i,block.data)==DISK_FAILURE){
-                        return -1;
-                    }
-                    
-                    //printf("\nj: %i\n",j);
-                    fs->disk->reads++;
-                    return (i-1) * INODES_PER_BLOCK + j;
-                }
-            }
-        }
+    fs_discard_flush(fs);
+    if (mode == DISCARD_NONE){
+        free(fs->discard);
+        fs->discard = NULL;
+        return true;
     }
-    return -1;
+    if (!fs->discard && !(fs->discard = calloc(1, sizeof(DiscardQueue)))){
+        return false;
+    }
+    fs->discard->mode = mode;
+    return true;
 }
 
 /**
- * Remove Inode and associated data from FileSystem by doing the following:
+ * Discard every free data block of the mounted FileSystem (like fstrim),
+ * one disk_discard per run of free blocks, after flushing any queued
+ * discards.  This works whatever the discard mode is.
  *
- *  1. Load and check status of Inode.
+ * @param       fs              Pointer to FileSystem structure.
+ * @return      Number of blocks discarded (-1 on error).
+ **/
+ssize_t fs_trim(FileSystem *fs) {
+    if (!fs->disk){
+        return -1;
+    }
+    fs_discard_flush(fs);
+    return fs_discard_range(fs, fs_data_start(&fs->meta_data), fs->meta_data.blocks);
+}
+
+/**
+ * Grow mounted FileSystem to the given number of blocks without
+ * reformatting by doing the following:
  *
- *  2. Release any direct blocks.
+ *  1. Extend the disk image (sparsely) to hold the new blocks.
  *
- *  3. Release any indirect blocks.
+ *  2. Write the SuperBlock with the new size (the only on-disk change).
  *
- *  4. Mark Inode as free in Inode table.
+ *  3. Extend the free block bitmap and reference counts to cover the new
+ *  blocks, which start out free.
+ *
+ * Existing blocks are never read or moved, so this takes time in proportion
+ * to the added space.  The inode table and checksum region sit in front of
+ * the data and cannot grow into it, so they only use what format reserved
+ * (FormatOptions.max_blocks): revision 2 file systems put more of their
+ * inode table in use to keep their inode ratio, and checksummed ones cannot
+ * grow past the blocks their checksum region covers.  Revision 1 keeps its
+ * inodes and may grow up to 32-bit block numbers.
+ *
+ * Note: Reopen the grown disk with its new number of blocks.
  *
  * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to remove.
- * @return      Whether or not removing the specified Inode was successful.
+ * @param       blocks          New number of blocks (>= current).
+ * @return      Whether or not the file system now has that many blocks.
  **/
-bool    fs_remove(FileSystem *fs, size_t inode_number) {
-    Block block;
-    size_t inode_block = (size_t)((int)(inode_number/INODES_PER_BLOCK)+1);
-    //printf("\n\nINODE BLOCK: %zu\n\n",inode_block);
-    if (disk_read(fs->disk,inode_block,block.data)==DISK_FAILURE){
+bool    fs_grow(FileSystem *fs, uint64_t blocks) {
+    SuperBlock64 meta = fs->meta_data;
+    if (!fs->disk || blocks < meta.blocks){
         return false;
     }
-    if (block.inodes[inode_number].valid==1){
-        for (uint32_t i = 0; i < POINTERS_PER_INODE; i++){
-            if(block.inodes[inode_number].direct[i]>0){
-                fs->free_blocks[block.inodes[inode_number].direct[i]] = true;
-                block.inodes[inode_number].direct[i] = 0;
-                //fs->free_blocks[block.inodes[inode_number].direct[i]] = true;
-            }
-        }
-        if(block.inodes[inode_number].indirect){
-            Block block2;
-            if(disk_read(fs->disk,block.inodes[inode_number].indirect,block2.data)==DISK_FAILURE){
-                return false;
-            }
-            for (uint32_t m = 0; m < POINTERS_PER_BLOCK; m++){
-                if(block2.pointers[m]>0){
-                    //printf("\n\nINDIRECT DATA BLOCK: %u\n\n",block2.pointers[m]);
-                    fs->free_blocks[block2.pointers[m]]=true;
-                    block.pointers[m] = 0;
-                }
-            }
-            fs->free_blocks[block.inodes[inode_number].indirect] = true;
-            block.inodes[inode_number].indirect = 0;
-        }
-        //fs->free_blocks[block.inodes[inode_number].indirect] = true;
-        //printf("\n\nChange valid to 0\n\n");
-        block.inodes[inode_number].valid = 0;
-        block.inodes[inode_number].size = 0;
-        if(disk_write(fs->disk,inode_block,block.data)==DISK_FAILURE){
-            return false;
-        };
-        //fs->disk->reads++;
-        return true;
+    if ((fs_revision1(&meta) && blocks > UINT32_MAX) ||
+        (meta.checksum_blocks && blocks > meta.checksum_blocks * fs_checksums_per_block(&meta)) ||
+        ((meta.features & FS_FEATURE_COMPRESSION) && blocks > POINTER_BLOCK_MASK)){
+        return false;
     }
-    return false;
-}
 
-/**
- * Return size of specified Inode.
- *
- * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to remove.
- * @return      Size of specified Inode (-1 if does not exist).
- **/
-ssize_t fs_stat(FileSystem *fs, size_t inode_number) {
-    Block block;
-    ssize_t inodeSize;
-    size_t inode_block = (size_t)((int)(inode_number/INODES_PER_BLOCK)+1);
-    if (disk_read(fs->disk,inode_block,block.data)==DISK_FAILURE){
-        return -1;
+    // Put more of a reserved inode table in use
+    meta.blocks = blocks;
+    if (!fs_revision1(&meta)){
+        uint64_t inodes_per_block = fs_inodes_per_block(&meta);
+        uint64_t inodes = max((blocks * meta.block_size) / meta.inode_ratio, 1);
+        inodes      = (inodes + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+        meta.inodes = min(max(inodes, meta.inodes), meta.inode_blocks * inodes_per_block);
     }
-    if (block.inodes[inode_number].valid==0){
-        return -1;
+
+    Block *block = fs_block_get(fs);
+    if (!block){
+        return false;
     }
-    if (inode_number > fs->meta_data.inode_blocks*INODES_PER_BLOCK){
-        return -1;
+    memset(block->data, 0, fs_block_size(&meta));
+    if (fs_revision1(&meta)){
+        block->super = (SuperBlock){MAGIC_NUMBER, blocks, meta.inode_blocks, meta.inodes};
+    } else {
+        block->super64 = meta;
+    }
+
+    // Workers may be using the bitmap and reference counts being resized
+    fs_async_exclude(fs, true);
+    size_t    words   = BITMAP_WORDS(blocks);
+    uint64_t *bitmap  = realloc(fs->free_blocks, words * sizeof(uint64_t));
+    bool      resized = bitmap != NULL;
+    fs->free_blocks   = bitmap ? bitmap : fs->free_blocks;
+    if (resized && fs->refcounts){
+        uint32_t *refcounts = realloc(fs->refcounts, blocks * sizeof(uint32_t));
+        resized       = refcounts != NULL;
+        fs->refcounts = refcounts ? refcounts : fs->refcounts;
+    }
+    if (resized && fs->dedup){
+        uint32_t *hashes  = realloc(fs->dedup->hashes, blocks * sizeof(uint32_t));
+        resized           = hashes != NULL;
+        fs->dedup->hashes = hashes ? hashes : fs->dedup->hashes;
+    }
+    if (resized && fs->dedup){
+        uint64_t *indexed  = realloc(fs->dedup->indexed, words * sizeof(uint64_t));
+        resized            = indexed != NULL;
+        fs->dedup->indexed = indexed ? indexed : fs->dedup->indexed;
+    }
+    bool written = resized && disk_grow(fs->disk, blocks) && disk_write(fs->disk, 0, block->data) != DISK_FAILURE;
+    fs_block_put(fs, block);
+    if (!written){
+        fs_async_exclude(fs, false);
+        return false;
+    }
+
+    // The new blocks start out free and unshared
+    uint64_t old = fs->meta_data.blocks;
+    for (uint64_t b = old; b < blocks && b % 64; b++){
+        bitmap_set(bitmap, b);
+    }
+    for (size_t w = (old + 63) / 64; w < words; w++){
+        bitmap[w] = ((w + 1) * 64 <= blocks) ? ~0ULL : (1ULL << (blocks % 64)) - 1;
     }
-    inodeSize = block.inodes[inode_number].size;
-    return inodeSize;
+    if (fs->refcounts){
+        memset(fs->refcounts + old, 0, (blocks - old) * sizeof(uint32_t));
+    }
+    if (fs->dedup){
+        size_t used = BITMAP_WORDS(old);
+        memset(fs->dedup->hashes + old, 0, (blocks - old) * sizeof(uint32_t));
+        memset(fs->dedup->indexed + used, 0, (words - used) * sizeof(uint64_t));
+    }
+    fs->meta_data = meta;
+    fs_async_exclude(fs, false);
+    return true;
 }
 
 /**
- * Read from the specified Inode into the data buffer exactly length bytes
- * beginning from the specified offset by doing the following:
+ * Check consistency of mounted FileSystem by doing the following:
  *
- *  1. Load Inode information.
+ *  1. Scan the inode table in parallel, claiming each referenced block in a
+ *  shared bitmap and reporting out of range pointers, duplicate references,
+ *  data blocks mapped past end of file, and unreadable blocks.
  *
- *  2. Continuously read blocks and copy data to buffer.
+ *  2. Compare referenced blocks with the free block bitmap to find leaked
+ *  blocks (in use but not referenced) and unmarked blocks (referenced but
+ *  free, so they could be handed out twice).
  *
- *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  3. Stream a summary.
+ *
+ * Problems are streamed as they are found, so their order varies when
+ * several workers run.  Repair clears bad pointers on disk and fixes the
+ * free block bitmap; it uses a single worker so that the first reference in
+ * inode order keeps a duplicated block.
  *
  * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to read data from.
- * @param       data            Buffer to copy data to.
- * @param       length          Number of bytes to read.
- * @param       offset          Byte offset from which to begin reading.
- * @return      Number of bytes read (-1 on error).
+ * @param       options         Check options (repair, JSON, report stream).
+ * @param       report          Problem counts.
+ * @return      Whether or not the file system is consistent (after repairs).
  **/
-ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
-    //printf("\n\nENTERED READ\n\n");
-    Block block;
-    size_t inode_block = (size_t)((int)(inode_number/INODES_PER_BLOCK)+1);
-    if (inode_block>fs->meta_data.inode_blocks){
-        return -1;
+bool    fs_check(FileSystem *fs, const CheckOptions *options, CheckReport *report) {
+    if (!fs->disk || !options || !report){
+        return false;
     }
-    //printf("\n\nINODE BLOCK: %u\n\n", inode_block);
-    if (disk_read(fs->disk,inode_block,block.data)==DISK_FAILURE){
-        //printf("\n\nSTILL NOT READING\n\n");
-        return -1;
+
+    size_t       words   = BITMAP_WORDS(fs->meta_data.blocks);
+    CheckContext context = {.options = options, .seen = calloc(words, sizeof(uint64_t))};
+    if (!context.seen){
+        return false;
     }
-    if (offset>=block.inodes[inode_number].size){
-        return -1;
+    pthread_mutex_init(&context.lock, NULL);
+
+    // Walk every inode
+    ScanWorker workers[MOUNT_MAX_THREADS] = {{{0}}};
+    uint64_t   next  = 1;
+    size_t     count = options->repair ? 1 : fs_scan_threads(fs_inode_table_blocks(&fs->meta_data));
+    for (size_t w = 0; w < count; w++){
+        workers[w].view  = *fs;
+        workers[w].next  = &next;
+        workers[w].last  = fs_inode_table_blocks(&fs->meta_data);
+        workers[w].scan  = fs_check_scan_block;
+        workers[w].check = &context;
     }
-    ssize_t bytesread = 0;
-    //printf("\n\nIT READ PROPERLY\n\n");
-    //printf("\n\nSIZE OF FILE: %u\n\n",block.inodes[inode_number].size);
-    if (block.inodes[inode_number].valid==1){
-        for (uint32_t m = offset/BLOCK_SIZE; m < POINTERS_PER_INODE; m++){
-            if (block.inodes[inode_number].direct[m]>0){
-                Block block2;
-                //printf("\n\nDIRECT BLOCK: %u\n\n",block.inodes[inode_number].direct[m]);
-                if (disk_read(fs->disk,block.inodes[inode_number].direct[m],block2.data)==DISK_FAILURE){
-                    return -1;
-                }
-                else{
-                    //printf("\n\n BYTES READ: %zu\n\n",bytesread);
-                    if (bytesread+BLOCK_SIZE<=block.inodes[inode_number].size && bytesread+BLOCK_SIZE<=length){
-                        //printf("\n\nFIRST MEMCPY\n\n");
-                        memcpy(data+bytesread,block2.data,BLOCK_SIZE);
-                        bytesread += BLOCK_SIZE;
-                    }
-                    else if (bytesread+BLOCK_SIZE>block.inodes[inode_number].size){
-                        //printf("\n\nHIT MEMCPY DIRECT\n\n");
-                        memcpy(data+bytesread,block2.data,block.inodes[inode_number].size-bytesread);
-                        bytesread += block.inodes[inode_number].size-bytesread;
-                        return bytesread;
-                    }
-                    else{
-                        return bytesread;
-                    }
-                }
-            }
+    fs_scan_run(workers, count);
+    fs_flush_checksums(fs);
+
+    // Compare referenced blocks with free block bitmap (data region only)
+    uint64_t low  = fs_data_start(&fs->meta_data);
+    uint64_t high = fs->meta_data.blocks;
+    for (size_t w = low / 64; w < words; w++){
+        uint64_t mask = ~0ULL;
+        if (w * 64 < low){
+            mask &= ~0ULL << (low - w * 64);
         }
-        uint32_t offnum = offset/BLOCK_SIZE;
-        if (offnum!=0){
-            offnum -= POINTERS_PER_INODE;
+        if (w * 64 + 64 > high){
+            mask &= (1ULL << (high - w * 64)) - 1;
         }
-        //printf("\n\nOFFNUM: %i\n\n",offnum);
-        Block block3;
-        if(disk_read(fs->disk,block.inodes[inode_number].indirect,block3.data)==BLOCK_SIZE){
-            for (uint32_t n = offnum; n < POINTERS_PER_BLOCK; n++){
-                if (block3.pointers[n]){
-                    Block block4;
-                    //printf("\n\nINDIRECT BLOCK: %u\n\n",block3.pointers[n]);
-                    if (disk_read(fs->disk,block3.pointers[n],block4.data)==DISK_FAILURE){
-                        return -1;
-                    }
-                    else{
-                        //printf("\n\n BYTES READ: %zu\n\n",bytesread);
-                        if (bytesread+BLOCK_SIZE<=block.inodes[inode_number].size && bytesread+BLOCK_SIZE<length){
-                            //printf("\n\nFIRST MEMCPY\n\n");
-                            memcpy(data+bytesread,block4.data,BLOCK_SIZE);
-                            bytesread += BLOCK_SIZE;
-                        }
-                        else if (bytesread+BLOCK_SIZE>block.inodes[inode_number].size){
-                            //printf("\n\nIt should hit this\n\n");
-                            memcpy(data+bytesread,block4.data,block.inodes[inode_number].size-bytesread);
-                            bytesread += block.inodes[inode_number].size-bytesread;
-                            return bytesread;
-                        }
-                        else if (bytesread+BLOCK_SIZE==length){
-                            //printf("\n\nWHAT?\n\n");
-                            memcpy(data+bytesread,block4.data,BLOCK_SIZE);
-                            bytesread += BLOCK_SIZE;
-                            return bytesread;
-                        }
-                    }
-                }
-                else{
-                    return block.inodes[inode_number].size-offset;
-                }
-            }
+
+        uint64_t leaked   = ~fs->free_blocks[w] & ~context.seen[w] & mask;
+        uint64_t unmarked = fs->free_blocks[w] & context.seen[w] & mask;
+        for (uint64_t bits = leaked; bits; bits &= bits - 1){
+            fs_check_problem(&workers[0], &workers[0].report.leaked, "leaked", -1, w * 64 + __builtin_ctzll(bits), options->repair);
         }
-        else{
-            return -1;
+        for (uint64_t bits = unmarked; bits; bits &= bits - 1){
+            fs_check_problem(&workers[0], &workers[0].report.unmarked, "unmarked", -1, w * 64 + __builtin_ctzll(bits), options->repair);
+        }
+        if (options->repair){
+            fs->free_blocks[w] = (fs->free_blocks[w] | leaked) & ~unmarked;
         }
     }
-    else{
-        return -1;
+    if (options->repair){
+        fs->free_hint = 0;
     }
-    return -1;
+
+    // Combine per-worker counts
+    memset(report, 0, sizeof(CheckReport));
+    for (size_t w = 0; w < count; w++){
+        report->inodes          += workers[w].report.inodes;
+        report->blocks          += workers[w].report.blocks;
+        report->out_of_range    += workers[w].report.out_of_range;
+        report->duplicates      += workers[w].report.duplicates;
+        report->size_mismatches += workers[w].report.size_mismatches;
+        report->unreadable      += workers[w].report.unreadable;
+        report->leaked          += workers[w].report.leaked;
+        report->unmarked        += workers[w].report.unmarked;
+        report->repaired        += workers[w].report.repaired;
+    }
+    fs_check_summary(options, report);
+
+    pthread_mutex_destroy(&context.lock);
+    free(context.seen);
+
+    uint64_t problems = report->out_of_range + report->duplicates + report->size_mismatches +
+                        report->unreadable + report->leaked + report->unmarked;
+    return problems == report->repaired;
 }
 
 /**
- * Write to the specified Inode from the data buffer exactly length bytes
- * beginning from the specified offset by doing the following:
+ * Verify every block in use of mounted FileSystem against its checksum by
+ * doing the following:
  *
- *  1. Load Inode information.
+ *  1. Let a pool of workers claim chunks of the whole image, reading the
+ *  inode table and every data or pointer block that is not free.
  *
- *  2. Continuously copy data from buffer to blocks.
+ *  2. Report each block that cannot be read or whose CRC32C does not match
+ *  the recorded one.
  *
- *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  3. Stream a summary.
+ *
+ * Without checksums only readability is verified.  Nothing is repaired.
  *
  * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to write data to.
- * @param       data            Buffer with data to copy
- * @param       length          Number of bytes to write.
- * @param       offset          Byte offset from which to begin writing.
- * @return      Number of bytes read (-1 on error).
+ * @param       options         Report options (JSON, report stream).
+ * @param       report          Problem counts.
+ * @return      Whether or not every block verified.
  **/
-ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
-    Block block;
-    size_t inode_block = (size_t)((int)(inode_number/INODES_PER_BLOCK)+1);
-    if (inode_block>fs->meta_data.inode_blocks){
-        return -1;
+bool    fs_scrub(FileSystem *fs, const CheckOptions *options, ScrubReport *report) {
+    if (!fs->disk || !options || !report){
+        return false;
     }
 
-    // Loads the inode block data into block.data
-    if(disk_read(fs->disk,inode_block,block.data)==DISK_FAILURE){
-        return -1;
+    CheckContext context = {.options = options};
+    pthread_mutex_init(&context.lock, NULL);
+
+    ScanWorker workers[MOUNT_MAX_THREADS] = {{{0}}};
+    uint64_t   next  = 1;
+    size_t     count = fs_scan_threads(fs->meta_data.blocks - 1);
+    for (size_t w = 0; w < count; w++){
+        workers[w].view  = *fs;
+        workers[w].next  = &next;
+        workers[w].last  = fs->meta_data.blocks - 1;
+        workers[w].scan  = fs_scrub_scan_block;
+        workers[w].check = &context;
     }
-    ssize_t bytewrite = 0;
-    //printf("\n\nENTERING THE MATRIX\n\n");
-    // Case where everything can fit on one inode
-    if (block.inodes[inode_number].size >= length){
-        //printf("\n\nYES\n\n");
-        if (block.inodes[inode_number].valid != 1){
-            return -1;
-        }
-        //printf("\n\nPASSES VALID\n\n");
-        for (uint32_t m = offset/BLOCK_SIZE; m < POINTERS_PER_INODE; m++){
-            if (block.inodes[inode_number].direct[m] > 0){
-                Block block2;       // Direct Block
-                if (disk_read(fs->disk,block.inodes[inode_number].direct[m],block2.data) == DISK_FAILURE){
-                    return -1;
-                }
-                else{
-                    //printf("\n\nDIRECT BLOCK: %i\n\n",block.inodes[inode_number].direct[m]);
-                    if (bytewrite + BLOCK_SIZE <= length){
-                        memcpy(block2.data, data+bytewrite, BLOCK_SIZE);
-                        bytewrite += BLOCK_SIZE;
-                        disk_write(fs->disk, block.inodes[inode_number].direct[m], block2.data);
-                    }
-                    else if (bytewrite + BLOCK_SIZE > block.inodes[inode_number].size){
-                        memcpy(block2.data, data+bytewrite, block.inodes[inode_number].size-bytewrite);
-                        bytewrite += (block.inodes[inode_number].size - bytewrite);
-                        disk_write(fs->disk, block.inodes[inode_number].direct[m], block2.data);
-                        return bytewrite;
-                    }
-                    else{
-                        return bytewrite;
-                    }   
-                }
-            }
-            else{
-                return -1;
-            }
-        } 
-        Block block3;
-        if (disk_read(fs->disk, block.inodes[inode_number].indirect, block3.data) == DISK_FAILURE){
-            return -1;
-        }
-        else{
-            uint32_t offnum = offset/BLOCK_SIZE;
-            if (offnum!=0){
-                offnum -= POINTERS_PER_INODE;
-            }
-            for (uint32_t n = offnum; n < POINTERS_PER_BLOCK; n++){
-                if (block3.pointers[n]){
+    fs_scan_run(workers, count);
 
-                }
-            }
-        }
+    memset(report, 0, sizeof(ScrubReport));
+    for (size_t w = 0; w < count; w++){
+        report->blocks     += workers[w].scrub.blocks;
+        report->corrupted  += workers[w].scrub.corrupted;
+        report->unreadable += workers[w].scrub.unreadable;
     }
+    fs_scrub_summary(options, report);
 
-    // Case where more space must be allocated
-    else{
-        //printf("\n\nAYO WHADDUP\n\n");
-        if (block.inodes[inode_number].valid != 1){
-            return -1;
-        }
-        int numBlockToAllocate = ((int)((offset+length-block.inodes[inode_number].size)/BLOCK_SIZE)+1);
-        //printf("\n\nNUM: %i\n\n",numBlockToAllocate);
-        int counter = 0;
-
-loop:
-        for (int f = counter; f < numBlockToAllocate; f++){
-            for (uint32_t g = 0; g < fs->meta_data.blocks; g++){
-                if(fs->free_blocks[g]){
-                    fs->free_blocks[g] = false;
-                    for (uint32_t m = 0; m < POINTERS_PER_INODE; m++){
-                        if(!block.inodes[inode_number].direct[m]){
-                            block.inodes[inode_number].direct[m] = g;
-                            counter++;
-                            goto loop;
-                        }
-                    }
-                    //printf("\n\n YEYEAHHHAHAHAHHA \n\n");
-                    Block block2;
-                    if (disk_read(fs->disk,block.inodes[inode_number].indirect,block2.data)==DISK_FAILURE){
-                        return -1;
-                    }
-                    for (uint32_t n = 0; n < POINTERS_PER_BLOCK; n++){
-                        if(!block2.pointers[n]){
-                            block2.pointers[n] = g;
-                            counter++;
-                            goto loop;
-                        }
-                    }
-                }
-            }
-        }
-        for (uint32_t m = offset/BLOCK_SIZE; m < POINTERS_PER_INODE; m++){
-            if (block.inodes[inode_number].direct[m] > 0){
-                Block block2;       // Direct Block
-                if (disk_read(fs->disk,block.inodes[inode_number].direct[m],block2.data) == DISK_FAILURE){
-                    return -1;
-                }
-                else{
-                    //printf("\n\nDIRECT BLOCK: %i\n\n",block.inodes[inode_number].direct[m]);
-                    if (bytewrite + BLOCK_SIZE <= length){
-                        //printf("\n\nWHAT\n\n");
-                        memcpy(block2.data, data+bytewrite, BLOCK_SIZE);
-                        bytewrite += BLOCK_SIZE;
-                        block.inodes[inode_number].size += BLOCK_SIZE;
-                        disk_write(fs->disk, block.inodes[inode_number].direct[m], block2.data);
-                        disk_write(fs->disk, inode_block, block.data);
-                    }
-                    else if (bytewrite + BLOCK_SIZE > length){
-                        //printf("\n\nIf this prints that'd be fucking sick: %zu\n\n",length);
-                        memcpy(block2.data, data+bytewrite, length-bytewrite);
-                        bytewrite += (length - bytewrite);
-                        block.inodes[inode_number].size += bytewrite;
-                        disk_write(fs->disk, block.inodes[inode_number].direct[m], block2.data);
-                        disk_write(fs->disk, inode_block, block.data);
-                        return bytewrite;
-                    }
-                    else{
-                        return bytewrite;
-                    }   
-                }
-            }
-            else{
-                return -1;
-            }
-        } 
-        Block block3;
-        uint32_t offnum = offset/BLOCK_SIZE;
-        if (offnum!=0){
-            offnum -= POINTERS_PER_INODE;
-        }
-        if(disk_read(fs->disk,block.inodes[inode_number].indirect,block3.data)==BLOCK_SIZE){
-            for (uint32_t n = offnum; n < POINTERS_PER_BLOCK; n++){
-                if (block3.pointers[n]){
-                    Block block4;
-                    //printf("\n\nINDIRECT BLOCK: %u\n\n",block3.pointers[n]);
-                    if (disk_read(fs->disk,block3.pointers[n],block4.data)==DISK_FAILURE){
-                        return -1;
-                    }
-                    else{
-                        //printf("\n\nDIRECT BLOCK: %i\n\n",block.inodes[inode_number].direct[m]);
-                        if (bytewrite + BLOCK_SIZE <= length){
-                            //printf("\n\nWHAT\n\n");
-                            memcpy(block4.data, data+bytewrite, BLOCK_SIZE);
-                            bytewrite += BLOCK_SIZE;
-                            disk_write(fs->disk, block3.pointers[n], block4.data);
-                            disk_write(fs->disk, inode_block, block3.data);
-                        }
-                        else if (bytewrite + BLOCK_SIZE > length){
-                            //printf("\n\nIf this prints that'd be fucking sick: %zu\n\n",length);
-                            memcpy(block4.data, data+bytewrite, length-bytewrite);
-                            bytewrite += (length - bytewrite);
-                            block.inodes[inode_number].size += bytewrite;
-                            disk_write(fs->disk, block3.pointers[n], block4.data);
-                            disk_write(fs->disk, inode_block, block3.data);
-                            return bytewrite;
-                        }
-                        else{
-                            return bytewrite;
-                        }   
-                        //printf("\n\n BYTES READ: %zu\n\n",bytesread);
-                    }
-                }
-                else{
-                    return block.inodes[inode_number].size-offset;
-                }
-            }
+    pthread_mutex_destroy(&context.lock);
+    return !report->corrupted && !report->unreadable;
+}
+
+/**
+ * Report how much sharing the reference counts of mounted FileSystem show
+ * and how much memory they and the content index take.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       report          Sharing counts.
+ * @return      Whether or not blocks can be shared on this FileSystem.
+ **/
+bool    fs_dedup_report(FileSystem *fs, DedupReport *report) {
+    if (!fs->disk || !fs->refcounts || !report){
+        return false;
+    }
+
+    memset(report, 0, sizeof(DedupReport));
+    for (uint64_t b = fs_data_start(&fs->meta_data); b < fs->meta_data.blocks; b++){
+        if (fs->refcounts[b] > 1){
+            report->shared++;
+            report->saved += fs->refcounts[b] - 1;
         }
+    }
 
+    report->memory = fs->meta_data.blocks * sizeof(uint32_t);
+    if (fs->dedup){
+        report->indexed = fs->dedup->count;
+        report->memory += fs->meta_data.blocks * sizeof(uint32_t) + BITMAP_WORDS(fs->meta_data.blocks) * sizeof(uint64_t) +
+                          fs->dedup->capacity * sizeof(uint64_t);
     }
+    return true;
+}
 
-    if(disk_write(fs->disk,inode_block,block.data)==DISK_FAILURE){
+/**
+ * Defragment mounted FileSystem by moving the data blocks of every
+ * fragmented file, in Inode order, into a single run of free blocks (see
+ * fs_defrag_inode).  Files whose data or pointer blocks are shared,
+ * compressed, inline and read-only Inodes, and files for which no free run
+ * is long enough are left in place.  Pointer blocks are not moved.
+ *
+ * Blocks are moved DEFRAG_BATCH_BLOCKS at a time, each batch holding the
+ * async I/O lock exclusively, so submitted requests run between batches.
+ * With a rate, the mover also sleeps between batches to average no more
+ * than that many blocks per second.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       options         Defrag options (rate, report stream; may be NULL).
+ * @param       report          File, block, and run counts.
+ * @return      Whether or not every file was examined (and moved) without
+ *              I/O errors.
+ **/
+bool    fs_defrag(FileSystem *fs, const DefragOptions *options, DefragReport *report) {
+    DefragOptions defaults = {0};
+    if (!fs->disk || !report){
+        return false;
+    }
+    options = options ? options : &defaults;
+    memset(report, 0, sizeof(DefragReport));
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    size_t inodes_per_block = fs_inodes_per_block(&fs->meta_data);
+    Block *block            = fs_block_get(fs);
+    bool   result           = block != NULL;
+    for (uint64_t i = 1; block && i <= fs_inode_table_blocks(&fs->meta_data); i++){
+        fs_async_exclude(fs, true);
+        bool loaded = fs_read_block(fs, i, block->data) != DISK_FAILURE;
+        fs_async_exclude(fs, false);
+        if (!loaded){
+            result = false;
+            continue;
+        }
+
+        for (size_t j = 0; j < inodes_per_block; j++){
+            size_t  inode_number = (i - 1) * inodes_per_block + j;
+            Inode64 node;
+            fs_get_inode(&fs->meta_data, block, j, &node);
+            if (inode_number < fs->meta_data.inodes && node.valid && node.size && !fs_inode_inline(&node)){
+                result = fs_defrag_inode(fs, inode_number, options, report, &started) && result;
+            }
+        }
+    }
+    fs_block_put(fs, block);
+    return result;
+}
+
+/**
+ * Allocate an Inode in the FileSystem Inode table by doing the following:
+ *
+ *  1. Search Inode table for free inode.
+ *
+ *  2. Reserve free inode in Inode table.
+ *
+ * Note: Be sure to record updates to Inode table to Disk.  When the file
+ * system has inline data enabled, new Inodes start out inline.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Inode number of allocated Inode.
+ **/
+ssize_t fs_create(FileSystem *fs) {
+    uint64_t started = trace_op_begin();
+    ssize_t result  = fs_allocate_inode(fs);
+    result = fs_flush_checksums(fs) ? result : -1;
+    trace_op_end(TRACE_FS_CREATE, started, 0, 0, 0, 0, result);
+    return result;
+}
+
+/**
+ * Body of fs_create (without tracing).
+ **/
+ssize_t fs_allocate_inode(FileSystem *fs) {
+    if (!fs->disk) {
+        return -1;
+    }
+
+    size_t  inodes_per_block = fs_inodes_per_block(&fs->meta_data);
+    Block  *block            = fs_block_get(fs);
+    ssize_t free_inode       = -1;
+    for (uint64_t i = 1; block && free_inode < 0 && i <= fs_inode_table_blocks(&fs->meta_data); i++){
+        if (fs_read_block(fs, i, block->data) == DISK_FAILURE){
+            break;
+        }
+        for (size_t j = 0; j < inodes_per_block && free_inode < 0; j++){
+            Inode64 node;
+            fs_get_inode(&fs->meta_data, block, j, &node);
+            if (!node.valid){
+                free_inode = (i - 1) * inodes_per_block + j;
+            }
+        }
+    }
+    fs_block_put(fs, block);
+    if (free_inode < 0){
+        return -1;
+    }
+
+    Inode64 node = {.valid = 1};
+    if (fs_inline_capacity(&fs->meta_data)){
+        node.flags |= INODE_INLINE;
+    }
+    if (fs->meta_data.features & FS_FEATURE_COMPRESSION){
+        node.flags |= INODE_COMPRESSED;
+    }
+    return fs_save_inode(fs, free_inode, &node) ? free_inode : -1;
+}
+
+/**
+ * Remove Inode and associated data from FileSystem by doing the following:
+ *
+ *  1. Load and check status of Inode.
+ *
+ *  2. Release any direct blocks.
+ *
+ *  3. Release any indirect blocks.
+ *
+ *  4. Mark Inode as free in Inode table.
+ *
+ * Snapshot copies are read-only and go away with their snapshot (see
+ * fs_snapshot_delete).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to remove.
+ * @return      Whether or not removing the specified Inode was successful.
+ **/
+bool    fs_remove(FileSystem *fs, size_t inode_number) {
+    uint64_t started = trace_op_begin();
+    Inode64  node;
+    bool     result  = fs_load_inode(fs, inode_number, &node) && node.valid && !(node.flags & INODE_READONLY) &&
+                       fs_release_inode(fs, inode_number, &node);
+    result = fs_flush_checksums(fs) && result;
+    trace_op_end(TRACE_FS_REMOVE, started, 0, inode_number, 0, 0, result);
+    return result;
+}
+
+/**
+ * Return size of specified Inode.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to remove.
+ * @return      Size of specified Inode (-1 if does not exist).
+ **/
+ssize_t fs_stat(FileSystem *fs, size_t inode_number) {
+    uint64_t started = trace_op_begin();
+    Inode64  node;
+    ssize_t  result  = fs_load_inode(fs, inode_number, &node) && node.valid ? (ssize_t)node.size : -1;
+    trace_op_end(TRACE_FS_STAT, started, 0, inode_number, 0, 0, result);
+    return result;
+}
+
+/**
+ * Load Inode from Inode table, for callers that need more than its size
+ * (see fs_seek_inode).  Unlike fs_stat this is not traced, and a free
+ * Inode still loads (with valid unset).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to load.
+ * @param       node            Inode structure to copy into.
+ * @return      Whether or not the Inode was loaded.
+ **/
+bool    fs_load_inode(FileSystem *fs, size_t inode_number, Inode64 *node) {
+    Block  *block = fs_block_get(fs);
+    ssize_t index = fs_read_inode_block(fs, inode_number, block);
+    if (index >= 0){
+        fs_get_inode(&fs->meta_data, block, index, node);
+    }
+    fs_block_put(fs, block);
+    return index >= 0;
+}
+
+/**
+ * Return the number of runs of physically consecutive blocks that hold the
+ * data of the specified Inode: 1 for a contiguous file, 0 for one with no
+ * data blocks (empty, sparse, or inline).  Holes do not split a run.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to measure.
+ * @return      Number of runs (-1 if invalid or unreadable).
+ **/
+ssize_t fs_fragmentation(FileSystem *fs, size_t inode_number) {
+    Inode64 node;
+    if (!fs_load_inode(fs, inode_number, &node) || !node.valid){
+        return -1;
+    }
+    return fs_defrag_runs(fs, &node, NULL, NULL);
+}
+
+/**
+ * Read from the specified Inode into the data buffer exactly length bytes
+ * beginning from the specified offset by doing the following:
+ *
+ *  1. Load Inode information.
+ *
+ *  2. Continuously read blocks and copy data to buffer.
+ *
+ *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  Unallocated blocks below the file size (holes) read back as zeroes without
+ *  touching the disk.  Inline data is copied from the Inode block itself,
+ *  and compressed Inodes are decoded a cluster at a time (fs_read_clusters).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read.
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+    struct iovec iov = {data, length};
+    return fs_readv(fs, inode_number, &iov, 1, offset);
+}
+
+/**
+ * Read from the specified Inode into the iovcnt buffers of iov, filling each
+ * in turn, like readv(2) at offset (see fs_read).  The Inode is loaded once
+ * for the whole request; whole blocks that land in one segment are read
+ * straight into it and the rest are copied out of a block buffer.
+ * Compressed Inodes are decoded segment by segment.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       iov             Buffers to copy data to.
+ * @param       iovcnt          Number of buffers.
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_readv(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset) {
+    uint64_t started = trace_op_begin();
+    ssize_t result  = fs_readv_inode(fs, inode_number, iov, iovcnt, offset);
+    trace_op_end(TRACE_FS_READ, started, 0, inode_number, fs_iov_length(iov, iovcnt), offset, result);
+    return result;
+}
+
+/**
+ * Body of fs_readv (without tracing).
+ **/
+ssize_t fs_readv_inode(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset) {
+    ssize_t total = fs_iov_length(iov, iovcnt);
+    if (total < 0){
+        return -1;
+    }
+
+    Block  *inodes = fs_block_get(fs);
+    Inode64 node;
+    ssize_t slot   = fs_read_inode_block(fs, inode_number, inodes);
+    if (slot < 0){
+        fs_block_put(fs, inodes);
+        return -1;
+    }
+    fs_get_inode(&fs->meta_data, inodes, slot, &node);
+    if (!node.valid || (fs_inode_inline(&node) && node.size > fs_inline_capacity(&fs->meta_data))){
+        fs_block_put(fs, inodes);
+        return -1;
+    }
+    if (offset >= node.size){
+        fs_block_put(fs, inodes);
+        return 0;
+    }
+    size_t   length = min((size_t)total, node.size - offset);
+    IoVector vector = {iov, iovcnt, 0};
+
+    // Inline data comes straight from the Inode block
+    if (fs_inode_inline(&node)){
+        fs_iov_copy(&vector, fs_inline_data(&fs->meta_data, inodes, slot) + offset, length, false);
+        fs_block_put(fs, inodes);
+        return length;
+    }
+    fs_block_put(fs, inodes);
+
+    size_t bytesread = 0;
+    if (fs_inode_compressed(&node)){
+        for (int i = 0; i < iovcnt && bytesread < length; i++){
+            size_t  chunk = min(iov[i].iov_len, length - bytesread);
+            ssize_t nread = fs_read_clusters(fs, &node, iov[i].iov_base, chunk, offset + bytesread);
+            if (nread < 0){
+                return -1;
+            }
+            bytesread += nread;
+        }
+        return bytesread;
+    }
+
+    size_t  block_size = fs_block_size(&fs->meta_data);
+    MapPath path       = {0};
+    while (bytesread < length){
+        size_t  index   = fs_block_index(&fs->meta_data, offset + bytesread);
+        size_t  start   = fs_block_offset(&fs->meta_data, offset + bytesread);
+        size_t  chunk   = min(block_size - start, length - bytesread);
+
+        int found = fs_map_slot(fs, &node, index, false, &path, NULL);
+        if (found < 0){
+            fs_release_path(fs, &path);
+            return -1;
+        }
+
+        // Unallocated blocks below the file size are holes and, like
+        // reserved blocks that were never written, read as zeroes
+        uint64_t pointer = found ? fs_get_slot(fs, &node, &path, 0) : 0;
+        if (!pointer || (pointer & POINTER_UNWRITTEN)){
+            fs_iov_copy(&vector, NULL, chunk, false);
+            bytesread += chunk;
+            continue;
+        }
+        pointer = fs_pointer_block(pointer);
+
+        char *direct = chunk == block_size ? fs_iov_direct(&vector, block_size) : NULL;
+        if (direct){
+            if (fs_read_block(fs, pointer, direct) == DISK_FAILURE){
+                fs_release_path(fs, &path);
+                return -1;
+            }
+        } else {
+            char *buffer = disk_buffer_get(fs->disk);
+            if (!buffer || fs_read_block(fs, pointer, buffer) == DISK_FAILURE){
+                disk_buffer_put(fs->disk, buffer);
+                fs_release_path(fs, &path);
+                return -1;
+            }
+            fs_iov_copy(&vector, buffer + start, chunk, false);
+            disk_buffer_put(fs->disk, buffer);
+        }
+        bytesread += chunk;
+    }
+    fs_release_path(fs, &path);
+    return bytesread;
+}
+
+/**
+ * Write to the specified Inode from the data buffer exactly length bytes
+ * beginning from the specified offset by doing the following:
+ *
+ *  1. Load Inode information.
+ *
+ *  2. Continuously copy data from buffer to blocks, allocating blocks (and
+ *  the indirect blocks) as necessary.
+ *
+ *  Note: Data is written to direct blocks first, and then to indirect
+ *  blocks.  Each data block is written before the pointer blocks and Inode
+ *  that refer to it, and the Inode is saved after every block allocation.
+ *  Data and pointer blocks shared with clones or snapshots are copied
+ *  before they are modified, and snapshot copies cannot be written.
+ *  Writing past the end of file only allocates the blocks that are written;
+ *  the blocks in between are left as holes.  An inline file is written in
+ *  place while it fits and is converted to a block-mapped file first when a
+ *  write would outgrow the inline area.  Compressed Inodes are rewritten a
+ *  cluster at a time (fs_write_clusters) and, with dedup enabled, other
+ *  Inodes share blocks with identical contents (fs_write_dedup).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+    struct iovec iov = {data, length};
+    return fs_writev(fs, inode_number, &iov, 1, offset);
+}
+
+/**
+ * Write the iovcnt buffers of iov to the specified Inode, one after the
+ * other, like writev(2) at offset (see fs_write).  The Inode is loaded once
+ * for the whole request; whole blocks that come from one segment are
+ * written straight from it and the rest are gathered into a block buffer.
+ * Compressed and deduplicated writes are made segment by segment.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       iov             Buffers with data to copy.
+ * @param       iovcnt          Number of buffers.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t fs_writev(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset) {
+    uint64_t started = trace_op_begin();
+    ssize_t result  = fs_writev_inode(fs, inode_number, iov, iovcnt, offset);
+    result = fs_flush_checksums(fs) ? result : -1;
+    trace_op_end(TRACE_FS_WRITE, started, 0, inode_number, fs_iov_length(iov, iovcnt), offset, result);
+    return result;
+}
+
+/**
+ * Body of fs_writev (without tracing).
+ **/
+ssize_t fs_writev_inode(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset) {
+    ssize_t total = fs_iov_length(iov, iovcnt);
+    if (total < 0){
+        return -1;
+    }
+    size_t   length = total;
+    IoVector vector = {iov, iovcnt, 0};
+
+    Block  *inodes = fs_block_get(fs);
+    Inode64 node;
+    ssize_t slot   = fs_read_inode_block(fs, inode_number, inodes);
+    if (slot < 0){
+        fs_block_put(fs, inodes);
+        return -1;
+    }
+    fs_get_inode(&fs->meta_data, inodes, slot, &node);
+    if (!node.valid || (node.flags & INODE_READONLY)){
+        fs_block_put(fs, inodes);
+        return -1;
+    }
+
+    // Inline files are updated in the Inode block until they outgrow it
+    if (fs_inode_inline(&node)){
+        size_t capacity    = fs_inline_capacity(&fs->meta_data);
+        char  *inline_data = fs_inline_data(&fs->meta_data, inodes, slot);
+        bool   converted;
+        if (node.size > capacity){
+            fs_block_put(fs, inodes);
+            return -1;
+        }
+        if (offset + length <= capacity){
+            if (offset > node.size){
+                memset(inline_data + node.size, 0, offset - node.size);
+            }
+            fs_iov_copy(&vector, inline_data + offset, length, true);
+            node.size = max(node.size, offset + length);
+            fs_put_inode(&fs->meta_data, inodes, slot, &node);
+            ssize_t written = fs_write_block(fs, inode_number / fs_inodes_per_block(&fs->meta_data) + 1, inodes->data);
+            fs_block_put(fs, inodes);
+            return written == DISK_FAILURE ? -1 : (ssize_t)length;
+        }
+        converted = fs_inline_convert(fs, inode_number, &node, inline_data);
+        fs_block_put(fs, inodes);
+        if (!converted){
+            return -1;
+        }
+    } else {
+        fs_block_put(fs, inodes);
+    }
+
+    size_t byteswritten = 0;
+    if (fs_inode_compressed(&node) || fs->dedup){
+        for (int i = 0; i < iovcnt; i++){
+            ssize_t written = fs_inode_compressed(&node) ?
+                fs_write_clusters(fs, inode_number, &node, iov[i].iov_base, iov[i].iov_len, offset + byteswritten) :
+                fs_write_dedup(fs, inode_number, &node, iov[i].iov_base, iov[i].iov_len, offset + byteswritten);
+            if (written > 0){
+                byteswritten += written;
+            }
+            if (written != (ssize_t)iov[i].iov_len){
+                break;
+            }
+        }
+        return byteswritten || !length ? (ssize_t)byteswritten : -1;
+    }
+
+    size_t position   = offset;
+    size_t end        = offset + length;
+    size_t  block_size = fs_block_size(&fs->meta_data);
+    MapPath path       = {0};
+
+    while (position < end){
+        size_t  index   = fs_block_index(&fs->meta_data, position);
+        size_t  start   = fs_block_offset(&fs->meta_data, position);
+        size_t  chunk   = min(block_size - start, end - position);
+        bool    dirty   = false;
+
+        // Locate pointer to data block, allocating pointer blocks if necessary
+        if (fs_map_slot(fs, &node, index, true, &path, &dirty) <= 0){
+            break;
+        }
+
+        // Whole blocks within one segment are written from it directly;
+        // otherwise load existing block for partial updates (new blocks
+        // start zeroed) into a buffer from the disk's arena and gather the
+        // data into it
+        uint64_t slot    = fs_get_slot(fs, &node, &path, 0);
+        uint64_t pointer = fs_pointer_block(slot);
+        char    *buffer  = NULL;
+        char    *source  = chunk == block_size ? fs_iov_direct(&vector, block_size) : NULL;
+        if (!source){
+            if (!(buffer = disk_buffer_get(fs->disk))){
+                fs_release_path(fs, &path);
+                return -1;
+            }
+            if (!pointer || (slot & POINTER_UNWRITTEN)){
+                memset(buffer, 0, block_size);
+            } else if (start || chunk < block_size){
+                if (fs_read_block(fs, pointer, buffer) == DISK_FAILURE){
+                    disk_buffer_put(fs->disk, buffer);
+                    fs_release_path(fs, &path);
+                    return -1;
+                }
+            }
+            fs_iov_copy(&vector, buffer + start, chunk, true);
+            source = buffer;
+        }
+
+        // Holes get a new block and shared blocks are copied on write
+        if (!pointer || fs_block_shared(fs, pointer)){
+            ssize_t fresh = fs_allocate_block(fs);
+            if (fresh < 0){
+                disk_buffer_put(fs->disk, buffer);
+                break;
+            }
+            fs_set_slot(fs, &node, &path, 0, fresh);
+            if (pointer){
+                fs_release_block(fs, pointer);
+            }
+            pointer = fresh;
+            dirty   = true;
+        } else if (slot & POINTER_UNWRITTEN){
+            fs_set_slot(fs, &node, &path, 0, pointer);
+            dirty = true;
+        }
+
+        ssize_t written = fs_write_block(fs, pointer, source);
+        disk_buffer_put(fs->disk, buffer);
+        if (written == DISK_FAILURE){
+            fs_release_path(fs, &path);
+            return -1;
+        }
+        if (!fs_commit_path(fs, &path)){
+            fs_release_path(fs, &path);
+            return -1;
+        }
+
+        position     += chunk;
+        byteswritten += chunk;
+        if (position > node.size){
+            node.size = position;
+            dirty = true;
+        }
+        if (dirty && !fs_save_inode(fs, inode_number, &node)){
+            fs_release_path(fs, &path);
+            return -1;
+        }
+    }
+    fs_release_path(fs, &path);
+
+    if (!byteswritten && length){
         return -1;
     }
-    return bytewrite;
+    return byteswritten;
+}
+
+/**
+ * Set the size of the specified Inode.  Growing leaves a hole past the old
+ * end of file.  Shrinking zeroes the rest of the block (or compression
+ * cluster) that holds the new end of file through the write path, so that
+ * shared and deduplicated blocks are copied rather than modified, and then
+ * releases every block past it along with pointer blocks left empty (see
+ * fs_truncate_tree).  Inline Inodes are resized in place while they fit.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to resize.
+ * @param       size            New size in bytes.
+ * @return      Whether or not the Inode was resized.
+ **/
+bool    fs_truncate(FileSystem *fs, size_t inode_number, size_t size) {
+    uint64_t started = trace_op_begin();
+    bool    result  = fs_truncate_inode(fs, inode_number, size);
+    result = fs_flush_checksums(fs) && result;
+    trace_op_end(TRACE_FS_TRUNCATE, started, 0, inode_number, size, 0, result);
+    return result;
+}
+
+/**
+ * Body of fs_truncate (without tracing).
+ **/
+bool    fs_truncate_inode(FileSystem *fs, size_t inode_number, size_t size) {
+    const SuperBlock64 *meta = &fs->meta_data;
+    Block  *inodes = fs_block_get(fs);
+    Inode64 node;
+    ssize_t slot   = fs_read_inode_block(fs, inode_number, inodes);
+    if (slot < 0){
+        fs_block_put(fs, inodes);
+        return false;
+    }
+    fs_get_inode(meta, inodes, slot, &node);
+    if (!node.valid || (node.flags & INODE_READONLY)){
+        fs_block_put(fs, inodes);
+        return false;
+    }
+
+    if (fs_inode_inline(&node)){
+        size_t capacity    = fs_inline_capacity(meta);
+        char  *inline_data = fs_inline_data(meta, inodes, slot);
+        bool   converted;
+        if (node.size > capacity){
+            fs_block_put(fs, inodes);
+            return false;
+        }
+        if (size <= capacity){
+            if (size > node.size){
+                memset(inline_data + node.size, 0, size - node.size);
+            }
+            node.size = size;
+            fs_put_inode(meta, inodes, slot, &node);
+            bool written = fs_write_block(fs, inode_number / fs_inodes_per_block(meta) + 1, inodes->data) != DISK_FAILURE;
+            fs_block_put(fs, inodes);
+            return written;
+        }
+        converted = fs_inline_convert(fs, inode_number, &node, inline_data);
+        fs_block_put(fs, inodes);
+        if (!converted){
+            return false;
+        }
+    } else {
+        fs_block_put(fs, inodes);
+    }
+
+    if (size >= node.size){
+        node.size = size;
+        return fs_save_inode(fs, inode_number, &node);
+    }
+
+    // Blocks (or whole clusters) up to keep still hold data
+    uint64_t keep  = fs_block_count(meta, size);
+    uint64_t first = keep ? keep - 1 : 0;
+    size_t   count = 1;
+    if (keep && fs_inode_compressed(&node)){
+        fs_cluster_range(keep - 1, &first, &count);
+        keep = first + count;
+    }
+
+    // Zero the tail of the last block (or cluster) if it is mapped
+    size_t tail = min((first + count) * fs_block_size(meta), node.size);
+    if (size > first * fs_block_size(meta) && size < tail){
+        MapPath path   = {0};
+        int     found  = fs_map_slot(fs, &node, first, false, &path, NULL);
+        bool    mapped = found > 0 && fs_get_slot(fs, &node, &path, 0);
+        fs_release_path(fs, &path);
+        if (found < 0){
+            return false;
+        }
+        if (mapped){
+            char *zeros   = calloc(1, tail - size);     /* Rest of a block or a cluster */
+            bool  written = zeros && fs_write(fs, inode_number, zeros, tail - size, size) == (ssize_t)(tail - size);
+            free(zeros);
+            if (!written || !fs_load_inode(fs, inode_number, &node)){
+                return false;
+            }
+        }
+    }
+
+    // Release data blocks past keep and pointer blocks that become empty
+    bool result = true;
+    for (size_t i = keep; i < POINTERS_PER_INODE; i++){
+        fs_release_block(fs, fs_pointer_block(node.direct[i]));
+        node.direct[i] = 0;
+    }
+    uint64_t base = POINTERS_PER_INODE;
+    uint64_t span = fs_pointers_per_block(meta);
+    for (size_t level = 1; level <= fs_indirect_levels(meta); level++){
+        result = fs_truncate_tree(fs, fs_indirect_root(&node, level), level, base, keep) && result;
+        base += span;
+        span *= fs_pointers_per_block(meta);
+    }
+
+    node.size = size;
+    return fs_save_inode(fs, inode_number, &node) && result;
+}
+
+/**
+ * Reserve the blocks of bytes [offset, offset + length) of the specified
+ * Inode so that later writes there allocate nothing, and extend the file
+ * to cover them.  The holes in the range are filled from a single run of
+ * free blocks when there is one long enough (otherwise from the first run
+ * found, then the next, and so on).  By default the new blocks are zeroed
+ * on disk; with FALLOCATE_UNWRITTEN they are only marked unwritten in their
+ * pointers, read as zeroes, and lose the mark when first written.
+ * Revision 1 pointers have no room for the mark, so there the blocks are
+ * zeroed regardless.  With checksums, unwritten blocks are punched out of
+ * the image (fs_zero_blocks) so that scrubbing them still succeeds.
+ *
+ * Compressed Inodes cannot reserve space (their clusters take as many
+ * blocks as their contents compress to), and inline Inodes are converted
+ * first unless the range fits inline.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to reserve blocks for.
+ * @param       offset          Byte offset of the range.
+ * @param       length          Number of bytes in the range (> 0).
+ * @param       flags           FALLOCATE_* flags.
+ * @return      Whether or not the whole range was reserved (on failure
+ *              some blocks may have been).
+ **/
+bool    fs_fallocate(FileSystem *fs, size_t inode_number, size_t offset, size_t length, uint32_t flags) {
+    uint64_t started = trace_op_begin();
+    bool    result  = fs_fallocate_inode(fs, inode_number, offset, length, flags);
+    result = fs_flush_checksums(fs) && result;
+    trace_op_end(TRACE_FS_FALLOCATE, started, flags, inode_number, length, offset, result);
+    return result;
+}
+
+/**
+ * Body of fs_fallocate (without tracing).
+ **/
+bool    fs_fallocate_inode(FileSystem *fs, size_t inode_number, size_t offset, size_t length, uint32_t flags) {
+    const SuperBlock64 *meta = &fs->meta_data;
+    size_t  end = offset + length;
+    Block  *inodes = fs_block_get(fs);
+    Inode64 node;
+    ssize_t slot   = fs_read_inode_block(fs, inode_number, inodes);
+    if (slot < 0 || !length || end < offset || (flags & ~FALLOCATE_UNWRITTEN)){
+        fs_block_put(fs, inodes);
+        return false;
+    }
+    fs_get_inode(meta, inodes, slot, &node);
+    if (!node.valid || (node.flags & INODE_READONLY) || fs_inode_compressed(&node)){
+        fs_block_put(fs, inodes);
+        return false;
+    }
+
+    if (fs_inode_inline(&node)){
+        size_t capacity    = fs_inline_capacity(meta);
+        char  *inline_data = fs_inline_data(meta, inodes, slot);
+        bool   converted;
+        if (node.size > capacity){
+            fs_block_put(fs, inodes);
+            return false;
+        }
+        if (end <= capacity){
+            bool written = true;
+            if (end > node.size){
+                memset(inline_data + node.size, 0, end - node.size);
+                node.size = end;
+                fs_put_inode(meta, inodes, slot, &node);
+                written = fs_write_block(fs, inode_number / fs_inodes_per_block(meta) + 1, inodes->data) != DISK_FAILURE;
+            }
+            fs_block_put(fs, inodes);
+            return written;
+        }
+        converted = fs_inline_convert(fs, inode_number, &node, inline_data);
+        fs_block_put(fs, inodes);
+        if (!converted){
+            return false;
+        }
+    } else {
+        fs_block_put(fs, inodes);
+    }
+
+    bool     unwritten = (flags & FALLOCATE_UNWRITTEN) && !fs_revision1(meta);
+    uint64_t first     = fs_block_index(meta, offset);
+    uint64_t last      = fs_block_count(meta, end);
+
+    // Count the holes (a leaf of pointers at a time) to size the run
+    MapPath  path  = {0};
+    uint64_t holes = 0;
+    for (uint64_t index = first; index < last; ){
+        uint64_t start = index;
+        uint64_t stop  = min(fs_leaf_end(meta, index), last);
+        int      found = fs_map_slot(fs, &node, index, false, &path, NULL);
+        if (found < 0){
+            fs_release_path(fs, &path);
+            return false;
+        }
+        for (; index < stop; index++){
+            holes += !found || !fs_get_slot(fs, &node, &path, index - start);
+        }
+    }
+
+    // Fill the holes from runs of free blocks, zeroing each stretch of
+    // consecutive blocks before the pointers to it are written
+    bool     result = true;
+    bool     saved  = false;
+    uint64_t run    = 0, available = 0;
+    for (uint64_t index = first; result && holes && index < last; ){
+        uint64_t start = index;
+        uint64_t stop  = min(fs_leaf_end(meta, index), last);
+        bool     dirty = false;
+
+        // Leaves without holes are skipped so shared ones are not copied
+        int  found  = fs_map_slot(fs, &node, index, false, &path, NULL);
+        bool needed = found == 0;
+        for (uint64_t i = start; found > 0 && !needed && i < stop; i++){
+            needed = !fs_get_slot(fs, &node, &path, i - start);
+        }
+        if (found < 0 || (needed && fs_map_slot(fs, &node, index, true, &path, &dirty) <= 0)){
+            result = false;
+            break;
+        }
+        if (!needed){
+            index = stop;
+            continue;
+        }
+        saved = saved || dirty || !path.depth;
+
+        uint64_t zero_start = 0, zero_count = 0;
+        for (; index < stop && holes; index++){
+            if (fs_get_slot(fs, &node, &path, index - start)){
+                continue;
+            }
+            if (!available){
+                ssize_t claimed = fs_claim_run(fs, holes, &available);
+                if (claimed < 0){
+                    result = false;
+                    break;
+                }
+                run = claimed;
+            }
+            if (zero_count && run != zero_start + zero_count){
+                result = fs_zero_blocks(fs, zero_start, zero_count, unwritten) && result;
+                zero_count = 0;
+            }
+            if (!zero_count){
+                zero_start = run;
+            }
+            zero_count++;
+            fs_set_slot(fs, &node, &path, index - start, run | (unwritten ? POINTER_UNWRITTEN : 0));
+            run++;
+            available--;
+            holes--;
+        }
+        if (zero_count){
+            result = fs_zero_blocks(fs, zero_start, zero_count, unwritten) && result;
+        }
+        result = fs_commit_path(fs, &path) && result;
+    }
+    fs_release_path(fs, &path);
+
+    // Blocks claimed but not needed go back
+    while (available--){
+        fs_release_block(fs, run++);
+    }
+
+    if (result && end > node.size){
+        node.size = end;
+        saved     = true;
+    }
+    if (saved && !fs_save_inode(fs, inode_number, &node)){
+        return false;
+    }
+    return result;
+}
+
+/**
+ * Return offset of the first byte of data at or after offset in the
+ * specified Inode, like lseek(SEEK_DATA).  Data is tracked per block, so the
+ * result is offset itself or the start of the next allocated block.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to query.
+ * @param       offset          Byte offset from which to search.
+ * @return      Offset of next data (-1 if invalid, offset is at or past end
+ *              of file, or only holes remain).
+ **/
+ssize_t fs_seek_data(FileSystem *fs, size_t inode_number, size_t offset) {
+    Inode64 node;
+    if (!fs_load_inode(fs, inode_number, &node)){
+        return -1;
+    }
+    return fs_seek_inode(fs, &node, offset, true);
+}
+
+/**
+ * Return offset of the first byte of a hole at or after offset in the
+ * specified Inode, like lseek(SEEK_HOLE).  The end of file counts as a hole.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to query.
+ * @param       offset          Byte offset from which to search.
+ * @return      Offset of next hole (-1 if invalid or offset is at or past
+ *              end of file).
+ **/
+ssize_t fs_seek_hole(FileSystem *fs, size_t inode_number, size_t offset) {
+    Inode64 node;
+    if (!fs_load_inode(fs, inode_number, &node)){
+        return -1;
+    }
+    return fs_seek_inode(fs, &node, offset, false);
+}
+
+/**
+ * Seek like fs_seek_data (data) or fs_seek_hole (!data) in an Inode loaded
+ * with fs_load_inode, so that walking the extents of a file costs no Inode
+ * reads beyond the first.  Only pointer blocks are read.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       node            Loaded Inode.
+ * @param       offset          Byte offset from which to search.
+ * @param       data            Whether to look for data (true) or a hole.
+ * @return      Offset of next data or hole (-1 as for fs_seek_data or
+ *              fs_seek_hole).
+ **/
+ssize_t fs_seek_inode(FileSystem *fs, Inode64 *node, size_t offset, bool data) {
+    if (!node->valid || offset >= node->size){
+        return -1;
+    }
+
+    uint64_t nblocks = fs_block_count(&fs->meta_data, node->size);
+    ssize_t  found   = fs_seek_block(fs, node, fs_block_index(&fs->meta_data, offset), data, nblocks);
+    if (found < 0 || (data && (uint64_t)found >= nblocks)){
+        return -1;
+    }
+    if ((uint64_t)found >= nblocks){
+        return node->size;
+    }
+    return max(offset, (size_t)found * fs_block_size(&fs->meta_data));
+}
+
+/**
+ * Start the asynchronous I/O worker pool of the mounted FileSystem with the
+ * given number of threads (0 means ASYNC_WORKERS).  Workers block in disk
+ * I/O rather than compute, so more of them than CPUs still overlap
+ * transfers.  fs_submit_* starts the default pool on first use; calling
+ * this again while the pool is running does nothing.  The pool is drained
+ * and stopped by fs_unmount.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       workers         Number of worker threads.
+ * @return      Whether or not at least one worker is running.
+ **/
+bool    fs_async_start(FileSystem *fs, size_t workers) {
+    if (!fs->disk){
+        return false;
+    }
+    if (fs->async){
+        return true;
+    }
+
+    AsyncQueue *queue = calloc(1, sizeof(AsyncQueue));
+    if (!queue){
+        return false;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->submitted, NULL);
+    pthread_cond_init(&queue->completed, NULL);
+    pthread_rwlock_init(&queue->io_lock, NULL);
+    fs->async = queue;
+
+    workers = min(workers ? workers : ASYNC_WORKERS, ASYNC_MAX_WORKERS);
+    while (queue->workers < workers && pthread_create(&queue->threads[queue->workers], NULL, fs_async_worker, fs) == 0){
+        queue->workers++;
+    }
+    if (!queue->workers){
+        fs_async_stop(fs);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Queue an fs_read of the specified Inode into data and return without
+ * waiting for it.  The buffer belongs to the caller and must stay valid
+ * until the request's completion (carrying tag and the fs_read result) is
+ * returned by fs_poll or fs_wait.
+ *
+ * Requests in flight run concurrently and complete in any order (reads
+ * share the FileSystem, writes have it to themselves), so requests whose
+ * order matters must not be in flight together.  Synchronous fs calls must
+ * not be made while requests are in flight.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read.
+ * @param       offset          Byte offset from which to begin reading.
+ * @param       tag             Caller's value returned in the completion.
+ * @return      Whether or not the request was queued.
+ **/
+bool    fs_submit_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset, uint64_t tag) {
+    return fs_async_submit(fs, false, inode_number, data, length, offset, tag);
+}
+
+/**
+ * Queue an fs_write of data to the specified Inode and return without
+ * waiting for it (see fs_submit_read).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       data            Buffer with data to copy.
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @param       tag             Caller's value returned in the completion.
+ * @return      Whether or not the request was queued.
+ **/
+bool    fs_submit_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset, uint64_t tag) {
+    return fs_async_submit(fs, true, inode_number, data, length, offset, tag);
+}
+
+/**
+ * Copy up to capacity finished requests into completions, oldest first,
+ * without waiting.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       completions     Array to fill.
+ * @param       capacity        Number of entries in completions.
+ * @return      Number of completions returned.
+ **/
+size_t  fs_poll(FileSystem *fs, Completion *completions, size_t capacity) {
+    return fs_wait(fs, completions, capacity, 0);
+}
+
+/**
+ * Wait until at least minimum requests have finished (or fewer if fewer are
+ * in flight), then copy up to capacity of them into completions, oldest
+ * first.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       completions     Array to fill.
+ * @param       capacity        Number of entries in completions.
+ * @param       minimum         Number of completions to wait for.
+ * @return      Number of completions returned.
+ **/
+size_t  fs_wait(FileSystem *fs, Completion *completions, size_t capacity, size_t minimum) {
+    AsyncQueue *queue = fs->async;
+    if (!queue){
+        return 0;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    minimum = min(min(minimum, capacity), queue->inflight);
+    while (queue->ready < minimum){
+        pthread_cond_wait(&queue->completed, &queue->lock);
+    }
+
+    size_t count = 0;
+    while (count < capacity && queue->done){
+        AsyncRequest *request = queue->done;
+        queue->done = request->next;
+        completions[count++] = request->completion;
+        free(request);
+    }
+    if (!queue->done){
+        queue->done_tail = NULL;
+    }
+    queue->ready    -= count;
+    queue->inflight -= count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+/**
+ * Clone the specified Inode: the new Inode shares all of its data and
+ * pointer blocks, which are copied on write by either Inode later, so
+ * cloning only writes the new Inode whatever the file size.  Cloning a
+ * snapshot copy yields a writable Inode (restoring the file).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to clone.
+ * @return      Inode number of the clone (-1 on error or if blocks cannot
+ *              be shared on this FileSystem).
+ **/
+ssize_t fs_clone(FileSystem *fs, size_t inode_number) {
+    uint64_t started = trace_op_begin();
+    ssize_t  result  = fs_clone_inode(fs, inode_number, 0);
+    result = fs_flush_checksums(fs) ? result : -1;
+    trace_op_end(TRACE_FS_CLONE, started, 0, inode_number, 0, 0, result);
+    return result;
+}
+
+/**
+ * Take a read-only snapshot of every Inode by doing the following:
+ *
+ *  1. Create the snapshot catalog Inode, whose data maps each Inode number
+ *  to the number of its copy (8 bytes per Inode, 0 if there is none).
+ *
+ *  2. Clone every valid Inode that is not part of a snapshot into a
+ *  read-only copy and record it in the catalog, one catalog block at a time
+ *  (ranges without Inodes are left as holes).
+ *
+ *  3. Mark the catalog as read-only.
+ *
+ * Like fs_clone, this costs Inode and catalog writes but no data copies.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @return      Snapshot number (the catalog Inode), -1 on error.
+ **/
+ssize_t fs_snapshot(FileSystem *fs) {
+    if (!fs->disk || !fs->refcounts){
+        return -1;
+    }
+
+    Inode64 node;
+    ssize_t snapshot = fs_create(fs);
+    if (snapshot < 0 || !fs_load_inode(fs, snapshot, &node)){
+        return -1;
+    }
+    node.flags |= INODE_SNAPSHOT;
+    if (!fs_save_inode(fs, snapshot, &node)){
+        return -1;
+    }
+
+    size_t   inodes_per_block = fs_inodes_per_block(&fs->meta_data);
+    size_t   block_size       = fs_block_size(&fs->meta_data);
+    size_t   entries          = block_size / sizeof(uint64_t);
+    uint64_t current          = 0;              /* Catalog block being filled */
+    bool     pending          = false;          /* Whether it holds unwritten entries */
+    Block   *catalog          = fs_block_get(fs);
+    Block   *block            = fs_block_get(fs);
+    uint64_t *copies          = catalog ? (uint64_t *)catalog->data : NULL;
+    bool     result           = catalog && block;
+    if (catalog){
+        memset(catalog->data, 0, block_size);
+    }
+
+    for (uint64_t i = 1; i <= fs_inode_table_blocks(&fs->meta_data) && result; i++){
+        if (fs_read_block(fs, i, block->data) == DISK_FAILURE){
+            result = false;
+            break;
+        }
+        for (size_t j = 0; j < inodes_per_block && result; j++){
+            size_t inode_number = (i - 1) * inodes_per_block + j;
+            fs_get_inode(&fs->meta_data, block, j, &node);
+            if (!node.valid || (node.flags & (INODE_READONLY | INODE_SNAPSHOT))){
+                continue;
+            }
+
+            // Write out the previous catalog block once past its range
+            if (pending && inode_number / entries != current){
+                if (fs_write(fs, snapshot, catalog->data, block_size, current * block_size) != (ssize_t)block_size){
+                    result = false;
+                    break;
+                }
+                pending = false;
+                memset(catalog->data, 0, block_size);
+            }
+            current = inode_number / entries;
+
+            ssize_t copy = fs_clone_inode(fs, inode_number, INODE_READONLY);
+            if (copy < 0){
+                result = false;
+                break;
+            }
+            copies[inode_number % entries] = copy;
+            pending = true;
+        }
+    }
+    if (result && pending){
+        result  = fs_write(fs, snapshot, catalog->data, block_size, current * block_size) == (ssize_t)block_size;
+        pending = !result;
+    }
+    fs_block_put(fs, block);
+
+    // On failure, drop the copies made so far (including unrecorded ones)
+    if (!result){
+        for (size_t e = 0; pending && e < entries; e++){
+            if (copies[e] && fs_load_inode(fs, copies[e], &node)){
+                fs_release_inode(fs, copies[e], &node);
+            }
+        }
+        fs_block_put(fs, catalog);
+        fs_snapshot_delete(fs, snapshot);
+        return -1;
+    }
+    fs_block_put(fs, catalog);
+
+    if (!fs_load_inode(fs, snapshot, &node)){
+        return -1;
+    }
+    node.flags |= INODE_READONLY;
+    bool saved = fs_save_inode(fs, snapshot, &node);
+    return fs_flush_checksums(fs) && saved ? snapshot : -1;
+}
+
+/**
+ * Return the Inode number of the read-only copy of inode_number in the
+ * given snapshot, which can be read like any other Inode.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       snapshot        Snapshot number (from fs_snapshot).
+ * @param       inode_number    Inode number at the time of the snapshot.
+ * @return      Inode number of the copy (-1 if there is none).
+ **/
+ssize_t fs_snapshot_inode(FileSystem *fs, size_t snapshot, size_t inode_number) {
+    Inode64  node;
+    uint64_t copy = 0;
+    if (!fs_load_inode(fs, snapshot, &node) || !node.valid || !(node.flags & INODE_SNAPSHOT)){
+        return -1;
+    }
+    if (fs_read(fs, snapshot, (char *)&copy, sizeof(copy), inode_number * sizeof(uint64_t)) != sizeof(copy) || !copy){
+        return -1;
+    }
+    return copy;
+}
+
+/**
+ * Delete a snapshot: remove every copy recorded in its catalog (blocks that
+ * only they still reference are freed) and then the catalog itself.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       snapshot        Snapshot number (from fs_snapshot).
+ * @return      Whether or not the whole snapshot was deleted.
+ **/
+bool    fs_snapshot_delete(FileSystem *fs, size_t snapshot) {
+    Inode64 node;
+    if (!fs_load_inode(fs, snapshot, &node) || !node.valid || !(node.flags & INODE_SNAPSHOT)){
+        return false;
+    }
+
+    Block    *catalog = fs_block_get(fs);
+    uint64_t *copies  = catalog ? (uint64_t *)catalog->data : NULL;
+    bool      result  = catalog != NULL;
+    for (size_t offset = 0; catalog && offset < node.size; offset += fs_block_size(&fs->meta_data)){
+        ssize_t length = fs_read(fs, snapshot, catalog->data, fs_block_size(&fs->meta_data), offset);
+        if (length < 0){
+            result = false;
+            continue;
+        }
+        for (size_t e = 0; e < length / sizeof(uint64_t); e++){
+            Inode64 copy;
+            if (!copies[e]){
+                continue;
+            }
+            if (!fs_load_inode(fs, copies[e], &copy) || !copy.valid ||
+                !fs_release_inode(fs, copies[e], &copy)){
+                result = false;
+            }
+        }
+    }
+    fs_block_put(fs, catalog);
+
+    result = fs_release_inode(fs, snapshot, &node) && result;
+    return fs_flush_checksums(fs) && result;
+}
+
+/* Internal Functions */
+
+/**
+ * Read SuperBlock from disk, verify it, and normalize it to the revision 2
+ * layout.  A grown file system (fs_grow) may have a smaller inode table
+ * than its size calls for, or an inode table and checksum region that are
+ * only partly in use.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       meta        SuperBlock64 structure to fill in.
+ * @return      Whether or not a valid SuperBlock was found.
+ **/
+bool    fs_read_super(Disk *disk, SuperBlock64 *meta) {
+    Block *block = (Block *)disk_buffer_get(disk);
+    if (!block || disk_read(disk, 0, block->data) == DISK_FAILURE){
+        disk_buffer_put(disk, (char *)block);
+        disk->reads++;
+        return false;
+    }
+    SuperBlock   super   = block->super;
+    SuperBlock64 super64 = block->super64;
+    disk_buffer_put(disk, (char *)block);
+
+    if (super.magic_number == MAGIC_NUMBER){
+        *meta = (SuperBlock64){
+            .magic_number = MAGIC_NUMBER,
+            .revision     = FS_REVISION_1,
+            .blocks       = super.blocks,
+            .inode_blocks = super.inode_blocks,
+            .inodes       = super.inodes,
+            .inode_size   = sizeof(Inode),
+            .block_size   = BLOCK_SIZE,
+        };
+        if (!meta->inode_blocks || meta->inode_blocks > (meta->blocks + 9) / 10){
+            return false;
+        }
+    } else if (super.magic_number == MAGIC_NUMBER_64){
+        *meta = super64;
+        if (!meta->inode_size){
+            meta->inode_size = INODE_SIZE_64;
+        }
+        if (!meta->block_size){
+            meta->block_size = BLOCK_SIZE;
+        }
+        if (meta->revision != FS_REVISION_2 ||
+            meta->block_size < MIN_BLOCK_SIZE || meta->block_size > MAX_BLOCK_SIZE ||
+            (meta->block_size & (meta->block_size - 1)) ||
+            meta->inode_size < INODE_SIZE_64 || meta->inode_size > MAX_INODE_SIZE ||
+            (meta->inode_size & (meta->inode_size - 1)) ||
+            (meta->features & ~FS_FEATURES_SUPPORTED) ||
+            ((meta->features & FS_FEATURE_COMPRESSION) && (meta->blocks > POINTER_BLOCK_MASK || meta->block_size > MAX_COMPRESSED_BLOCK_SIZE)) ||
+            ((meta->features & FS_FEATURE_CHECKSUMS) ? meta->checksum_blocks < (meta->blocks + fs_checksums_per_block(meta) - 1) / fs_checksums_per_block(meta) : meta->checksum_blocks != 0)){
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    // The disk may still be addressed in blocks of another size
+    return meta->blocks == (uint64_t)disk->blocks * disk->block_size / meta->block_size &&
+           fs_data_start(meta) < meta->blocks &&
+           meta->inodes && meta->inodes % fs_inodes_per_block(meta) == 0 &&
+           meta->inodes <= meta->inode_blocks * fs_inodes_per_block(meta);
+}
+
+/**
+ * Read block from disk and, when checksums are enabled, verify it against
+ * its recorded CRC32C.  A mismatch is reported like a read error.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       block           Block number to read.
+ * @param       data            Buffer of one block.
+ * @return      Block size on success, DISK_FAILURE on error or mismatch.
+ **/
+ssize_t fs_read_block(FileSystem *fs, uint64_t block, char *data) {
+    if (disk_read(fs->disk, block, data) == DISK_FAILURE){
+        return DISK_FAILURE;
+    }
+    if (fs->checksums && fs_checksummed(&fs->meta_data, block) &&
+        crc32c(0, data, fs_block_size(&fs->meta_data)) != fs->checksums[block]){
+        return DISK_FAILURE;
+    }
+    return fs_block_size(&fs->meta_data);
+}
+
+/**
+ * Write block to disk and, when checksums are enabled, record its CRC32C
+ * in memory and mark the checksum block that holds it dirty.  Dirty
+ * checksum blocks are written back by fs_flush_checksums once the
+ * operation's block writes are done.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       block           Block number to write.
+ * @param       data            Buffer of one block.
+ * @return      Block size on success, DISK_FAILURE on error.
+ **/
+ssize_t fs_write_block(FileSystem *fs, uint64_t block, char *data) {
+    if (disk_write(fs->disk, block, data) == DISK_FAILURE){
+        return DISK_FAILURE;
+    }
+    if (fs->checksums && fs_checksummed(&fs->meta_data, block)){
+        fs->checksums[block] = crc32c(0, data, fs_block_size(&fs->meta_data));
+        bitmap_set(fs->dirty_checksums, block / fs_checksums_per_block(&fs->meta_data));
+    }
+    return fs_block_size(&fs->meta_data);
+}
+
+/**
+ * Write back the checksum blocks marked dirty by fs_write_block (and
+ * fs_zero_blocks), each once however many of its checksums changed.
+ * Blocks that fail to write stay dirty.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @return      Whether or not every dirty checksum block was written.
+ **/
+bool    fs_flush_checksums(FileSystem *fs) {
+    const SuperBlock64 *meta   = &fs->meta_data;
+    bool                result = true;
+    if (!fs->dirty_checksums){
+        return true;
+    }
+
+    for (size_t w = 0; w < BITMAP_WORDS(meta->checksum_blocks); w++){
+        for (uint64_t bits = fs->dirty_checksums[w]; bits; bits &= bits - 1){
+            uint64_t index = w * 64 + __builtin_ctzll(bits);
+            if (disk_write(fs->disk, meta->inode_blocks + 1 + index, (char *)(fs->checksums + index * fs_checksums_per_block(meta))) == DISK_FAILURE){
+                result = false;
+                continue;
+            }
+            bitmap_clear(fs->dirty_checksums, index);
+        }
+    }
+    return result;
+}
+
+/**
+ * Decode Inode at index within an Inode block into the 64-bit in-core layout.
+ **/
+void    fs_get_inode(const SuperBlock64 *meta, Block *block, size_t index, Inode64 *node) {
+    if (!fs_revision1(meta)){
+        memcpy(node, (char *)block + index * meta->inode_size, sizeof(Inode64));
+        // Inline data overlays the block pointers: hide it from pointer walkers
+        if (fs_inode_inline(node)){
+            memset(node->direct, 0, sizeof(Inode64) - offsetof(Inode64, direct));
+        }
+        return;
+    }
+
+    Inode *legacy = &block->inodes[index];
+    memset(node, 0, sizeof(Inode64));
+    node->valid    = legacy->valid;
+    node->size     = legacy->size;
+    node->indirect = legacy->indirect;
+    for (size_t i = 0; i < POINTERS_PER_INODE; i++){
+        node->direct[i] = legacy->direct[i];
+    }
+}
+
+/**
+ * Encode in-core Inode into index within an Inode block.  For inline Inodes
+ * only the header is stored, which leaves the inline data untouched.
+ **/
+void    fs_put_inode(const SuperBlock64 *meta, Block *block, size_t index, const Inode64 *node) {
+    if (!fs_revision1(meta)){
+        size_t length = fs_inode_inline(node) ? offsetof(Inode64, direct) : sizeof(Inode64);
+        memcpy((char *)block + index * meta->inode_size, node, length);
+        return;
+    }
+
+    Inode *legacy = &block->inodes[index];
+    legacy->valid    = node->valid;
+    legacy->size     = node->size;
+    legacy->indirect = node->indirect;
+    for (size_t i = 0; i < POINTERS_PER_INODE; i++){
+        legacy->direct[i] = node->direct[i];
+    }
+}
+
+/**
+ * Return address of the inline data area of the Inode at index within an
+ * Inode block (fs_inline_capacity bytes, starting where the pointers are).
+ **/
+char *  fs_inline_data(const SuperBlock64 *meta, Block *block, size_t index) {
+    return (char *)block + index * meta->inode_size + offsetof(Inode64, direct);
+}
+
+/**
+ * Return pointer at index within a pointer block (block_size bytes, which
+ * may be more than a Block holds).
+ **/
+uint64_t fs_get_pointer(const SuperBlock64 *meta, Block *block, size_t index) {
+    return fs_revision1(meta) ? block->pointers[index] : ((uint64_t *)block)[index];
+}
+
+/**
+ * Set pointer at index within a pointer block.
+ **/
+void    fs_set_pointer(const SuperBlock64 *meta, Block *block, size_t index, uint64_t pointer) {
+    if (fs_revision1(meta)){
+        block->pointers[index] = pointer;
+    } else {
+        ((uint64_t *)block)[index] = pointer;
+    }
+}
+
+/**
+ * Return address of the root pointer for the given indirection level
+ * (1 = single, 2 = double, 3 = triple).
+ **/
+uint64_t *fs_indirect_root(Inode64 *node, size_t level) {
+    switch (level) {
+        case 1:  return &node->indirect;
+        case 2:  return &node->double_indirect;
+        default: return &node->triple_indirect;
+    }
+}
+
+/**
+ * Read the Inode table block that holds the specified Inode.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to locate.
+ * @param       block           Block to read Inode table block into (a
+ *                              NULL buffer from fs_block_get fails).
+ * @return      Index of Inode within block (-1 on error).
+ **/
+ssize_t fs_read_inode_block(FileSystem *fs, size_t inode_number, Block *block) {
+    if (!fs->disk || !block || inode_number >= fs->meta_data.inodes){
+        return -1;
+    }
+
+    size_t inodes_per_block = fs_inodes_per_block(&fs->meta_data);
+    if (fs_read_block(fs, inode_number / inodes_per_block + 1, block->data) == DISK_FAILURE){
+        return -1;
+    }
+    return inode_number % inodes_per_block;
+}
+
+/**
+ * Save Inode to Inode table (read-modify-write of its Inode block).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to save.
+ * @param       node            Inode structure to copy from.
+ * @return      Whether or not the Inode was saved.
+ **/
+bool    fs_save_inode(FileSystem *fs, size_t inode_number, Inode64 *node) {
+    Block  *block   = fs_block_get(fs);
+    ssize_t index   = fs_read_inode_block(fs, inode_number, block);
+    bool    written = false;
+    if (index >= 0){
+        fs_put_inode(&fs->meta_data, block, index, node);
+        written = fs_write_block(fs, inode_number / fs_inodes_per_block(&fs->meta_data) + 1, block->data) != DISK_FAILURE;
+    }
+    fs_block_put(fs, block);
+    return written;
+}
+
+/**
+ * Release every block of a loaded Inode and mark it free in the Inode table
+ * (see fs_remove).  Shared trees only lose a reference.  An unreadable
+ * pointer block does not stop the release: the Inode is still cleared, so
+ * nothing live refers to the blocks already freed, and the blocks below it
+ * stay allocated until fs_check reclaims them.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to release.
+ * @param       node            In-core Inode.
+ * @return      Whether or not every block of the Inode was released.
+ **/
+bool    fs_release_inode(FileSystem *fs, size_t inode_number, Inode64 *node) {
+    bool result = true;
+
+    // Release direct blocks
+    for (size_t i = 0; i < POINTERS_PER_INODE; i++){
+        if (fs_pointer_block(node->direct[i])){
+            fs_release_block(fs, fs_pointer_block(node->direct[i]));
+        }
+    }
+
+    // Release indirect data blocks and the indirect blocks themselves
+    for (size_t level = 1; level <= fs_indirect_levels(&fs->meta_data); level++){
+        uint64_t root = *fs_indirect_root(node, level);
+        if (root){
+            if (!fs_block_shared(fs, root)){
+                result = fs_release_tree(fs, root, level) && result;
+            }
+            fs_release_block(fs, root);
+        }
+    }
+
+    memset(node, 0, sizeof(Inode64));
+    return fs_save_inode(fs, inode_number, node) && result;
+}
+
+/**
+ * Clone an Inode into a newly created one (see fs_clone).  The raw Inode is
+ * copied, so inline data comes along, and every block the Inode points to
+ * directly (data blocks and the roots of its indirect trees) gains a
+ * reference.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to clone.
+ * @param       flags           Inode flags to set on the clone (INODE_READONLY
+ *                              for snapshot copies).
+ * @return      Inode number of the clone (-1 on error).
+ **/
+ssize_t fs_clone_inode(FileSystem *fs, size_t inode_number, uint32_t flags) {
+    const SuperBlock64 *meta = &fs->meta_data;
+    Inode64             node;
+
+    if (!fs->refcounts){
+        return -1;
+    }
+    Block  *source = fs_block_get(fs);
+    ssize_t slot   = fs_read_inode_block(fs, inode_number, source);
+    if (slot < 0){
+        fs_block_put(fs, source);
+        return -1;
+    }
+    fs_get_inode(meta, source, slot, &node);
+    if (!node.valid || (node.flags & INODE_SNAPSHOT)){
+        fs_block_put(fs, source);
+        return -1;
+    }
+
+    ssize_t clone       = fs_create(fs);
+    Block  *target      = fs_block_get(fs);
+    ssize_t target_slot = clone < 0 ? -1 : fs_read_inode_block(fs, clone, target);
+    if (target_slot < 0){
+        fs_block_put(fs, target);
+        fs_block_put(fs, source);
+        return -1;
+    }
+
+    for (size_t k = 0; k < POINTERS_PER_INODE; k++){
+        fs_share_block(fs, fs_pointer_block(node.direct[k]));
+    }
+    for (size_t level = 1; level <= fs_indirect_levels(meta); level++){
+        fs_share_block(fs, *fs_indirect_root(&node, level));
+    }
+
+    memcpy((char *)target + target_slot * meta->inode_size, (char *)source + slot * meta->inode_size, meta->inode_size);
+    node.flags = (node.flags & ~INODE_READONLY) | flags;
+    fs_put_inode(meta, target, target_slot, &node);
+    ssize_t written = fs_write_block(fs, clone / fs_inodes_per_block(meta) + 1, target->data);
+    fs_block_put(fs, target);
+    fs_block_put(fs, source);
+    if (written == DISK_FAILURE){
+        fs_release_inode(fs, clone, &node);
+        return -1;
+    }
+    return clone;
+}
+
+/**
+ * Add a reference to a block (0 and out of range blocks are ignored).
+ **/
+void    fs_share_block(FileSystem *fs, uint64_t block) {
+    if (block && block < fs->meta_data.blocks){
+        fs->refcounts[block]++;
+    }
+}
+
+/**
+ * Copy a shared pointer block, whose contents are in block, to a newly
+ * allocated block before it is modified: every block it points to gains a
+ * reference and the original loses one.  The copy is written by the caller.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       block           Contents of the shared pointer block.
+ * @param       number          Block number of the shared pointer block.
+ * @return      Block number of the copy (-1 if disk is full).
+ **/
+ssize_t fs_copy_pointers(FileSystem *fs, Block *block, uint64_t number) {
+    ssize_t copy = fs_allocate_block(fs);
+    if (copy < 0){
+        return -1;
+    }
+    for (size_t i = 0; i < fs_pointers_per_block(&fs->meta_data); i++){
+        fs_share_block(fs, fs_pointer_block(fs_get_pointer(&fs->meta_data, block, i)));
+    }
+    fs_release_block(fs, number);
+    return copy;
+}
+
+/**
+ * Locate the pointer for file block index by walking the direct pointers and
+ * then the single, double, and triple indirect trees.  On success the
+ * pointer is slot path->slot of the leaf pointer block held by path, or of
+ * the Inode's direct pointers if path->depth is 0 (see fs_get_slot).
+ *
+ * When allocating, missing pointer blocks are allocated and recorded in the
+ * Inode or in the pointer blocks held by path, but the data block itself is
+ * left to the caller.  Shared pointer blocks on the way are copied (see
+ * fs_copy_pointers), since allocating means the caller is about to write.
+ * Modified pointer blocks are not written until fs_commit_path so the
+ * caller can write the data block first.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       node            In-core Inode (updated when allocating).
+ * @param       index           File block index.
+ * @param       allocate        Whether or not to allocate missing pointer blocks.
+ * @param       path            Pointer blocks visited (for fs_commit_path).
+ * @param       allocated       Set if any block was allocated, in which case
+ *                              the Inode must be saved (may be NULL).
+ * @return      1 if the pointer was located, 0 if index lies under an
+ *              unallocated pointer block, -1 on error or no space.
+ **/
+int     fs_map_slot(FileSystem *fs, Inode64 *node, size_t index, bool allocate, MapPath *path, bool *allocated) {
+    const SuperBlock64 *meta     = &fs->meta_data;
+    size_t              pointers = fs_pointers_per_block(meta);
+
+    path->depth = 0;
+
+    // Direct pointers
+    if (index < POINTERS_PER_INODE){
+        path->slot = index;
+        return 1;
+    }
+
+    // Find indirection level covering index (span = pointers^level)
+    size_t level = 1;
+    size_t span  = pointers;
+    index -= POINTERS_PER_INODE;
+    while (index >= span){
+        index -= span;
+        span  *= pointers;
+        if (++level > fs_indirect_levels(meta)){
+            return -1;
+        }
+    }
+
+    // Borrow the pointer blocks the walk needs (kept until fs_release_path)
+    for (size_t depth = 0; depth < level; depth++){
+        if (!path->blocks[depth] && !(path->blocks[depth] = fs_block_get(fs))){
+            return -1;
+        }
+    }
+
+    // Load (or allocate) root pointer block
+    uint64_t *root = fs_indirect_root(node, level);
+    if (!*root){
+        if (!allocate){
+            return 0;
+        }
+        ssize_t pointer = fs_allocate_block(fs);
+        if (pointer < 0){
+            return -1;
+        }
+        *root = pointer;
+        memset(path->blocks[0]->data, 0, fs_block_size(meta));
+        path->dirty[0] = true;
+        if (allocated) *allocated = true;
+    } else {
+        if (fs_read_block(fs, *root, path->blocks[0]->data) == DISK_FAILURE){
+            return -1;
+        }
+        path->dirty[0] = false;
+        if (allocate && fs_block_shared(fs, *root)){
+            ssize_t copy = fs_copy_pointers(fs, path->blocks[0], *root);
+            if (copy < 0){
+                return -1;
+            }
+            *root = copy;
+            path->dirty[0] = true;
+            if (allocated) *allocated = true;
+        }
+    }
+    path->numbers[0] = *root;
+    path->depth      = 1;
+
+    // Walk down to the leaf pointer block
+    for (size_t depth = 0; ; depth++){
+        Block *block = path->blocks[depth];
+        span /= pointers;
+        size_t slot = index / span;
+        index %= span;
+
+        if (depth + 1 == level){
+            path->slot = slot;
+            return 1;
+        }
+
+        uint64_t next  = fs_get_pointer(meta, block, slot);
+        bool     fresh = false;
+        if (!next){
+            if (!allocate){
+                return 0;
+            }
+            ssize_t pointer = fs_allocate_block(fs);
+            if (pointer < 0){
+                return -1;
+            }
+            next  = pointer;
+            fresh = true;
+            fs_set_pointer(meta, block, slot, next);
+            path->dirty[depth] = true;
+            if (allocated) *allocated = true;
+        }
+
+        Block *child = path->blocks[depth + 1];
+        if (fresh){
+            memset(child->data, 0, fs_block_size(meta));
+            path->dirty[depth + 1] = true;
+        } else {
+            if (fs_read_block(fs, next, child->data) == DISK_FAILURE){
+                return -1;
+            }
+            path->dirty[depth + 1] = false;
+            if (allocate && fs_block_shared(fs, next)){
+                ssize_t copy = fs_copy_pointers(fs, child, next);
+                if (copy < 0){
+                    return -1;
+                }
+                next = copy;
+                fs_set_pointer(meta, block, slot, next);
+                path->dirty[depth]     = true;
+                path->dirty[depth + 1] = true;
+            }
+        }
+        path->numbers[depth + 1] = next;
+        path->depth              = depth + 2;
+    }
+}
+
+/**
+ * Return the pointer offset slots past the one located by fs_map_slot.
+ **/
+uint64_t fs_get_slot(FileSystem *fs, Inode64 *node, MapPath *path, size_t offset) {
+    if (!path->depth){
+        return node->direct[path->slot + offset];
+    }
+    return fs_get_pointer(&fs->meta_data, path->blocks[path->depth - 1], path->slot + offset);
+}
+
+/**
+ * Set the pointer offset slots past the one located by fs_map_slot (the
+ * leaf pointer block is marked dirty, the Inode is left to the caller).
+ **/
+void    fs_set_slot(FileSystem *fs, Inode64 *node, MapPath *path, size_t offset, uint64_t pointer) {
+    if (!path->depth){
+        node->direct[path->slot + offset] = pointer;
+        return;
+    }
+    fs_set_pointer(&fs->meta_data, path->blocks[path->depth - 1], path->slot + offset, pointer);
+    path->dirty[path->depth - 1] = true;
+}
+
+/**
+ * Map file block index to its disk block (see fs_map_slot).  When
+ * allocating, missing pointer blocks and the data block are allocated (in
+ * that order).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       node            In-core Inode (updated when allocating).
+ * @param       index           File block index.
+ * @param       allocate        Whether or not to allocate missing blocks.
+ * @param       path            Pointer blocks visited (for fs_commit_path).
+ * @param       allocated       Set if any block was allocated, in which case
+ *                              the data block is new and the Inode must be
+ *                              saved (may be NULL).
+ * @return      Disk block number (0 if unmapped, -1 on error or no space).
+ **/
+ssize_t fs_map_block(FileSystem *fs, Inode64 *node, size_t index, bool allocate, MapPath *path, bool *allocated) {
+    int found = fs_map_slot(fs, node, index, allocate, path, allocated);
+    if (found <= 0){
+        return found;
+    }
+
+    uint64_t pointer = fs_get_slot(fs, node, path, 0);
+    if (!pointer && allocate){
+        ssize_t block = fs_allocate_block(fs);
+        if (block < 0){
+            return -1;
+        }
+        fs_set_slot(fs, node, path, 0, block);
+        if (allocated) *allocated = true;
+        pointer = block;
+    }
+    return fs_pointer_block(pointer);
+}
+
+/**
+ * Write modified pointer blocks on path, from the leaf up to the root.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       path            Pointer blocks returned by fs_map_block.
+ * @return      Whether or not all writes succeeded.
+ **/
+bool    fs_commit_path(FileSystem *fs, MapPath *path) {
+    for (size_t depth = path->depth; depth > 0; depth--){
+        if (path->dirty[depth - 1]){
+            if (fs_write_block(fs, path->numbers[depth - 1], path->blocks[depth - 1]->data) == DISK_FAILURE){
+                return false;
+            }
+            path->dirty[depth - 1] = false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Return the pointer blocks borrowed by fs_map_slot to the disk arena.  A
+ * MapPath starts zeroed and may be reused for any number of fs_map_slot
+ * calls before it is released.
+ **/
+void    fs_release_path(FileSystem *fs, MapPath *path) {
+    for (size_t depth = 0; depth < MAX_INDIRECT_LEVELS; depth++){
+        fs_block_put(fs, path->blocks[depth]);
+        path->blocks[depth] = NULL;
+    }
+    path->depth = 0;
+}
+
+/**
+ * Return the file block index just past the leaf of pointers (the direct
+ * pointers, or one indirect leaf block) that holds the pointer for index.
+ * Leaves at every indirection level start POINTERS_PER_INODE plus a
+ * multiple of the pointers per block.
+ **/
+uint64_t fs_leaf_end(const SuperBlock64 *meta, uint64_t index) {
+    if (index < POINTERS_PER_INODE){
+        return POINTERS_PER_INODE;
+    }
+    size_t pointers = fs_pointers_per_block(meta);
+    return index + pointers - (index - POINTERS_PER_INODE) % pointers;
+}
+
+/**
+ * Return the compression cluster holding file block index.  Clusters are
+ * CLUSTER_BLOCKS consecutive blocks that never straddle a pointer block: the
+ * direct pointers form one full cluster and a short one, and each indirect
+ * leaf holds a whole number of clusters.
+ *
+ * @param       index           File block index.
+ * @param       first           Set to the file block index of the cluster start.
+ * @param       count           Set to the number of blocks in the cluster.
+ **/
+void    fs_cluster_range(uint64_t index, uint64_t *first, size_t *count) {
+    if (index < POINTERS_PER_INODE){
+        *first = index - index % CLUSTER_BLOCKS;
+        *count = min(CLUSTER_BLOCKS, POINTERS_PER_INODE - *first);
+    } else {
+        *first = index - (index - POINTERS_PER_INODE) % CLUSTER_BLOCKS;
+        *count = CLUSTER_BLOCKS;
+    }
+}
+
+/**
+ * Allocate a scratch buffer for the given number of contiguous blocks of
+ * cluster data (compressed streams and whole clusters span several blocks,
+ * so they cannot come from the arena).  It is DISK_ALIGNMENT aligned, so
+ * direct I/O into it needs no bounce buffer.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       blocks          Number of blocks.
+ * @return      Buffer to free (NULL on error).
+ **/
+char *  fs_cluster_buffer(FileSystem *fs, size_t blocks) {
+    void *memory = NULL;
+    if (posix_memalign(&memory, DISK_ALIGNMENT, blocks * fs_block_size(&fs->meta_data)) != 0){
+        return NULL;
+    }
+    return memory;
+}
+
+/**
+ * Read bytes [offset, offset + length) of a cluster located by fs_map_slot.
+ *
+ * A compressed cluster has POINTER_COMPRESSED set in each of its pointers
+ * along with the compressed length; the compressed stream is stored in the
+ * blocks of the leading pointers and the trailing pointers hold no block.
+ * Otherwise every pointer maps its own block (0 for a hole).  Data past the
+ * end of the stream reads as zeroes.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       node            In-core Inode.
+ * @param       path            Location of the first pointer of the cluster.
+ * @param       count           Number of blocks in the cluster.
+ * @param       data            Buffer to copy data to.
+ * @param       offset          Byte offset within the cluster.
+ * @param       length          Number of bytes to read.
+ * @return      Whether or not the cluster could be read.
+ **/
+bool    fs_cluster_load(FileSystem *fs, Inode64 *node, MapPath *path, size_t count, char *data, size_t offset, size_t length) {
+    uint64_t first      = fs_get_slot(fs, node, path, 0);
+    size_t   block_size = fs_block_size(&fs->meta_data);
+
+    if (!(first & POINTER_COMPRESSED)){
+        Block *block  = fs_block_get(fs);
+        bool   result = block != NULL;
+        for (size_t i = offset / block_size; result && i * block_size < offset + length; i++){
+            size_t   start   = max(offset, i * block_size);
+            size_t   chunk   = min((i + 1) * block_size, offset + length) - start;
+            uint64_t pointer = fs_pointer_block(fs_get_slot(fs, node, path, i));
+            if (!pointer){
+                memset(data + start - offset, 0, chunk);
+                continue;
+            }
+            result = fs_read_block(fs, pointer, block->data) != DISK_FAILURE;
+            if (result){
+                memcpy(data + start - offset, (char *)block + start % block_size, chunk);
+            }
+        }
+        fs_block_put(fs, block);
+        return result;
+    }
+
+    size_t packed_length = fs_pointer_length(first);
+    size_t packed_blocks = (packed_length + block_size - 1) / block_size;
+    if (!packed_length || packed_blocks >= count){
+        return false;
+    }
+
+    // Decompress straight into the caller's buffer when reading from the start
+    char *packed  = fs_cluster_buffer(fs, packed_blocks + (offset ? count : 0));
+    char *cluster = packed ? packed + packed_blocks * block_size : NULL;
+    bool  result  = packed != NULL;
+    for (size_t i = 0; result && i < packed_blocks; i++){
+        uint64_t pointer = fs_pointer_block(fs_get_slot(fs, node, path, i));
+        result = pointer && pointer < fs->meta_data.blocks &&
+                 fs_read_block(fs, pointer, packed + i * block_size) != DISK_FAILURE;
+    }
+
+    char   *output   = offset ? cluster : data;
+    ssize_t unpacked = result ? lz_decompress(packed, packed_length, output, offset + length) : -1;
+    result = unpacked >= 0;
+    if (result){
+        memset(output + unpacked, 0, offset + length - unpacked);
+        if (offset){
+            memcpy(data, cluster + offset, length);
+        }
+    }
+    free(packed);
+    return result;
+}
+
+/**
+ * Write the first length bytes of a cluster located by fs_map_slot,
+ * replacing its previous contents.  The data is compressed when that saves
+ * at least one block and stored as is otherwise; the cluster's existing
+ * blocks are reused first and any left over are released.  Pointers are
+ * updated in the Inode or in path (written by fs_commit_path).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       node            In-core Inode (updated).
+ * @param       path            Location of the first pointer of the cluster.
+ * @param       count           Number of blocks in the cluster.
+ * @param       data            Cluster contents.
+ * @param       length          Number of bytes of contents (> 0).
+ * @param       dirty           Set if the Inode was modified.
+ * @return      Whether or not the cluster was written.
+ **/
+bool    fs_cluster_store(FileSystem *fs, Inode64 *node, MapPath *path, size_t count, const char *data, size_t length, bool *dirty) {
+    uint64_t blocks[CLUSTER_BLOCKS];
+    uint64_t shared[CLUSTER_BLOCKS];
+    size_t   block_size = fs_block_size(&fs->meta_data);
+    size_t   nblocks = (length + block_size - 1) / block_size;
+    size_t   nold    = 0;
+    size_t   nshared = 0;
+
+    // Shared blocks are not reused, they only lose a reference once stored
+    for (size_t i = 0; i < count; i++){
+        uint64_t pointer = fs_pointer_block(fs_get_slot(fs, node, path, i));
+        if (pointer && fs_block_shared(fs, pointer)){
+            shared[nshared++] = pointer;
+        } else if (pointer){
+            blocks[nold++] = pointer;
+        }
+    }
+
+    char       *packed        = nblocks > 1 ? fs_cluster_buffer(fs, nblocks - 1) : NULL;
+    size_t      packed_length = packed ? lz_compress(data, length, packed, (nblocks - 1) * block_size) : 0;
+    const char *source        = packed_length ? packed : data;
+    size_t      stored        = packed_length ? packed_length : length;
+    size_t      needed        = (stored + block_size - 1) / block_size;
+
+    for (size_t i = nold; i < needed; i++){
+        ssize_t pointer = fs_allocate_block(fs);
+        if (pointer < 0){
+            while (i-- > nold){
+                fs_release_block(fs, blocks[i]);
+            }
+            free(packed);
+            return false;
+        }
+        blocks[i] = pointer;
+    }
+
+    Block *block   = fs_block_get(fs);
+    bool   written = block != NULL;
+    for (size_t i = 0; written && i < needed; i++){
+        size_t chunk = min(block_size, stored - i * block_size);
+        memcpy(block->data, source + i * block_size, chunk);
+        memset((char *)block + chunk, 0, block_size - chunk);
+        written = fs_write_block(fs, blocks[i], block->data) != DISK_FAILURE;
+    }
+    fs_block_put(fs, block);
+    free(packed);
+    if (!written){
+        return false;
+    }
+    for (size_t i = needed; i < nold; i++){
+        fs_release_block(fs, blocks[i]);
+    }
+    for (size_t i = 0; i < nshared; i++){
+        fs_release_block(fs, shared[i]);
+    }
+
+    for (size_t i = 0; i < count; i++){
+        uint64_t pointer = i < needed ? blocks[i] : 0;
+        if (packed_length && i < nblocks){
+            pointer |= POINTER_COMPRESSED | ((uint64_t)packed_length << POINTER_LENGTH_SHIFT);
+        }
+        fs_set_slot(fs, node, path, i, pointer);
+    }
+    if (!path->depth){
+        *dirty = true;
+    }
+    return true;
+}
+
+/**
+ * Read from a compressed Inode (see fs_read), one cluster at a time.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       node            In-core Inode.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read (within file size).
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_read_clusters(FileSystem *fs, Inode64 *node, char *data, size_t length, size_t offset) {
+    size_t  block_size = fs_block_size(&fs->meta_data);
+    size_t  bytesread  = 0;
+    MapPath path       = {0};
+    while (bytesread < length){
+        uint64_t first;
+        size_t   count;
+        fs_cluster_range((offset + bytesread) / block_size, &first, &count);
+
+        size_t  start = offset + bytesread - first * block_size;
+        size_t  chunk = min(count * block_size - start, length - bytesread);
+
+        int found = fs_map_slot(fs, node, first, false, &path, NULL);
+        if (found < 0){
+            fs_release_path(fs, &path);
+            return -1;
+        }
+        if (!found){
+            memset(data + bytesread, 0, chunk);
+        } else if (!fs_cluster_load(fs, node, &path, count, data + bytesread, start, chunk)){
+            fs_release_path(fs, &path);
+            return -1;
+        }
+        bytesread += chunk;
+    }
+    fs_release_path(fs, &path);
+    return bytesread;
+}
+
+/**
+ * Write to a compressed Inode (see fs_write).  Each cluster the write
+ * touches is loaded if the write only covers part of it, updated, and
+ * stored again, after which its pointer blocks and the Inode are saved.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       node            In-core Inode (updated).
+ * @param       data            Buffer with data to copy.
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t fs_write_clusters(FileSystem *fs, size_t inode_number, Inode64 *node, const char *data, size_t length, size_t offset) {
+    char   *cluster      = fs_cluster_buffer(fs, CLUSTER_BLOCKS);
+    size_t  block_size   = fs_block_size(&fs->meta_data);
+    size_t  byteswritten = 0;
+    MapPath path         = {0};
+    if (!cluster){
+        return -1;
+    }
+
+    while (byteswritten < length){
+        uint64_t first;
+        size_t   count;
+        fs_cluster_range((offset + byteswritten) / block_size, &first, &count);
+
+        size_t  base   = first * block_size;
+        size_t  start  = offset + byteswritten - base;
+        size_t  chunk  = min(count * block_size - start, length - byteswritten);
+        size_t  valid  = node->size > base ? min(node->size - base, count * block_size) : 0;
+        bool    dirty  = false;
+
+        if (fs_map_slot(fs, node, first, true, &path, &dirty) <= 0){
+            break;
+        }
+
+        // Keep existing data the write does not replace
+        if (valid && (start || start + chunk < valid) &&
+            !fs_cluster_load(fs, node, &path, count, cluster, 0, valid)){
+            fs_release_path(fs, &path);
+            free(cluster);
+            return -1;
+        }
+        if (start > valid){
+            memset(cluster + valid, 0, start - valid);
+        }
+        memcpy(cluster + start, data + byteswritten, chunk);
+
+        if (!fs_cluster_store(fs, node, &path, count, cluster, max(valid, start + chunk), &dirty)){
+            fs_commit_path(fs, &path);
+            if (dirty){
+                fs_save_inode(fs, inode_number, node);
+            }
+            break;
+        }
+        if (!fs_commit_path(fs, &path)){
+            fs_release_path(fs, &path);
+            free(cluster);
+            return -1;
+        }
+
+        byteswritten += chunk;
+        if (offset + byteswritten > node->size){
+            node->size = offset + byteswritten;
+            dirty = true;
+        }
+        if (dirty && !fs_save_inode(fs, inode_number, node)){
+            fs_release_path(fs, &path);
+            free(cluster);
+            return -1;
+        }
+    }
+    fs_release_path(fs, &path);
+    free(cluster);
+
+    if (!byteswritten && length){
+        return -1;
+    }
+    return byteswritten;
+}
+
+/**
+ * Write to an Inode on a FileSystem with dedup enabled (see fs_write).  Each
+ * block the write touches is merged with its existing contents if the write
+ * only covers part of it and handed to fs_dedup_store, after which its
+ * pointer blocks and the Inode are saved.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       node            In-core Inode (updated).
+ * @param       data            Buffer with data to copy.
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes written (-1 on error).
+ **/
+ssize_t fs_write_dedup(FileSystem *fs, size_t inode_number, Inode64 *node, const char *data, size_t length, size_t offset) {
+    size_t block_size   = fs_block_size(&fs->meta_data);
+    size_t byteswritten = 0;
+    MapPath path        = {0};
+
+    while (byteswritten < length){
+        size_t  position = offset + byteswritten;
+        size_t  start    = fs_block_offset(&fs->meta_data, position);
+        size_t  chunk    = min(block_size - start, length - byteswritten);
+        bool    dirty    = false;
+
+        if (fs_map_slot(fs, node, fs_block_index(&fs->meta_data, position), true, &path, &dirty) <= 0){
+            break;
+        }
+
+        // Keep existing data the write does not replace (holes start zeroed)
+        uint64_t slot    = fs_get_slot(fs, node, &path, 0);
+        uint64_t pointer = fs_pointer_block(slot);
+        char    *buffer  = disk_buffer_get(fs->disk);
+        if (!buffer){
+            fs_release_path(fs, &path);
+            return -1;
+        }
+        if (chunk < block_size){
+            if (!pointer || (slot & POINTER_UNWRITTEN)){
+                memset(buffer, 0, block_size);
+            } else if (fs_read_block(fs, pointer, buffer) == DISK_FAILURE){
+                disk_buffer_put(fs->disk, buffer);
+                fs_release_path(fs, &path);
+                return -1;
+            }
+        }
+        memcpy(buffer + start, data + byteswritten, chunk);
+
+        bool stored = fs_dedup_store(fs, node, &path, buffer, &dirty);
+        disk_buffer_put(fs->disk, buffer);
+        if (!stored){
+            fs_commit_path(fs, &path);
+            if (dirty){
+                fs_save_inode(fs, inode_number, node);
+            }
+            break;
+        }
+        if (!fs_commit_path(fs, &path)){
+            fs_release_path(fs, &path);
+            return -1;
+        }
+
+        byteswritten += chunk;
+        if (offset + byteswritten > node->size){
+            node->size = offset + byteswritten;
+            dirty = true;
+        }
+        if (dirty && !fs_save_inode(fs, inode_number, node)){
+            fs_release_path(fs, &path);
+            return -1;
+        }
+    }
+    fs_release_path(fs, &path);
+
+    if (!byteswritten && length){
+        return -1;
+    }
+    return byteswritten;
+}
+
+/**
+ * Store the new contents of the block located by fs_map_slot, sharing an
+ * existing block with identical contents when the content index has one.
+ * Otherwise the contents are written to the current block if no one else
+ * references it (which stops it being unwritten), or to a newly allocated
+ * block, and indexed.  A block that
+ * is replaced loses one reference.  The pointer is updated in the Inode or
+ * in path (written by fs_commit_path).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       node            In-core Inode (updated).
+ * @param       path            Location of the pointer.
+ * @param       data            Block contents (one block).
+ * @param       dirty           Set if the Inode was modified.
+ * @return      Whether or not the block was stored.
+ **/
+bool    fs_dedup_store(FileSystem *fs, Inode64 *node, MapPath *path, const char *data, bool *dirty) {
+    uint64_t slot   = fs_get_slot(fs, node, path, 0);
+    uint64_t old    = fs_pointer_block(slot);
+    uint32_t hash   = crc32c(0, data, fs_block_size(&fs->meta_data));
+    uint64_t target = fs_dedup_lookup(fs, hash, data);
+
+    if (target == old && old){
+        return true;
+    }
+
+    if (target){
+        fs->refcounts[target]++;
+    } else if (old && fs->refcounts[old] == 1){
+        // Overwrite in place: the old contents leave the index first
+        fs_dedup_remove(fs, old);
+        if (fs_write_block(fs, old, (char *)data) == DISK_FAILURE){
+            return false;
+        }
+        fs_dedup_insert(fs, old, hash);
+        if (slot & POINTER_UNWRITTEN){
+            fs_set_slot(fs, node, path, 0, old);
+            if (!path->depth){
+                *dirty = true;
+            }
+        }
+        return true;
+    } else {
+        ssize_t block = fs_allocate_block(fs);
+        if (block < 0){
+            return false;
+        }
+        if (fs_write_block(fs, block, (char *)data) == DISK_FAILURE){
+            fs_release_block(fs, block);
+            return false;
+        }
+        fs_dedup_insert(fs, block, hash);
+        target = block;
+    }
+
+    fs_set_slot(fs, node, path, 0, target);
+    if (old){
+        fs_release_block(fs, old);
+    }
+    if (!path->depth){
+        *dirty = true;
+    }
+    return true;
+}
+
+/**
+ * Find an indexed block whose contents are data.  Candidates with the same
+ * hash are read back and compared, so hash collisions are never shared.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       hash            Content hash of data.
+ * @param       data            Block contents (one block).
+ * @return      Matching block number (0 if none).
+ **/
+uint64_t fs_dedup_lookup(FileSystem *fs, uint32_t hash, const char *data) {
+    DedupIndex *index = fs->dedup;
+    uint64_t    mask  = index->capacity - 1;
+    uint64_t    match = 0;
+    Block      *block = NULL;
+
+    for (uint64_t s = hash & mask; !match && index->slots[s]; s = (s + 1) & mask){
+        uint64_t candidate = index->slots[s];
+        if (index->hashes[candidate] != hash || fs->refcounts[candidate] == UINT32_MAX){
+            continue;
+        }
+        if (!block && !(block = fs_block_get(fs))){
+            break;
+        }
+        if (fs_read_block(fs, candidate, block->data) != DISK_FAILURE &&
+            memcmp(block->data, data, fs_block_size(&fs->meta_data)) == 0){
+            match = candidate;
+        }
+    }
+    fs_block_put(fs, block);
+    return match;
+}
+
+/**
+ * Add block with the given content hash to the content index (linear
+ * probing), doubling the table first if it would become more than half full.
+ *
+ * @return      Whether or not the block was indexed.
+ **/
+bool    fs_dedup_insert(FileSystem *fs, uint64_t block, uint32_t hash) {
+    DedupIndex *index = fs->dedup;
+    if ((index->count + 1) * 2 > index->capacity && !fs_dedup_resize(index, index->capacity * 2)){
+        return false;
+    }
+
+    uint64_t mask = index->capacity - 1;
+    uint64_t s    = hash & mask;
+    while (index->slots[s]){
+        s = (s + 1) & mask;
+    }
+    index->slots[s]      = block;
+    index->hashes[block] = hash;
+    bitmap_set(index->indexed, block);
+    index->count++;
+    return true;
+}
+
+/**
+ * Remove block from the content index if it is there.  Blocks that were
+ * never indexed (partial writes, metadata) are skipped without probing.
+ * Later entries of the probe run are shifted back into the gap, so no
+ * tombstones are needed.
+ **/
+void    fs_dedup_remove(FileSystem *fs, uint64_t block) {
+    DedupIndex *index = fs->dedup;
+    if (!bitmap_test(index->indexed, block)){
+        return;
+    }
+
+    uint64_t mask = index->capacity - 1;
+    uint64_t hole = index->hashes[block] & mask;
+
+    bitmap_clear(index->indexed, block);
+    while (index->slots[hole] != block){
+        if (!index->slots[hole]){
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+
+    for (uint64_t s = (hole + 1) & mask; index->slots[s]; s = (s + 1) & mask){
+        uint64_t home = index->hashes[index->slots[s]] & mask;
+        if (((s - home) & mask) >= ((s - hole) & mask)){
+            index->slots[hole] = index->slots[s];
+            hole = s;
+        }
+    }
+    index->slots[hole] = 0;
+    index->count--;
+}
+
+/**
+ * Rehash the content index into a table of the given number of slots.
+ *
+ * @return      Whether or not the new table could be allocated.
+ **/
+bool    fs_dedup_resize(DedupIndex *index, uint64_t capacity) {
+    uint64_t *slots = calloc(capacity, sizeof(uint64_t));
+    if (!slots){
+        return false;
+    }
+
+    for (uint64_t i = 0; i < index->capacity; i++){
+        uint64_t block = index->slots[i];
+        if (!block){
+            continue;
+        }
+        uint64_t s = index->hashes[block] & (capacity - 1);
+        while (slots[s]){
+            s = (s + 1) & (capacity - 1);
+        }
+        slots[s] = block;
+    }
+
+    free(index->slots);
+    index->slots    = slots;
+    index->capacity = capacity;
+    return true;
+}
+
+/**
+ * Release content index (NULL is ignored).
+ **/
+void    fs_dedup_free(DedupIndex *index) {
+    if (index){
+        free(index->slots);
+        free(index->hashes);
+        free(index->indexed);
+        free(index);
+    }
+}
+
+/**
+ * Convert an inline Inode to a block-mapped one by moving its data into a
+ * newly allocated first data block.  The data block is written before the
+ * Inode is saved, so the data is never lost.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to convert.
+ * @param       node            In-core Inode (updated).
+ * @param       inline_data     Current inline data (node->size bytes).
+ * @return      Whether or not the conversion was successful.
+ **/
+bool    fs_inline_convert(FileSystem *fs, size_t inode_number, Inode64 *node, const char *inline_data) {
+    ssize_t pointer = 0;
+    if (node->size){
+        pointer = fs_allocate_block(fs);
+        if (pointer < 0){
+            return false;
+        }
+
+        Block *block   = fs_block_get(fs);
+        bool   written = false;
+        if (block){
+            memset(block->data, 0, fs_block_size(&fs->meta_data));
+            memcpy(block->data, inline_data, node->size);
+            written = fs_write_block(fs, pointer, block->data) != DISK_FAILURE;
+        }
+        fs_block_put(fs, block);
+        if (!written){
+            fs_release_block(fs, pointer);
+            return false;
+        }
+    }
+
+    node->flags &= ~INODE_INLINE;
+    memset(node->direct, 0, sizeof(Inode64) - offsetof(Inode64, direct));
+    node->direct[0] = pointer;
+    return fs_save_inode(fs, inode_number, node);
+}
+
+/**
+ * Return total length of the iovcnt buffers of iov.
+ *
+ * @return      Number of bytes (-1 if iovcnt is negative or the total does
+ *              not fit in ssize_t).
+ **/
+ssize_t fs_iov_length(const struct iovec *iov, int iovcnt) {
+    if (iovcnt < 0 || (iovcnt && !iov)){
+        return -1;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++){
+        if (iov[i].iov_len > (size_t)SSIZE_MAX - total){
+            return -1;
+        }
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/**
+ * Return the next length bytes of the vector if they lie in one segment,
+ * and consume them.
+ *
+ * @param       vector          Position within caller's buffers.
+ * @param       length          Number of bytes wanted.
+ * @return      Pointer to the bytes (NULL, consuming nothing, if they span
+ *              segments).
+ **/
+char *  fs_iov_direct(IoVector *vector, size_t length) {
+    while (vector->count && vector->skip == vector->iov->iov_len){
+        vector->iov++;
+        vector->count--;
+        vector->skip = 0;
+    }
+    if (!vector->count || vector->iov->iov_len - vector->skip < length){
+        return NULL;
+    }
+
+    char *data = (char *)vector->iov->iov_base + vector->skip;
+    vector->skip += length;
+    return data;
+}
+
+/**
+ * Consume the next length bytes of the vector, copying them into data
+ * (gather) or filling them from data (scatter; zeroes if data is NULL).
+ *
+ * @param       vector          Position within caller's buffers.
+ * @param       data            Contiguous buffer (or NULL).
+ * @param       length          Number of bytes to copy.
+ * @param       gather          Whether to copy from the vector into data.
+ **/
+void    fs_iov_copy(IoVector *vector, char *data, size_t length, bool gather) {
+    while (length && vector->count){
+        size_t chunk   = min(vector->iov->iov_len - vector->skip, length);
+        char  *segment = (char *)vector->iov->iov_base + vector->skip;
+        if (gather){
+            memcpy(data, segment, chunk);
+        } else if (data){
+            memcpy(segment, data, chunk);
+        } else {
+            memset(segment, 0, chunk);
+        }
+
+        data         += data ? chunk : 0;
+        length       -= chunk;
+        vector->skip += chunk;
+        if (vector->skip == vector->iov->iov_len){
+            vector->iov++;
+            vector->count--;
+            vector->skip = 0;
+        }
+    }
+}
+
+/**
+ * Find the first file block index at or after index whose allocation state
+ * matches data (allocated if true, hole if false).  Unallocated indirect
+ * trees are skipped as a whole without reading anything.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       node            In-core Inode.
+ * @param       index           File block index to start from (< nblocks).
+ * @param       data            Whether to look for data (true) or a hole.
+ * @param       nblocks         Number of blocks covered by the file size.
+ * @return      Matching block index (nblocks if none, -1 on read error).
+ **/
+ssize_t fs_seek_block(FileSystem *fs, Inode64 *node, uint64_t index, bool data, uint64_t nblocks) {
+    const SuperBlock64 *meta = &fs->meta_data;
+
+    // Inline data has no holes
+    if (fs_inode_inline(node)){
+        return data ? index : nblocks;
+    }
+
+    // Direct pointers
+    for (; index < min(nblocks, POINTERS_PER_INODE); index++){
+        if ((node->direct[index] != 0) == data){
+            return index;
+        }
+    }
+
+    // Indirect trees
+    uint64_t first = POINTERS_PER_INODE;
+    uint64_t span  = 1;
+    for (size_t level = 1; level <= fs_indirect_levels(meta) && first < nblocks; level++){
+        span *= fs_pointers_per_block(meta);
+        if (index < first + span){
+            uint64_t root  = *fs_indirect_root(node, level);
+            ssize_t  found = nblocks;
+            if (root){
+                found = fs_seek_tree(fs, root, level, first, index, data, nblocks);
+            } else if (!data){
+                found = max(index, first);
+            }
+            if (found < 0 || (uint64_t)found < nblocks){
+                return found;
+            }
+        }
+        first += span;
+    }
+    return nblocks;
+}
+
+/**
+ * Search the pointer block at the given indirection level for the first
+ * file block index at or after index whose allocation state matches data.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       block           Pointer block number.
+ * @param       level           Levels of indirection below block (>= 1).
+ * @param       first           File block index of the first block below block.
+ * @param       index           File block index to start from.
+ * @param       data            Whether to look for data (true) or a hole.
+ * @param       nblocks         Number of blocks covered by the file size.
+ * @return      Matching block index (nblocks if none, -1 on read error).
+ **/
+ssize_t fs_seek_tree(FileSystem *fs, uint64_t block, size_t level, uint64_t first, uint64_t index, bool data, uint64_t nblocks) {
+    const SuperBlock64 *meta     = &fs->meta_data;
+    size_t              ppb      = fs_pointers_per_block(meta);
+    uint64_t            span     = 1;
+    Block              *pointers = fs_block_get(fs);
+    ssize_t             found    = nblocks;
+
+    if (!pointers || block >= meta->blocks || fs_read_block(fs, block, pointers->data) == DISK_FAILURE){
+        fs_block_put(fs, pointers);
+        return -1;
+    }
+
+    for (size_t l = 1; l < level; l++){
+        span *= ppb;
+    }
+
+    for (size_t i = index > first ? (index - first) / span : 0; i < ppb; i++){
+        uint64_t start   = first + i * span;
+        uint64_t pointer = fs_get_pointer(meta, pointers, i);
+        if (start >= nblocks){
+            break;
+        }
+
+        if (!pointer || level == 1){
+            if ((pointer != 0) == data){
+                found = max(index, start);
+                break;
+            }
+            continue;
+        }
+
+        found = fs_seek_tree(fs, pointer, level - 1, start, index, data, nblocks);
+        if (found < 0 || (uint64_t)found < nblocks){
+            break;
+        }
+    }
+    fs_block_put(fs, pointers);
+    return found;
+}
+
+/**
+ * Count the runs of physically consecutive data blocks of a loaded Inode
+ * (holes do not split a run), walking its pointers a leaf at a time.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       node            In-core Inode.
+ * @param       blocks          Set to the number of data blocks (may be NULL).
+ * @param       movable         Set if fs_defrag_inode may move them: the
+ *                              Inode is plain and none of its data or
+ *                              pointer blocks is shared (may be NULL).
+ * @return      Number of runs (-1 if a pointer block could not be read).
+ **/
+ssize_t fs_defrag_runs(FileSystem *fs, Inode64 *node, uint64_t *blocks, bool *movable) {
+    const SuperBlock64 *meta = &fs->meta_data;
+    uint64_t nblocks  = fs_inode_inline(node) ? 0 : fs_block_count(meta, node->size);
+    uint64_t runs     = 0, count = 0, previous = 0;
+    bool     plain    = !(node->flags & (INODE_INLINE | INODE_COMPRESSED | INODE_READONLY | INODE_SNAPSHOT));
+    MapPath  path     = {0};
+
+    for (uint64_t index = 0; index < nblocks; ){
+        uint64_t start = index;
+        uint64_t stop  = min(fs_leaf_end(meta, index), nblocks);
+        int      found = fs_map_slot(fs, node, index, false, &path, NULL);
+        if (found < 0){
+            fs_release_path(fs, &path);
+            return -1;
+        }
+        for (size_t depth = 0; depth < path.depth; depth++){
+            plain = plain && !fs_block_shared(fs, path.numbers[depth]);
+        }
+        for (; found && index < stop; index++){
+            uint64_t block = fs_pointer_block(fs_get_slot(fs, node, &path, index - start));
+            if (!block){
+                continue;
+            }
+            runs    += block != previous + 1;
+            plain    = plain && !fs_block_shared(fs, block);
+            previous = block;
+            count++;
+        }
+        index = stop;
+    }
+    fs_release_path(fs, &path);
+
+    if (blocks) *blocks = count;
+    if (movable) *movable = plain;
+    return runs;
+}
+
+/**
+ * Move the data blocks of one fragmented Inode, in file order, into a run
+ * of free blocks claimed up front (see fs_defrag).  Each block is copied
+ * before the pointer to it is written, and released only after, so after a
+ * crash every pointer names either the old or the new copy of the same data
+ * (the free block bitmap is rebuilt at mount).  The Inode is reloaded for
+ * every batch since async writes may run in between; blocks they add that
+ * do not fit in the run stay where they are.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to move.
+ * @param       options         Defrag options.
+ * @param       report          Counts to add to.
+ * @param       started         When fs_defrag started (for the rate).
+ * @return      Whether or not the Inode was examined (and moved) without
+ *              I/O errors (on failure it may be partly moved).
+ **/
+bool    fs_defrag_inode(FileSystem *fs, size_t inode_number, const DefragOptions *options, DefragReport *report, const struct timespec *started) {
+    const SuperBlock64 *meta = &fs->meta_data;
+    Inode64  node;
+    uint64_t blocks  = 0, length = 0;
+    bool     movable = false;
+
+    fs_async_exclude(fs, true);
+    if (!fs_load_inode(fs, inode_number, &node) || !node.valid){
+        fs_async_exclude(fs, false);
+        return true;
+    }
+    ssize_t runs = fs_defrag_runs(fs, &node, &blocks, &movable);
+    if (runs <= 1){
+        if (blocks){
+            report->files++;
+            report->runs_before += runs;
+            report->runs_after  += runs;
+        }
+        fs_async_exclude(fs, false);
+        return runs >= 0;
+    }
+    report->files++;
+    report->fragmented++;
+    report->runs_before += runs;
+
+    ssize_t target = movable ? fs_claim_run(fs, blocks, &length) : -1;
+    if (target >= 0 && length < blocks){
+        for (uint64_t block = target; block < target + length; block++){
+            fs_release_block(fs, block);
+        }
+        target = -1;
+    }
+    if (target < 0){
+        report->skipped++;
+        report->runs_after += runs;
+        fs_async_exclude(fs, false);
+        if (options->stream){
+            fprintf(options->stream, "inode %zu: %zd runs (left in place)\n", inode_number, runs);
+        }
+        return true;
+    }
+
+    // Move a batch at a time, dropping the lock (and pausing) in between
+    uint64_t next   = target, end = target + blocks;
+    uint64_t index  = 0;
+    MapPath  path   = {0};
+    Block   *data   = fs_block_get(fs);
+    bool     result = data != NULL;
+    bool     locked = true;
+    while (result && next < end){
+        if (!locked){
+            fs_async_exclude(fs, true);
+            if (!fs_load_inode(fs, inode_number, &node) || !node.valid){
+                fs_async_exclude(fs, false);
+                break;
+            }
+        }
+        locked = false;
+
+        uint64_t nblocks = fs_block_count(&fs->meta_data, node.size);
+        uint64_t moved   = 0;
+        while (result && index < nblocks && next < end && moved < DEFRAG_BATCH_BLOCKS){
+            uint64_t start = index;
+            uint64_t stop  = min(fs_leaf_end(meta, index), nblocks);
+            uint64_t freed[DEFRAG_BATCH_BLOCKS];
+            size_t   nfreed = 0;
+            int      found = fs_map_slot(fs, &node, index, false, &path, NULL);
+            if (found <= 0){
+                result = found == 0;
+                index  = stop;
+                continue;
+            }
+            for (index = start; index < stop && next < end && moved < DEFRAG_BATCH_BLOCKS; index++){
+                uint64_t slot  = fs_get_slot(fs, &node, &path, index - start);
+                uint64_t block = fs_pointer_block(slot);
+                if (!block){
+                    continue;
+                }
+                if (slot & POINTER_UNWRITTEN){
+                    result = fs_zero_blocks(fs, next, 1, true);
+                } else {
+                    result = fs_read_block(fs, block, data->data) != DISK_FAILURE &&
+                             fs_write_block(fs, next, data->data) != DISK_FAILURE;
+                    if (result && fs->dedup){
+                        fs_dedup_insert(fs, next, crc32c(0, data->data, fs_block_size(&fs->meta_data)));
+                    }
+                }
+                if (!result){
+                    break;
+                }
+                fs_set_slot(fs, &node, &path, index - start, next | (slot & POINTER_UNWRITTEN));
+                freed[nfreed++] = block;
+                next++;
+                moved++;
+            }
+
+            // Old blocks go only once the pointers to their copies are on
+            // disk; if that fails both stay in use until the next mount
+            if (nfreed){
+                if (!fs_commit_path(fs, &path) || (!path.depth && !fs_save_inode(fs, inode_number, &node))){
+                    result = false;
+                    break;
+                }
+                for (size_t f = 0; f < nfreed; f++){
+                    fs_release_block(fs, freed[f]);
+                }
+            }
+        }
+        if (index >= nblocks){
+            end = next;
+        }
+        result = fs_flush_checksums(fs) && result;
+        fs_async_exclude(fs, false);
+
+        report->blocks += moved;
+        fs_defrag_throttle(options, started, report->blocks);
+    }
+    fs_release_path(fs, &path);
+    fs_block_put(fs, data);
+
+    // Give back what the file no longer needs and measure the result
+    fs_async_exclude(fs, true);
+    for (uint64_t block = next; block < target + blocks; block++){
+        fs_release_block(fs, block);
+    }
+    ssize_t after = fs_load_inode(fs, inode_number, &node) && node.valid ? fs_defrag_runs(fs, &node, NULL, NULL) : 0;
+    fs_async_exclude(fs, false);
+
+    report->relocated += result;
+    report->runs_after += max(after, 0);
+    if (options->stream){
+        fprintf(options->stream, "inode %zu: %zd runs -> %zd runs\n", inode_number, runs, after);
+    }
+    return result && after >= 0;
+}
+
+/**
+ * Sleep until moving moved blocks since started averages no more than the
+ * rate in options (blocks per second, 0 for no limit).
+ **/
+void    fs_defrag_throttle(const DefragOptions *options, const struct timespec *started, uint64_t moved) {
+    struct timespec now;
+    if (!options->rate || !moved){
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9;
+    double wait    = (double)moved / options->rate - elapsed;
+    if (wait > 0){
+        struct timespec delay = {.tv_sec = (time_t)wait, .tv_nsec = (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&delay, NULL);
+    }
+}
+
+/**
+ * Allocate first free block from free block bitmap.
+ *
+ * The bitmap is scanned a word at a time starting from free_hint, the
+ * lowest word that may still contain a free block.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @return      Block number of allocated block (-1 if disk is full).
+ **/
+ssize_t fs_allocate_block(FileSystem *fs) {
+    size_t words = BITMAP_WORDS(fs->meta_data.blocks);
+    for (size_t w = fs->free_hint; w < words; w++){
+        if (fs->free_blocks[w]){
+            size_t block = w * 64 + __builtin_ctzll(fs->free_blocks[w]);
+            bitmap_clear(fs->free_blocks, block);
+            fs->free_hint = w;
+            if (fs->refcounts){
+                fs->refcounts[block] = 1;
+            }
+            return block;
+        }
+    }
+    fs->free_hint = words;
+    return -1;
+}
+
+/**
+ * Claim a run of free blocks for fs_fallocate: the first run of at least
+ * count free data blocks, or the longest run if there is none that long.
+ * The blocks are marked in use (with one reference each).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       count           Number of blocks wanted.
+ * @param       length          Set to the number of blocks claimed (<= count).
+ * @return      First block of the run (-1 if disk is full).
+ **/
+ssize_t fs_claim_run(FileSystem *fs, uint64_t count, uint64_t *length) {
+    uint64_t blocks     = fs->meta_data.blocks;
+    uint64_t best_start = 0, best_length = 0;
+    uint64_t run_start  = 0, run_length  = 0;
+
+    for (uint64_t block = max(fs->free_hint * 64, fs_data_start(&fs->meta_data)); block < blocks && best_length < count; ){
+        uint64_t word = fs->free_blocks[block / 64];
+        if (block % 64 == 0 && !word){
+            run_length = 0;
+            block     += 64;
+            continue;
+        }
+        if (bitmap_test(fs->free_blocks, block)){
+            if (!run_length++){
+                run_start = block;
+            }
+            if (run_length > best_length){
+                best_start  = run_start;
+                best_length = run_length;
+            }
+        } else {
+            run_length = 0;
+        }
+        block++;
+    }
+    if (!best_length){
+        return -1;
+    }
+
+    *length = min(best_length, count);
+    for (uint64_t block = best_start; block < best_start + *length; block++){
+        bitmap_clear(fs->free_blocks, block);
+        if (fs->refcounts){
+            fs->refcounts[block] = 1;
+        }
+    }
+    return best_start;
+}
+
+/**
+ * Make count blocks starting at start read as zeroes for fs_fallocate by
+ * writing zero blocks.  Unwritten blocks are never read through their
+ * pointers, so they are left alone, except that with checksums they are
+ * punched out of the image (or, failing that, zeroed) to keep their
+ * checksums, which are marked dirty one checksum block at a time, valid.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       start           First block.
+ * @param       count           Number of blocks.
+ * @param       unwritten       Whether the blocks are marked unwritten.
+ * @return      Whether or not all writes succeeded.
+ **/
+bool    fs_zero_blocks(FileSystem *fs, uint64_t start, uint64_t count, bool unwritten) {
+    if (unwritten && !fs->checksums){
+        return true;
+    }
+
+    const SuperBlock64 *meta = &fs->meta_data;
+    Block *zeros   = fs_block_get(fs);
+    bool   punched = unwritten && disk_discard(fs->disk, start, count) == (ssize_t)count;
+    bool   written = zeros != NULL;
+    if (zeros){
+        memset(zeros->data, 0, fs_block_size(meta));
+    }
+    for (uint64_t block = start; written && !punched && block < start + count; block++){
+        written = disk_write(fs->disk, block, zeros->data) != DISK_FAILURE;
+    }
+    uint32_t checksum = written ? crc32c(0, zeros->data, fs_block_size(meta)) : 0;
+    fs_block_put(fs, zeros);
+    if (!written || !fs->checksums){
+        return written;
+    }
+
+    for (uint64_t block = start; block < start + count; block++){
+        fs->checksums[block] = checksum;
+    }
+    for (uint64_t index = start / fs_checksums_per_block(meta); index <= (start + count - 1) / fs_checksums_per_block(meta); index++){
+        bitmap_set(fs->dirty_checksums, index);
+    }
+    return true;
+}
+
+/**
+ * Return block to free block bitmap.  When blocks may be shared, this drops
+ * one reference and the block is only freed (and unindexed) with the last.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       block           Block number to release.
+ **/
+void    fs_release_block(FileSystem *fs, uint64_t block) {
+    if (block < fs_data_start(&fs->meta_data) || block >= fs->meta_data.blocks){
+        return;
+    }
+    if (fs->refcounts){
+        if (fs->refcounts[block] > 1){
+            fs->refcounts[block]--;
+            return;
+        }
+        fs->refcounts[block] = 0;
+        if (fs->dedup){
+            fs_dedup_remove(fs, block);
+        }
+    }
+    bitmap_set(fs->free_blocks, block);
+    fs->free_hint = min(fs->free_hint, block / 64);
+    if (fs->discard){
+        fs_discard_block(fs, block);
+    }
+}
+
+/**
+ * Release every block referenced below the pointer block at the given
+ * indirection level (pointer blocks and data blocks, but not block itself).
+ * The tree below a shared pointer block still belongs to its other owners,
+ * so such a block only loses a reference.  Out-of-range pointers are
+ * skipped.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       block           Pointer block number.
+ * @param       level           Levels of indirection below block (>= 1).
+ * @return      Whether or not all pointer blocks could be read.
+ **/
+bool    fs_release_tree(FileSystem *fs, uint64_t block, size_t level) {
+    Block *pointers = fs_block_get(fs);
+    bool   result   = true;
+    if (!pointers || fs_read_block(fs, block, pointers->data) == DISK_FAILURE){
+        fs_block_put(fs, pointers);
+        return false;
+    }
+
+    for (size_t i = 0; i < fs_pointers_per_block(&fs->meta_data); i++){
+        uint64_t pointer = fs_pointer_block(fs_get_pointer(&fs->meta_data, pointers, i));
+        if (!pointer || pointer >= fs->meta_data.blocks){
+            continue;
+        }
+        if (level > 1 && !fs_block_shared(fs, pointer)){
+            result = fs_release_tree(fs, pointer, level - 1) && result;
+        }
+        fs_release_block(fs, pointer);
+    }
+    fs_block_put(fs, pointers);
+    return result;
+}
+
+/**
+ * Release the part of a pointer tree that maps file blocks at or past keep
+ * (see fs_truncate).  A tree entirely past keep is released whole; one that
+ * straddles it is copied first if shared, trimmed recursively, and then
+ * released too if no pointers are left in it, or written back otherwise.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       pointer         Pointer to the tree's root (cleared if released).
+ * @param       level           Levels of indirection below the root (>= 1).
+ * @param       first           File block index of the tree's first data block.
+ * @param       keep            Number of file blocks to keep.
+ * @return      Whether or not all pointer blocks could be read and written.
+ **/
+bool    fs_truncate_tree(FileSystem *fs, uint64_t *pointer, size_t level, uint64_t first, uint64_t keep) {
+    const SuperBlock64 *meta     = &fs->meta_data;
+    size_t              pointers = fs_pointers_per_block(meta);
+    if (!*pointer || *pointer >= meta->blocks){
+        return true;
+    }
+
+    if (first >= keep){
+        bool result = fs_block_shared(fs, *pointer) || fs_release_tree(fs, *pointer, level);
+        fs_release_block(fs, *pointer);
+        *pointer = 0;
+        return result;
+    }
+
+    uint64_t span = 1;
+    for (size_t l = 1; l < level; l++){
+        span *= pointers;
+    }
+    if (first + span * pointers <= keep){
+        return true;
+    }
+
+    Block *block = fs_block_get(fs);
+    bool   dirty = false;
+    if (!block || fs_read_block(fs, *pointer, block->data) == DISK_FAILURE){
+        fs_block_put(fs, block);
+        return false;
+    }
+    if (fs_block_shared(fs, *pointer)){
+        ssize_t copy = fs_copy_pointers(fs, block, *pointer);
+        if (copy < 0){
+            fs_block_put(fs, block);
+            return false;
+        }
+        *pointer = copy;
+        dirty    = true;
+    }
+
+    bool result = true;
+    bool empty  = true;
+    for (size_t i = 0; i < pointers; i++){
+        uint64_t child = fs_get_pointer(meta, block, i);
+        uint64_t index = first + i * span;
+        if (level == 1 && child && index >= keep){
+            fs_release_block(fs, fs_pointer_block(child));
+            child = 0;
+            fs_set_pointer(meta, block, i, child);
+            dirty = true;
+        } else if (level > 1 && child){
+            uint64_t trimmed = child;
+            result = fs_truncate_tree(fs, &trimmed, level - 1, index, keep) && result;
+            if (trimmed != child){
+                child = trimmed;
+                fs_set_pointer(meta, block, i, child);
+                dirty = true;
+            }
+        }
+        empty = empty && !child;
+    }
+
+    if (empty){
+        fs_release_block(fs, *pointer);
+        *pointer = 0;
+    } else if (dirty && fs_write_block(fs, *pointer, block->data) == DISK_FAILURE){
+        result = false;
+    }
+    fs_block_put(fs, block);
+    return result;
+}
+
+/**
+ * Discard a freed block according to the discard mode: immediately, or by
+ * extending the last queued run (or queueing a new one, flushing the queue
+ * first if it is full).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       block           Block number that was just freed.
+ **/
+void    fs_discard_block(FileSystem *fs, uint64_t block) {
+    DiscardQueue *queue = fs->discard;
+    if (queue->mode == DISCARD_SYNC){
+        disk_discard(fs->disk, block, 1);
+        return;
+    }
+
+    if (queue->count){
+        DiscardExtent *last = &queue->extents[queue->count - 1];
+        if (block == last->start + last->count){
+            last->count++;
+            return;
+        }
+        if (block + 1 == last->start){
+            last->start--;
+            last->count++;
+            return;
+        }
+    }
+    if (queue->count == DISCARD_QUEUE_EXTENTS){
+        fs_discard_flush(fs);
+    }
+    queue->extents[queue->count++] = (DiscardExtent){block, 1};
+}
+
+/**
+ * Discard the queued runs: sort them, merge overlapping and adjacent runs,
+ * and discard the blocks in each that are still free.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ **/
+void    fs_discard_flush(FileSystem *fs) {
+    DiscardQueue *queue = fs->discard;
+    if (!queue || !queue->count){
+        return;
+    }
+
+    qsort(queue->extents, queue->count, sizeof(DiscardExtent), fs_discard_compare);
+    uint64_t start = queue->extents[0].start;
+    uint64_t end   = start + queue->extents[0].count;
+    for (uint64_t e = 1; e < queue->count; e++){
+        if (queue->extents[e].start > end){
+            fs_discard_range(fs, start, end);
+            start = queue->extents[e].start;
+        }
+        end = max(end, queue->extents[e].start + queue->extents[e].count);
+    }
+    fs_discard_range(fs, start, end);
+    queue->count = 0;
+}
+
+/**
+ * Discard the free blocks in [start, end), one disk_discard per run.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       start           First block of the range.
+ * @param       end             Block after the range.
+ * @return      Number of blocks discarded.
+ **/
+uint64_t fs_discard_range(FileSystem *fs, uint64_t start, uint64_t end) {
+    uint64_t discarded = 0;
+    start = max(start, fs_data_start(&fs->meta_data));
+    end   = min(end, fs->meta_data.blocks);
+    while (start < end){
+        if (!bitmap_test(fs->free_blocks, start)){
+            start++;
+            continue;
+        }
+        uint64_t run = start;
+        while (run < end && bitmap_test(fs->free_blocks, run)){
+            run++;
+        }
+        if (disk_discard(fs->disk, start, run - start) != DISK_FAILURE){
+            discarded += run - start;
+        }
+        start = run;
+    }
+    return discarded;
+}
+
+/**
+ * Order discard runs by first block (for qsort).
+ **/
+int     fs_discard_compare(const void *a, const void *b) {
+    const DiscardExtent *x = a;
+    const DiscardExtent *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+/**
+ * Queue one asynchronous request, starting the worker pool if needed.
+ *
+ * @return      Whether or not the request was queued.
+ **/
+bool    fs_async_submit(FileSystem *fs, bool write, size_t inode_number, char *data, size_t length, size_t offset, uint64_t tag) {
+    if (!fs_async_start(fs, 0)){
+        return false;
+    }
+
+    AsyncRequest *request = malloc(sizeof(AsyncRequest));
+    if (!request){
+        return false;
+    }
+    *request = (AsyncRequest){
+        .write        = write,
+        .inode_number = inode_number,
+        .data         = data,
+        .length       = length,
+        .offset       = offset,
+        .completion   = {.tag = tag, .result = -1},
+    };
+
+    AsyncQueue *queue = fs->async;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->pending_tail){
+        queue->pending_tail->next = request;
+    } else {
+        queue->pending = request;
+    }
+    queue->pending_tail = request;
+    queue->inflight++;
+    pthread_cond_signal(&queue->submitted);
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+/**
+ * Async worker: take pending requests in submission order, run each under
+ * the I/O lock (shared for reads, exclusive for writes), and move it to the
+ * done list.  Exits once stopping is set and nothing is pending.
+ *
+ * @param       arg             Pointer to FileSystem structure.
+ * @return      NULL.
+ **/
+void *  fs_async_worker(void *arg) {
+    FileSystem *fs    = arg;
+    AsyncQueue *queue = fs->async;
+
+    pthread_mutex_lock(&queue->lock);
+    while (true){
+        while (!queue->pending && !queue->stopping){
+            pthread_cond_wait(&queue->submitted, &queue->lock);
+        }
+        AsyncRequest *request = queue->pending;
+        if (!request){
+            break;
+        }
+        queue->pending = request->next;
+        if (!queue->pending){
+            queue->pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        if (request->write){
+            pthread_rwlock_wrlock(&queue->io_lock);
+            request->completion.result = fs_write(fs, request->inode_number, request->data, request->length, request->offset);
+        } else {
+            pthread_rwlock_rdlock(&queue->io_lock);
+            request->completion.result = fs_read(fs, request->inode_number, request->data, request->length, request->offset);
+        }
+        pthread_rwlock_unlock(&queue->io_lock);
+
+        pthread_mutex_lock(&queue->lock);
+        request->next = NULL;
+        if (queue->done_tail){
+            queue->done_tail->next = request;
+        } else {
+            queue->done = request;
+        }
+        queue->done_tail = request;
+        queue->ready++;
+        pthread_cond_broadcast(&queue->completed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+/**
+ * Stop the async worker pool: let the workers finish every pending request,
+ * join them, and drop completions that were never reaped.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ **/
+void    fs_async_stop(FileSystem *fs) {
+    AsyncQueue *queue = fs->async;
+    if (!queue){
+        return;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = true;
+    pthread_cond_broadcast(&queue->submitted);
+    pthread_mutex_unlock(&queue->lock);
+    for (size_t w = 0; w < queue->workers; w++){
+        pthread_join(queue->threads[w], NULL);
+    }
+
+    while (queue->done){
+        AsyncRequest *request = queue->done;
+        queue->done = request->next;
+        free(request);
+    }
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->submitted);
+    pthread_cond_destroy(&queue->completed);
+    pthread_rwlock_destroy(&queue->io_lock);
+    free(queue);
+    fs->async = NULL;
+}
+
+/**
+ * Take (or drop) the async I/O lock exclusively when the worker pool runs,
+ * so that long operations like fs_defrag can run between submitted
+ * requests.  The pool must not be started while the lock is held.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       exclude         Whether to take (or drop) the lock.
+ **/
+void    fs_async_exclude(FileSystem *fs, bool exclude) {
+    if (!fs->async){
+        return;
+    }
+    if (exclude){
+        pthread_rwlock_wrlock(&fs->async->io_lock);
+    } else {
+        pthread_rwlock_unlock(&fs->async->io_lock);
+    }
+}
+
+/**
+ * Mark block as in use in the free block bitmap.
+ **/
+void    fs_mark_used(FileSystem *fs, uint64_t block) {
+    if (block < fs->meta_data.blocks){
+        bitmap_clear(fs->free_blocks, block);
+    }
+}
+
+/**
+ * Return number of workers for a pass over the given number of blocks: one
+ * per online CPU, bounded by MOUNT_MAX_THREADS and by the number of chunks
+ * to claim.
+ **/
+size_t  fs_scan_threads(uint64_t blocks) {
+    long   cpus   = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t chunks = (blocks + MOUNT_CHUNK_BLOCKS - 1) / MOUNT_CHUNK_BLOCKS;
+    size_t count  = min((uint64_t)max(cpus, 1), chunks);
+    return max(min(count, MOUNT_MAX_THREADS), 1);
+}
+
+/**
+ * Scan worker: repeatedly claim the next MOUNT_CHUNK_BLOCKS blocks (up to
+ * and including worker->last) and pass each one to the worker's scan
+ * function.
+ *
+ * @param       arg             Pointer to ScanWorker structure.
+ * @return      NULL.
+ **/
+void *  fs_scan_worker(void *arg) {
+    ScanWorker *worker = arg;
+    uint64_t    last   = worker->last;
+
+    while (true){
+        uint64_t first = __atomic_fetch_add(worker->next, MOUNT_CHUNK_BLOCKS, __ATOMIC_RELAXED);
+        if (first > last){
+            break;
+        }
+        for (uint64_t b = first; b < first + MOUNT_CHUNK_BLOCKS && b <= last; b++){
+            worker->scan(worker, b);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run workers over their block range (usually the inode table).  Workers
+ * 1..count-1 get their own threads and the calling thread acts as worker 0.
+ * Workers that cannot be started are skipped; the others (at least the
+ * calling thread) still drain the whole range.
+ *
+ * @param       workers         Initialized workers sharing one next cursor.
+ * @param       count           Number of workers.
+ **/
+void    fs_scan_run(ScanWorker *workers, size_t count) {
+    for (size_t w = 1; w < count; w++){
+        workers[w].started = pthread_create(&workers[w].thread, NULL, fs_scan_worker, &workers[w]) == 0;
+    }
+
+    fs_scan_worker(&workers[0]);
+
+    for (size_t w = 1; w < count; w++){
+        if (workers[w].started){
+            pthread_join(workers[w].thread, NULL);
+        }
+    }
+}
+
+/**
+ * Mark every block referenced by the valid inodes in one inode table block
+ * as in use in the worker's free block bitmap.
+ *
+ * @param       worker          Pointer to ScanWorker structure.
+ * @param       block           Inode table block number.
+ **/
+void    fs_mount_scan_block(ScanWorker *worker, uint64_t block) {
+    FileSystem *fs     = &worker->view;
+    Block      *inodes = fs_block_get(fs);
+    if (!inodes || fs_read_block(fs, block, inodes->data) == DISK_FAILURE){
+        fs_block_put(fs, inodes);
+        return;
+    }
+
+    for (size_t j = 0; j < fs_inodes_per_block(&fs->meta_data); j++){
+        Inode64 node;
+        fs_get_inode(&fs->meta_data, inodes, j, &node);
+        if (!node.valid){
+            continue;
+        }
+        // Compressed clusters are not indexed (their blocks hold streams)
+        bool index = !fs_inode_compressed(&node);
+        for (size_t k = 0; k < POINTERS_PER_INODE; k++){
+            fs_mount_reference(worker, fs_pointer_block(node.direct[k]), 0, index);
+        }
+        for (size_t level = 1; level <= fs_indirect_levels(&fs->meta_data); level++){
+            fs_mount_reference(worker, *fs_indirect_root(&node, level), level, index);
+        }
+    }
+    fs_block_put(fs, inodes);
+}
+
+/**
+ * Mark a block referenced by a valid inode, and for pointer blocks (level
+ * >= 1) every block below it, as in use.  When blocks may be shared, the
+ * reference is counted and only the first one walks the tree below the
+ * block or, for data blocks, queues it for the content index.
+ *
+ * @param       worker          Pointer to ScanWorker structure.
+ * @param       block           Referenced block number (0 or out of range for none).
+ * @param       level           Levels of indirection below block (0 for data block).
+ * @param       index           Whether or not data blocks may be indexed.
+ **/
+void    fs_mount_reference(ScanWorker *worker, uint64_t block, size_t level, bool index) {
+    FileSystem *fs = &worker->view;
+    if (!block || block >= fs->meta_data.blocks){
+        return;
+    }
+
+    fs_mark_used(fs, block);
+    if (fs->refcounts &&
+        __atomic_fetch_add(&fs->refcounts[block], 1, __ATOMIC_RELAXED)){
+        return;
+    }
+
+    if (level == 0){
+        if (index && worker->indexed){
+            // Without checksums the hash has to be computed from the contents
+            if (!(fs->meta_data.features & FS_FEATURE_CHECKSUMS)){
+                Block *data = fs_block_get(fs);
+                if (!data || disk_read(fs->disk, block, data->data) == DISK_FAILURE){
+                    fs_block_put(fs, data);
+                    return;
+                }
+                fs->dedup->hashes[block] = crc32c(0, data->data, fs_block_size(&fs->meta_data));
+                fs_block_put(fs, data);
+            }
+            __atomic_fetch_or(&worker->indexed[block / 64], 1ULL << (block % 64), __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    Block *pointers = fs_block_get(fs);
+    if (!pointers || fs_read_block(fs, block, pointers->data) == DISK_FAILURE){
+        fs_block_put(fs, pointers);
+        return;
+    }
+    for (size_t i = 0; i < fs_pointers_per_block(&fs->meta_data); i++){
+        fs_mount_reference(worker, fs_pointer_block(fs_get_pointer(&fs->meta_data, pointers, i)), level - 1, index);
+    }
+    fs_block_put(fs, pointers);
+}
+
+/**
+ * Mark every block referenced by a valid inode as in use by doing the
+ * following:
+ *
+ *  1. Give each extra worker a private all-free bitmap; the calling thread
+ *  works directly on fs->free_blocks.
+ *
+ *  2. Let the workers claim inode table chunks until it is exhausted.
+ *
+ *  3. Merge the partial bitmaps into fs->free_blocks (a block is free only
+ *  if no worker marked it in use).
+ *
+ *  4. With dedup enabled, add the data blocks the workers found to the
+ *  content index (their hashes are the recorded checksums when there are
+ *  any, so only images without checksums read their data blocks).
+ *
+ * Reference counts are shared by all workers and updated atomically.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ **/
+void    fs_mount_scan(FileSystem *fs) {
+    ScanWorker workers[MOUNT_MAX_THREADS] = {{{0}}};
+    uint64_t   next    = 1;
+    size_t     count   = fs_scan_threads(fs_inode_table_blocks(&fs->meta_data));
+    size_t     words   = BITMAP_WORDS(fs->meta_data.blocks);
+    uint64_t  *indexed = fs->dedup ? calloc(words, sizeof(uint64_t)) : NULL;
+
+    for (size_t w = 0; w < count; w++){
+        workers[w].view    = *fs;
+        workers[w].next    = &next;
+        workers[w].last    = fs_inode_table_blocks(&fs->meta_data);
+        workers[w].scan    = fs_mount_scan_block;
+        workers[w].indexed = indexed;
+        // Skip checksum verification: marking what a corrupted block points
+        // to only leaks blocks, while skipping it could hand them out twice
+        workers[w].view.checksums = NULL;
+        if (w == 0){
+            continue;
+        }
+
+        workers[w].view.free_blocks = malloc(words * sizeof(uint64_t));
+        if (!workers[w].view.free_blocks){
+            count = w;
+            break;
+        }
+        memset(workers[w].view.free_blocks, 0xff, words * sizeof(uint64_t));
+    }
+
+    fs_scan_run(workers, count);
+
+    for (size_t w = 1; w < count; w++){
+        for (size_t i = 0; i < words; i++){
+            fs->free_blocks[i] &= workers[w].view.free_blocks[i];
+        }
+        free(workers[w].view.free_blocks);
+    }
+
+    for (size_t w = 0; indexed && w < words; w++){
+        for (uint64_t bits = indexed[w]; bits; bits &= bits - 1){
+            uint64_t block = w * 64 + __builtin_ctzll(bits);
+            fs_dedup_insert(fs, block, fs->checksums ? fs->checksums[block] : fs->dedup->hashes[block]);
+        }
+    }
+    free(indexed);
+}
+
+/**
+ * Check every valid inode in one inode table block, writing the block back
+ * if repairs modified any inode.
+ *
+ * @param       worker          Pointer to ScanWorker structure.
+ * @param       block           Inode table block number.
+ **/
+void    fs_check_scan_block(ScanWorker *worker, uint64_t block) {
+    const SuperBlock64 *meta   = &worker->view.meta_data;
+    bool                repair = worker->check->options->repair;
+    bool                dirty  = false;
+    size_t              ipb    = fs_inodes_per_block(meta);
+    Block              *inodes = fs_block_get(&worker->view);
+
+    if (!inodes || fs_read_block(&worker->view, block, inodes->data) == DISK_FAILURE){
+        fs_check_problem(worker, &worker->report.unreadable, "unreadable", -1, block, false);
+        fs_block_put(&worker->view, inodes);
+        return;
+    }
+
+    for (size_t j = 0; j < ipb; j++){
+        Inode64 node;
+        fs_get_inode(meta, inodes, j, &node);
+        if (!node.valid){
+            continue;
+        }
+
+        uint64_t inode_number = (block - 1) * ipb + j;
+        uint64_t nblocks      = fs_block_count(meta, node.size);
+        bool     modified     = false;
+        worker->report.inodes++;
+
+        // Inline data must fit in the Inode (repair truncates it)
+        if (fs_inode_inline(&node) && node.size > fs_inline_capacity(meta)){
+            fs_check_problem(worker, &worker->report.size_mismatches, "size_mismatch", inode_number, block, repair);
+            node.size = fs_inline_capacity(meta);
+            modified  = true;
+        }
+
+        for (size_t k = 0; k < POINTERS_PER_INODE; k++){
+            if (node.direct[k]){
+                modified = fs_check_pointer(worker, inode_number, &node.direct[k], k, 0, nblocks) || modified;
+            }
+        }
+
+        uint64_t first = POINTERS_PER_INODE;
+        uint64_t span  = 1;
+        for (size_t level = 1; level <= fs_indirect_levels(meta); level++){
+            uint64_t *root = fs_indirect_root(&node, level);
+            span *= fs_pointers_per_block(meta);
+            if (*root){
+                modified = fs_check_pointer(worker, inode_number, root, first, level, nblocks) || modified;
+            }
+            first += span;
+        }
+
+        if (modified && repair){
+            fs_put_inode(meta, inodes, j, &node);
+            dirty = true;
+        }
+    }
+
+    if (dirty){
+        fs_write_block(&worker->view, block, inodes->data);
+    }
+    fs_block_put(&worker->view, inodes);
+}
+
+/**
+ * Check one block pointer of an inode and, for pointer blocks, the tree
+ * below it.  Each problem is reported; when repairing, a bad pointer is
+ * cleared (the block it referenced is then picked up as leaked).
+ *
+ * Ownership of a block goes to the first reference that claims it in the
+ * shared seen bitmap; later references are duplicates.
+ *
+ * @param       worker          Pointer to ScanWorker structure.
+ * @param       inode_number    Inode that owns the pointer.
+ * @param       pointer         Pointer to check (cleared on repair).
+ * @param       index           File block index of the first data block below pointer.
+ * @param       level           Levels of indirection below pointer (0 for data block).
+ * @param       nblocks         Number of data blocks covered by the file size.
+ * @return      Whether or not pointer was modified.
+ **/
+bool    fs_check_pointer(ScanWorker *worker, uint64_t inode_number, uint64_t *pointer, uint64_t index, size_t level, uint64_t nblocks) {
+    const SuperBlock64 *meta   = &worker->view.meta_data;
+    bool                repair = worker->check->options->repair;
+    uint64_t            block  = fs_pointer_block(*pointer);
+    bool                bad    = true;
+
+    // Trailing pointers of a compressed cluster have no block of their own
+    if (level == 0 && (*pointer & POINTER_COMPRESSED) && !block){
+        return false;
+    }
+
+    if (block < fs_data_start(meta) || block >= meta->blocks){
+        fs_check_problem(worker, &worker->report.out_of_range, "out_of_range", inode_number, block, repair);
+    } else if (level == 0 && index >= nblocks && repair){
+        fs_check_problem(worker, &worker->report.size_mismatches, "size_mismatch", inode_number, block, repair);
+    } else {
+        // Without repair, a block past end of file still counts as referenced
+        if (level == 0 && index >= nblocks){
+            fs_check_problem(worker, &worker->report.size_mismatches, "size_mismatch", inode_number, block, false);
+        }
+
+        uint64_t bit = 1ULL << (block % 64);
+        if (__atomic_fetch_or(&worker->check->seen[block / 64], bit, __ATOMIC_RELAXED) & bit){
+            // Shared blocks are referenced more than once (their trees were checked with the first)
+            if (worker->view.refcounts){
+                return false;
+            }
+            fs_check_problem(worker, &worker->report.duplicates, "duplicate", inode_number, block, repair);
+        } else {
+            worker->report.blocks++;
+            if (level > 0){
+                fs_check_tree(worker, inode_number, block, level, index, nblocks);
+            }
+            bad = false;
+        }
+    }
+
+    if (bad && repair){
+        *pointer = 0;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Check every pointer in the pointer block at the given indirection level,
+ * writing the block back if repairs modified it.
+ *
+ * @param       worker          Pointer to ScanWorker structure.
+ * @param       inode_number    Inode that owns the tree.
+ * @param       block           Pointer block number.
+ * @param       level           Levels of indirection below block (>= 1).
+ * @param       first           File block index of the first data block below block.
+ * @param       nblocks         Number of data blocks covered by the file size.
+ * @return      Whether or not the pointer block could be read.
+ **/
+bool    fs_check_tree(ScanWorker *worker, uint64_t inode_number, uint64_t block, size_t level, uint64_t first, uint64_t nblocks) {
+    const SuperBlock64 *meta = &worker->view.meta_data;
+    size_t              ppb  = fs_pointers_per_block(meta);
+    uint64_t            span = 1;
+    bool                dirty = false;
+    Block              *pointers = fs_block_get(&worker->view);
+
+    if (!pointers || fs_read_block(&worker->view, block, pointers->data) == DISK_FAILURE){
+        fs_check_problem(worker, &worker->report.unreadable, "unreadable", inode_number, block, false);
+        fs_block_put(&worker->view, pointers);
+        return false;
+    }
+
+    for (size_t l = 1; l < level; l++){
+        span *= ppb;
+    }
+
+    for (size_t i = 0; i < ppb; i++){
+        uint64_t pointer = fs_get_pointer(meta, pointers, i);
+        if (pointer && fs_check_pointer(worker, inode_number, &pointer, first + i * span, level - 1, nblocks)){
+            fs_set_pointer(meta, pointers, i, pointer);
+            dirty = true;
+        }
+    }
+
+    if (dirty){
+        fs_write_block(&worker->view, block, pointers->data);
+    }
+    fs_block_put(&worker->view, pointers);
+    return true;
+}
+
+/**
+ * Count a problem and stream it to the report (if any) as one line of text
+ * or JSON.
+ *
+ * @param       worker          Pointer to ScanWorker structure.
+ * @param       counter         Report counter for this kind of problem.
+ * @param       problem         Problem name.
+ * @param       inode_number    Inode the problem belongs to (-1 for none).
+ * @param       block           Block the problem refers to.
+ * @param       repaired        Whether or not the problem was fixed.
+ **/
+void    fs_check_problem(ScanWorker *worker, uint64_t *counter, const char *problem, int64_t inode_number, uint64_t block, bool repaired) {
+    const CheckOptions *options = worker->check->options;
+
+    (*counter)++;
+    if (repaired){
+        worker->report.repaired++;
+    }
+    if (!options->stream){
+        return;
+    }
+
+    pthread_mutex_lock(&worker->check->lock);
+    if (options->json){
+        fprintf(options->stream, "{\"problem\": \"%s\", ", problem);
+        if (inode_number >= 0){
+            fprintf(options->stream, "\"inode\": %ld, ", inode_number);
+        }
+        fprintf(options->stream, "\"block\": %lu, \"repaired\": %s}\n", block, repaired ? "true" : "false");
+    } else {
+        if (inode_number >= 0){
+            fprintf(options->stream, "inode %ld: ", inode_number);
+        }
+        fprintf(options->stream, "%s block %lu%s\n", problem, block, repaired ? " (repaired)" : "");
+    }
+    pthread_mutex_unlock(&worker->check->lock);
+}
+
+/**
+ * Stream check summary to the report (if any).
+ **/
+void    fs_check_summary(const CheckOptions *options, const CheckReport *report) {
+    if (!options->stream){
+        return;
+    }
+
+    static const char *Names[] = {
+        "inodes", "blocks", "out_of_range", "duplicates", "size_mismatches",
+        "unreadable", "leaked", "unmarked", "repaired",
+    };
+    const uint64_t Counts[] = {
+        report->inodes, report->blocks, report->out_of_range, report->duplicates, report->size_mismatches,
+        report->unreadable, report->leaked, report->unmarked, report->repaired,
+    };
+
+    fprintf(options->stream, options->json ? "{" : "check:");
+    for (size_t i = 0; i < sizeof(Counts) / sizeof(Counts[0]); i++){
+        if (options->json){
+            fprintf(options->stream, "%s\"%s\": %lu", i ? ", " : "", Names[i], Counts[i]);
+        } else {
+            fprintf(options->stream, " %lu %s", Counts[i], Names[i]);
+        }
+    }
+    fprintf(options->stream, options->json ? "}\n" : "\n");
+}
+
+/**
+ * Verify one block if it is in use: an inode table block, or a data or
+ * pointer block marked in use in the free block bitmap.
+ *
+ * @param       worker          Pointer to ScanWorker structure.
+ * @param       block           Block number.
+ **/
+void    fs_scrub_scan_block(ScanWorker *worker, uint64_t block) {
+    FileSystem         *fs   = &worker->view;
+    const SuperBlock64 *meta = &fs->meta_data;
+
+    if (!fs_checksummed(meta, block) || (block > meta->inode_blocks && bitmap_test(fs->free_blocks, block))){
+        return;
+    }
+
+    char *data = disk_buffer_get(fs->disk);
+    if (!data || disk_read(fs->disk, block, data) == DISK_FAILURE){
+        fs_check_problem(worker, &worker->scrub.unreadable, "unreadable", -1, block, false);
+        disk_buffer_put(fs->disk, data);
+        return;
+    }
+    worker->scrub.blocks++;
+    if (fs->checksums && crc32c(0, data, fs_block_size(meta)) != fs->checksums[block]){
+        fs_check_problem(worker, &worker->scrub.corrupted, "corrupted", -1, block, false);
+    }
+    disk_buffer_put(fs->disk, data);
+}
+
+/**
+ * Stream scrub summary to the report (if any).
+ **/
+void    fs_scrub_summary(const CheckOptions *options, const ScrubReport *report) {
+    if (!options->stream){
+        return;
+    }
+
+    if (options->json){
+        fprintf(options->stream, "{\"blocks\": %lu, \"corrupted\": %lu, \"unreadable\": %lu}\n",
+            report->blocks, report->corrupted, report->unreadable);
+    } else {
+        fprintf(options->stream, "scrub: %lu blocks %lu corrupted %lu unreadable\n",
+            report->blocks, report->corrupted, report->unreadable);
+    }
+}
+
+/**
+ * Print data blocks referenced below the pointer block at the given
+ * indirection level.
+ **/
+void    fs_debug_tree(const SuperBlock64 *meta, Disk *disk, uint64_t block, size_t level) {
+    Block *pointers = (Block *)disk_buffer_get(disk);
+    if (!pointers || block >= meta->blocks || disk_read(disk, block, pointers->data) == DISK_FAILURE){
+        disk_buffer_put(disk, (char *)pointers);
+        return;
+    }
+
+    for (size_t i = 0; i < fs_pointers_per_block(meta); i++){
+        uint64_t pointer = fs_pointer_block(fs_get_pointer(meta, pointers, i));
+        if (!pointer){
+            continue;
+        }
+        if (level > 1){
+            fs_debug_tree(meta, disk, pointer, level - 1);
+        } else {
+            printf(" %lu", pointer);
+        }
+    }
+    disk_buffer_put(disk, (char *)pointers);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,240 @@
+/* lz.c: SimpleFS block compression codec */
+
+#include "sfs/lz.h"
+#include "sfs/utils.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Internal Prototypes */
+
+uint32_t lz_read32(const unsigned char *p);
+uint32_t lz_hash(uint32_t sequence);
+bool    lz_emit_length(unsigned char *output, size_t *op, size_t capacity, size_t length);
+bool    lz_emit(unsigned char *output, size_t *op, size_t capacity, const unsigned char *literals, size_t nliterals, size_t offset, size_t match);
+bool    lz_read_length(const unsigned char *source, size_t *ip, size_t length, size_t *value);
+
+/* External Functions */
+
+/**
+ * Compress source into output using a byte-oriented LZ77 format (in the
+ * style of LZ4) that favors decoding speed over ratio.
+ *
+ * The stream is a series of sequences, each a token byte (literal count in
+ * the high nibble, match length minus LZ_MIN_MATCH in the low nibble), any
+ * extra literal count bytes, the literals, a 16-bit little-endian match
+ * offset, and any extra match length bytes.  Counts that do not fit in a
+ * nibble continue in bytes of 255 until a smaller byte.  The last sequence
+ * carries literals only and ends the stream.
+ *
+ * @param       source      Data to compress.
+ * @param       length      Number of bytes in source.
+ * @param       output      Buffer for compressed data.
+ * @param       capacity    Size of output buffer.
+ * @return      Number of compressed bytes (0 if they do not fit in capacity).
+ **/
+size_t  lz_compress(const char *source, size_t length, char *output, size_t capacity) {
+    const unsigned char *in     = (const unsigned char *)source;
+    unsigned char       *out    = (unsigned char *)output;
+    uint32_t             table[1 << LZ_HASH_BITS] = {0};   /* Last position + 1 per hash */
+    size_t               ip     = 0;
+    size_t               anchor = 0;
+    size_t               op     = 0;
+
+    while (ip + LZ_MIN_MATCH <= length){
+        uint32_t sequence  = lz_read32(in + ip);
+        uint32_t hash      = lz_hash(sequence);
+        size_t   candidate = table[hash];
+        table[hash] = ip + 1;
+
+        if (!candidate || ip - (candidate - 1) > LZ_MAX_OFFSET || lz_read32(in + candidate - 1) != sequence){
+            ip++;
+            continue;
+        }
+
+        // Extend match as far as it goes (it may overlap the current position)
+        size_t reference = candidate - 1;
+        size_t match     = LZ_MIN_MATCH;
+        while (ip + match < length && in[reference + match] == in[ip + match]){
+            match++;
+        }
+
+        if (!lz_emit(out, &op, capacity, in + anchor, ip - anchor, ip - reference, match)){
+            return 0;
+        }
+        ip    += match;
+        anchor = ip;
+    }
+
+    if (!lz_emit(out, &op, capacity, in + anchor, length - anchor, 0, 0)){
+        return 0;
+    }
+    return op;
+}
+
+/**
+ * Decompress source into output.  Decoding stops early once output is full,
+ * so a prefix of the original data can be recovered cheaply.
+ *
+ * @param       source      Compressed data (from lz_compress).
+ * @param       length      Number of bytes in source.
+ * @param       output      Buffer for decompressed data.
+ * @param       capacity    Size of output buffer.
+ * @return      Number of decompressed bytes (-1 if source is malformed).
+ **/
+ssize_t lz_decompress(const char *source, size_t length, char *output, size_t capacity) {
+    const unsigned char *in  = (const unsigned char *)source;
+    unsigned char       *out = (unsigned char *)output;
+    size_t               ip  = 0;
+    size_t               op  = 0;
+
+    while (true){
+        // Streams end with a literals-only sequence
+        if (ip == length){
+            return -1;
+        }
+        unsigned char token = in[ip++];
+
+        // Literals
+        size_t nliterals = token >> 4;
+        if (nliterals == 15 && !lz_read_length(in, &ip, length, &nliterals)){
+            return -1;
+        }
+        if (nliterals > length - ip){
+            return -1;
+        }
+        if (nliterals >= capacity - op){
+            memcpy(out + op, in + ip, capacity - op);
+            return capacity;
+        }
+        memcpy(out + op, in + ip, nliterals);
+        ip += nliterals;
+        op += nliterals;
+
+        // Final sequence has no match
+        if (ip == length){
+            break;
+        }
+
+        // Match
+        if (length - ip < 2){
+            return -1;
+        }
+        size_t offset = in[ip] | (in[ip + 1] << 8);
+        size_t match  = token & 15;
+        ip += 2;
+        if (match == 15 && !lz_read_length(in, &ip, length, &match)){
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+        if (!offset || offset > op){
+            return -1;
+        }
+
+        match = min(match, capacity - op);
+        if (offset >= match){
+            memcpy(out + op, out + op - offset, match);
+        } else {
+            // Overlapping match repeats the last offset bytes
+            for (size_t i = 0; i < match; i++){
+                out[op + i] = out[op - offset + i];
+            }
+        }
+        op += match;
+        if (op == capacity){
+            break;
+        }
+    }
+
+    return op;
+}
+
+/* Internal Functions */
+
+/**
+ * Load four bytes from unaligned address.
+ **/
+uint32_t lz_read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * Hash four bytes into a match finder table index (Fibonacci hashing).
+ **/
+uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Append the continuation bytes of a count that overflowed its nibble.
+ **/
+bool    lz_emit_length(unsigned char *output, size_t *op, size_t capacity, size_t length) {
+    while (length >= 255){
+        if (*op == capacity){
+            return false;
+        }
+        output[(*op)++] = 255;
+        length -= 255;
+    }
+    if (*op == capacity){
+        return false;
+    }
+    output[(*op)++] = length;
+    return true;
+}
+
+/**
+ * Append one sequence: nliterals literals followed by a match of the given
+ * length at the given offset (no match if match is 0).
+ *
+ * @return      Whether or not the sequence fit in capacity.
+ **/
+bool    lz_emit(unsigned char *output, size_t *op, size_t capacity, const unsigned char *literals, size_t nliterals, size_t offset, size_t match) {
+    if (*op == capacity){
+        return false;
+    }
+
+    size_t extra = match ? match - LZ_MIN_MATCH : 0;
+    output[(*op)++] = (min(nliterals, 15) << 4) | min(extra, 15);
+
+    if (nliterals >= 15 && !lz_emit_length(output, op, capacity, nliterals - 15)){
+        return false;
+    }
+    if (nliterals > capacity - *op){
+        return false;
+    }
+    memcpy(output + *op, literals, nliterals);
+    *op += nliterals;
+
+    if (!match){
+        return true;
+    }
+    if (capacity - *op < 2){
+        return false;
+    }
+    output[(*op)++] = offset & 0xff;
+    output[(*op)++] = offset >> 8;
+    return extra < 15 || lz_emit_length(output, op, capacity, extra - 15);
+}
+
+/**
+ * Add the continuation bytes of a count at ip to value.
+ *
+ * @return      Whether or not the count was complete.
+ **/
+bool    lz_read_length(const unsigned char *source, size_t *ip, size_t length, size_t *value) {
+    unsigned char byte;
+    do {
+        if (*ip == length){
+            return false;
+        }
+        byte    = source[(*ip)++];
+        *value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
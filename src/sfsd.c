@@ -0,0 +1,565 @@
+/* sfsd.c: SimpleFS daemon */
+
+#define _GNU_SOURCE                             /* accept4 */
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/logging.h"
+#include "sfs/protocol.h"
+#include "sfs/trace.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MAX_EVENTS      (64)                    /* Events handled per epoll_wait */
+#define MAX_WORKERS     (64)                    /* Upper bound on worker threads */
+#define LISTEN_BACKLOG  (128)                   /* Pending connections */
+#define RECEIVE_CHUNK   (64 * 1024)             /* Least free input space for a read */
+
+/* Structures */
+
+typedef struct Connection Connection;
+struct Connection {
+    int         fd;                             /* Client socket (non-blocking) */
+    pthread_mutex_t lock;                       /* Held by the worker servicing it */
+    char       *input;                          /* Received bytes (executed from input_start) */
+    size_t      input_start;
+    size_t      input_used;
+    size_t      input_capacity;
+    char       *output;                         /* Responses not yet sent */
+    size_t      output_used;
+    size_t      output_capacity;
+    bool        closing;                        /* Client closed its end (answer, then close) */
+    Connection *next;                           /* Work queue link */
+    Connection *prev_open;                      /* Open connections list links */
+    Connection *next_open;
+};
+
+/* Globals */
+
+static FileSystem       Fs        = {0};        /* Mounted file system */
+static pthread_rwlock_t FsLock    = PTHREAD_RWLOCK_INITIALIZER;  /* Readers share fs, others own it */
+static int              Epoll     = -1;         /* Event loop */
+static size_t           Workers   = 0;          /* Worker threads (0 for one per CPU) */
+static int              DiskFlags = 0;          /* DISK_* flags for the image */
+static const char      *TracePath = NULL;       /* File to capture a trace into (see sfs-replay) */
+static DiskModel        Model     = {0};        /* Simulated device (see disk_set_model) */
+static bool             Schedule  = false;      /* Sort and merge block I/O (see disk_set_scheduler) */
+static volatile sig_atomic_t Running = 1;       /* Cleared by SIGINT and SIGTERM */
+
+static pthread_mutex_t  QueueLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   QueueReady = PTHREAD_COND_INITIALIZER;
+static Connection      *QueueHead  = NULL;      /* Connections with pending input */
+static Connection      *QueueTail  = NULL;
+static Connection      *OpenList   = NULL;      /* Every open connection */
+static bool             Stopping   = false;     /* Workers exit once set */
+
+/* Statistics */
+
+static size_t           Accepted  = 0;
+static size_t           Requests  = 0;
+
+/* Utility Prototypes */
+
+int     listen_socket(const char *path);
+void    accept_connections(int listener);
+void    handle_signal(int signal);
+void *  worker(void *arg);
+void    queue_push(Connection *connection);
+Connection *queue_pop();
+bool    connection_service(Connection *connection);
+bool    connection_reserve(char **buffer, size_t *capacity, size_t needed);
+bool    connection_execute(Connection *connection, size_t *consumed);
+bool    connection_flush(Connection *connection);
+uint32_t connection_events(Connection *connection);
+void    connection_close(Connection *connection);
+
+/* Main Execution */
+
+void usage(const char *program, int status) {
+    fprintf(stderr, "Usage: %s [options] <socket> <diskfile> <nblocks>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -t WORKERS     Worker threads (default: one per CPU)\n");
+    fprintf(stderr, "    -d             Bypass the host page cache (O_DIRECT)\n");
+    fprintf(stderr, "    -T FILE        Capture a binary trace of served operations\n");
+    fprintf(stderr, "    -m MODEL       Simulate device latency: none, hdd, ssd, nvme (default: none)\n");
+    fprintf(stderr, "    -s             Queue, sort, and merge block I/O with write-back\n");
+    fprintf(stderr, "    -h             Show this help message\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "t:dT:m:sh")) != -1) {
+        switch (c) {
+            case 't': Workers = min(max(atoi(optarg), 1), MAX_WORKERS); break;
+            case 'd': DiskFlags |= DISK_DIRECT; break;
+            case 'T': TracePath = optarg; break;
+            case 's': Schedule  = true; break;
+            case 'm':
+                if (!disk_model_preset(optarg, &Model)) {
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+
+    if (argc - optind != 3) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+    if (!Workers) {
+        Workers = min(max(sysconf(_SC_NPROCESSORS_ONLN), 1), MAX_WORKERS);
+    }
+
+    const char *path = argv[optind];
+    Disk *disk = disk_open_ex(argv[optind + 1], strtoull(argv[optind + 2], NULL, 10), DiskFlags);
+    if (!disk) {
+        error("Unable to open %s", argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+    if (!fs_mount(&Fs, disk)) {
+        error("Unable to mount %s", argv[optind + 1]);
+        disk_close(disk);
+        return EXIT_FAILURE;
+    }
+    disk_set_model(disk, &Model);
+    if (Schedule && !disk_set_scheduler(disk, &(DiskScheduler){0})) {
+        error("Unable to start I/O scheduler");
+        fs_unmount(&Fs);
+        disk_close(disk);
+        return EXIT_FAILURE;
+    }
+
+    int listener = listen_socket(path);
+    Epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (listener < 0 || Epoll < 0 || epoll_ctl(Epoll, EPOLL_CTL_ADD, listener, &event) < 0) {
+        error("Unable to listen on %s: %s", path, strerror(errno));
+        fs_unmount(&Fs);
+        disk_close(disk);
+        return EXIT_FAILURE;
+    }
+    if (TracePath && !trace_start(TracePath)) {
+        fs_unmount(&Fs);
+        disk_close(disk);
+        return EXIT_FAILURE;
+    }
+
+    /* Only the event loop handles signals, so they interrupt epoll_wait */
+    struct sigaction action = {.sa_handler = handle_signal};
+    sigaction(SIGINT,  &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+    pthread_t threads[MAX_WORKERS];
+    size_t    started = 0;
+    while (started < Workers && pthread_create(&threads[started], NULL, worker, NULL) == 0) {
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    info("sfsd: serving %s on %s with %zu workers", argv[optind + 1], path, started);
+
+    /* Event loop: accept connections and hand readable ones to workers.
+     * Connections are registered one-shot, so each is serviced by at most
+     * one worker at a time and its requests run in order. */
+    struct epoll_event events[MAX_EVENTS];
+    while (Running && started) {
+        int count = epoll_wait(Epoll, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno != EINTR) {
+                error("Unable to wait for events: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+        for (int e = 0; e < count; e++) {
+            if (!events[e].data.ptr) {
+                accept_connections(listener);
+            } else {
+                queue_push(events[e].data.ptr);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&QueueLock);
+    Stopping = true;
+    pthread_cond_broadcast(&QueueReady);
+    pthread_mutex_unlock(&QueueLock);
+    for (size_t t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    while (OpenList) {
+        connection_close(OpenList);
+    }
+    if (TracePath) {
+        info("sfsd: traced %zd records to %s", trace_stop(), TracePath);
+    }
+
+    close(listener);
+    close(Epoll);
+    unlink(path);
+    info("sfsd: %zu connections %zu requests", Accepted, Requests);
+
+    fs_unmount(&Fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+/* Utility Functions */
+
+/**
+ * Create a non-blocking Unix socket listening at path (replacing any stale
+ * socket file).
+ *
+ * @return      Socket file descriptor (-1 on failure).
+ **/
+int     listen_socket(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, LISTEN_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Accept every pending connection and register it (one-shot) with the
+ * event loop.
+ **/
+void    accept_connections(int listener) {
+    while (true) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                error("Unable to accept connection: %s", strerror(errno));
+            }
+            if (errno != EINTR) {
+                return;
+            }
+            continue;
+        }
+
+        Connection *connection = calloc(1, sizeof(Connection));
+        if (!connection) {
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        pthread_mutex_init(&connection->lock, NULL);
+
+        pthread_mutex_lock(&QueueLock);
+        connection->next_open = OpenList;
+        if (OpenList) {
+            OpenList->prev_open = connection;
+        }
+        OpenList = connection;
+        Accepted++;
+        pthread_mutex_unlock(&QueueLock);
+
+        struct epoll_event event = {.events = connection_events(connection), .data.ptr = connection};
+        if (epoll_ctl(Epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+            connection_close(connection);
+        }
+    }
+}
+
+/**
+ * Stop the event loop.
+ **/
+void    handle_signal(int signal) {
+    Running = 0;
+}
+
+/**
+ * Worker thread: service connections from the work queue, re-arming each
+ * with the event loop afterwards (or closing it once the client is gone).
+ **/
+void *  worker(void *arg) {
+    Connection *connection;
+    while ((connection = queue_pop())) {
+        /* One-shot events already keep other workers away; the lock makes
+         * that hand-off visible to thread checkers and costs nothing */
+        pthread_mutex_lock(&connection->lock);
+        bool open = connection_service(connection);
+        struct epoll_event event = {.events = connection_events(connection), .data.ptr = connection};
+        open = open && epoll_ctl(Epoll, EPOLL_CTL_MOD, connection->fd, &event) == 0;
+        pthread_mutex_unlock(&connection->lock);
+        if (!open) {
+            connection_close(connection);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Append connection to the work queue and wake a worker.
+ **/
+void    queue_push(Connection *connection) {
+    pthread_mutex_lock(&QueueLock);
+    connection->next = NULL;
+    if (QueueTail) {
+        QueueTail->next = connection;
+    } else {
+        QueueHead = connection;
+    }
+    QueueTail = connection;
+    pthread_cond_signal(&QueueReady);
+    pthread_mutex_unlock(&QueueLock);
+}
+
+/**
+ * Remove the next connection from the work queue, waiting for one.
+ *
+ * @return      Connection to service (NULL once the daemon is stopping).
+ **/
+Connection *queue_pop() {
+    pthread_mutex_lock(&QueueLock);
+    while (!QueueHead && !Stopping) {
+        pthread_cond_wait(&QueueReady, &QueueLock);
+    }
+    Connection *connection = Stopping ? NULL : QueueHead;
+    if (connection) {
+        QueueHead = connection->next;
+        if (!QueueHead) {
+            QueueTail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&QueueLock);
+    return connection;
+}
+
+/**
+ * Service a ready connection without blocking by doing the following:
+ *
+ *  1. Execute every complete request received so far in order, appending
+ *  each response to the output buffer.
+ *
+ *  2. Send as many responses as the socket takes (so a pipelined batch
+ *  costs few sends).
+ *
+ *  3. Read more input after any partial request (moving the partial
+ *  request to the front of the buffer only when the buffer is full).
+ *
+ * This repeats until the socket has no more input or PROTOCOL_WINDOW bytes
+ * of responses are waiting on a client that is not reading them; the
+ * remaining requests then wait until the socket is writable again.  Nothing
+ * blocks, so a worker never waits on a slow client.
+ *
+ * @return      Whether or not the connection should stay open.
+ **/
+bool    connection_service(Connection *connection) {
+    while (true) {
+        while (connection->output_used < PROTOCOL_WINDOW && connection_execute(connection, &connection->input_start));
+        if (connection->input_start == SIZE_MAX) {
+            return false;                   /* Malformed request */
+        }
+        if (connection->input_start == connection->input_used) {
+            connection->input_start = connection->input_used = 0;
+        }
+
+        if (!connection_flush(connection)) {
+            return false;
+        }
+        if (connection->closing || connection->output_used >= PROTOCOL_WINDOW) {
+            break;
+        }
+
+        if (connection->input_capacity - connection->input_used < RECEIVE_CHUNK) {
+            memmove(connection->input, connection->input + connection->input_start, connection->input_used - connection->input_start);
+            connection->input_used -= connection->input_start;
+            connection->input_start = 0;
+        }
+        if (!connection_reserve(&connection->input, &connection->input_capacity, connection->input_used + RECEIVE_CHUNK)) {
+            return false;
+        }
+        ssize_t nread = recv(connection->fd, connection->input + connection->input_used, connection->input_capacity - connection->input_used, 0);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (nread < 0) {
+            return false;
+        }
+        if (nread == 0) {
+            connection->closing = true;     /* Still answer what was received before */
+        }
+        connection->input_used += nread;
+    }
+    return !connection->closing || connection->output_used;
+}
+
+/**
+ * Grow buffer to hold at least needed bytes.
+ **/
+bool    connection_reserve(char **buffer, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t size = max(needed, *capacity * 2);
+    char  *grown = realloc(*buffer, size);
+    if (!grown) {
+        return false;
+    }
+    *buffer   = grown;
+    *capacity = size;
+    return true;
+}
+
+/**
+ * Execute the complete request at consumed in the input buffer (if any) and
+ * append its response to the output buffer.  Read requests take the file
+ * system lock shared, everything else takes it exclusively.
+ *
+ * @param       connection      Connection to execute request from.
+ * @param       consumed        Input offset of the request (advanced past it;
+ *                              SIZE_MAX if the request is malformed).
+ * @return      Whether or not a request was executed.
+ **/
+bool    connection_execute(Connection *connection, size_t *consumed) {
+    size_t available = connection->input_used - *consumed;
+    if (available < sizeof(Request)) {
+        return false;
+    }
+
+    Request request;
+    memcpy(&request, connection->input + *consumed, sizeof(request));
+    if (request.magic != PROTOCOL_MAGIC || request.length > PROTOCOL_MAX_LENGTH) {
+        *consumed = SIZE_MAX;
+        return false;
+    }
+    size_t payload = request.op == OP_WRITE ? request.length : 0;
+    if (available < sizeof(Request) + payload) {
+        return false;
+    }
+    char *data = connection->input + *consumed + sizeof(Request);
+
+    size_t output = request.op == OP_READ ? request.length : 0;
+    if (!connection_reserve(&connection->output, &connection->output_capacity, connection->output_used + sizeof(Response) + output)) {
+        *consumed = SIZE_MAX;
+        return false;
+    }
+    char *buffer = connection->output + connection->output_used + sizeof(Response);
+
+    Response response = {.magic = PROTOCOL_MAGIC, .op = request.op, .tag = request.tag};
+    bool     shared   = request.op == OP_READ || request.op == OP_STAT;
+    if (shared) {
+        pthread_rwlock_rdlock(&FsLock);
+    } else {
+        pthread_rwlock_wrlock(&FsLock);
+    }
+    switch (request.op) {
+        case OP_CREATE: response.result = fs_create(&Fs); break;
+        case OP_REMOVE: response.result = fs_remove(&Fs, request.inode); break;
+        case OP_STAT:   response.result = fs_stat(&Fs, request.inode); break;
+        case OP_READ:   response.result = fs_read(&Fs, request.inode, buffer, request.length, request.offset); break;
+        case OP_WRITE:  response.result = fs_write(&Fs, request.inode, data, request.length, request.offset); break;
+        case OP_CLONE:  response.result = fs_clone(&Fs, request.inode); break;
+        default:        response.result = -1; break;
+    }
+    pthread_rwlock_unlock(&FsLock);
+
+    if (request.op == OP_READ && response.result > 0) {
+        response.length = response.result;
+    }
+    memcpy(connection->output + connection->output_used, &response, sizeof(response));
+    connection->output_used += sizeof(Response) + response.length;
+    *consumed += sizeof(Request) + payload;
+    __atomic_fetch_add(&Requests, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Send as many pending responses as the socket takes.
+ *
+ * @return      Whether or not the connection is still usable.
+ **/
+bool    connection_flush(Connection *connection) {
+    size_t sent = 0;
+    while (sent < connection->output_used) {
+        ssize_t written = send(connection->fd, connection->output + sent, connection->output_used - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        sent += written;
+    }
+    memmove(connection->output, connection->output + sent, connection->output_used - sent);
+    connection->output_used -= sent;
+    return true;
+}
+
+/**
+ * Return the epoll events to wait for on connection: readable while it
+ * accepts input, writable while responses are waiting (one-shot either way).
+ **/
+uint32_t connection_events(Connection *connection) {
+    uint32_t events = EPOLLONESHOT;
+    if (!connection->closing && connection->output_used < PROTOCOL_WINDOW) {
+        events |= EPOLLIN;
+    }
+    if (connection->output_used) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
+/**
+ * Close connection and release its buffers.
+ **/
+void    connection_close(Connection *connection) {
+    pthread_mutex_lock(&QueueLock);
+    if (connection->prev_open) {
+        connection->prev_open->next_open = connection->next_open;
+    } else {
+        OpenList = connection->next_open;
+    }
+    if (connection->next_open) {
+        connection->next_open->prev_open = connection->prev_open;
+    }
+    pthread_mutex_unlock(&QueueLock);
+
+    close(connection->fd);
+    pthread_mutex_destroy(&connection->lock);
+    free(connection->input);
+    free(connection->output);
+    free(connection);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,246 @@
+/* sfsload.c: SimpleFS daemon load generator */
+
+#include "sfs/client.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MAX_CLIENTS     (256)                   /* Upper bound on concurrent clients */
+#define MAX_DEPTH       (1024)                  /* Upper bound on requests in flight */
+
+/* Structures */
+
+typedef struct LoadClient LoadClient;
+struct LoadClient {
+    size_t      id;                             /* Client index (seeds its PRNG) */
+    pthread_t   thread;                         /* Client thread */
+    size_t      completed;                      /* Requests answered */
+    size_t      errors;                         /* Failed requests (or connection errors) */
+    size_t      bytes;                          /* Bytes read and written */
+    double     *latencies;                      /* Seconds from send to response, per request */
+};
+
+/* Globals */
+
+static const char  *SocketPath   = NULL;        /* Daemon socket */
+static size_t       Clients      = 4;           /* Concurrent connections */
+static size_t       RequestCount = 1000;        /* Requests per client */
+static size_t       Depth        = 1;           /* Requests in flight per client */
+static size_t       RequestSize  = 4096;        /* Bytes per read or write */
+static size_t       WritePercent = 50;          /* Share of requests that write */
+static size_t       FileSize     = 1 << 20;     /* Bytes of the file each client works on */
+
+/* Utility Prototypes */
+
+double  timestamp();
+uint64_t random_next(uint64_t *seed);
+void *  load_client(void *arg);
+int     compare_doubles(const void *a, const void *b);
+
+/* Main Execution */
+
+void usage(const char *program, int status) {
+    fprintf(stderr, "Usage: %s [options] <socket>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -c CLIENTS     Concurrent connections (default: 4)\n");
+    fprintf(stderr, "    -n REQUESTS    Requests per connection (default: 1000)\n");
+    fprintf(stderr, "    -p DEPTH       Pipelined requests in flight per connection (default: 1)\n");
+    fprintf(stderr, "    -s SIZE        Bytes per read or write (default: 4096)\n");
+    fprintf(stderr, "    -w PERCENT     Percentage of requests that write (default: 50)\n");
+    fprintf(stderr, "    -f SIZE        Bytes of the file each connection works on (default: 1048576)\n");
+    fprintf(stderr, "    -h             Show this help message\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "c:n:p:s:w:f:h")) != -1) {
+        switch (c) {
+            case 'c': Clients      = min(max(atoi(optarg), 1), MAX_CLIENTS); break;
+            case 'n': RequestCount = strtoull(optarg, NULL, 0); break;
+            case 'p': Depth        = min(max(atoi(optarg), 1), MAX_DEPTH); break;
+            case 's': RequestSize  = min(max(strtoull(optarg, NULL, 0), 1), PROTOCOL_MAX_LENGTH); break;
+            case 'w': WritePercent = min(atoi(optarg), 100); break;
+            case 'f': FileSize     = strtoull(optarg, NULL, 0); break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+    SocketPath = argv[optind];
+    FileSize   = max(FileSize, RequestSize);
+
+    LoadClient *clients = calloc(Clients, sizeof(LoadClient));
+    if (!clients) {
+        error("Unable to allocate clients");
+        return EXIT_FAILURE;
+    }
+
+    double start = timestamp();
+    for (size_t i = 0; i < Clients; i++) {
+        clients[i].id = i;
+        if (pthread_create(&clients[i].thread, NULL, load_client, &clients[i]) != 0) {
+            error("Unable to start client %zu", i);
+            Clients = i;
+            break;
+        }
+    }
+
+    size_t completed = 0, errors = 0, bytes = 0;
+    for (size_t i = 0; i < Clients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        completed += clients[i].completed;
+        errors    += clients[i].errors;
+        bytes     += clients[i].bytes;
+    }
+    double seconds = max(timestamp() - start, 1e-9);
+
+    double *latencies = malloc(max(completed, 1) * sizeof(double));
+    double  total     = 0;
+    size_t  count     = 0;
+    for (size_t i = 0; latencies && i < Clients; i++) {
+        for (size_t r = 0; r < clients[i].completed; r++) {
+            total += clients[i].latencies[r];
+            latencies[count++] = clients[i].latencies[r];
+        }
+        free(clients[i].latencies);
+    }
+    if (latencies && count) {
+        qsort(latencies, count, sizeof(double), compare_doubles);
+    }
+
+    printf("%zu requests\n", completed);
+    printf("%zu errors\n", errors);
+    printf("%.3f seconds\n", seconds);
+    printf("%.1f requests/s\n", completed / seconds);
+    printf("%.2f MiB/s\n", bytes / seconds / (1 << 20));
+    printf("%.1f us mean latency\n", count ? total / count * 1e6 : 0.0);
+    printf("%.1f us p99 latency\n", count ? latencies[min(count * 99 / 100, count - 1)] * 1e6 : 0.0);
+
+    free(latencies);
+    free(clients);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Utility Functions */
+
+/**
+ * Return current monotonic time in seconds.
+ **/
+double  timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Return next value from xorshift64* generator.
+ **/
+uint64_t random_next(uint64_t *seed) {
+    *seed ^= *seed >> 12;
+    *seed ^= *seed << 25;
+    *seed ^= *seed >> 27;
+    return *seed * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Client thread: create a file of FileSize bytes, issue RequestCount random
+ * reads and writes of RequestSize bytes with up to Depth in flight, check
+ * each result, and remove the file.
+ **/
+void *  load_client(void *arg) {
+    LoadClient *self    = arg;
+    uint64_t    seed    = 0x5f5 + self->id;
+    char       *data    = malloc(PROTOCOL_MAX_LENGTH);
+    double     *started = malloc(Depth * sizeof(double));
+    size_t     *expected = malloc(Depth * sizeof(size_t));
+    Client     *client  = client_open(SocketPath);
+    self->latencies     = malloc(max(RequestCount, 1) * sizeof(double));
+
+    ssize_t inode_number = client ? client_create(client) : -1;
+    if (!data || !started || !expected || !self->latencies || inode_number < 0) {
+        self->errors++;
+        goto done;
+    }
+
+    memset(data, 'a' + self->id % 26, PROTOCOL_MAX_LENGTH);
+    for (size_t offset = 0; offset < FileSize; offset += PROTOCOL_MAX_LENGTH) {
+        size_t length = min(FileSize - offset, PROTOCOL_MAX_LENGTH);
+        if (client_write(client, inode_number, data, length, offset) != (ssize_t)length) {
+            self->errors++;
+            goto done;
+        }
+    }
+
+    /* Keep up to Depth requests (and less than PROTOCOL_WINDOW bytes of
+     * responses) in flight; responses arrive in order, so the oldest
+     * outstanding request is always the next one answered */
+    size_t sent     = 0;
+    size_t slots    = FileSize / RequestSize;
+    size_t inflight = 0;
+    while (self->completed < RequestCount) {
+        while (sent < RequestCount && sent - self->completed < Depth) {
+            size_t   offset = random_next(&seed) % slots * RequestSize;
+            uint16_t op     = random_next(&seed) % 100 < WritePercent ? OP_WRITE : OP_READ;
+            size_t   expect = sizeof(Response) + (op == OP_READ ? RequestSize : 0);
+            if (sent > self->completed && inflight + expect >= PROTOCOL_WINDOW) {
+                break;
+            }
+            started[sent % Depth]  = timestamp();
+            expected[sent % Depth] = expect;
+            if (client_send(client, op, inode_number, data, RequestSize, offset) < 0) {
+                self->errors++;
+                goto done;
+            }
+            inflight += expect;
+            sent++;
+        }
+
+        Response response;
+        if (!client_receive(client, &response, data, PROTOCOL_MAX_LENGTH)) {
+            self->errors++;
+            goto done;
+        }
+        self->latencies[self->completed] = timestamp() - started[self->completed % Depth];
+        inflight -= expected[self->completed % Depth];
+        self->completed++;
+        if (response.result != (int64_t)RequestSize) {
+            self->errors++;
+        } else {
+            self->bytes += RequestSize;
+        }
+    }
+
+    if (!client_remove(client, inode_number)) {
+        self->errors++;
+    }
+
+done:
+    client_close(client);
+    free(started);
+    free(expected);
+    free(data);
+    return NULL;
+}
+
+/**
+ * Order doubles ascending (for qsort).
+ **/
+int     compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,328 @@
+/* sfspopulate.c: SimpleFS synthetic image population tool */
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/logging.h"
+#include "sfs/utils.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MAX_FILE_SIZE   ((size_t)1 << 34)      /* Cap for distribution tails */
+
+/* Structures */
+
+typedef enum {
+    DIST_FIXED,                                 /* Every file is size a */
+    DIST_UNIFORM,                               /* Uniform in [a, b] */
+    DIST_LOGNORMAL,                             /* Log-normal with median a, sigma b */
+} Distribution;
+
+typedef struct File File;
+struct File {
+    ssize_t     inode_number;                   /* Inode backing the file */
+    size_t      target;                         /* Planned file size */
+    size_t      written;                        /* Bytes written so far */
+};
+
+/* Globals */
+
+static uint64_t     Seed          = 1;          /* PRNG state (fixed for reproducibility) */
+static Distribution SizeDist      = DIST_LOGNORMAL;
+static double       SizeA         = 16384;      /* Distribution parameter a */
+static double       SizeB         = 1.5;        /* Distribution parameter b */
+static size_t       FillPercent   = 75;         /* Target data block utilization */
+static size_t       Fragmentation = 0;          /* 0 (sequential) .. 100 (maximally interleaved) */
+static size_t       ChurnPercent  = 0;          /* Files removed and replaced per round */
+static size_t       ChurnRounds   = 1;          /* Number of churn rounds */
+static FormatOptions Format       = {0};        /* Format revision and inode ratio */
+
+static File        *Files         = NULL;       /* Live files */
+static size_t       FilesCount    = 0;
+static size_t       FilesCapacity = 0;
+
+/* Statistics */
+
+static size_t       Created       = 0;
+static size_t       Removed       = 0;
+static size_t       BytesWritten  = 0;
+
+/* Utility Prototypes */
+
+uint64_t    random_next();
+double      random_uniform();
+size_t      random_size();
+size_t      blocks_for(size_t size);
+bool        parse_distribution(const char *spec);
+size_t      populate(FileSystem *fs, size_t budget);
+void        churn(FileSystem *fs);
+
+/* Main Execution */
+
+void usage(const char *program, int status) {
+    fprintf(stderr, "Usage: %s [options] <diskfile> <nblocks>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -s SEED        PRNG seed (default: 1)\n");
+    fprintf(stderr, "    -d DIST        File size distribution (default: lognormal:16384:1.5)\n");
+    fprintf(stderr, "                     fixed:SIZE | uniform:MIN:MAX | lognormal:MEDIAN:SIGMA\n");
+    fprintf(stderr, "    -f PERCENT     Target data block utilization (default: 75)\n");
+    fprintf(stderr, "    -F LEVEL       Fragmentation level 0-100 (default: 0)\n");
+    fprintf(stderr, "    -c PERCENT     Percentage of files removed and replaced per churn round (default: 0)\n");
+    fprintf(stderr, "    -r ROUNDS      Number of churn rounds (default: 1)\n");
+    fprintf(stderr, "    -R REVISION    Format revision (default: chosen by image size)\n");
+    fprintf(stderr, "    -i RATIO       Bytes per inode for revision 2 (default: %d)\n", DEFAULT_INODE_RATIO);
+    fprintf(stderr, "    -I SIZE        Inode size for revision 2 (default: %d)\n", INODE_SIZE_64);
+    fprintf(stderr, "    -L             Store small files inline in their inodes\n");
+    fprintf(stderr, "    -C             Compress file data\n");
+    fprintf(stderr, "    -K             Protect blocks with checksums\n");
+    fprintf(stderr, "    -D             Store identical data blocks once\n");
+    fprintf(stderr, "    -h             Show this help message\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "s:d:f:F:c:r:R:i:I:LCKDh")) != -1) {
+        switch (c) {
+            case 's': Seed          = strtoull(optarg, NULL, 0); break;
+            case 'd': if (!parse_distribution(optarg)) usage(argv[0], EXIT_FAILURE); break;
+            case 'f': FillPercent   = min(atoi(optarg), 100); break;
+            case 'F': Fragmentation = min(atoi(optarg), 100); break;
+            case 'c': ChurnPercent  = min(atoi(optarg), 100); break;
+            case 'r': ChurnRounds   = atoi(optarg); break;
+            case 'R': Format.revision    = atoi(optarg); break;
+            case 'i': Format.inode_ratio = strtoull(optarg, NULL, 0); break;
+            case 'I': Format.inode_size  = atoi(optarg); break;
+            case 'L': Format.features   |= FS_FEATURE_INLINE_DATA; break;
+            case 'C': Format.features   |= FS_FEATURE_COMPRESSION; break;
+            case 'K': Format.features   |= FS_FEATURE_CHECKSUMS; break;
+            case 'D': Format.features   |= FS_FEATURE_DEDUP; break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    /* xorshift state must be non-zero */
+    if (!Seed) {
+        Seed = 1;
+    }
+
+    Disk *disk = disk_open(argv[optind], strtoull(argv[optind + 1], NULL, 10));
+    if (!disk) {
+        error("Unable to open %s", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    FileSystem fs = {0};
+    if (!fs_format_ex(&fs, disk, &Format) || !fs_mount(&fs, disk)) {
+        error("Unable to format and mount %s", argv[optind]);
+        disk_close(disk);
+        return EXIT_FAILURE;
+    }
+
+    size_t data_blocks = fs.meta_data.blocks - fs.meta_data.inode_blocks - 1;
+    size_t budget      = data_blocks * FillPercent / 100;
+    size_t used        = populate(&fs, budget);
+
+    for (size_t round = 0; ChurnPercent && round < ChurnRounds; round++) {
+        churn(&fs);
+        used = populate(&fs, budget);
+    }
+
+    printf("%zu files created\n", Created);
+    printf("%zu files removed\n", Removed);
+    printf("%zu files live\n", FilesCount);
+    printf("%zu bytes written\n", BytesWritten);
+    printf("%zu of %zu data blocks used\n", used, data_blocks);
+
+    free(Files);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+/* Utility Functions */
+
+/**
+ * Return next value from xorshift64* generator (independent of libc rand so
+ * images are reproducible across hosts).
+ **/
+uint64_t    random_next() {
+    Seed ^= Seed >> 12;
+    Seed ^= Seed << 25;
+    Seed ^= Seed >> 27;
+    return Seed * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Return uniform random double in (0, 1].
+ **/
+double      random_uniform() {
+    return ((random_next() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Draw file size from the configured distribution.
+ **/
+size_t      random_size() {
+    double size = SizeA;
+
+    switch (SizeDist) {
+        case DIST_FIXED:
+            break;
+        case DIST_UNIFORM:
+            size = SizeA + (SizeB - SizeA + 1) * (random_uniform() - 1e-12);
+            break;
+        case DIST_LOGNORMAL: {
+            /* Box-Muller transform */
+            double normal = sqrt(-2.0 * log(random_uniform())) * cos(2.0 * M_PI * random_uniform());
+            size = SizeA * exp(SizeB * normal);
+            break;
+        }
+    }
+
+    return min((size_t)max(size, 1.0), MAX_FILE_SIZE);
+}
+
+/**
+ * Return number of disk blocks (data and indirect) a file of size bytes uses
+ * (none if it is stored inline).
+ **/
+size_t      blocks_for(size_t size) {
+    size_t inode_size = Format.inode_size ? Format.inode_size : INODE_SIZE_64;
+    if ((Format.features & FS_FEATURE_INLINE_DATA) && size <= inode_size - offsetof(Inode64, direct)) {
+        return 0;
+    }
+
+    size_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blocks <= POINTERS_PER_INODE) {
+        return blocks;
+    }
+    /* Estimate pointer blocks using the smaller (revision 2) fan-out */
+    return blocks + 1 + (blocks - POINTERS_PER_INODE) / POINTERS_PER_BLOCK_64;
+}
+
+/**
+ * Parse distribution specification (e.g. "uniform:1024:65536").
+ **/
+bool        parse_distribution(const char *spec) {
+    if (sscanf(spec, "fixed:%lf", &SizeA) == 1) {
+        SizeDist = DIST_FIXED;
+    } else if (sscanf(spec, "uniform:%lf:%lf", &SizeA, &SizeB) == 2 && SizeA <= SizeB) {
+        SizeDist = DIST_UNIFORM;
+    } else if (sscanf(spec, "lognormal:%lf:%lf", &SizeA, &SizeB) == 2) {
+        SizeDist = DIST_LOGNORMAL;
+    } else {
+        error("Invalid distribution: %s", spec);
+        return false;
+    }
+    return SizeA > 0;
+}
+
+/**
+ * Create files until budget blocks are in use or the file system is full.
+ *
+ * Files are written one block-sized chunk at a time.  With a non-zero
+ * fragmentation level, several files grow concurrently and each chunk is
+ * appended to a randomly chosen one, which interleaves their blocks.
+ *
+ * @return  Number of data blocks in use by live files.
+ **/
+size_t      populate(FileSystem *fs, size_t budget) {
+    size_t used   = 0;
+    size_t active = 1 + Fragmentation / 10;
+    char   chunk[BLOCK_SIZE];
+
+    for (size_t f = 0; f < FilesCount; f++) {
+        used += blocks_for(Files[f].written);
+    }
+
+    size_t first_open = FilesCount;             /* Files [first_open, FilesCount) still growing */
+    bool   exhausted  = false;
+    while (true) {
+        /* Open new files while within budget */
+        while (!exhausted && FilesCount - first_open < active) {
+            size_t target = random_size();
+            if (used + blocks_for(target) > budget) {
+                exhausted = true;
+                break;
+            }
+
+            ssize_t inode_number = fs_create(fs);
+            if (inode_number < 0) {
+                exhausted = true;
+                break;
+            }
+
+            if (FilesCount == FilesCapacity) {
+                FilesCapacity = max(FilesCapacity * 2, 64);
+                Files = realloc(Files, FilesCapacity * sizeof(File));
+            }
+            Files[FilesCount++] = (File){inode_number, target, 0};
+            used += blocks_for(target);
+            Created++;
+        }
+
+        if (first_open == FilesCount) {
+            break;
+        }
+
+        /* Pick next file to append to */
+        size_t open  = FilesCount - first_open;
+        size_t pick  = first_open;
+        if (open > 1 && random_next() % 100 < Fragmentation) {
+            pick += random_next() % open;
+        }
+
+        File  *file   = &Files[pick];
+        size_t length = min(file->target - file->written, BLOCK_SIZE);
+        memset(chunk, 'a' + (file->inode_number + file->written / BLOCK_SIZE) % 26, length);
+
+        ssize_t result = fs_write(fs, file->inode_number, chunk, length, file->written);
+        if (result > 0) {
+            file->written += result;
+            BytesWritten  += result;
+        }
+
+        /* Retire finished (or failed) files by swapping them into the closed prefix */
+        if (result != (ssize_t)length || file->written == file->target) {
+            if (file->written != file->target) {
+                used -= blocks_for(file->target) - blocks_for(file->written);
+                file->target = file->written;
+            }
+            File tmp          = Files[first_open];
+            Files[first_open] = *file;
+            *file             = tmp;
+            first_open++;
+        }
+    }
+
+    return used;
+}
+
+/**
+ * Remove ChurnPercent of the live files, chosen at random.
+ **/
+void        churn(FileSystem *fs) {
+    size_t victims = FilesCount * ChurnPercent / 100;
+
+    for (size_t v = 0; v < victims && FilesCount; v++) {
+        size_t pick = random_next() % FilesCount;
+        if (fs_remove(fs, Files[pick].inode_number)) {
+            Removed++;
+        }
+        Files[pick] = Files[--FilesCount];
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
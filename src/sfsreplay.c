@@ -0,0 +1,362 @@
+/* sfsreplay.c: SimpleFS trace replay tool */
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/logging.h"
+#include "sfs/trace.h"
+#include "sfs/utils.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Structures */
+
+typedef struct Samples Samples;
+struct Samples {
+    uint64_t   *values;                         /* Nanoseconds */
+    size_t      count;
+    size_t      capacity;
+};
+
+typedef struct OpStats OpStats;
+struct OpStats {
+    Samples     traced;                         /* Durations recorded in the trace */
+    Samples     replayed;                       /* Durations measured during replay */
+    size_t      mismatches;                     /* Results that differ from the trace */
+};
+
+/* Globals */
+
+static bool         Timed     = false;          /* Honor recorded inter-arrival times */
+static int          DiskFlags = 0;              /* DISK_* flags for the image */
+static DiskModel    Model     = {0};            /* Simulated device (see disk_set_model) */
+static bool         Schedule  = false;          /* Sort and merge block I/O (see disk_set_scheduler) */
+
+static uint64_t    *InodeMap      = NULL;       /* Traced inode -> replayed inode + 1 (0 for identity) */
+static size_t       InodeCapacity = 0;
+static char        *Buffer        = NULL;       /* Read destination */
+static char        *Pattern       = NULL;       /* Write source */
+static size_t       BufferSize    = 0;          /* Bytes in Buffer and in Pattern */
+
+/* Utility Prototypes */
+
+bool        samples_add(Samples *samples, uint64_t value);
+uint64_t    samples_percentile(Samples *samples, size_t percent);
+double      samples_mean(const Samples *samples);
+int         compare_uint64(const void *a, const void *b);
+bool        inode_map(uint64_t traced, int64_t replayed);
+size_t      inode_lookup(uint64_t traced);
+bool        buffer_reserve(size_t length);
+int64_t     replay(FileSystem *fs, const TraceRecord *record);
+void        wait_until(uint64_t deadline);
+
+/* Main Execution */
+
+void usage(const char *program, int status) {
+    fprintf(stderr, "Usage: %s [options] <trace> <diskfile> <nblocks>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -t             Issue operations at their recorded times\n");
+    fprintf(stderr, "    -d             Bypass the host page cache (O_DIRECT)\n");
+    fprintf(stderr, "    -m MODEL       Simulate device latency: none, hdd, ssd, nvme (default: none)\n");
+    fprintf(stderr, "    -s             Queue, sort, and merge block I/O with write-back\n");
+    fprintf(stderr, "    -h             Show this help message\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "tdm:sh")) != -1) {
+        switch (c) {
+            case 't': Timed = true; break;
+            case 'd': DiskFlags |= DISK_DIRECT; break;
+            case 's': Schedule = true; break;
+            case 'm':
+                if (!disk_model_preset(optarg, &Model)) {
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+
+    if (argc - optind != 3) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    FILE *stream = fopen(argv[optind], "r");
+    TraceHeader header;
+    if (!stream || fread(&header, sizeof(header), 1, stream) != 1) {
+        error("Unable to read %s: %s", argv[optind], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+        error("%s is not a version %d trace", argv[optind], TRACE_VERSION);
+        fclose(stream);
+        return EXIT_FAILURE;
+    }
+
+    Disk *disk = disk_open_ex(argv[optind + 1], strtoull(argv[optind + 2], NULL, 10), DiskFlags);
+    if (!disk) {
+        error("Unable to open %s", argv[optind + 1]);
+        fclose(stream);
+        return EXIT_FAILURE;
+    }
+
+    FileSystem fs = {0};
+    if (!fs_mount(&fs, disk)) {
+        error("Unable to mount %s", argv[optind + 1]);
+        disk_close(disk);
+        fclose(stream);
+        return EXIT_FAILURE;
+    }
+    disk_set_model(disk, &Model);
+    if (Schedule && !disk_set_scheduler(disk, &(DiskScheduler){0})) {
+        error("Unable to start I/O scheduler");
+        fs_unmount(&fs);
+        disk_close(disk);
+        fclose(stream);
+        return EXIT_FAILURE;
+    }
+
+    /* Replay file system records in the order they finished, one at a time;
+     * disk records are only counted, since replaying the fs operations
+     * reissues them.  A trace that was never stopped has no record count in
+     * its header, so read to the end of the file. */
+    OpStats     stats[TRACE_OPS] = {{{0}}};
+    size_t      traced_reads  = 0, traced_writes = 0;
+    size_t      disk_reads    = disk->reads;
+    size_t      disk_writes   = disk->writes;
+    size_t      replayed      = 0;
+    uint64_t    start         = trace_clock();
+    TraceRecord record;
+    for (size_t r = 0; (!header.records || r < header.records) && fread(&record, sizeof(record), 1, stream) == 1; r++) {
+        if (!trace_op_name(record.op)) {
+            continue;
+        }
+        if (record.op == TRACE_DISK_READ) {
+            traced_reads++;
+            continue;
+        }
+        if (record.op == TRACE_DISK_WRITE) {
+            traced_writes++;
+            continue;
+        }
+        if (record.op == TRACE_DISK_DISCARD) {
+            continue;
+        }
+
+        if (Timed) {
+            wait_until(start + record.timestamp);
+        }
+        uint64_t began  = trace_clock();
+        int64_t  result = replay(&fs, &record);
+        uint64_t spent  = trace_clock() - began;
+
+        OpStats *op = &stats[record.op];
+        if (!samples_add(&op->traced, record.duration) || !samples_add(&op->replayed, spent)) {
+            error("Unable to allocate samples");
+            break;
+        }
+        if (result != record.result) {
+            op->mismatches++;
+        }
+        if ((record.op == TRACE_FS_CREATE || record.op == TRACE_FS_CLONE) && record.result >= 0 && result >= 0) {
+            inode_map(record.result, result);
+        }
+        replayed++;
+    }
+    double seconds = (trace_clock() - start) / 1e9;
+    fclose(stream);
+
+    size_t mismatches = 0;
+    printf("%-10s %8s %10s %10s %10s %10s %10s %10s %10s\n", "op", "count", "mismatches",
+           "trace p50", "trace p99", "mean", "p50", "p99", "max");
+    for (uint16_t o = 0; o < TRACE_OPS; o++) {
+        OpStats *op = &stats[o];
+        if (!op->replayed.count) {
+            continue;
+        }
+        printf("%-10s %8zu %10zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", trace_op_name(o),
+               op->replayed.count, op->mismatches,
+               samples_percentile(&op->traced, 50) / 1e3, samples_percentile(&op->traced, 99) / 1e3,
+               samples_mean(&op->replayed) / 1e3,
+               samples_percentile(&op->replayed, 50) / 1e3, samples_percentile(&op->replayed, 99) / 1e3,
+               samples_percentile(&op->replayed, 100) / 1e3);
+        mismatches += op->mismatches;
+        free(op->traced.values);
+        free(op->replayed.values);
+    }
+    printf("%zu operations replayed in %.3f seconds\n", replayed, seconds);
+    printf("%zu mismatches\n", mismatches);
+    printf("%zu disk reads traced, %zu replayed\n", traced_reads, disk->reads - disk_reads);
+    printf("%zu disk writes traced, %zu replayed\n", traced_writes, disk->writes - disk_writes);
+    if (header.dropped) {
+        printf("%lu records dropped from trace\n", (unsigned long)header.dropped);
+    }
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    free(InodeMap);
+    free(Buffer);
+    free(Pattern);
+    return EXIT_SUCCESS;
+}
+
+/* Utility Functions */
+
+/**
+ * Append value to samples, growing them as needed.
+ **/
+bool        samples_add(Samples *samples, uint64_t value) {
+    if (samples->count == samples->capacity) {
+        size_t    capacity = max(samples->capacity * 2, 64);
+        uint64_t *values   = realloc(samples->values, capacity * sizeof(uint64_t));
+        if (!values) {
+            return false;
+        }
+        samples->values   = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = value;
+    return true;
+}
+
+/**
+ * Return percentile of samples (sorting them in place; 0 if empty).
+ **/
+uint64_t    samples_percentile(Samples *samples, size_t percent) {
+    if (!samples->count) {
+        return 0;
+    }
+    qsort(samples->values, samples->count, sizeof(uint64_t), compare_uint64);
+    return samples->values[min(samples->count * percent / 100, samples->count - 1)];
+}
+
+/**
+ * Return mean of samples (0 if empty).
+ **/
+double      samples_mean(const Samples *samples) {
+    double total = 0;
+    for (size_t i = 0; i < samples->count; i++) {
+        total += samples->values[i];
+    }
+    return samples->count ? total / samples->count : 0.0;
+}
+
+/**
+ * Order uint64_t values ascending (for qsort).
+ **/
+int         compare_uint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Record that the inode the trace knows as traced is replayed as replayed.
+ **/
+bool        inode_map(uint64_t traced, int64_t replayed) {
+    if (traced >= InodeCapacity) {
+        size_t    capacity = max(traced + 1, InodeCapacity * 2);
+        uint64_t *map      = realloc(InodeMap, capacity * sizeof(uint64_t));
+        if (!map) {
+            return false;
+        }
+        memset(map + InodeCapacity, 0, (capacity - InodeCapacity) * sizeof(uint64_t));
+        InodeMap      = map;
+        InodeCapacity = capacity;
+    }
+    InodeMap[traced] = replayed + 1;
+    return true;
+}
+
+/**
+ * Return the replayed inode for a traced one.  Inodes the trace did not
+ * create keep their number, so replaying against a copy of the traced image
+ * finds its existing files.
+ **/
+size_t      inode_lookup(uint64_t traced) {
+    return traced < InodeCapacity && InodeMap[traced] ? InodeMap[traced] - 1 : traced;
+}
+
+/**
+ * Grow Buffer and Pattern to at least length bytes, filling Pattern with the
+ * fixed data replayed writes store.
+ **/
+bool        buffer_reserve(size_t length) {
+    if (length <= BufferSize) {
+        return true;
+    }
+    char *buffer  = realloc(Buffer, length);
+    if (buffer) {
+        Buffer = buffer;
+    }
+    char *pattern = realloc(Pattern, length);
+    if (pattern) {
+        Pattern = pattern;
+    }
+    if (!buffer || !pattern) {
+        return false;
+    }
+    for (size_t i = BufferSize; i < length; i++) {
+        Pattern[i] = 'a' + i % 26;
+    }
+    BufferSize = length;
+    return true;
+}
+
+/**
+ * Issue the file system operation a record describes.
+ *
+ * @return      Result in trace form (bool as 0 or 1, -1 if it could not be
+ *              issued).
+ **/
+int64_t     replay(FileSystem *fs, const TraceRecord *record) {
+    size_t inode_number = inode_lookup(record->inode);
+    switch (record->op) {
+        case TRACE_FS_CREATE:
+            return fs_create(fs);
+        case TRACE_FS_REMOVE:
+            return fs_remove(fs, inode_number);
+        case TRACE_FS_STAT:
+            return fs_stat(fs, inode_number);
+        case TRACE_FS_READ:
+            if (!buffer_reserve(record->length)) {
+                return -1;
+            }
+            return fs_read(fs, inode_number, Buffer, record->length, record->offset);
+        case TRACE_FS_WRITE:
+            if (!buffer_reserve(record->length)) {
+                return -1;
+            }
+            return fs_write(fs, inode_number, Pattern, record->length, record->offset);
+        case TRACE_FS_TRUNCATE:
+            return fs_truncate(fs, inode_number, record->length);
+        case TRACE_FS_FALLOCATE:
+            return fs_fallocate(fs, inode_number, record->offset, record->length, record->flags);
+        case TRACE_FS_CLONE:
+            return fs_clone(fs, inode_number);
+    }
+    return -1;
+}
+
+/**
+ * Sleep until trace_clock() reaches deadline.
+ **/
+void        wait_until(uint64_t deadline) {
+    uint64_t now = trace_clock();
+    if (now < deadline) {
+        struct timespec delay = {
+            .tv_sec  = (deadline - now) / 1000000000ULL,
+            .tv_nsec = (deadline - now) % 1000000000ULL,
+        };
+        nanosleep(&delay, NULL);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,11 +2,13 @@
 
 #include "sfs/disk.h"
 #include "sfs/fs.h"
+#include "sfs/utils.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 /* Macros */
 
@@ -17,9 +19,20 @@
 void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_check(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_scrub(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_dedup(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_fstrim(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_grow(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_frag(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_defrag(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_clone(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_snapshot(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_truncate(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_fallocate(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_cat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
@@ -29,6 +42,9 @@ void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 
 bool copyout(FileSystem *fs, size_t inode_number, const char *path);
 bool copyin(FileSystem *fs, const char *path, size_t inode_number);
+bool copyout_zeroes(const char *buffer, size_t length);
+bool copyout_skip(FILE *stream, size_t length, bool *sparse);
+bool parse_format_options(char *spec, FormatOptions *options);
 
 /* Main Execution */
 
@@ -38,7 +54,7 @@ int main(int argc, char *argv[]) {
 	return EXIT_FAILURE;
     }
 
-    Disk *disk = disk_open(argv[1], atoi(argv[2]));
+    Disk *disk = disk_open(argv[1], strtoull(argv[2], NULL, 10));
     if (!disk) {
     	return EXIT_FAILURE;
     }
@@ -65,12 +81,34 @@ int main(int argc, char *argv[]) {
 	    do_format(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "mount")) {
 	    do_mount(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "check")) {
+	    do_check(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "scrub")) {
+	    do_scrub(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "dedup")) {
+	    do_dedup(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "fstrim")) {
+	    do_fstrim(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "grow")) {
+	    do_grow(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "frag")) {
+	    do_frag(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "defrag")) {
+	    do_defrag(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "create")) {
 	    do_create(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "remove")) {
 	    do_remove(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "clone")) {
+	    do_clone(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "snapshot")) {
+	    do_snapshot(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "stat")) {
 	    do_stat(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "truncate")) {
+	    do_truncate(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "fallocate")) {
+	    do_fallocate(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "copyout")) {
 	    do_copyout(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "cat")) {
@@ -105,12 +143,17 @@ void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 }
 
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-	printf("Usage: format\n");
+    FormatOptions options = {0};
+    if (args >= 2) {
+        options.revision = atoi(arg1);
+    }
+    if (args > 3 || (args == 3 && !parse_format_options(arg2, &options))) {
+	printf("Usage: format [revision] [inode_ratio | option,...]\n");
+	printf("Options: ratio=BYTES, inodes=COUNT, inode_size=BYTES, block_size=BYTES, max_blocks=BLOCKS, inline, compress, checksums, dedup, reflink\n");
 	return;
     }
 
-    if (fs_format(fs, disk)) {
+    if (fs_format_ex(fs, disk, &options)) {
         printf("disk formatted.\n");
     } else {
         printf("format failed!\n");
@@ -118,18 +161,141 @@ void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 }
 
 void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-	printf("Usage: mount\n");
+    uint32_t discard = DISCARD_NONE;
+    if (args == 2 && streq(arg1, "discard")) {
+        discard = DISCARD_SYNC;
+    } else if (args == 2 && streq(arg1, "discard=batch")) {
+        discard = DISCARD_BATCH;
+    } else if (args != 1) {
+	printf("Usage: mount [discard | discard=batch]\n");
 	return;
     }
 
-    if (fs_mount(fs, disk)) {
+    if (fs_mount(fs, disk) && fs_set_discard(fs, discard)) {
         printf("disk mounted.\n");
     } else {
         printf("mount failed!\n");
     }
 }
 
+void do_check(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    CheckOptions options = {.stream = stdout};
+    bool         usage   = false;
+    for (int i = 1; i < args; i++) {
+        char *arg = (i == 1) ? arg1 : arg2;
+        if (streq(arg, "repair")) {
+            options.repair = true;
+        } else if (streq(arg, "json")) {
+            options.json = true;
+        } else {
+            usage = true;
+        }
+    }
+
+    if (usage) {
+        printf("Usage: check [repair] [json]\n");
+        return;
+    }
+
+    CheckReport report;
+    if (!fs->disk) {
+        printf("check failed!\n");
+    } else if (!fs_check(fs, &options, &report) && !options.json) {
+        printf("check found problems.\n");
+    }
+}
+
+void do_scrub(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    CheckOptions options = {.stream = stdout};
+    if (args > 2 || (args == 2 && !streq(arg1, "json"))) {
+        printf("Usage: scrub [json]\n");
+        return;
+    }
+    options.json = args == 2;
+
+    ScrubReport report;
+    if (!fs->disk) {
+        printf("scrub failed!\n");
+    } else if (!fs_scrub(fs, &options, &report) && !options.json) {
+        printf("scrub found corruption.\n");
+    }
+}
+
+void do_dedup(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: dedup\n");
+        return;
+    }
+
+    DedupReport report;
+    if (fs_dedup_report(fs, &report)) {
+        printf("dedup: %lu indexed %lu shared %lu saved %lu bytes\n",
+            report.indexed, report.shared, report.saved, report.memory);
+    } else {
+        printf("dedup failed!\n");
+    }
+}
+
+void do_fstrim(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: fstrim\n");
+        return;
+    }
+
+    ssize_t discarded = fs_trim(fs);
+    if (discarded >= 0) {
+        printf("trimmed %ld blocks.\n", discarded);
+    } else {
+        printf("fstrim failed!\n");
+    }
+}
+
+void do_grow(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: grow <blocks>\n");
+        return;
+    }
+
+    uint64_t blocks = strtoull(arg1, NULL, 0);
+    if (fs_grow(fs, blocks)) {
+        printf("grew file system to %lu blocks (%lu inodes).\n", blocks, fs->meta_data.inodes);
+    } else {
+        printf("grow failed!\n");
+    }
+}
+
+void do_frag(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: frag <inode>\n");
+        return;
+    }
+
+    ssize_t inode_number = atoi(arg1);
+    ssize_t runs         = fs_fragmentation(fs, inode_number);
+    if (runs >= 0) {
+        printf("inode %ld has %ld runs.\n", inode_number, runs);
+    } else {
+        printf("frag failed!\n");
+    }
+}
+
+void do_defrag(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args > 2) {
+        printf("Usage: defrag [rate]\n");
+        return;
+    }
+
+    DefragOptions options = {.rate = args == 2 ? strtoull(arg1, NULL, 0) : 0, .stream = stdout};
+    DefragReport  report;
+    if (fs_defrag(fs, &options, &report)) {
+        printf("defrag: %lu files %lu fragmented %lu relocated %lu skipped %lu blocks %lu runs_before %lu runs_after\n",
+            report.files, report.fragmented, report.relocated, report.skipped,
+            report.blocks, report.runs_before, report.runs_after);
+    } else {
+        printf("defrag failed!\n");
+    }
+}
+
 void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     if (args != 1) {
         printf("Usage: create\n");
@@ -158,6 +324,47 @@ void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_clone(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: clone <inode>\n");
+        return;
+    }
+
+    size_t  inode_number = atoi(arg1);
+    ssize_t clone        = fs_clone(fs, inode_number);
+    if (clone >= 0) {
+        printf("cloned inode %ld to inode %ld.\n", inode_number, clone);
+    } else {
+        printf("clone failed!\n");
+    }
+}
+
+void do_snapshot(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args == 1) {
+        ssize_t snapshot = fs_snapshot(fs);
+        if (snapshot >= 0) {
+            printf("created snapshot %ld.\n", snapshot);
+        } else {
+            printf("snapshot failed!\n");
+        }
+    } else if (args == 3 && streq(arg1, "delete")) {
+        if (fs_snapshot_delete(fs, atoi(arg2))) {
+            printf("deleted snapshot %d.\n", atoi(arg2));
+        } else {
+            printf("snapshot failed!\n");
+        }
+    } else if (args == 3) {
+        ssize_t copy = fs_snapshot_inode(fs, atoi(arg1), atoi(arg2));
+        if (copy >= 0) {
+            printf("snapshot %d has inode %d as inode %ld.\n", atoi(arg1), atoi(arg2), copy);
+        } else {
+            printf("snapshot failed!\n");
+        }
+    } else {
+        printf("Usage: snapshot [delete <snapshot> | <snapshot> <inode>]\n");
+    }
+}
+
 void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
         printf("Usage: stat <inode>\n");
@@ -173,6 +380,36 @@ void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_truncate(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+        printf("Usage: truncate <inode> <size>\n");
+        return;
+    }
+
+    size_t inode_number = atoi(arg1);
+    size_t size         = strtoull(arg2, NULL, 0);
+    if (fs_truncate(fs, inode_number, size)) {
+        printf("truncated inode %ld to %ld bytes.\n", inode_number, size);
+    } else {
+        printf("truncate failed!\n");
+    }
+}
+
+void do_fallocate(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+        printf("Usage: fallocate <inode> <size>\n");
+        return;
+    }
+
+    size_t inode_number = atoi(arg1);
+    size_t size         = strtoull(arg2, NULL, 0);
+    if (fs_fallocate(fs, inode_number, 0, size, FALLOCATE_UNWRITTEN)) {
+        printf("allocated %ld bytes for inode %ld.\n", size, inode_number);
+    } else {
+        printf("fallocate failed!\n");
+    }
+}
+
 void do_copyout(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     if (args != 3) {
         printf("Usage: copyout <inode> <file>\n");
@@ -208,13 +445,24 @@ void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
-    printf("    mount\n");
+    printf("    format  [revision] [inode_ratio | option,...]\n");
+    printf("    mount   [discard | discard=batch]\n");
+    printf("    check   [repair] [json]\n");
+    printf("    scrub   [json]\n");
+    printf("    dedup\n");
+    printf("    fstrim\n");
+    printf("    grow    <blocks>\n");
+    printf("    frag    <inode>\n");
+    printf("    defrag  [rate]\n");
     printf("    debug\n");
     printf("    create\n");
     printf("    remove  <inode>\n");
+    printf("    clone   <inode>\n");
+    printf("    snapshot [delete <snapshot> | <snapshot> <inode>]\n");
     printf("    cat     <inode>\n");
     printf("    stat    <inode>\n");
+    printf("    truncate <inode> <size>\n");
+    printf("    fallocate <inode> <size>\n");
     printf("    copyin  <file> <inode>\n");
     printf("    copyout <inode> <file>\n");
     printf("    help\n");
@@ -261,23 +509,106 @@ bool copyout(FileSystem *fs, size_t inode_number, const char *path) {
         return false;
     }
 
-    char buffer[4*BUFSIZ] = {0};
-    size_t offset = 0;
-    while (true) {
-        //printf("\n\nSIZE OF BUFFER: %zu\n\n",sizeof(buffer));
-        ssize_t result = fs_read(fs, inode_number, buffer, sizeof(buffer), offset);
-        //printf("\n\nRESULT: %zu\n\n", result);
+    // The Inode is loaded once for its size and for seeking past holes
+    char    buffer[4*BUFSIZ] = {0};
+    Inode64 node   = {0};
+    ssize_t size   = fs_load_inode(fs, inode_number, &node) && node.valid ? (ssize_t)node.size : -1;
+    size_t  offset = 0;
+    bool    sparse = false;
+    while ((ssize_t)offset < size) {
+        ssize_t result = fs_read(fs, inode_number, buffer, min(sizeof(buffer), size - offset), offset);
         if (result <= 0) {
-            //printf("\n\nRESULT IS 0 OR LESS\n\n");
             break;
         }
-        //printf("\n\nRESULT: %zu\n\n",result);
+
+        // Only a run of zeroes may start a hole: skip it up to the next data
+        // (holes read as zeroes without costing block reads)
+        if (copyout_zeroes(buffer, result)) {
+            ssize_t data = fs_seek_inode(fs, &node, offset + result, true);
+            if (data < 0) {
+                data = size;
+            }
+            if (!copyout_skip(stream, data - offset, &sparse)) {
+                break;
+            }
+            offset = data;
+            continue;
+        }
         fwrite(buffer, 1, result, stream);
         offset += result;
     }
+
+    // A trailing hole was seeked over, so extend the output to its full size
+    fflush(stream);
+    if (sparse && ftruncate(fileno(stream), offset) < 0) {
+        fprintf(stderr, "Unable to extend %s: %s\n", path, strerror(errno));
+    }
     printf("%lu bytes copied\n", offset);
     fclose(stream);
     return true;
 }
 
+bool copyout_zeroes(const char *buffer, size_t length) {
+    return length && buffer[0] == 0 && memcmp(buffer, buffer + 1, length - 1) == 0;
+}
+
+bool copyout_skip(FILE *stream, size_t length, bool *sparse) {
+    if (!length) {
+        return true;
+    }
+
+    // Leave a hole in seekable output, otherwise write zeroes
+    if (fseeko(stream, length, SEEK_CUR) == 0) {
+        *sparse = true;
+        return true;
+    }
+
+    char zeroes[4*BUFSIZ] = {0};
+    while (length) {
+        size_t chunk = min(length, sizeof(zeroes));
+        if (fwrite(zeroes, 1, chunk, stream) != chunk) {
+            return false;
+        }
+        length -= chunk;
+    }
+    return true;
+}
+
+bool parse_format_options(char *spec, FormatOptions *options) {
+    // A bare number is the inode ratio
+    char *end;
+    options->inode_ratio = strtoull(spec, &end, 10);
+    if (end != spec && *end == 0) {
+        return true;
+    }
+    options->inode_ratio = 0;
+
+    for (char *option = strtok(spec, ","); option; option = strtok(NULL, ",")) {
+        if (strncmp(option, "ratio=", 6) == 0) {
+            options->inode_ratio = strtoull(option + 6, NULL, 10);
+        } else if (strncmp(option, "inode_size=", 11) == 0) {
+            options->inode_size  = strtoul(option + 11, NULL, 10);
+        } else if (strncmp(option, "inodes=", 7) == 0) {
+            options->inodes      = strtoull(option + 7, NULL, 10);
+        } else if (strncmp(option, "block_size=", 11) == 0) {
+            options->block_size  = strtoul(option + 11, NULL, 10);
+        } else if (strncmp(option, "max_blocks=", 11) == 0) {
+            options->max_blocks  = strtoull(option + 11, NULL, 10);
+        } else if (streq(option, "inline")) {
+            options->features   |= FS_FEATURE_INLINE_DATA;
+        } else if (streq(option, "compress")) {
+            options->features   |= FS_FEATURE_COMPRESSION;
+        } else if (streq(option, "checksums")) {
+            options->features   |= FS_FEATURE_CHECKSUMS;
+        } else if (streq(option, "dedup")) {
+            options->features   |= FS_FEATURE_DEDUP;
+        } else if (streq(option, "reflink")) {
+            options->features   |= FS_FEATURE_REFLINK;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
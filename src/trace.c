@@ -0,0 +1,326 @@
+/* trace.c: SimpleFS binary I/O tracing */
+
+#include "sfs/trace.h"
+#include "sfs/logging.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Internal Constants */
+
+#define TRACE_RING_MASK     (TRACE_RING_RECORDS - 1)
+#define TRACE_BATCH         (256)               /* Records copied out of the ring per fwrite */
+
+/* Internal Structures */
+
+typedef struct TraceSlot TraceSlot;
+struct TraceSlot {
+    uint64_t    sequence;                       /* Position the slot is free for (or position + 1 once filled) */
+    TraceRecord record;                         /* Record published at that position */
+};
+
+/* Internal Globals */
+
+bool                    TraceEnabled = false;
+
+static TraceSlot        Ring[TRACE_RING_RECORDS];   /* Bounded multi-producer, single-consumer queue */
+static uint64_t         Head     = 0;           /* Next position producers claim */
+static uint64_t         Tail     = 0;           /* Next position the flusher reads (flusher only) */
+static uint64_t         Started  = 0;           /* trace_clock() when the trace began */
+static uint64_t         Dropped  = 0;           /* Records lost because the ring was full */
+static uint64_t         Written  = 0;           /* Records written to Stream */
+static bool             Failed   = false;       /* Whether a write to Stream failed */
+static bool             Running  = false;       /* Whether a trace is open (protected by Lock) */
+static bool             Stopping = false;       /* Whether the flusher should exit (protected by Lock) */
+static FILE            *Stream   = NULL;        /* Trace file */
+static pthread_t        Flusher;                /* Thread draining Ring into Stream */
+static pthread_mutex_t  Lock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   Wake     = PTHREAD_COND_INITIALIZER;
+static pthread_once_t   Once     = PTHREAD_ONCE_INIT;
+static __thread size_t  Depth    = 0;           /* Nested fs operations on this thread */
+
+static const char *OpNames[TRACE_OPS] = {
+    [TRACE_DISK_READ]       = "disk_read",
+    [TRACE_DISK_WRITE]      = "disk_write",
+    [TRACE_DISK_DISCARD]    = "disk_discard",
+    [TRACE_FS_CREATE]       = "create",
+    [TRACE_FS_REMOVE]       = "remove",
+    [TRACE_FS_STAT]         = "stat",
+    [TRACE_FS_READ]         = "read",
+    [TRACE_FS_WRITE]        = "write",
+    [TRACE_FS_TRUNCATE]     = "truncate",
+    [TRACE_FS_FALLOCATE]    = "fallocate",
+    [TRACE_FS_CLONE]        = "clone",
+};
+
+/* Internal Prototypes */
+
+void    trace_init();
+void    trace_record(uint16_t op, uint64_t started, uint16_t flags, uint64_t inode, uint64_t length, uint64_t offset, int64_t result);
+size_t  trace_drain();
+void *  trace_flusher(void *arg);
+
+/* External Functions */
+
+/**
+ * Start capturing a trace into the file at path (which is truncated).
+ * Operations are buffered in a ring and written out by a background thread
+ * every TRACE_FLUSH_MS milliseconds.
+ *
+ * @param       path        Path to trace file.
+ * @return      Whether or not the trace was started (false if one already is).
+ **/
+bool    trace_start(const char *path) {
+    pthread_once(&Once, trace_init);
+    pthread_mutex_lock(&Lock);
+    if (Running){
+        pthread_mutex_unlock(&Lock);
+        return false;
+    }
+
+    /* Discard anything an operation straddling the previous trace_stop left */
+    trace_drain();
+
+    TraceHeader header = {.magic = TRACE_MAGIC, .version = TRACE_VERSION, .record_size = sizeof(TraceRecord)};
+    Stream = fopen(path, "w");
+    if (!Stream || fwrite(&header, sizeof(header), 1, Stream) != 1){
+        error("Unable to open trace %s: %s", path, strerror(errno));
+        if (Stream){
+            fclose(Stream);
+            Stream = NULL;
+        }
+        pthread_mutex_unlock(&Lock);
+        return false;
+    }
+
+    Written  = 0;
+    Failed   = false;
+    Stopping = false;
+    __atomic_store_n(&Dropped, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&Started, trace_clock(), __ATOMIC_RELAXED);
+    if (pthread_create(&Flusher, NULL, trace_flusher, NULL) != 0){
+        fclose(Stream);
+        Stream = NULL;
+        pthread_mutex_unlock(&Lock);
+        return false;
+    }
+    Running = true;
+    __atomic_store_n(&TraceEnabled, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&Lock);
+    return true;
+}
+
+/**
+ * Stop the current trace: flush the records buffered so far, fill in the
+ * header, and close the file.  Operations still running may not be recorded.
+ *
+ * @return      Number of records written (-1 if no trace was running or the
+ *              file could not be written).
+ **/
+ssize_t trace_stop() {
+    pthread_mutex_lock(&Lock);
+    if (!Running){
+        pthread_mutex_unlock(&Lock);
+        return -1;
+    }
+    __atomic_store_n(&TraceEnabled, false, __ATOMIC_RELEASE);
+    Stopping = true;
+    pthread_cond_signal(&Wake);
+    pthread_mutex_unlock(&Lock);
+    pthread_join(Flusher, NULL);
+
+    pthread_mutex_lock(&Lock);
+    TraceHeader header = {
+        .magic       = TRACE_MAGIC,
+        .version     = TRACE_VERSION,
+        .record_size = sizeof(TraceRecord),
+        .records     = Written,
+        .dropped     = __atomic_load_n(&Dropped, __ATOMIC_RELAXED),
+    };
+    if (fseek(Stream, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, Stream) != 1){
+        Failed = true;
+    }
+    if (fclose(Stream) != 0){
+        Failed = true;
+    }
+    Stream  = NULL;
+    Running = false;
+    ssize_t result = Failed ? -1 : (ssize_t)Written;
+    pthread_mutex_unlock(&Lock);
+    return result;
+}
+
+/**
+ * Return current monotonic time in nanoseconds (never zero).
+ **/
+uint64_t trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec + 1;
+}
+
+/**
+ * Record a disk operation that began at started (from trace_begin; nothing
+ * is recorded if it is zero, which means tracing was off).
+ *
+ * @param       op          TRACE_* operation.
+ * @param       started     trace_begin() value from before the operation.
+ * @param       inode       Inode or block number.
+ * @param       length      Bytes (or blocks) transferred.
+ * @param       offset      Byte offset.
+ * @param       result      Operation return value.
+ **/
+void    trace_end(uint16_t op, uint64_t started, uint64_t inode, uint64_t length, uint64_t offset, int64_t result) {
+    if (started){
+        trace_record(op, started, 0, inode, length, offset, result);
+    }
+}
+
+/**
+ * Begin a file system operation.  Only the outermost operation on a thread
+ * is traced, so this returns zero for nested ones; every call must be paired
+ * with trace_op_end.
+ *
+ * @return      Start time to pass to trace_op_end (zero if not traced).
+ **/
+uint64_t trace_op_begin() {
+    return Depth++ ? 0 : trace_begin();
+}
+
+/**
+ * End a file system operation begun with trace_op_begin and record it.
+ *
+ * @param       op          TRACE_* operation.
+ * @param       started     trace_op_begin() value.
+ * @param       flags       Operation flags.
+ * @param       inode       Inode number.
+ * @param       length      Bytes requested.
+ * @param       offset      Byte offset.
+ * @param       result      Operation return value.
+ **/
+void    trace_op_end(uint16_t op, uint64_t started, uint16_t flags, uint64_t inode, uint64_t length, uint64_t offset, int64_t result) {
+    Depth--;
+    if (started){
+        trace_record(op, started, flags, inode, length, offset, result);
+    }
+}
+
+/**
+ * Return name of trace operation (NULL if unknown).
+ **/
+const char *trace_op_name(uint16_t op) {
+    return op < TRACE_OPS ? OpNames[op] : NULL;
+}
+
+/* Internal Functions */
+
+/**
+ * Mark every ring slot free for its first position.
+ **/
+void    trace_init() {
+    for (uint64_t i = 0; i < TRACE_RING_RECORDS; i++){
+        __atomic_store_n(&Ring[i].sequence, i, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Append a record to the ring without blocking: claim the next position
+ * with a compare-and-swap once its slot has been drained, fill it in, and
+ * publish it by advancing the slot's sequence.  When the flusher has fallen
+ * a whole ring behind the record is counted as dropped instead.
+ **/
+void    trace_record(uint16_t op, uint64_t started, uint16_t flags, uint64_t inode, uint64_t length, uint64_t offset, int64_t result) {
+    uint64_t now   = trace_clock();
+    uint64_t base  = __atomic_load_n(&Started, __ATOMIC_RELAXED);
+    uint64_t spent = now - started;
+
+    uint64_t   position = __atomic_load_n(&Head, __ATOMIC_RELAXED);
+    TraceSlot *slot;
+    while (true){
+        slot = &Ring[position & TRACE_RING_MASK];
+        int64_t lag = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lag == 0){
+            if (__atomic_compare_exchange_n(&Head, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                break;
+            }
+        } else if (lag < 0){
+            __atomic_fetch_add(&Dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            position = __atomic_load_n(&Head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->record = (TraceRecord){
+        .timestamp = started > base ? started - base : 0,
+        .duration  = spent > UINT32_MAX ? UINT32_MAX : spent,
+        .op        = op,
+        .flags     = flags,
+        .inode     = inode,
+        .length    = length,
+        .offset    = offset,
+        .result    = result,
+    };
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copy published records out of the ring, in order, and write them to
+ * Stream (or discard them if it is not open).  Only the flusher, or
+ * trace_start while there is none, calls this.
+ *
+ * @return      Number of records drained.
+ **/
+size_t  trace_drain() {
+    TraceRecord batch[TRACE_BATCH];
+    size_t      total = 0;
+    while (true){
+        size_t count = 0;
+        while (count < TRACE_BATCH){
+            TraceSlot *slot = &Ring[Tail & TRACE_RING_MASK];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != Tail + 1){
+                break;
+            }
+            batch[count++] = slot->record;
+            __atomic_store_n(&slot->sequence, Tail + TRACE_RING_RECORDS, __ATOMIC_RELEASE);
+            Tail++;
+        }
+        if (!count){
+            return total;
+        }
+        if (Stream){
+            if (fwrite(batch, sizeof(TraceRecord), count, Stream) != count){
+                Failed = true;
+            }
+            Written += count;
+        }
+        total += count;
+    }
+}
+
+/**
+ * Flusher thread: drain the ring every TRACE_FLUSH_MS until trace_stop, then
+ * drain it one last time.
+ **/
+void *  trace_flusher(void *arg) {
+    pthread_mutex_lock(&Lock);
+    while (!Stopping){
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+        deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&Wake, &Lock, &deadline);
+        pthread_mutex_unlock(&Lock);
+        trace_drain();
+        pthread_mutex_lock(&Lock);
+    }
+    pthread_mutex_unlock(&Lock);
+    trace_drain();
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
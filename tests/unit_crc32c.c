@@ -0,0 +1,63 @@
+/* unit_crc32c.c: Unit tests for SimpleFS block checksums */
+
+#include "sfs/crc32c.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Internal functions under test */
+
+uint32_t crc32c_table(uint32_t crc, const unsigned char *data, size_t length);
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char *data, size_t length);
+
+/* Functions */
+
+int test_00_crc32c() {
+    debug("Check standard test vectors");
+    assert(crc32c(0, "", 0) == 0);
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+
+    static unsigned char zeroes[32];
+    assert(crc32c(0, zeroes, sizeof(zeroes)) == 0x8a9136aa);
+
+    debug("Check incremental updates");
+    assert(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+
+    debug("Check hardware and table agree at every alignment and length");
+    static unsigned char data[4096 + 16];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = i * 131 + 7;
+    }
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t length = 4080; length <= 4096; length++) {
+            assert(crc32c_table(~0U, data + offset, length) == crc32c_hardware(~0U, data + offset, length));
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test crc32c\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_crc32c(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -5,19 +5,81 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 #include <unistd.h>
+#include <sys/stat.h>
 
 /* Constants */
 
 #define DISK_PATH   "unit_disk.image"
 #define DISK_BLOCKS (4)
 
+#define SCHEDULER_THREADS   (4)
+#define SCHEDULER_ROUNDS    (200)
+
+#define STRIPE_SPEC     "stripe:8192:unit_disk.image.0,unit_disk.image.1,unit_disk.image.2"
+#define STRIPE_MEMBERS  (3)
+#define STRIPE_UNIT     (2)                 /* Blocks per stripe unit */
+
+#define MIRROR_SPEC     "mirror:unit_disk.image.0,unit_disk.image.1,unit_disk.image.2"
+#define MIRROR_BLOCKS   (1024)              /* Four DISK_REGION_SIZE regions */
+
 /* Functions */
 
 void test_cleanup() {
     unlink(DISK_PATH);
+    unlink("unit_disk.image.0");
+    unlink("unit_disk.image.1");
+    unlink("unit_disk.image.2");
+    unlink("unit_disk.image.3");
+}
+
+off_t member_size(size_t member) {
+    char path[BUFSIZ];
+    struct stat st;
+    snprintf(path, sizeof(path), "unit_disk.image.%zu", member);
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+char image_byte(size_t member, off_t offset) {
+    char path[BUFSIZ];
+    char byte = -1;
+    snprintf(path, sizeof(path), "unit_disk.image.%zu", member);
+    FILE *stream = fopen(path, "r");
+    assert(stream);
+    assert(fseek(stream, offset, SEEK_SET) == 0);
+    assert(fread(&byte, 1, 1, stream) == 1);
+    fclose(stream);
+    return byte;
+}
+
+char member_byte(size_t block) {
+    size_t stripe = block / STRIPE_UNIT;
+    off_t  offset = ((stripe / STRIPE_MEMBERS) * STRIPE_UNIT + block % STRIPE_UNIT) * BLOCK_SIZE;
+    return image_byte(stripe % STRIPE_MEMBERS, offset);
+}
+
+typedef struct {
+    Disk       *disk;
+    size_t      id;
+} SchedulerClient;
+
+void *scheduler_client(void *arg) {
+    SchedulerClient *client = arg;
+    static __thread char data[BLOCK_SIZE];
+    for (size_t round = 0; round < SCHEDULER_ROUNDS; round++) {
+        size_t block = client->id + SCHEDULER_THREADS * (round % 4);
+        memset(data, 'a' + (client->id + round) % 26, BLOCK_SIZE);
+        assert(disk_write(client->disk, block, data) == BLOCK_SIZE);
+        assert(disk_read(client->disk, (block + 1) % 16, data) == BLOCK_SIZE);
+        assert(disk_read(client->disk, block, data) == BLOCK_SIZE);
+        assert(data[0] == 'a' + (client->id + round) % 26 && data[BLOCK_SIZE - 1] == data[0]);
+    }
+    return NULL;
 }
 
 int test_00_disk_open() {
@@ -36,6 +98,7 @@ int test_00_disk_open() {
     assert(disk->blocks  == 10);
     assert(disk->reads   == 0);
     assert(disk->writes  == 0);
+    assert(disk->discards == 0);
     disk_close(disk);
 
     return EXIT_SUCCESS;
@@ -106,6 +169,485 @@ int test_02_disk_write() {
     return EXIT_SUCCESS;
 }
 
+int test_03_disk_discard() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char data[BLOCK_SIZE];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data, 'a' + b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    assert(fsync(disk->fd) == 0);
+
+    struct stat before, after;
+    assert(fstat(disk->fd, &before) == 0);
+
+    debug("Check bad disk");
+    assert(disk_discard(NULL, 0, 1) == DISK_FAILURE);
+
+    debug("Check bad range");
+    assert(disk_discard(disk, DISK_BLOCKS, 1) == DISK_FAILURE);
+    assert(disk_discard(disk, 1, DISK_BLOCKS) == DISK_FAILURE);
+    assert(disk_discard(disk, 1, 0) == DISK_FAILURE);
+    assert(disk->discards == 0);
+
+    debug("Check discarded blocks read as zeros");
+    assert(disk_discard(disk, 1, 2) == 2);
+    assert(disk->discards == 2);
+    assert(disk->writes == DISK_BLOCKS);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            assert(data[i] == ((b == 1 || b == 2) ? 0 : 'a' + b));
+        }
+    }
+
+    debug("Check host storage is released");
+    assert(fstat(disk->fd, &after) == 0);
+    assert(after.st_size == before.st_size);
+    assert(after.st_blocks < before.st_blocks);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_04_disk_grow() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char data[BLOCK_SIZE];
+    memset(data, 'g', BLOCK_SIZE);
+    assert(disk_write(disk, DISK_BLOCKS - 1, data) == BLOCK_SIZE);
+
+    debug("Check bad sizes");
+    assert(disk_grow(NULL, DISK_BLOCKS) == false);
+    assert(disk_grow(disk, DISK_BLOCKS - 1) == false);
+    assert(disk_grow(disk, (size_t)-1) == false);
+    assert(disk->blocks == DISK_BLOCKS);
+
+    debug("Check new blocks can be used and old ones are kept");
+    assert(disk_write(disk, DISK_BLOCKS, data) == DISK_FAILURE);
+    assert(disk_grow(disk, DISK_BLOCKS * 2));
+    assert(disk->blocks == DISK_BLOCKS * 2);
+    assert(disk_read(disk, DISK_BLOCKS * 2 - 1, data) == BLOCK_SIZE);
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        assert(data[i] == 0);
+    }
+    assert(disk_read(disk, DISK_BLOCKS - 1, data) == BLOCK_SIZE);
+    assert(data[0] == 'g');
+    assert(disk_write(disk, DISK_BLOCKS, data) == BLOCK_SIZE);
+
+    debug("Check image is extended sparsely");
+    struct stat st;
+    assert(fstat(disk->fd, &st) == 0);
+    assert(st.st_size == DISK_BLOCKS * 2 * BLOCK_SIZE);
+    assert(disk_grow(disk, DISK_BLOCKS * 2));
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_disk_set_block_size() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    assert(disk->block_size == BLOCK_SIZE);
+
+    static char data[MAX_BLOCK_SIZE];
+    memset(data, 's', BLOCK_SIZE);
+    assert(disk_write(disk, 1, data) == BLOCK_SIZE);
+
+    debug("Check bad sizes");
+    assert(disk_set_block_size(NULL, BLOCK_SIZE) == false);
+    assert(disk_set_block_size(disk, MIN_BLOCK_SIZE / 2) == false);
+    assert(disk_set_block_size(disk, MAX_BLOCK_SIZE * 2) == false);
+    assert(disk_set_block_size(disk, 3 * MIN_BLOCK_SIZE) == false);
+    assert(disk->block_size == BLOCK_SIZE && disk->blocks == DISK_BLOCKS);
+
+    debug("Check smaller blocks address the same bytes");
+    assert(disk_set_block_size(disk, MIN_BLOCK_SIZE));
+    assert(disk->blocks == DISK_BLOCKS * (BLOCK_SIZE / MIN_BLOCK_SIZE));
+    assert(disk_read(disk, BLOCK_SIZE / MIN_BLOCK_SIZE, data) == MIN_BLOCK_SIZE);
+    assert(data[0] == 's' && data[MIN_BLOCK_SIZE - 1] == 's');
+
+    debug("Check larger blocks round the number of blocks down and discard");
+    assert(disk_set_block_size(disk, 2 * BLOCK_SIZE));
+    assert(disk->blocks == DISK_BLOCKS / 2);
+    assert(disk_read(disk, 0, data) == 2 * BLOCK_SIZE);
+    assert(data[BLOCK_SIZE] == 's' && data[2 * BLOCK_SIZE - 1] == 's');
+    if (disk_discard(disk, 0, 1) == 1) {
+        assert(disk_read(disk, 0, data) == 2 * BLOCK_SIZE);
+        assert(data[BLOCK_SIZE] == 0 && data[2 * BLOCK_SIZE - 1] == 0);
+    }
+    assert(disk_set_block_size(disk, MAX_BLOCK_SIZE));
+    assert(disk->blocks == 0);
+    assert(disk_read(disk, 0, data) == DISK_FAILURE);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_06_disk_direct() {
+    Disk *disk = disk_open_ex(DISK_PATH, DISK_BLOCKS, DISK_DIRECT);
+    assert(disk);
+    debug("Direct I/O %s", (disk->flags & DISK_DIRECT) ? "enabled" : "unsupported (buffered)");
+    assert(disk_open_ex(DISK_PATH, DISK_BLOCKS, 1 << 8) == NULL);
+
+    debug("Check arena buffers are aligned, distinct, and reused");
+    char *buffers[DISK_ARENA_BUFFERS + 1];
+    for (size_t i = 0; i <= DISK_ARENA_BUFFERS; i++) {
+        buffers[i] = disk_buffer_get(disk);
+        assert(buffers[i] && (uintptr_t)buffers[i] % DISK_ALIGNMENT == 0);
+        for (size_t j = 0; j < i; j++) {
+            assert(buffers[i] != buffers[j]);
+        }
+    }
+    assert(disk_set_block_size(disk, MIN_BLOCK_SIZE) == false);
+    for (size_t i = 0; i <= DISK_ARENA_BUFFERS; i++) {
+        disk_buffer_put(disk, buffers[i]);
+    }
+    disk_buffer_put(disk, NULL);
+    char *buffer = disk_buffer_get(disk);
+    assert(buffer == buffers[DISK_ARENA_BUFFERS - 1]);
+
+    debug("Check aligned and unaligned transfers");
+    static char data[BLOCK_SIZE + 1];
+    memset(buffer, 'a', BLOCK_SIZE);
+    memset(data + 1, 'u', BLOCK_SIZE);
+    assert(disk_write(disk, 0, buffer) == BLOCK_SIZE);
+    assert(disk_write(disk, 1, data + 1) == BLOCK_SIZE);
+    assert(disk_read(disk, 1, buffer) == BLOCK_SIZE);
+    assert(buffer[0] == 'u' && buffer[BLOCK_SIZE - 1] == 'u');
+    assert(disk_read(disk, 0, data + 1) == BLOCK_SIZE);
+    assert(data[1] == 'a' && data[BLOCK_SIZE] == 'a');
+    assert(disk_read(disk, DISK_BLOCKS, buffer) == DISK_FAILURE);
+    disk_buffer_put(disk, buffer);
+
+    debug("Check small blocks work (falling back to buffered I/O if needed)");
+    assert(disk_set_block_size(disk, MIN_BLOCK_SIZE));
+    buffer = disk_buffer_get(disk);
+    assert(buffer);
+    assert(disk_read(disk, BLOCK_SIZE / MIN_BLOCK_SIZE + 1, buffer) == MIN_BLOCK_SIZE);
+    assert(buffer[0] == 'u');
+    assert(disk_write(disk, 1, buffer) == MIN_BLOCK_SIZE);
+    assert(disk_read(disk, 1, data + 1) == MIN_BLOCK_SIZE);
+    assert(data[1] == 'u');
+    disk_buffer_put(disk, buffer);
+    assert(disk->reads == 4 && disk->writes == 3);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_07_disk_model() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    assert(disk_grow(disk, 20));
+
+    static char data[BLOCK_SIZE];
+    DiskModel model;
+
+    debug("Check presets");
+    assert(disk_model_preset("hdd", &model) && model.type == DISK_MODEL_HDD && model.inject);
+    assert(disk_model_preset("nvme", &model) && model.type == DISK_MODEL_NVME);
+    assert(disk_model_preset("none", &model) && model.type == DISK_MODEL_NONE);
+    assert(!disk_model_preset("floppy", &model));
+
+    debug("Check invalid models");
+    assert(!disk_set_model(disk, &(DiskModel){.type = DISK_MODEL_SSD, .channels = 0}));
+    assert(!disk_set_model(disk, &(DiskModel){.type = DISK_MODEL_SSD, .channels = DISK_MAX_CHANNELS + 1}));
+    assert(!disk_set_model(disk, &(DiskModel){.type = DISK_MODEL_HDD, .track_blocks = 4}));
+    assert(!disk_set_model(disk, &(DiskModel){.type = 42, .channels = 1}));
+    assert(disk->device == NULL);
+
+    debug("Check SSD accounting");
+    assert(disk_set_model(disk, &(DiskModel){.type = DISK_MODEL_SSD, .channels = 2, .read_ns = 1000, .write_ns = 3000}));
+    for (size_t b = 0; b < 4; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+    }
+    assert(disk->device_ns == 4000);
+    assert(disk_write(disk, 5, data) == BLOCK_SIZE);
+    assert(disk->device_ns == 7000);
+    assert(disk_read(disk, 20, data) == DISK_FAILURE);
+    assert(disk->device_ns == 7000);
+
+    debug("Check HDD accounting: streaming, rotation, and seeks");
+    assert(disk_set_model(disk, &(DiskModel){.type = DISK_MODEL_HDD, .track_blocks = 4, .rotation_ns = 4000,
+                                              .seek_min_ns = 100, .seek_max_ns = 1124}));
+    assert(disk->device_ns == 0);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    assert(disk_read(disk, 1, data) == BLOCK_SIZE);
+    assert(disk->device_ns == 2000);
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE);    /* Wait 1000 for block 3 to come around */
+    assert(disk->device_ns == 4000);
+    assert(disk_read(disk, 9, data) == BLOCK_SIZE);    /* Seek 518 over 1 of 6 tracks, wait 482 */
+    assert(disk->device_ns == 6000);
+    assert(disk_read(disk, 18, data) == BLOCK_SIZE);   /* Seek 691 over 2 tracks, wait 3309 */
+    assert(disk->device_ns == 11000);
+
+    debug("Check injected delays");
+    assert(disk_set_model(disk, &(DiskModel){.type = DISK_MODEL_SSD, .channels = 1, .read_ns = 2000000, .inject = true}));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t b = 0; b < 3; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec) >= 6000000L);
+    assert(disk->device_ns == 6000000);
+
+    assert(disk_set_model(disk, NULL));
+    assert(disk->device == NULL);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_08_disk_scheduler() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+    assert(disk_grow(disk, 16));
+
+    static char data[BLOCK_SIZE];
+    static char copy[BLOCK_SIZE];
+    DiskScheduler scheduler = {.depth = 16, .write_expire_ns = 60000000000ULL};
+
+    debug("Check invalid schedulers");
+    assert(!disk_set_scheduler(disk, &(DiskScheduler){.max_merge = DISK_MAX_MERGE + 1}));
+    assert(disk->queue == NULL);
+    assert(disk_flush(disk));
+
+    debug("Check held writes are sorted and merged");
+    assert(disk_set_scheduler(disk, &scheduler));
+    assert(!disk_set_block_size(disk, MIN_BLOCK_SIZE));
+    size_t order[] = {7, 3, 5, 4, 6};
+    for (size_t i = 0; i < 5; i++) {
+        memset(data, '0' + order[i], BLOCK_SIZE);
+        assert(disk_write(disk, order[i], data) == BLOCK_SIZE);
+    }
+    assert(disk->writes == 0);
+    assert(disk_flush(disk));
+    assert(disk->writes == 1);
+    for (size_t b = 3; b <= 7; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        assert(data[0] == (char)('0' + b) && data[BLOCK_SIZE - 1] == data[0]);
+    }
+    assert(disk->reads == 5);
+
+    debug("Check reads of held writes and rewrites of them");
+    memset(data, 'x', BLOCK_SIZE);
+    assert(disk_write(disk, 10, data) == BLOCK_SIZE);
+    memset(data, 'y', BLOCK_SIZE);
+    assert(disk_write(disk, 10, data) == BLOCK_SIZE);
+    assert(disk_read(disk, 10, copy) == BLOCK_SIZE && copy[0] == 'y');
+    assert(disk->reads == 5);
+    assert(disk_flush(disk));
+    assert(disk->writes == 2);
+
+    debug("Check discards drop held writes");
+    assert(disk_write(disk, 12, data) == BLOCK_SIZE);
+    if (disk_discard(disk, 12, 1) == 1) {
+        assert(disk_flush(disk));
+        assert(disk->writes == 2);
+        assert(disk_read(disk, 12, copy) == BLOCK_SIZE && copy[0] == 0);
+    }
+    assert(disk_flush(disk));
+
+    debug("Check transfers are limited to max_merge blocks");
+    assert(disk_set_scheduler(disk, &(DiskScheduler){.depth = 16, .max_merge = 2, .write_expire_ns = 60000000000ULL}));
+    for (size_t b = 0; b < 5; b++) {
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    assert(disk_flush(disk));
+    assert(disk->writes == 5);
+
+    debug("Check held writes go out by their deadline");
+    assert(disk_set_scheduler(disk, &(DiskScheduler){.write_expire_ns = 1000000}));
+    assert(disk_write(disk, 0, data) == BLOCK_SIZE);
+    for (size_t i = 0; i < 1000 && __atomic_load_n(&disk->writes, __ATOMIC_RELAXED) == 5; i++) {
+        usleep(1000);
+    }
+    assert(__atomic_load_n(&disk->writes, __ATOMIC_RELAXED) == 6);
+
+    debug("Check concurrent readers and writers");
+    pthread_t       threads[SCHEDULER_THREADS];
+    SchedulerClient clients[SCHEDULER_THREADS];
+    assert(disk_set_scheduler(disk, &(DiskScheduler){.depth = 4}));
+    for (size_t t = 0; t < SCHEDULER_THREADS; t++) {
+        clients[t] = (SchedulerClient){disk, t};
+        assert(pthread_create(&threads[t], NULL, scheduler_client, &clients[t]) == 0);
+    }
+    for (size_t t = 0; t < SCHEDULER_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    debug("Check detaching flushes");
+    assert(disk_set_scheduler(disk, NULL));
+    assert(disk->queue == NULL);
+    for (size_t t = 0; t < SCHEDULER_THREADS; t++) {
+        for (size_t r = SCHEDULER_ROUNDS - 4; r < SCHEDULER_ROUNDS; r++) {
+            assert(disk_read(disk, t + SCHEDULER_THREADS * (r % 4), data) == BLOCK_SIZE);
+            assert(data[0] == 'a' + (t + r) % 26);
+        }
+    }
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_09_disk_striped() {
+    static char data[BLOCK_SIZE];
+
+    debug("Check invalid stripe specs");
+    assert(disk_open("stripe:1000:unit_disk.image.0,unit_disk.image.1", 16) == NULL);
+    assert(disk_open("stripe:8192", 16) == NULL);
+    assert(disk_open("stripe:8192:", 16) == NULL);
+    assert(disk_open_striped((const char *[]){"unit_disk.image.0"}, 0, 8192, 16, 0) == NULL);
+
+    debug("Check members are sized for their share of stripe units");
+    Disk *disk = disk_open(STRIPE_SPEC, 16);
+    assert(disk);
+    assert(disk->nmembers == STRIPE_MEMBERS);
+    assert(disk->stripe_size == STRIPE_UNIT * BLOCK_SIZE);
+    for (size_t m = 0; m < STRIPE_MEMBERS; m++) {
+        assert(member_size(m) == 3 * STRIPE_UNIT * BLOCK_SIZE);
+    }
+    assert(!disk_set_block_size(disk, 4 * BLOCK_SIZE));
+
+    debug("Check blocks are dealt round-robin in stripe units");
+    for (size_t b = 0; b < 16; b++) {
+        memset(data, 'A' + b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    for (size_t b = 0; b < 16; b++) {
+        assert(member_byte(b) == 'A' + (char)b);
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        assert(data[0] == 'A' + (char)b && data[BLOCK_SIZE - 1] == data[0]);
+    }
+
+    debug("Check merged transfers are split across members");
+    size_t writes = disk->writes;
+    assert(disk_set_scheduler(disk, &(DiskScheduler){.depth = 16, .write_expire_ns = 60000000000ULL}));
+    for (size_t b = 11; b > 0; b--) {
+        memset(data, 'a' + b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    assert(disk_flush(disk));
+    assert(disk->writes == writes + 1);
+    assert(disk_set_scheduler(disk, NULL));
+    for (size_t b = 1; b <= 11; b++) {
+        assert(member_byte(b) == 'a' + (char)b);
+    }
+    assert(member_byte(0) == 'A' && member_byte(12) == 'A' + 12);
+
+    debug("Check discards punch every member");
+    if (disk_discard(disk, 1, 10) == 10) {
+        for (size_t b = 1; b <= 10; b++) {
+            assert(disk_read(disk, b, data) == BLOCK_SIZE && data[0] == 0);
+        }
+        assert(disk_read(disk, 0, data) == BLOCK_SIZE && data[0] == 'A');
+        assert(disk_read(disk, 11, data) == BLOCK_SIZE && data[0] == 'a' + 11);
+    }
+
+    debug("Check growing extends every member");
+    assert(disk_grow(disk, 40));
+    for (size_t m = 0; m < STRIPE_MEMBERS; m++) {
+        assert(member_size(m) == 7 * STRIPE_UNIT * BLOCK_SIZE);
+    }
+    memset(data, 'z', BLOCK_SIZE);
+    assert(disk_write(disk, 39, data) == BLOCK_SIZE);
+    assert(member_byte(39) == 'z');
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_10_disk_mirrored() {
+    static char data[BLOCK_SIZE];
+
+    debug("Check invalid mirror specs");
+    assert(disk_open("mirror:unit_disk.image.0", 16) == NULL);
+    assert(disk_open("mirror:", 16) == NULL);
+
+    debug("Check writes reach every member");
+    Disk *disk = disk_open(MIRROR_SPEC, MIRROR_BLOCKS);
+    assert(disk);
+    assert(disk->nmembers == 3 && disk->mirror);
+    for (size_t m = 0; m < 3; m++) {
+        assert(member_size(m) == MIRROR_BLOCKS * BLOCK_SIZE);
+    }
+    for (size_t b = 0; b < 16; b++) {
+        memset(data, 'A' + b, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    for (size_t b = 0; b < 16; b++) {
+        for (size_t m = 0; m < 3; m++) {
+            assert(image_byte(m, b * BLOCK_SIZE) == 'A' + (char)b);
+        }
+        assert(disk_read(disk, b, data) == BLOCK_SIZE && data[0] == 'A' + (char)b);
+    }
+    assert(disk->writes == 16 && disk->reads == 16);
+
+    debug("Check detaching keeps one member online");
+    assert(!disk_detach(disk, 3));
+    assert(disk_detach(disk, 0));
+    assert(!disk_detach(disk, 0));
+    assert(disk_detach(disk, 1));
+    assert(!disk_detach(disk, 2));
+    assert(disk_resync(disk, 2, NULL) == DISK_FAILURE);
+
+    debug("Check offline members miss writes but reads do not");
+    memset(data, 'q', BLOCK_SIZE);
+    assert(disk_write(disk, 3, data) == BLOCK_SIZE);
+    assert(disk_write(disk, 600, data) == BLOCK_SIZE);
+    assert(image_byte(0, 3 * BLOCK_SIZE) == 'A' + 3 && image_byte(1, 3 * BLOCK_SIZE) == 'A' + 3);
+    assert(image_byte(2, 3 * BLOCK_SIZE) == 'q');
+    for (size_t i = 0; i < 4; i++) {
+        assert(disk_read(disk, 3, data) == BLOCK_SIZE && data[0] == 'q');
+    }
+
+    debug("Check resync only copies dirty regions");
+    assert(disk_resync(disk, 1, NULL) == 2);
+    assert(image_byte(1, 3 * BLOCK_SIZE) == 'q' && image_byte(1, 600 * BLOCK_SIZE) == 'q');
+    assert(disk_resync(disk, 1, NULL) == DISK_FAILURE);
+    if (disk_discard(disk, 3, 1) == 1) {
+        assert(disk_resync(disk, 0, NULL) == 2);
+        assert(image_byte(0, 3 * BLOCK_SIZE) == 0);
+    } else {
+        assert(disk_resync(disk, 0, NULL) == 2);
+    }
+    assert(image_byte(0, 600 * BLOCK_SIZE) == 'q');
+
+    debug("Check a blank replacement is copied in full");
+    assert(disk_detach(disk, 2));
+    assert(disk_resync(disk, 2, "unit_disk.image.3") == MIRROR_BLOCKS * BLOCK_SIZE / DISK_REGION_SIZE);
+    assert(member_size(3) == MIRROR_BLOCKS * BLOCK_SIZE);
+    assert(image_byte(3, 600 * BLOCK_SIZE) == 'q' && image_byte(3, 15 * BLOCK_SIZE) == 'A' + 15);
+    assert(disk_detach(disk, 0) && disk_detach(disk, 1));
+    assert(disk_read(disk, 15, data) == BLOCK_SIZE && data[0] == 'A' + 15);
+
+    debug("Check growing extends every member");
+    assert(disk_grow(disk, 2 * MIRROR_BLOCKS));
+    memset(data, 'z', BLOCK_SIZE);
+    assert(disk_write(disk, 2 * MIRROR_BLOCKS - 1, data) == BLOCK_SIZE);
+    assert(disk_resync(disk, 0, NULL) == 1 && disk_resync(disk, 1, NULL) == 1);
+    assert(image_byte(1, (2 * MIRROR_BLOCKS - 1) * BLOCK_SIZE) == 'z');
+
+    debug("Check merged reads and writes with a scheduler");
+    assert(disk_set_scheduler(disk, &(DiskScheduler){.depth = 32, .write_expire_ns = 60000000000ULL}));
+    for (size_t b = 100; b < 132; b++) {
+        memset(data, 'a' + b % 26, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    assert(disk_flush(disk));
+    for (size_t b = 100; b < 132; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE && data[0] == 'a' + (char)(b % 26));
+        assert(image_byte(0, b * BLOCK_SIZE) == data[0] && image_byte(3, b * BLOCK_SIZE) == data[0]);
+    }
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -115,6 +657,14 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    0. Test disk_open\n");
         fprintf(stderr, "    1. Test disk_read\n");
         fprintf(stderr, "    2. Test disk_write\n");
+        fprintf(stderr, "    3. Test disk_discard\n");
+        fprintf(stderr, "    4. Test disk_grow\n");
+        fprintf(stderr, "    5. Test disk_set_block_size\n");
+        fprintf(stderr, "    6. Test direct I/O and the buffer arena\n");
+        fprintf(stderr, "    7. Test device latency models\n");
+        fprintf(stderr, "    8. Test the I/O scheduler\n");
+        fprintf(stderr, "    9. Test striped disks\n");
+        fprintf(stderr, "   10. Test mirrored disks\n");
         return EXIT_FAILURE;
     }
 
@@ -127,6 +677,14 @@ int main(int argc, char *argv[]) {
         case 0:  status = test_00_disk_open(); break;
         case 1:  status = test_01_disk_read(); break;
         case 2:  status = test_02_disk_write(); break;
+        case 3:  status = test_03_disk_discard(); break;
+        case 4:  status = test_04_disk_grow(); break;
+        case 5:  status = test_05_disk_set_block_size(); break;
+        case 6:  status = test_06_disk_direct(); break;
+        case 7:  status = test_07_disk_model(); break;
+        case 8:  status = test_08_disk_scheduler(); break;
+        case 9:  status = test_09_disk_striped(); break;
+        case 10: status = test_10_disk_mirrored(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 
@@ -2,10 +2,13 @@
 
 #include "sfs/fs.h"
 #include "sfs/logging.h"
+#include "sfs/utils.h"
 
 #include <assert.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include <unistd.h>
 
@@ -24,11 +27,11 @@ int test_00_fs_mount() {
     assert(fs_mount(&fs, disk));
     assert(fs.disk           == disk);
     assert(fs.free_blocks);
-    assert(fs.free_blocks[0] == false);
-    assert(fs.free_blocks[1] == false);
-    assert(fs.free_blocks[2] == false);
-    assert(fs.free_blocks[3] == true);
-    assert(fs.free_blocks[4] == true);
+    assert(bitmap_test(fs.free_blocks, 0) == false);
+    assert(bitmap_test(fs.free_blocks, 1) == false);
+    assert(bitmap_test(fs.free_blocks, 2) == false);
+    assert(bitmap_test(fs.free_blocks, 3) == true);
+    assert(bitmap_test(fs.free_blocks, 4) == true);
 
     debug("Check mounting filesystem (already mounted)");
     assert(fs_mount(&fs, disk) == false);
@@ -43,26 +46,26 @@ int test_00_fs_mount() {
     assert(fs_mount(&fs, disk));
     assert(fs.disk           == disk);
     assert(fs.free_blocks);
-    assert(fs.free_blocks[0] == false);
-    assert(fs.free_blocks[1] == false);
-    assert(fs.free_blocks[2] == false);
-    assert(fs.free_blocks[3] == true);
-    assert(fs.free_blocks[4] == false);
-    assert(fs.free_blocks[5] == false);
-    assert(fs.free_blocks[6] == false);
-    assert(fs.free_blocks[7] == false);
-    assert(fs.free_blocks[8] == false);
-    assert(fs.free_blocks[9] == false);
-    assert(fs.free_blocks[10] == false);
-    assert(fs.free_blocks[11] == false);
-    assert(fs.free_blocks[12] == false);
-    assert(fs.free_blocks[13] == false);
-    assert(fs.free_blocks[14] == false);
-    assert(fs.free_blocks[15] == true);
-    assert(fs.free_blocks[16] == true);
-    assert(fs.free_blocks[17] == true);
-    assert(fs.free_blocks[18] == true);
-    assert(fs.free_blocks[19] == true);
+    assert(bitmap_test(fs.free_blocks, 0) == false);
+    assert(bitmap_test(fs.free_blocks, 1) == false);
+    assert(bitmap_test(fs.free_blocks, 2) == false);
+    assert(bitmap_test(fs.free_blocks, 3) == true);
+    assert(bitmap_test(fs.free_blocks, 4) == false);
+    assert(bitmap_test(fs.free_blocks, 5) == false);
+    assert(bitmap_test(fs.free_blocks, 6) == false);
+    assert(bitmap_test(fs.free_blocks, 7) == false);
+    assert(bitmap_test(fs.free_blocks, 8) == false);
+    assert(bitmap_test(fs.free_blocks, 9) == false);
+    assert(bitmap_test(fs.free_blocks, 10) == false);
+    assert(bitmap_test(fs.free_blocks, 11) == false);
+    assert(bitmap_test(fs.free_blocks, 12) == false);
+    assert(bitmap_test(fs.free_blocks, 13) == false);
+    assert(bitmap_test(fs.free_blocks, 14) == false);
+    assert(bitmap_test(fs.free_blocks, 15) == true);
+    assert(bitmap_test(fs.free_blocks, 16) == true);
+    assert(bitmap_test(fs.free_blocks, 17) == true);
+    assert(bitmap_test(fs.free_blocks, 18) == true);
+    assert(bitmap_test(fs.free_blocks, 19) == true);
 
     debug("Check mounting filesystem (already mounted)");
     assert(fs_mount(&fs, disk) == false);
@@ -115,14 +118,14 @@ int test_02_fs_remove() {
 
     debug("Check removing inode 2");
     assert(fs_remove(&fs, 2));
-    assert(fs.free_blocks[4]);
-    assert(fs.free_blocks[5]);
-    assert(fs.free_blocks[6]);
-    assert(fs.free_blocks[7]);
-    assert(fs.free_blocks[8]);
-    assert(fs.free_blocks[9]);
-    assert(fs.free_blocks[13]);
-    assert(fs.free_blocks[14]);
+    assert(bitmap_test(fs.free_blocks, 4));
+    assert(bitmap_test(fs.free_blocks, 5));
+    assert(bitmap_test(fs.free_blocks, 6));
+    assert(bitmap_test(fs.free_blocks, 7));
+    assert(bitmap_test(fs.free_blocks, 8));
+    assert(bitmap_test(fs.free_blocks, 9));
+    assert(bitmap_test(fs.free_blocks, 13));
+    assert(bitmap_test(fs.free_blocks, 14));
 
     Block block;
     assert(disk_read(fs.disk, 1, block.data) != DISK_FAILURE);
@@ -164,6 +167,1467 @@ int test_03_fs_stat() {
     return EXIT_SUCCESS;
 }
 
+size_t count_free_blocks(FileSystem *fs) {
+    size_t count = 0;
+    for (size_t b = 0; b < fs->meta_data.blocks; b++) {
+        count += bitmap_test(fs->free_blocks, b);
+    }
+    return count;
+}
+
+int test_04_fs_revision_2() {
+    const size_t blocks = 1 << 19;              /* 2 GiB: past the old 16 MiB ceiling */
+    const size_t length = 4 << 20;              /* Reaches the double indirect tree */
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    FileSystem fs = {0};
+    FormatOptions options = {.revision = FS_REVISION_2, .inode_ratio = 1 << 20};
+
+    debug("Check formatting revision 2");
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.revision     == FS_REVISION_2);
+    assert(fs.meta_data.blocks       == blocks);
+    assert(fs.meta_data.inodes       == 2048);
+    assert(fs.meta_data.inode_blocks == 2048 / INODES_PER_BLOCK_64);
+    size_t free_blocks = count_free_blocks(&fs);
+    assert(free_blocks == blocks - fs.meta_data.inode_blocks - 1);
+
+    debug("Check writing and reading through double indirect blocks");
+    char *data = malloc(length);
+    char *copy = malloc(length);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = (i * 7 + i / BLOCK_SIZE) & 0xff;
+    }
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, length, 0) == length);
+    assert(fs_stat(&fs, 0) == length);
+    assert(fs_read(&fs, 0, copy, length, 0) == length);
+    assert(memcmp(data, copy, length) == 0);
+
+    /* 1024 data blocks + 1 indirect + 1 double indirect + 1 leaf */
+    assert(count_free_blocks(&fs) == free_blocks - 1027);
+
+    debug("Check remount rebuilds free block bitmap");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(count_free_blocks(&fs) == free_blocks - 1027);
+    assert(fs_read(&fs, 0, copy, length, 0) == length);
+    assert(memcmp(data, copy, length) == 0);
+
+    debug("Check removing releases every block");
+    assert(fs_remove(&fs, 0));
+    assert(count_free_blocks(&fs) == free_blocks);
+
+    free(data);
+    free(copy);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_fs_mount_parallel() {
+    const size_t blocks = 1 << 16;
+    const size_t files  = 2048;                 /* Fills 64 inode blocks (several scan chunks) */
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    FileSystem fs = {0};
+    FormatOptions options = {.revision = FS_REVISION_2, .inode_ratio = 1 << 14};
+
+    debug("Check populating inodes across the inode table");
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+
+    char *data = calloc(1, 600 * BLOCK_SIZE);
+    for (size_t i = 0; i < files; i++) {
+        /* Mostly small files, with a double indirect one every 64 inodes */
+        size_t length = (i % 64 == 63) ? 600 * BLOCK_SIZE : (i % 9) * BLOCK_SIZE + i;
+        assert(fs_create(&fs) == i);
+        assert(fs_write(&fs, i, data, length, 0) == length);
+    }
+    for (size_t i = 0; i < files; i += 3) {
+        assert(fs_remove(&fs, i));
+    }
+
+    size_t    words  = BITMAP_WORDS(blocks);
+    uint64_t *bitmap = malloc(words * sizeof(uint64_t));
+    memcpy(bitmap, fs.free_blocks, words * sizeof(uint64_t));
+
+    debug("Check remount rebuilds identical free block bitmap");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(memcmp(bitmap, fs.free_blocks, words * sizeof(uint64_t)) == 0);
+
+    free(bitmap);
+    free(data);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_06_fs_check() {
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem   fs      = {0};
+    CheckOptions options = {0};
+    CheckReport  report;
+    char         data[3 * BLOCK_SIZE] = {0};
+
+    debug("Check clean file system");
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, 3 * BLOCK_SIZE, 0) == 3 * BLOCK_SIZE);   /* Blocks 21-23 */
+    assert(fs_create(&fs) == 1);
+    assert(fs_write(&fs, 1, data, 2 * BLOCK_SIZE, 0) == 2 * BLOCK_SIZE);   /* Blocks 24-25 */
+    assert(fs_check(&fs, &options, &report));
+    assert(report.inodes == 2 && report.blocks == 5);
+
+    debug("Check detecting problems");
+    Block block;
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    block.inodes[0].size      = 2 * BLOCK_SIZE;     /* Block 23 past end of file */
+    block.inodes[1].direct[1] = 21;                 /* Duplicate; block 25 leaked */
+    block.inodes[1].direct[2] = 5000;               /* Out of range */
+    block.inodes[1].size      = 3 * BLOCK_SIZE;
+    assert(disk_write(disk, 1, block.data) == BLOCK_SIZE);
+    bitmap_clear(fs.free_blocks, 100);              /* Leaked */
+    bitmap_set(fs.free_blocks, 22);                 /* Unmarked */
+
+    assert(!fs_check(&fs, &options, &report));
+    assert(report.out_of_range    == 1);
+    assert(report.duplicates      == 1);
+    assert(report.size_mismatches == 1);
+    assert(report.leaked          == 2);
+    assert(report.unmarked        == 1);
+    assert(report.repaired        == 0);
+
+    debug("Check repairing problems");
+    options.repair = true;
+    assert(fs_check(&fs, &options, &report));
+    assert(report.leaked   == 3);                   /* Block 23 is released by repair */
+    assert(report.repaired == 7);
+    assert(!bitmap_test(fs.free_blocks, 22));
+    assert(bitmap_test(fs.free_blocks, 23) && bitmap_test(fs.free_blocks, 25) && bitmap_test(fs.free_blocks, 100));
+
+    options.repair = false;
+    assert(fs_check(&fs, &options, &report));
+    assert(report.inodes == 2 && report.blocks == 3 && report.repaired == 0);
+
+    debug("Check repairs persist across remount");
+    size_t free_blocks = count_free_blocks(&fs);
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_check(&fs, &options, &report));
+    assert(count_free_blocks(&fs) == free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_07_fs_sparse() {
+    const size_t blocks = 1 << 16;
+    const size_t far    = 100 << 20;            /* In the double indirect tree */
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    FormatOptions options = {.revision = FS_REVISION_2};
+    char          data[BLOCK_SIZE];
+    char          zeroes[BLOCK_SIZE] = {0};
+
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    size_t free_blocks = count_free_blocks(&fs);
+
+    debug("Check writing past end of file only allocates touched blocks");
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, "sparse", 6, far) == 6);
+    assert(fs_stat(&fs, 0) == far + 6);
+    assert(count_free_blocks(&fs) == free_blocks - 3);  /* Data, leaf, double indirect */
+
+    debug("Check holes read as zeroes without data block reads");
+    size_t reads = disk->reads;
+    memset(data, 'x', sizeof(data));
+    assert(fs_read(&fs, 0, data, sizeof(data), BLOCK_SIZE) == sizeof(data));
+    assert(memcmp(data, zeroes, sizeof(data)) == 0);
+    assert(disk->reads == reads + 1);                   /* Inode only */
+    assert(fs_read(&fs, 0, data, 6, far) == 6);
+    assert(memcmp(data, "sparse", 6) == 0);
+
+    debug("Check seeking data and holes");
+    assert(fs_seek_data(&fs, 0, 0)       == far / BLOCK_SIZE * BLOCK_SIZE);
+    assert(fs_seek_data(&fs, 0, far + 1) == far + 1);
+    assert(fs_seek_data(&fs, 0, far + 6) == -1);
+    assert(fs_seek_hole(&fs, 0, 0)       == 0);
+    assert(fs_seek_hole(&fs, 0, far)     == far + 6);
+    assert(fs_seek_hole(&fs, 0, far + 6) == -1);
+
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_seek_data(&fs, 0, 0)       == 0);
+    assert(fs_seek_hole(&fs, 0, 0)       == BLOCK_SIZE);
+    assert(fs_seek_data(&fs, 0, 1)       == 1);
+    assert(fs_seek_data(&fs, 0, BLOCK_SIZE) == far / BLOCK_SIZE * BLOCK_SIZE);
+
+    debug("Check sparse file is consistent and removable");
+    CheckOptions check = {0};
+    CheckReport  report;
+    assert(fs_check(&fs, &check, &report));
+    assert(report.blocks == 4);
+    assert(fs_remove(&fs, 0));
+    assert(count_free_blocks(&fs) == free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_08_fs_inline() {
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    FormatOptions options = {.inode_size = 256, .features = FS_FEATURE_INLINE_DATA};
+    char          data[256];
+    char          copy[256];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    debug("Check formatting with inline data");
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.revision == FS_REVISION_2);
+    assert(fs.meta_data.inodes   == fs.meta_data.inode_blocks * (BLOCK_SIZE / 256));
+    size_t free_blocks = count_free_blocks(&fs);
+
+    debug("Check small files stay in the inode");
+    assert(fs_create(&fs) == 0);
+    size_t reads  = disk->reads;
+    size_t writes = disk->writes;
+    assert(fs_write(&fs, 0, data, 100, 0) == 100);
+    assert(disk->reads == reads + 1 && disk->writes == writes + 1);
+    assert(fs_write(&fs, 0, data + 200, 40, 200) == 40);     /* Fills all 240 bytes */
+    assert(fs_stat(&fs, 0) == 240);
+    assert(count_free_blocks(&fs) == free_blocks);
+
+    reads = disk->reads;
+    memset(copy, 'x', sizeof(copy));
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == 240);
+    assert(disk->reads == reads + 1);
+    assert(memcmp(copy, data, 100) == 0);
+    assert(copy[100] == 0 && copy[199] == 0);
+    assert(memcmp(copy + 200, data + 200, 40) == 0);
+    assert(fs_seek_data(&fs, 0, 150) == 150);
+    assert(fs_seek_hole(&fs, 0, 0)   == 240);
+
+    debug("Check outgrowing the inode converts to block-mapped");
+    assert(fs_write(&fs, 0, data + 240, 16, 240) == 16);
+    assert(fs_stat(&fs, 0) == 256);
+    assert(count_free_blocks(&fs) == free_blocks - 1);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == 256);
+    assert(memcmp(copy, data, 100) == 0 && memcmp(copy + 200, data + 200, 56) == 0);
+
+    debug("Check inline and converted files survive remount");
+    assert(fs_create(&fs) == 1);
+    assert(fs_write(&fs, 1, data, 10, 0) == 10);
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(count_free_blocks(&fs) == free_blocks - 1);
+    assert(fs_read(&fs, 1, copy, sizeof(copy), 0) == 10);
+    assert(memcmp(copy, data, 10) == 0);
+
+    CheckOptions check = {0};
+    CheckReport  report;
+    assert(fs_check(&fs, &check, &report));
+    assert(report.inodes == 2 && report.blocks == 1);
+
+    assert(fs_remove(&fs, 0) && fs_remove(&fs, 1));
+    assert(count_free_blocks(&fs) == free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_09_fs_compression() {
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    FormatOptions options = {.features = FS_FEATURE_COMPRESSION};
+    static char   data[100000];
+    static char   copy[100000];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = "compressible text "[i % 18] + (i / 4096) % 3;
+    }
+
+    debug("Check formatting with compression");
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.revision == FS_REVISION_2);
+    size_t free_blocks = count_free_blocks(&fs);
+
+    debug("Check compressible data uses fewer blocks");
+    assert(fs_create(&fs) == 0);
+    for (size_t offset = 0; offset < sizeof(data); offset += 3000) {
+        size_t length = min(3000, sizeof(data) - offset);
+        assert(fs_write(&fs, 0, data + offset, length, offset) == (ssize_t)length);
+    }
+    assert(fs_stat(&fs, 0) == sizeof(data));
+    assert(free_blocks - count_free_blocks(&fs) < sizeof(data) / BLOCK_SIZE / 2);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+
+    debug("Check unaligned reads and overwrites");
+    assert(fs_read(&fs, 0, copy, 10000, 12345) == 10000);
+    assert(memcmp(copy, data + 12345, 10000) == 0);
+    memset(data + 20000, 'z', 5000);
+    assert(fs_write(&fs, 0, data + 20000, 5000, 20000) == 5000);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+
+    debug("Check incompressible data is stored as is");
+    uint64_t seed = 1;
+    for (size_t i = 0; i < 5 * BLOCK_SIZE; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        copy[i] = seed >> 56;
+    }
+    size_t before = count_free_blocks(&fs);
+    assert(fs_create(&fs) == 1);
+    assert(fs_write(&fs, 1, copy, 5 * BLOCK_SIZE, 0) == 5 * BLOCK_SIZE);
+    assert(before - count_free_blocks(&fs) == 5);
+    char check[5 * BLOCK_SIZE];
+    assert(fs_read(&fs, 1, check, sizeof(check), 0) == sizeof(check));
+    assert(memcmp(check, copy, sizeof(check)) == 0);
+
+    debug("Check holes in compressed files");
+    assert(fs_write(&fs, 1, data, 100, 200000) == 100);
+    assert(fs_stat(&fs, 1) == 200100);
+    assert(fs_seek_hole(&fs, 1, 0) == 5 * BLOCK_SIZE);
+    assert(fs_read(&fs, 1, check, 200, 199900) == 200);
+    assert(check[0] == 0 && check[99] == 0 && memcmp(check + 100, data, 100) == 0);
+
+    debug("Check compressed files survive remount and check");
+    size_t used = count_free_blocks(&fs);
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(count_free_blocks(&fs) == used);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+
+    CheckOptions check_options = {0};
+    CheckReport  report;
+    assert(fs_check(&fs, &check_options, &report));
+    assert(report.inodes == 2 && !report.leaked && !report.unmarked && !report.size_mismatches);
+
+    assert(fs_remove(&fs, 0) && fs_remove(&fs, 1));
+    assert(count_free_blocks(&fs) == free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_10_fs_checksums() {
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    FormatOptions options = {.features = FS_FEATURE_CHECKSUMS};
+    CheckOptions  scrub   = {0};
+    ScrubReport   report;
+    char          data[3 * BLOCK_SIZE];
+    char          copy[3 * BLOCK_SIZE];
+    Block         block;
+    memset(data, 'c', sizeof(data));
+
+    debug("Check formatting with checksums");
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    assert(fs.checksums);
+    assert(fs.meta_data.checksum_blocks == 1);
+    assert(fs_scrub(&fs, &scrub, &report));
+    assert(report.blocks == fs.meta_data.inode_blocks);
+
+    debug("Check written blocks are verified");
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_scrub(&fs, &scrub, &report));
+    assert(report.blocks == fs.meta_data.inode_blocks + 3 && !report.corrupted);
+
+    debug("Check silent corruption is detected");
+    uint64_t target = fs.meta_data.inode_blocks + fs.meta_data.checksum_blocks + 2;
+    assert(disk_read(disk, target, block.data) == BLOCK_SIZE);
+    block.data[100] ^= 1;
+    assert(disk_write(disk, target, block.data) == BLOCK_SIZE);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == -1);
+    assert(fs_read(&fs, 0, copy, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(!fs_scrub(&fs, &scrub, &report));
+    assert(report.corrupted == 1 && !report.unreadable);
+
+    debug("Check rewriting a block updates its checksum");
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+
+    debug("Check checksum blocks are written once per operation");
+    size_t writes = disk->writes;
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    assert(disk->writes == writes + 3 + 1);         /* Data blocks, then checksum block */
+
+    debug("Check checksums survive remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_scrub(&fs, &scrub, &report));
+    assert(report.blocks == fs.meta_data.inode_blocks + 3);
+
+    debug("Check removing a file with a corrupted pointer block");
+    Inode64 node;
+    assert(fs_create(&fs) == 1);
+    for (size_t offset = 0; offset < 3 * sizeof(data); offset += sizeof(data)) {
+        assert(fs_write(&fs, 1, data, sizeof(data), offset) == sizeof(data));
+    }
+    assert(fs_load_inode(&fs, 1, &node) && node.indirect);
+    assert(disk_read(disk, node.indirect, block.data) == BLOCK_SIZE);
+    block.data[0] ^= 1;
+    assert(disk_write(disk, node.indirect, block.data) == BLOCK_SIZE);
+    assert(!fs_remove(&fs, 1));
+    assert(fs_stat(&fs, 1) == -1);
+    assert(bitmap_test(fs.free_blocks, node.direct[0]) && bitmap_test(fs.free_blocks, node.indirect));
+    assert(fs_create(&fs) == 1);
+    assert(fs_load_inode(&fs, 1, &node) && node.valid && node.size == 0);
+    assert(fs_remove(&fs, 1));
+
+    debug("Check corrupted inode blocks are detected");
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    block.data[0] ^= 1;
+    assert(disk_write(disk, 1, block.data) == BLOCK_SIZE);
+    assert(fs_stat(&fs, 0) == -1);
+    assert(!fs_scrub(&fs, &scrub, &report) && report.corrupted == 1);
+
+    debug("Check revision 1 rejects checksums");
+    fs_unmount(&fs);
+    options.revision = FS_REVISION_1;
+    assert(!fs_format_ex(&fs, disk, &options));
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_11_fs_dedup() {
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    FormatOptions options = {.features = FS_FEATURE_DEDUP};
+    CheckOptions  check   = {0};
+    CheckReport   report;
+    DedupReport   dedup;
+    char          data[8 * BLOCK_SIZE];
+    char          copy[8 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + (i / BLOCK_SIZE) % 4;
+    }
+
+    debug("Check plain images cannot report sharing");
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(!fs.refcounts && !fs_dedup_report(&fs, &dedup));
+    fs_unmount(&fs);
+
+    debug("Check identical blocks are stored once");
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    size_t free_before = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_before += bitmap_test(fs.free_blocks, b);
+    }
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_create(&fs) == 1);
+    assert(fs_write(&fs, 1, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_dedup_report(&fs, &dedup));
+    assert(dedup.indexed == 4 && dedup.shared == 4);
+    size_t free_after = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_after += bitmap_test(fs.free_blocks, b);
+    }
+    assert(free_before - free_after == 4 + 2);
+    assert(fs_read(&fs, 1, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+    assert(fs_check(&fs, &check, &report) && !report.duplicates);
+
+    debug("Check writing a shared block copies it");
+    assert(fs_write(&fs, 1, "xyz", 3, 10) == 3);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+    assert(fs_read(&fs, 1, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy + 10, "xyz", 3) == 0 && copy[9] == 'a' && copy[13] == 'a');
+    assert(fs_dedup_report(&fs, &dedup) && dedup.indexed == 5);
+
+    debug("Check removing a file keeps shared blocks");
+    assert(fs_remove(&fs, 0));
+    assert(fs_read(&fs, 1, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy + BLOCK_SIZE, data + BLOCK_SIZE, sizeof(data) - BLOCK_SIZE) == 0);
+    assert(fs_dedup_report(&fs, &dedup) && dedup.indexed == 5);
+    assert(dedup.shared == 3 && dedup.saved == 3);
+
+    debug("Check the index is rebuilt at mount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_dedup_report(&fs, &dedup));
+    assert(dedup.indexed == 5 && dedup.shared == 3 && dedup.saved == 3);
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_dedup_report(&fs, &dedup) && dedup.indexed == 5 && dedup.saved == 11);
+    assert(fs_check(&fs, &check, &report));
+
+    debug("Check removing blocks that were never indexed");
+    assert(fs_create(&fs) == 2);
+    assert(fs_fallocate(&fs, 2, 0, 2 * BLOCK_SIZE, 0));
+    assert(fs_dedup_report(&fs, &dedup) && dedup.indexed == 5);
+    assert(fs_remove(&fs, 2));
+    assert(fs_dedup_report(&fs, &dedup) && dedup.indexed == 5 && dedup.saved == 11);
+
+    debug("Check blocks are freed with their last reference");
+    assert(fs_remove(&fs, 0));
+    assert(fs_remove(&fs, 1));
+    assert(fs_dedup_report(&fs, &dedup) && !dedup.indexed && !dedup.shared);
+    free_after = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_after += bitmap_test(fs.free_blocks, b);
+    }
+    assert(free_after == free_before);
+    fs_unmount(&fs);
+
+    debug("Check dedup with checksums");
+    options.features |= FS_FEATURE_CHECKSUMS;
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_dedup_report(&fs, &dedup) && dedup.indexed == 4 && dedup.saved == 4);
+    fs_unmount(&fs);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+size_t test_free_blocks(FileSystem *fs) {
+    size_t free_blocks = 0;
+    for (size_t b = 0; b < fs->meta_data.blocks; b++) {
+        free_blocks += bitmap_test(fs->free_blocks, b);
+    }
+    return free_blocks;
+}
+
+int test_12_fs_clone() {
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    FormatOptions options = {.features = FS_FEATURE_REFLINK};
+    CheckOptions  check   = {0};
+    CheckReport   report;
+    static char   data[200 * BLOCK_SIZE];
+    static char   copy[200 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + i % 23;
+    }
+
+    debug("Check cloning needs reference counts");
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_clone(&fs, 0) == -1);
+    assert(fs_snapshot(&fs) == -1);
+    fs_unmount(&fs);
+
+    debug("Check cloning shares every block");
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    size_t free_blocks = test_free_blocks(&fs);
+    size_t writes      = disk->writes;
+    assert(fs_clone(&fs, 0) == 1);
+    assert(disk->writes - writes <= 2);
+    assert(test_free_blocks(&fs) == free_blocks);
+    assert(fs_stat(&fs, 1) == sizeof(data));
+    assert(fs_read(&fs, 1, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+    assert(fs_clone(&fs, 7) == -1);
+
+    debug("Check writes copy shared blocks");
+    assert(fs_write(&fs, 1, "clone", 5, 150 * BLOCK_SIZE) == 5);
+    assert(test_free_blocks(&fs) == free_blocks - 2);
+    assert(fs_write(&fs, 0, "first", 5, 0) == 5);
+    assert(test_free_blocks(&fs) == free_blocks - 3);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, "first", 5) == 0 && memcmp(copy + 5, data + 5, sizeof(data) - 5) == 0);
+    assert(fs_read(&fs, 1, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, 150 * BLOCK_SIZE) == 0 && memcmp(copy + 150 * BLOCK_SIZE, "clone", 5) == 0);
+    assert(fs_check(&fs, &check, &report) && !report.duplicates);
+
+    debug("Check references survive remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(test_free_blocks(&fs) == free_blocks - 3);
+    assert(fs_remove(&fs, 0));
+    assert(fs_read(&fs, 1, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy + 5, data + 5, 150 * BLOCK_SIZE - 5) == 0);
+    assert(fs_check(&fs, &check, &report));
+
+    debug("Check snapshots are read-only copies");
+    ssize_t snapshot = fs_snapshot(&fs);
+    assert(snapshot >= 0);
+    ssize_t frozen = fs_snapshot_inode(&fs, snapshot, 1);
+    assert(frozen >= 0 && frozen != 1);
+    assert(fs_snapshot_inode(&fs, snapshot, 0) == -1);
+    assert(fs_snapshot_inode(&fs, 1, 1) == -1);
+    assert(fs_write(&fs, 1, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_read(&fs, frozen, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy + 150 * BLOCK_SIZE, "clone", 5) == 0);
+    assert(fs_write(&fs, frozen, data, 1, 0) == -1);
+    assert(!fs_remove(&fs, frozen));
+    assert(!fs_remove(&fs, snapshot));
+
+    debug("Check cloning a snapshot copy restores it");
+    ssize_t restored = fs_clone(&fs, frozen);
+    assert(restored >= 0);
+    assert(fs_write(&fs, restored, "restored", 8, 0) == 8);
+    assert(fs_check(&fs, &check, &report));
+
+    debug("Check deleting snapshots frees their blocks");
+    assert(fs_remove(&fs, restored));
+    assert(fs_snapshot_delete(&fs, snapshot));
+    assert(fs_stat(&fs, frozen) == -1);
+    assert(!fs_snapshot_delete(&fs, 1));
+    assert(fs_remove(&fs, 1));
+    assert(test_free_blocks(&fs) == free_blocks + 200 + 1);
+    assert(fs_check(&fs, &check, &report));
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_13_fs_discard() {
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    FormatOptions options = {.features = FS_FEATURE_CHECKSUMS};
+    CheckOptions  check   = {0};
+    CheckReport   report;
+    ScrubReport   scrub;
+    static char   data[100 * BLOCK_SIZE];
+    static char   copy[100 * BLOCK_SIZE];
+    memset(data, 'd', sizeof(data));
+
+    debug("Check discard needs a mounted file system");
+    assert(!fs_set_discard(&fs, DISCARD_SYNC));
+    assert(fs_trim(&fs) == -1);
+
+    debug("Check synchronous discard");
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    assert(!fs_set_discard(&fs, DISCARD_BATCH + 1));
+    assert(fs_set_discard(&fs, DISCARD_SYNC));
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    size_t free_blocks = test_free_blocks(&fs);
+    assert(disk->discards == 0);
+    assert(fs_remove(&fs, 0));
+    assert(disk->discards == test_free_blocks(&fs) - free_blocks);
+    fs_unmount(&fs);
+
+    debug("Check batched discard skips reallocated blocks");
+    assert(fs_mount(&fs, disk));
+    assert(fs_set_discard(&fs, DISCARD_BATCH));
+    size_t discards = disk->discards;
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_remove(&fs, 0));
+    assert(disk->discards == discards);
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data) / 2, 0) == sizeof(data) / 2);
+    fs_unmount(&fs);
+    assert(disk->discards > discards);
+    assert(fs_mount(&fs, disk));
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data) / 2);
+    assert(memcmp(copy, data, sizeof(data) / 2) == 0);
+    assert(fs_check(&fs, &check, &report));
+    assert(fs_scrub(&fs, &check, &scrub) && scrub.blocks);
+
+    debug("Check trim discards every free block");
+    free_blocks = test_free_blocks(&fs);
+    discards    = disk->discards;
+    assert(fs_trim(&fs) == free_blocks);
+    assert(disk->discards - discards == free_blocks);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data) / 2);
+    assert(memcmp(copy, data, sizeof(data) / 2) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_14_fs_async() {
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem    fs     = {0};
+    CheckOptions  check  = {0};
+    CheckReport   report;
+    Completion    completions[32];
+    static char   data[16][4 * BLOCK_SIZE];
+    static char   copy[16][4 * BLOCK_SIZE];
+    for (size_t i = 0; i < 16; i++) {
+        memset(data[i], 'a' + i, sizeof(data[i]));
+    }
+
+    debug("Check async I/O needs a mounted file system");
+    assert(!fs_submit_read(&fs, 0, copy[0], sizeof(copy[0]), 0, 0));
+    assert(fs_poll(&fs, completions, 32) == 0);
+    assert(fs_wait(&fs, completions, 32, 1) == 0);
+
+    debug("Check writes to many files in flight");
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_async_start(&fs, 8));
+    for (size_t i = 0; i < 16; i++) {
+        assert(fs_create(&fs) == (ssize_t)i);
+    }
+    for (size_t i = 0; i < 16; i++) {
+        assert(fs_submit_write(&fs, i, data[i], sizeof(data[i]), 0, 100 + i));
+    }
+    bool   seen[16] = {false};
+    size_t count    = 0;
+    while (count < 16) {
+        size_t n = fs_wait(&fs, completions, 32, 1);
+        assert(n >= 1);
+        for (size_t c = 0; c < n; c++) {
+            assert(completions[c].tag >= 100 && completions[c].tag < 116);
+            assert(!seen[completions[c].tag - 100]);
+            assert(completions[c].result == sizeof(data[0]));
+            seen[completions[c].tag - 100] = true;
+        }
+        count += n;
+    }
+    assert(fs_poll(&fs, completions, 32) == 0);
+
+    debug("Check reads in flight with an invalid request");
+    for (size_t i = 0; i < 16; i++) {
+        assert(fs_submit_read(&fs, i, copy[i], sizeof(copy[i]), 0, i));
+    }
+    assert(fs_submit_read(&fs, 99, copy[0], sizeof(copy[0]), 0, 99));
+    assert(fs_wait(&fs, completions, 32, 100) == 17);
+    for (size_t c = 0; c < 17; c++) {
+        assert(completions[c].result == (completions[c].tag == 99 ? -1 : (ssize_t)sizeof(data[0])));
+    }
+    for (size_t i = 0; i < 16; i++) {
+        assert(memcmp(copy[i], data[i], sizeof(data[i])) == 0);
+    }
+
+    debug("Check unmount finishes requests still in flight");
+    for (size_t i = 0; i < 16; i++) {
+        assert(fs_submit_write(&fs, i, data[15 - i], sizeof(data[i]), sizeof(data[i]), i));
+    }
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    for (size_t i = 0; i < 16; i++) {
+        assert(fs_stat(&fs, i) == 2 * sizeof(data[i]));
+        assert(fs_read(&fs, i, copy[i], sizeof(copy[i]), sizeof(data[i])) == sizeof(data[i]));
+        assert(memcmp(copy[i], data[15 - i], sizeof(data[i])) == 0);
+    }
+    assert(fs_check(&fs, &check, &report));
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+size_t test_split(char *data, size_t length, const size_t *sizes, size_t count, struct iovec *iov) {
+    size_t n = 0;
+    for (size_t i = 0; length; i++) {
+        size_t chunk = min(sizes[i % count], length);
+        iov[n++] = (struct iovec){data, chunk};
+        data   += chunk;
+        length -= chunk;
+    }
+    return n;
+}
+
+int test_15_fs_vectors() {
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    const size_t  ragged[] = {1, 4096, 0, 4095, 8192, 7, 12289};
+    const size_t  whole[]  = {BLOCK_SIZE};
+    const uint32_t features[] = {0, FS_FEATURE_INLINE_DATA, FS_FEATURE_COMPRESSION, FS_FEATURE_DEDUP};
+    struct iovec  iov[64];
+    static char   data[20 * BLOCK_SIZE + 100];
+    static char   copy[20 * BLOCK_SIZE + 100];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = "vectored io "[i % 12] + (i / BLOCK_SIZE) % 5;
+    }
+
+    debug("Check bad vectors");
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_writev(&fs, 0, iov, -1, 0) == -1);
+    assert(fs_readv(&fs, 0, NULL, 1, 0) == -1);
+    iov[0] = (struct iovec){data, SSIZE_MAX};
+    iov[1] = (struct iovec){data, 1};
+    assert(fs_writev(&fs, 0, iov, 2, 0) == -1);
+    assert(fs_writev(&fs, 0, iov, 0, 0) == 0);
+    assert(fs_stat(&fs, 0) == 0);
+    fs_unmount(&fs);
+
+    for (size_t f = 0; f < sizeof(features) / sizeof(features[0]); f++) {
+        FormatOptions options = {.features = features[f]};
+        debug("Check vectors with features %u", features[f]);
+        assert(fs_format_ex(&fs, disk, &options));
+        assert(fs_mount(&fs, disk));
+        assert(fs_create(&fs) == 0);
+
+        // Small write stays inline when enabled
+        size_t n = test_split(data, 40, ragged, 2, iov);
+        assert(fs_writev(&fs, 0, iov, n, 10) == 40);
+        memset(copy, 'x', sizeof(copy));
+        n = test_split(copy, 60, ragged, 7, iov);
+        assert(fs_readv(&fs, 0, iov, n, 0) == 50);
+        assert(memcmp(copy, (char[10]){0}, 10) == 0);
+        assert(memcmp(copy + 10, data, 40) == 0);
+
+        // Ragged segments across blocks, past a hole
+        n = test_split(data, sizeof(data), ragged, 7, iov);
+        assert(fs_writev(&fs, 0, iov, n, 3 * BLOCK_SIZE + 100) == sizeof(data));
+        assert(fs_stat(&fs, 0) == 3 * BLOCK_SIZE + 100 + sizeof(data));
+        memset(copy, 'x', sizeof(copy));
+        n = test_split(copy, sizeof(copy), ragged + 1, 6, iov);
+        assert(fs_readv(&fs, 0, iov, n, 3 * BLOCK_SIZE + 100) == sizeof(data));
+        assert(memcmp(copy, data, sizeof(data)) == 0);
+        assert(fs_read(&fs, 0, copy, 2 * BLOCK_SIZE, BLOCK_SIZE) == 2 * BLOCK_SIZE);
+        for (size_t i = 0; i < 2 * BLOCK_SIZE; i++) {
+            assert(copy[i] == 0);
+        }
+        fs_unmount(&fs);
+    }
+
+    debug("Check whole-block segments cost the same as one buffer");
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0 && fs_create(&fs) == 1);
+    size_t reads  = disk->reads;
+    size_t writes = disk->writes;
+    assert(fs_write(&fs, 0, data, 16 * BLOCK_SIZE, 0) == 16 * BLOCK_SIZE);
+    size_t contiguous_reads  = disk->reads - reads;
+    size_t contiguous_writes = disk->writes - writes;
+    size_t n = test_split(data, 16 * BLOCK_SIZE, whole, 1, iov);
+    reads  = disk->reads;
+    writes = disk->writes;
+    assert(fs_writev(&fs, 1, iov, n, 0) == 16 * BLOCK_SIZE);
+    assert(disk->reads - reads == contiguous_reads);
+    assert(disk->writes - writes == contiguous_writes);
+    reads = disk->reads;
+    assert(fs_read(&fs, 0, copy, 16 * BLOCK_SIZE, 0) == 16 * BLOCK_SIZE);
+    contiguous_reads = disk->reads - reads;
+    n = test_split(copy, 16 * BLOCK_SIZE, whole, 1, iov);
+    reads = disk->reads;
+    assert(fs_readv(&fs, 1, iov, n, 0) == 16 * BLOCK_SIZE);
+    assert(disk->reads - reads == contiguous_reads);
+    assert(memcmp(copy, data, 16 * BLOCK_SIZE) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_16_fs_truncate() {
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem    fs       = {0};
+    FormatOptions reflink  = {.features = FS_FEATURE_REFLINK | FS_FEATURE_CHECKSUMS};
+    FormatOptions compress = {.features = FS_FEATURE_COMPRESSION | FS_FEATURE_INLINE_DATA};
+    CheckOptions  check    = {0};
+    CheckReport   report;
+    ScrubReport   scrub;
+    static char   data[600 * BLOCK_SIZE];
+    static char   copy[600 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = "truncate "[i % 9] + (i / BLOCK_SIZE) % 7;
+    }
+
+    debug("Check shrinking releases data and indirect blocks");
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    size_t free_blocks = count_free_blocks(&fs);
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, 100 * BLOCK_SIZE, 0) == 100 * BLOCK_SIZE);
+    assert(count_free_blocks(&fs) == free_blocks - 101);
+    assert(fs_truncate(&fs, 0, 50 * BLOCK_SIZE + 10));
+    assert(fs_stat(&fs, 0) == 50 * BLOCK_SIZE + 10);
+    assert(count_free_blocks(&fs) == free_blocks - 52);
+    assert(fs_truncate(&fs, 0, 3 * BLOCK_SIZE + 10));
+    assert(count_free_blocks(&fs) == free_blocks - 4);
+    assert(fs_truncate(&fs, 7, 0) == false);
+
+    debug("Check growing reads zeroes past the old end");
+    assert(fs_truncate(&fs, 0, 6 * BLOCK_SIZE));
+    assert(count_free_blocks(&fs) == free_blocks - 4);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == 6 * BLOCK_SIZE);
+    assert(memcmp(copy, data, 3 * BLOCK_SIZE + 10) == 0);
+    for (size_t i = 3 * BLOCK_SIZE + 10; i < 6 * BLOCK_SIZE; i++) {
+        assert(copy[i] == 0);
+    }
+    assert(fs_truncate(&fs, 0, 0));
+    assert(count_free_blocks(&fs) == free_blocks);
+    assert(fs_check(&fs, &check, &report));
+    fs_unmount(&fs);
+
+    debug("Check shrinking a clone leaves shared blocks to the original");
+    assert(fs_format_ex(&fs, disk, &reflink));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    free_blocks = count_free_blocks(&fs);
+    assert(fs_clone(&fs, 0) == 1);
+    assert(fs_truncate(&fs, 1, 520 * BLOCK_SIZE + 1));
+    assert(fs_truncate(&fs, 1, 10));
+    assert(count_free_blocks(&fs) == free_blocks - 1);
+    assert(fs_read(&fs, 1, copy, sizeof(copy), 0) == 10);
+    assert(memcmp(copy, data, 10) == 0);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+    assert(fs_check(&fs, &check, &report));
+    assert(fs_scrub(&fs, &check, &scrub));
+    assert(fs_remove(&fs, 1));
+    assert(fs_truncate(&fs, 0, 0));
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(count_free_blocks(&fs) == free_blocks + 600 + 3);
+    fs_unmount(&fs);
+
+    debug("Check shrinking compressed and inline files");
+    assert(fs_format_ex(&fs, disk, &compress));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, 40, 0) == 40);
+    assert(fs_truncate(&fs, 0, 20) && fs_truncate(&fs, 0, 60));
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == 60);
+    assert(memcmp(copy, data, 20) == 0 && memcmp(copy + 20, (char[40]){0}, 40) == 0);
+    assert(fs_create(&fs) == 1);
+    assert(fs_write(&fs, 1, data, 40 * BLOCK_SIZE, 0) == 40 * BLOCK_SIZE);
+    assert(fs_truncate(&fs, 1, 9 * BLOCK_SIZE + 3));
+    assert(fs_truncate(&fs, 1, 12 * BLOCK_SIZE));
+    assert(fs_read(&fs, 1, copy, sizeof(copy), 0) == 12 * BLOCK_SIZE);
+    assert(memcmp(copy, data, 9 * BLOCK_SIZE + 3) == 0);
+    for (size_t i = 9 * BLOCK_SIZE + 3; i < 12 * BLOCK_SIZE; i++) {
+        assert(copy[i] == 0);
+    }
+    assert(fs_check(&fs, &check, &report));
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_17_fs_fallocate() {
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem    fs        = {0};
+    FormatOptions checksums = {.features = FS_FEATURE_CHECKSUMS};
+    FormatOptions compress  = {.features = FS_FEATURE_COMPRESSION};
+    CheckOptions  check     = {0};
+    CheckReport   report;
+    ScrubReport   scrub;
+    Block         block;
+    static char   data[50 * BLOCK_SIZE];
+    static char   copy[50 * BLOCK_SIZE];
+    memset(data, 'f', sizeof(data));
+
+    debug("Check reserved blocks are contiguous and zeroed");
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0 && fs_create(&fs) == 1);
+    assert(fs_write(&fs, 0, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_write(&fs, 1, data, 3 * BLOCK_SIZE, 0) == 3 * BLOCK_SIZE);
+    assert(fs_truncate(&fs, 0, 0));
+    size_t free_blocks = count_free_blocks(&fs);
+    assert(!fs_fallocate(&fs, 0, 0, 0, 0));
+    assert(!fs_fallocate(&fs, 0, 0, BLOCK_SIZE, 1 << 7));
+    assert(fs_fallocate(&fs, 0, 100, sizeof(data) - 100, 0));
+    assert(fs_stat(&fs, 0) == sizeof(data));
+    assert(count_free_blocks(&fs) == free_blocks - 51);
+    assert(disk_read(disk, 1, block.data) != DISK_FAILURE);
+    Inode *node = &block.inodes[0];
+    for (size_t i = 1; i < POINTERS_PER_INODE; i++) {
+        assert(node->direct[i] == node->direct[0] + i);
+    }
+    uint32_t first = node->direct[0];
+    assert(disk_read(disk, node->indirect, block.data) != DISK_FAILURE);
+    assert(block.pointers[0] == first + POINTERS_PER_INODE);
+    assert(block.pointers[44] == first + 49);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    for (size_t i = 0; i < sizeof(copy); i++) {
+        assert(copy[i] == 0);
+    }
+
+    debug("Check writes into reserved blocks allocate nothing");
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    assert(count_free_blocks(&fs) == free_blocks - 51);
+    assert(fs_fallocate(&fs, 0, 0, sizeof(data), FALLOCATE_UNWRITTEN));
+    assert(count_free_blocks(&fs) == free_blocks - 51);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+    assert(fs_check(&fs, &check, &report));
+    fs_unmount(&fs);
+
+    debug("Check unwritten blocks read as zeroes until written");
+    assert(fs_format_ex(&fs, disk, &checksums));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_remove(&fs, 0));
+    assert(fs_create(&fs) == 0);
+    free_blocks = count_free_blocks(&fs);
+    size_t writes = disk->writes;
+    assert(fs_fallocate(&fs, 0, 0, sizeof(data), FALLOCATE_UNWRITTEN));
+    assert(disk->writes - writes < 8);
+    assert(count_free_blocks(&fs) == free_blocks - 51);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    for (size_t i = 0; i < sizeof(copy); i++) {
+        assert(copy[i] == 0);
+    }
+    assert(fs_write(&fs, 0, data, 10, 20 * BLOCK_SIZE + 5) == 10);
+    assert(fs_write(&fs, 0, data, BLOCK_SIZE, 30 * BLOCK_SIZE) == BLOCK_SIZE);
+    assert(count_free_blocks(&fs) == free_blocks - 51);
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    for (size_t i = 0; i < sizeof(copy); i++) {
+        bool written = (i >= 20 * BLOCK_SIZE + 5 && i < 20 * BLOCK_SIZE + 15) || i / BLOCK_SIZE == 30;
+        assert(copy[i] == (written ? 'f' : 0));
+    }
+    assert(fs_check(&fs, &check, &report));
+    assert(fs_scrub(&fs, &check, &scrub));
+    fs_unmount(&fs);
+
+    debug("Check compressed files cannot reserve blocks");
+    assert(fs_format_ex(&fs, disk, &compress));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(!fs_fallocate(&fs, 0, 0, BLOCK_SIZE, 0));
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_18_fs_defrag() {
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    FormatOptions reflink = {.features = FS_FEATURE_REFLINK | FS_FEATURE_CHECKSUMS};
+    CheckOptions  check   = {0};
+    CheckReport   report;
+    ScrubReport   scrub;
+    DefragOptions options = {0};
+    DefragReport  defrag;
+    Completion    completions[30];
+    static char   data[3][30 * BLOCK_SIZE];
+    static char   copy[40][BLOCK_SIZE];
+    for (size_t f = 0; f < 3; f++) {
+        for (size_t i = 0; i < sizeof(data[f]); i++) {
+            data[f][i] = 'a' + f * 5 + (i / BLOCK_SIZE) % 5;
+        }
+    }
+
+    debug("Check interleaved writes fragment files");
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_fragmentation(&fs, 0) == -1);
+    for (size_t f = 0; f < 3; f++) {
+        assert(fs_create(&fs) == (ssize_t)f);
+    }
+    assert(fs_fragmentation(&fs, 0) == 0);
+    for (size_t b = 0; b < 30; b++) {
+        for (size_t f = 0; f < 3; f++) {
+            assert(fs_write(&fs, f, data[f] + b * BLOCK_SIZE, BLOCK_SIZE, b * BLOCK_SIZE) == BLOCK_SIZE);
+        }
+    }
+    assert(fs_fragmentation(&fs, 0) == 30);
+    assert(fs_remove(&fs, 1));
+    size_t free_blocks = count_free_blocks(&fs);
+
+    debug("Check defrag moves each file into one run while reads are in flight");
+    for (size_t b = 0; b < 30; b++) {
+        assert(fs_submit_read(&fs, 2, copy[b], BLOCK_SIZE, b * BLOCK_SIZE, b));
+    }
+    assert(fs_defrag(&fs, &options, &defrag));
+    assert(fs_wait(&fs, completions, 30, 30) == 30);
+    for (size_t b = 0; b < 30; b++) {
+        assert(completions[b].result == BLOCK_SIZE);
+        assert(memcmp(copy[b], data[2] + b * BLOCK_SIZE, BLOCK_SIZE) == 0);
+    }
+    assert(defrag.files == 2 && defrag.fragmented == 2 && defrag.relocated == 2 && defrag.skipped == 0);
+    assert(defrag.blocks == 60 && defrag.runs_before == 60 && defrag.runs_after == 2);
+    assert(fs_fragmentation(&fs, 0) == 1 && fs_fragmentation(&fs, 2) == 1);
+    assert(count_free_blocks(&fs) == free_blocks);
+    for (size_t f = 0; f < 3; f += 2) {
+        assert(fs_read(&fs, f, (char *)copy, sizeof(data[f]), 0) == sizeof(data[f]));
+        assert(memcmp(copy, data[f], sizeof(data[f])) == 0);
+    }
+    assert(fs_check(&fs, &check, &report));
+
+    debug("Check defrag leaves contiguous files alone");
+    size_t writes = disk->writes;
+    assert(fs_defrag(&fs, NULL, &defrag));
+    assert(defrag.files == 2 && defrag.fragmented == 0 && defrag.blocks == 0 && defrag.runs_after == 2);
+    assert(disk->writes == writes);
+    fs_unmount(&fs);
+
+    debug("Check shared files stay in place and the rate is kept");
+    assert(fs_format_ex(&fs, disk, &reflink));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0 && fs_create(&fs) == 1);
+    for (size_t b = 0; b < 30; b++) {
+        for (size_t f = 0; f < 2; f++) {
+            assert(fs_write(&fs, f, data[f] + b * BLOCK_SIZE, BLOCK_SIZE, b * BLOCK_SIZE) == BLOCK_SIZE);
+        }
+    }
+    assert(fs_fallocate(&fs, 0, sizeof(data[0]), 4 * BLOCK_SIZE, FALLOCATE_UNWRITTEN));
+    assert(fs_clone(&fs, 1) == 2);
+    struct timespec start, stop;
+    options.rate = 2000;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(fs_defrag(&fs, &options, &defrag));
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    assert((stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9 >= 34.0 / 2000 * 0.9);
+    assert(defrag.files == 3 && defrag.fragmented == 3 && defrag.relocated == 1 && defrag.skipped == 2);
+    assert(defrag.blocks == 34 && defrag.runs_after == 1 + 30 + 30);
+    assert(fs_fragmentation(&fs, 0) == 1 && fs_fragmentation(&fs, 1) == 30);
+    assert(fs_read(&fs, 0, (char *)copy, sizeof(copy), 0) == 34 * BLOCK_SIZE);
+    assert(memcmp(copy, data[0], sizeof(data[0])) == 0);
+    for (size_t i = sizeof(data[0]); i < 34 * BLOCK_SIZE; i++) {
+        assert(((char *)copy)[i] == 0);
+    }
+    assert(fs_check(&fs, &check, &report));
+    assert(fs_scrub(&fs, &check, &scrub));
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_19_fs_grow() {
+    const char   *path    = "data/image.grow";
+    unlink(path);
+    Disk *disk = disk_open(path, 500);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    FormatOptions reserve = {.features = FS_FEATURE_CHECKSUMS | FS_FEATURE_REFLINK, .max_blocks = 4096};
+    FormatOptions fixed   = {.features = FS_FEATURE_CHECKSUMS};
+    CheckOptions  check   = {0};
+    CheckReport   report;
+    ScrubReport   scrub;
+    Block         block;
+    static char   data[460 * BLOCK_SIZE];
+    static char   copy[460 * BLOCK_SIZE];
+    memset(data, 'g', sizeof(data));
+
+    debug("Check growing a full revision 1 file system");
+    assert(fs_grow(&fs, 1000) == false);
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == 448 * BLOCK_SIZE);
+    assert(count_free_blocks(&fs) == 0);
+    assert(fs_grow(&fs, 499) == false);
+    assert(fs_grow(&fs, 500));
+    size_t reads = disk->reads, writes = disk->writes;
+    assert(fs_grow(&fs, 1000));
+    assert(disk->reads == reads && disk->writes == writes + 1);
+    assert(count_free_blocks(&fs) == 500);
+    assert(fs.meta_data.inode_blocks == 50 && fs.meta_data.inodes == 50 * INODES_PER_BLOCK);
+    assert(fs_write(&fs, 0, data, sizeof(data) - 448 * BLOCK_SIZE, 448 * BLOCK_SIZE) == sizeof(data) - 448 * BLOCK_SIZE);
+    assert(fs_check(&fs, &check, &report));
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check grown file system mounts at its new size");
+    disk = disk_open(path, 1000);
+    assert(disk);
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    assert(block.super.blocks == 1000 && block.super.inode_blocks == 50);
+    assert(fs_mount(&fs, disk));
+    assert(count_free_blocks(&fs) == 1000 - 51 - 461);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+    fs_unmount(&fs);
+
+    debug("Check growing into reserved inodes and checksums");
+    assert(fs_format_ex(&fs, disk, &reserve));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.inode_blocks == 4096 * BLOCK_SIZE / DEFAULT_INODE_RATIO / INODES_PER_BLOCK_64);
+    assert(fs.meta_data.inodes == 256 && fs.meta_data.checksum_blocks == 4);
+    for (size_t i = 0; i < 256; i++) {
+        assert(fs_create(&fs) == (ssize_t)i);
+    }
+    assert(fs_create(&fs) == -1);
+    assert(fs_write(&fs, 3, data, 10 * BLOCK_SIZE, 0) == 10 * BLOCK_SIZE);
+    assert(fs_clone(&fs, 3) == -1);
+    assert(fs_grow(&fs, 4097) == false);
+    assert(fs_grow(&fs, 2048));
+    assert(fs.meta_data.inodes == 512);
+    assert(fs_clone(&fs, 3) == 256);
+    assert(fs_write(&fs, 256, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_check(&fs, &check, &report));
+    assert(fs_scrub(&fs, &check, &scrub));
+    fs_unmount(&fs);
+    disk_close(disk);
+    disk = disk_open(path, 2048);
+    assert(disk);
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.inodes == 512);
+    assert(fs_read(&fs, 3, copy, sizeof(copy), 0) == 10 * BLOCK_SIZE);
+    assert(fs_read(&fs, 256, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+    assert(fs_check(&fs, &check, &report));
+    assert(fs_scrub(&fs, &check, &scrub));
+    assert(fs_grow(&fs, 4096));
+    assert(fs.meta_data.inodes == 1024);
+    fs_unmount(&fs);
+
+    debug("Check checksums limit growth without a reserve");
+    assert(fs_format_ex(&fs, disk, &fixed));
+    assert(fs_mount(&fs, disk));
+    assert(fs_grow(&fs, 4097) == false);
+    assert(fs_grow(&fs, 4096));
+    fs_unmount(&fs);
+
+    disk_close(disk);
+    unlink(path);
+    return EXIT_SUCCESS;
+}
+
+int test_20_fs_block_size() {
+    const char   *path    = "data/image.geometry";
+    unlink(path);
+    Disk *disk = disk_open(path, 1024);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    FormatOptions small   = {.block_size = 1024, .inodes = 100, .features = FS_FEATURE_CHECKSUMS | FS_FEATURE_REFLINK};
+    FormatOptions large   = {.block_size = 65536};
+    FormatOptions packed  = {.block_size = 1024, .features = FS_FEATURE_COMPRESSION};
+    FormatOptions bad     = {0};
+    CheckOptions  check   = {0};
+    CheckReport   report;
+    ScrubReport   scrub;
+    static char   data[1 << 20];
+    static char   copy[1 << 20];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = i * 7 + i / 4096;
+    }
+
+    debug("Check invalid geometry");
+    uint32_t sizes[] = {512, 1000, 3072, 1 << 17};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bad.block_size = sizes[i];
+        assert(fs_format_ex(&fs, disk, &bad) == false);
+    }
+    bad = (FormatOptions){.revision = FS_REVISION_1, .block_size = 1024};
+    assert(fs_format_ex(&fs, disk, &bad) == false);
+    bad = (FormatOptions){.revision = FS_REVISION_1, .inodes = 100};
+    assert(fs_format_ex(&fs, disk, &bad) == false);
+    bad = (FormatOptions){.block_size = 8192, .features = FS_FEATURE_COMPRESSION};
+    assert(fs_format_ex(&fs, disk, &bad) == false);
+    bad = (FormatOptions){.inodes = 1 << 20};
+    assert(fs_format_ex(&fs, disk, &bad) == false);
+
+    debug("Check 1 KiB blocks with an explicit inode count");
+    assert(fs_format_ex(&fs, disk, &small));
+    assert(disk->block_size == 1024 && disk->blocks == 4096);
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.block_size == 1024 && fs.meta_data.inodes == 104);
+    assert(fs.meta_data.inode_blocks == 13 && fs.meta_data.checksum_blocks == 16);
+    for (size_t i = 0; i < 104; i++) {
+        assert(fs_create(&fs) == (ssize_t)i);
+    }
+    assert(fs_create(&fs) == -1);
+    assert(fs_write(&fs, 7, data, 300 * 1024 + 17, 0) == 300 * 1024 + 17);
+    assert(fs_write(&fs, 8, data, 5000, 123456) == 5000);
+    assert(fs_stat(&fs, 7) == 300 * 1024 + 17);
+    assert(fs_read(&fs, 7, copy, sizeof(copy), 0) == 300 * 1024 + 17);
+    assert(memcmp(copy, data, 300 * 1024 + 17) == 0);
+    assert(fs_seek_data(&fs, 8, 0) == 120 * 1024);
+    assert(fs_truncate(&fs, 7, 4000));
+    assert(fs_check(&fs, &check, &report));
+    assert(fs_scrub(&fs, &check, &scrub));
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check the disk picks up the block size at mount");
+    disk = disk_open(path, 1024);
+    assert(disk);
+    assert(disk->block_size == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(disk->block_size == 1024 && disk->blocks == 4096);
+    assert(fs_read(&fs, 7, copy, sizeof(copy), 0) == 4000);
+    assert(memcmp(copy, data, 4000) == 0);
+    assert(fs_read(&fs, 8, copy, sizeof(copy), 123456) == 5000);
+    assert(memcmp(copy, data, 5000) == 0);
+    assert(fs_check(&fs, &check, &report));
+    fs_unmount(&fs);
+
+    debug("Check 64 KiB blocks");
+    assert(fs_format_ex(&fs, disk, &large));
+    assert(disk->block_size == 65536 && disk->blocks == 64);
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.inodes == 512 && fs.meta_data.inode_blocks == 1);
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data) - 100, 100) == sizeof(data) - 100);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 100) == sizeof(data) - 100);
+    assert(memcmp(copy, data, sizeof(data) - 100) == 0);
+    assert(count_free_blocks(&fs) == 64 - 2 - 17);
+    assert(fs_check(&fs, &check, &report));
+    fs_unmount(&fs);
+
+    debug("Check large blocks with checksums, fallocate and discard");
+    uint32_t larger[] = {8192, 16384, 65536};
+    for (size_t i = 0; i < sizeof(larger) / sizeof(larger[0]); i++) {
+        size_t        size   = larger[i];
+        FormatOptions summed = {.block_size = size, .features = FS_FEATURE_CHECKSUMS};
+        assert(fs_format_ex(&fs, disk, &summed));
+        assert(fs_mount(&fs, disk));
+        assert(fs_set_discard(&fs, DISCARD_SYNC));
+        assert(fs_create(&fs) == 0);
+        assert(fs_fallocate(&fs, 0, 0, 3 * size, 0));
+        assert(fs_write(&fs, 0, data, 5 * size + 7, size / 2) == (ssize_t)(5 * size + 7));
+        assert(fs_read(&fs, 0, copy, sizeof(copy), size / 2) == (ssize_t)(5 * size + 7));
+        assert(memcmp(copy, data, 5 * size + 7) == 0);
+        assert(fs_truncate(&fs, 0, size));
+        assert(fs_trim(&fs) >= 0);
+        assert(fs_check(&fs, &check, &report));
+        assert(report.leaked == 0 && report.unmarked == 0);
+        assert(fs_scrub(&fs, &check, &scrub));
+        assert(scrub.corrupted == 0 && scrub.unreadable == 0);
+        fs_unmount(&fs);
+    }
+
+    debug("Check compression with small blocks");
+    memset(data, 'c', sizeof(data));
+    assert(fs_format_ex(&fs, disk, &packed));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, 64 * 1024, 0) == 64 * 1024);
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == 64 * 1024);
+    assert(memcmp(copy, data, 64 * 1024) == 0);
+    assert(count_free_blocks(&fs) > 4096 - 1 - fs.meta_data.inode_blocks - 64);
+    fs_unmount(&fs);
+
+    debug("Check default format restores the default block size");
+    assert(fs_format(&fs, disk));
+    assert(disk->block_size == BLOCK_SIZE && disk->blocks == 1024);
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.magic_number == MAGIC_NUMBER && fs.meta_data.block_size == BLOCK_SIZE);
+    fs_unmount(&fs);
+
+    disk_close(disk);
+    unlink(path);
+    return EXIT_SUCCESS;
+}
+
+int test_21_fs_direct() {
+    const char   *path    = "data/image.direct";
+    unlink(path);
+    Disk *disk = disk_open_ex(path, 2048, DISK_DIRECT);
+    assert(disk);
+
+    FileSystem    fs      = {0};
+    FormatOptions options = {.features = FS_FEATURE_CHECKSUMS};
+    CheckOptions  check   = {0};
+    CheckReport   report;
+    ScrubReport   scrub;
+    static char   data[256 * BLOCK_SIZE + 1];
+    static char   copy[256 * BLOCK_SIZE + 1];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = i % 251;
+    }
+
+    debug("Check aligned and unaligned streams on a direct disk");
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    char *aligned = disk_buffer_get(disk);
+    assert(aligned);
+    memcpy(aligned, data, BLOCK_SIZE);
+    assert(fs_write(&fs, 0, aligned, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_write(&fs, 0, data + 1, sizeof(data) - 1, BLOCK_SIZE) == sizeof(data) - 1);
+    assert(fs_write(&fs, 0, data, 100, 3 * BLOCK_SIZE + 7) == 100);
+    assert(fs_read(&fs, 0, aligned, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(aligned, data + 1, BLOCK_SIZE) == 0);
+    disk_buffer_put(disk, aligned);
+    assert(fs_read(&fs, 0, copy + 1, sizeof(copy) - 1, 0) == sizeof(copy) - 1);
+    assert(memcmp(copy + 1, data, BLOCK_SIZE) == 0);
+    assert(memcmp(copy + 1 + BLOCK_SIZE, data + 1, 2 * BLOCK_SIZE + 7) == 0);
+    assert(memcmp(copy + 1 + 3 * BLOCK_SIZE + 7, data, 100) == 0);
+    assert(fs_check(&fs, &check, &report));
+    assert(fs_scrub(&fs, &check, &scrub));
+    assert(scrub.corrupted == 0 && scrub.unreadable == 0);
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check the image reads back through the page cache");
+    disk = disk_open(path, 2048);
+    assert(disk);
+    assert(fs_mount(&fs, disk));
+    assert(fs_read(&fs, 0, copy, sizeof(copy), 0) == sizeof(copy));
+    assert(memcmp(copy + 3 * BLOCK_SIZE + 7, data, 100) == 0);
+    assert(fs_scrub(&fs, &check, &scrub));
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check compressed clusters on a direct disk");
+    disk = disk_open_ex(path, 2048, DISK_DIRECT);
+    assert(disk);
+    options.features = FS_FEATURE_COMPRESSION;
+    assert(fs_format_ex(&fs, disk, &options));
+    assert(fs_mount(&fs, disk));
+    assert(fs_create(&fs) == 0);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_write(&fs, 0, data, 100, 3 * BLOCK_SIZE + 7) == 100);
+    assert(fs_read(&fs, 0, copy + 1, sizeof(copy) - 1, 1) == sizeof(copy) - 1);
+    assert(memcmp(copy + 1, data + 1, 3 * BLOCK_SIZE + 6) == 0);
+    assert(memcmp(copy + 3 * BLOCK_SIZE + 7, data, 100) == 0);
+    assert(memcmp(copy + 4 * BLOCK_SIZE, data + 4 * BLOCK_SIZE, sizeof(data) - 4 * BLOCK_SIZE) == 0);
+    assert(fs_check(&fs, &check, &report));
+    fs_unmount(&fs);
+
+    disk_close(disk);
+    unlink(path);
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -174,6 +1638,24 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    1. Test fs_create\n");
         fprintf(stderr, "    2. Test fs_remove\n");
         fprintf(stderr, "    3. Test fs_stat\n");
+        fprintf(stderr, "    4. Test revision 2 (64-bit) file system\n");
+        fprintf(stderr, "    5. Test parallel fs_mount scan\n");
+        fprintf(stderr, "    6. Test fs_check\n");
+        fprintf(stderr, "    7. Test sparse files\n");
+        fprintf(stderr, "    8. Test inline data\n");
+        fprintf(stderr, "    9. Test compression\n");
+        fprintf(stderr, "    10. Test checksums and fs_scrub\n");
+        fprintf(stderr, "    11. Test block deduplication\n");
+        fprintf(stderr, "    12. Test clones and snapshots\n");
+        fprintf(stderr, "    13. Test discard and trim\n");
+        fprintf(stderr, "    14. Test asynchronous reads and writes\n");
+        fprintf(stderr, "    15. Test fs_readv and fs_writev\n");
+        fprintf(stderr, "    16. Test fs_truncate\n");
+        fprintf(stderr, "    17. Test fs_fallocate\n");
+        fprintf(stderr, "    18. Test fs_defrag\n");
+        fprintf(stderr, "    19. Test fs_grow\n");
+        fprintf(stderr, "    20. Test block size\n");
+        fprintf(stderr, "    21. Test direct I/O\n");
         return EXIT_FAILURE;
     }
 
@@ -187,6 +1669,24 @@ int main(int argc, char *argv[]) {
         case 1:  status = test_01_fs_create(); break;
         case 2:  status = test_02_fs_remove(); break;
         case 3:  status = test_03_fs_stat(); break;
+        case 4:  status = test_04_fs_revision_2(); break;
+        case 5:  status = test_05_fs_mount_parallel(); break;
+        case 6:  status = test_06_fs_check(); break;
+        case 7:  status = test_07_fs_sparse(); break;
+        case 8:  status = test_08_fs_inline(); break;
+        case 9:  status = test_09_fs_compression(); break;
+        case 10: status = test_10_fs_checksums(); break;
+        case 11: status = test_11_fs_dedup(); break;
+        case 12: status = test_12_fs_clone(); break;
+        case 13: status = test_13_fs_discard(); break;
+        case 14: status = test_14_fs_async(); break;
+        case 15: status = test_15_fs_vectors(); break;
+        case 16: status = test_16_fs_truncate(); break;
+        case 17: status = test_17_fs_fallocate(); break;
+        case 18: status = test_18_fs_defrag(); break;
+        case 19: status = test_19_fs_grow(); break;
+        case 20: status = test_20_fs_block_size(); break;
+        case 21: status = test_21_fs_direct(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 
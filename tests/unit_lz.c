@@ -0,0 +1,111 @@
+/* unit_lz.c: Unit tests for SimpleFS block compression codec */
+
+#include "sfs/lz.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Constants */
+
+#define LZ_LENGTH   (4 * 4096)
+
+/* Functions */
+
+int test_00_lz_roundtrip() {
+    static char data[LZ_LENGTH];
+    static char packed[LZ_LENGTH];
+    static char unpacked[LZ_LENGTH];
+
+    debug("Check empty input");
+    size_t length = lz_compress(data, 0, packed, sizeof(packed));
+    assert(length == 1);
+    assert(lz_decompress(packed, length, unpacked, sizeof(unpacked)) == 0);
+
+    debug("Check repetitive input");
+    memset(data, 'a', sizeof(data));
+    length = lz_compress(data, sizeof(data), packed, sizeof(packed));
+    assert(length > 0 && length < 100);
+    assert(lz_decompress(packed, length, unpacked, sizeof(unpacked)) == sizeof(data));
+    assert(memcmp(data, unpacked, sizeof(data)) == 0);
+
+    debug("Check text input");
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44] ^ (i / 1000 % 2);
+    }
+    length = lz_compress(data, sizeof(data), packed, sizeof(packed));
+    assert(length > 0 && length < sizeof(data) / 4);
+    assert(lz_decompress(packed, length, unpacked, sizeof(unpacked)) == sizeof(data));
+    assert(memcmp(data, unpacked, sizeof(data)) == 0);
+
+    debug("Check random input");
+    uint64_t seed = 1;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        seed    = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        data[i] = seed >> 56;
+    }
+    assert(lz_compress(data, sizeof(data), packed, sizeof(data) - 4096) == 0);
+    length = lz_compress(data, 1000, packed, sizeof(packed));
+    assert(length > 1000);
+    assert(lz_decompress(packed, length, unpacked, sizeof(unpacked)) == 1000);
+    assert(memcmp(data, unpacked, 1000) == 0);
+
+    return EXIT_SUCCESS;
+}
+
+int test_01_lz_decompress() {
+    static char data[LZ_LENGTH];
+    static char packed[LZ_LENGTH];
+    static char unpacked[2 * LZ_LENGTH];
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + i % 7;
+    }
+    size_t length = lz_compress(data, sizeof(data), packed, sizeof(packed));
+    assert(length > 0);
+
+    debug("Check decoding a prefix");
+    memset(unpacked, 0, sizeof(unpacked));
+    assert(lz_decompress(packed, length, unpacked, 1234) == 1234);
+    assert(memcmp(data, unpacked, 1234) == 0);
+    assert(unpacked[1234] == 0);
+
+    debug("Check output larger than original");
+    assert(lz_decompress(packed, length, unpacked, sizeof(unpacked)) == sizeof(data));
+
+    debug("Check truncated input");
+    assert(lz_decompress(packed, length - 1, unpacked, sizeof(unpacked)) == -1);
+
+    debug("Check bad match offset");
+    char bad[] = {0x10, 'a', 0x05, 0x00};
+    assert(lz_decompress(bad, sizeof(bad), unpacked, sizeof(unpacked)) == -1);
+
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test lz_compress round trip\n");
+        fprintf(stderr, "    1. Test lz_decompress\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_lz_roundtrip(); break;
+        case 1:  status = test_01_lz_decompress(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,216 @@
+/* unit_trace.c: Unit tests for SimpleFS binary I/O tracing */
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/logging.h"
+#include "sfs/trace.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define TRACE_PATH      "data/trace.unit"
+#define TRACE_THREADS   (4)
+#define TRACE_PER_THREAD (20000)
+
+/* Functions */
+
+TraceRecord *load_trace(TraceHeader *header) {
+    FILE *stream = fopen(TRACE_PATH, "r");
+    assert(stream);
+    assert(fread(header, sizeof(TraceHeader), 1, stream) == 1);
+    assert(header->magic == TRACE_MAGIC);
+    assert(header->version == TRACE_VERSION);
+    assert(header->record_size == sizeof(TraceRecord));
+
+    TraceRecord *records = malloc((header->records + 1) * sizeof(TraceRecord));
+    assert(records);
+    assert(fread(records, sizeof(TraceRecord), header->records, stream) == header->records);
+    assert(fgetc(stream) == EOF);
+    fclose(stream);
+    return records;
+}
+
+void *trace_producer(void *arg) {
+    uint64_t id = (uintptr_t)arg;
+    for (uint64_t i = 0; i < TRACE_PER_THREAD; i++) {
+        trace_end(TRACE_DISK_READ, trace_begin(), id, 0, i, 0);
+    }
+    return NULL;
+}
+
+int test_00_trace_file() {
+    TraceHeader header;
+
+    debug("Check nothing is recorded while tracing is off");
+    assert(trace_begin() == 0);
+    assert(trace_stop() == -1);
+
+    debug("Check records and header");
+    assert(trace_start(TRACE_PATH));
+    assert(!trace_start(TRACE_PATH));
+    assert(trace_begin() != 0);
+    for (uint64_t i = 0; i < 1000; i++) {
+        trace_end(TRACE_DISK_WRITE, trace_begin(), i, 4096, i * 4096, 4096);
+    }
+    trace_end(TRACE_DISK_DISCARD, trace_begin(), 7, 3, 0, -1);
+    assert(trace_stop() == 1001);
+    assert(trace_begin() == 0);
+    trace_end(TRACE_DISK_READ, trace_begin(), 0, 0, 0, 0);
+
+    TraceRecord *records = load_trace(&header);
+    assert(header.records == 1001);
+    assert(header.dropped == 0);
+    for (uint64_t i = 0; i < 1000; i++) {
+        assert(records[i].op     == TRACE_DISK_WRITE);
+        assert(records[i].inode  == i);
+        assert(records[i].length == 4096);
+        assert(records[i].offset == i * 4096);
+        assert(records[i].result == 4096);
+        assert(i == 0 || records[i].timestamp >= records[i - 1].timestamp);
+    }
+    assert(records[1000].op     == TRACE_DISK_DISCARD);
+    assert(records[1000].length == 3);
+    assert(records[1000].result == -1);
+    free(records);
+
+    debug("Check op names");
+    assert(strcmp(trace_op_name(TRACE_FS_WRITE), "write") == 0);
+    assert(trace_op_name(0) == NULL);
+    assert(trace_op_name(TRACE_OPS) == NULL);
+
+    unlink(TRACE_PATH);
+    return EXIT_SUCCESS;
+}
+
+int test_01_trace_fs() {
+    assert(system("cp data/image.20 data/image.trace") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.trace", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    debug("Check only outermost operations are recorded");
+    assert(trace_start(TRACE_PATH));
+    uint64_t outer = trace_op_begin();
+    uint64_t inner = trace_op_begin();
+    assert(outer != 0 && inner == 0);
+    trace_op_end(TRACE_FS_STAT, inner, 0, 1, 0, 0, 0);
+    trace_op_end(TRACE_FS_TRUNCATE, outer, 0, 1, 10, 0, 1);
+
+    debug("Check fs operations");
+    char data[100] = {0};
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 50) == 50);
+    assert(fs_stat(&fs, inode_number) == sizeof(data));
+    assert(fs_remove(&fs, inode_number));
+    size_t reads  = disk->reads;
+    size_t writes = disk->writes;
+    assert(trace_stop() > 0);
+
+    TraceHeader  header;
+    TraceRecord *records = load_trace(&header);
+    uint16_t     ops[8];
+    size_t       nops = 0, disk_reads = 0, disk_writes = 0;
+    for (size_t r = 0; r < header.records; r++) {
+        switch (records[r].op) {
+            case TRACE_DISK_READ:  disk_reads++; break;
+            case TRACE_DISK_WRITE: disk_writes++; break;
+            default:
+                assert(nops < 8);
+                ops[nops] = records[r].op;
+                if (records[r].op == TRACE_FS_READ) {
+                    assert(records[r].inode  == (uint64_t)inode_number);
+                    assert(records[r].length == sizeof(data));
+                    assert(records[r].offset == 50);
+                    assert(records[r].result == 50);
+                }
+                nops++;
+                break;
+        }
+    }
+    assert(nops == 6);
+    assert(ops[0] == TRACE_FS_TRUNCATE && records[0].result == 1);
+    assert(ops[1] == TRACE_FS_CREATE);
+    assert(ops[2] == TRACE_FS_WRITE);
+    assert(ops[3] == TRACE_FS_READ);
+    assert(ops[4] == TRACE_FS_STAT);
+    assert(ops[5] == TRACE_FS_REMOVE);
+    assert(disk_reads <= reads && disk_writes <= writes && disk_writes > 0);
+    free(records);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    unlink(TRACE_PATH);
+    unlink("data/image.trace");
+    return EXIT_SUCCESS;
+}
+
+int test_02_trace_concurrent() {
+    pthread_t threads[TRACE_THREADS];
+
+    debug("Check concurrent producers");
+    assert(trace_start(TRACE_PATH));
+    for (uintptr_t t = 0; t < TRACE_THREADS; t++) {
+        assert(pthread_create(&threads[t], NULL, trace_producer, (void *)t) == 0);
+    }
+    for (size_t t = 0; t < TRACE_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    ssize_t written = trace_stop();
+    assert(written > 0);
+
+    TraceHeader  header;
+    TraceRecord *records = load_trace(&header);
+    assert(header.records == (uint64_t)written);
+    assert(header.records + header.dropped == TRACE_THREADS * TRACE_PER_THREAD);
+
+    debug("Check each thread's records are in order");
+    int64_t last[TRACE_THREADS] = {-1, -1, -1, -1};
+    for (size_t r = 0; r < header.records; r++) {
+        assert(records[r].op == TRACE_DISK_READ);
+        assert(records[r].inode < TRACE_THREADS);
+        assert((int64_t)records[r].offset > last[records[r].inode]);
+        last[records[r].inode] = records[r].offset;
+    }
+    free(records);
+
+    unlink(TRACE_PATH);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test trace file\n");
+        fprintf(stderr, "    1. Test tracing fs operations\n");
+        fprintf(stderr, "    2. Test concurrent tracing\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_trace_file(); break;
+        case 1:  status = test_01_trace_fs(); break;
+        case 2:  status = test_02_trace_concurrent(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */